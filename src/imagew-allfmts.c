@@ -13,6 +13,7 @@
 // to link to third party libraries that you're not using.
 
 #include "imagew-config.h"
+#define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
 
 IW_IMPL(int) iw_read_file_by_fmt(struct iw_context *ctx,
@@ -28,6 +29,8 @@ IW_IMPL(int) iw_read_file_by_fmt(struct iw_context *ctx,
 	iw_enable_zlib(ctx);
 #endif
 
+	iw_begin_stage(ctx,IW_STAGE_READ);
+
 	switch(fmt) {
 
 	case IW_FORMAT_PNG:
@@ -67,6 +70,8 @@ IW_IMPL(int) iw_read_file_by_fmt(struct iw_context *ctx,
 		break;
 
 	case IW_FORMAT_TIFF:
+		supported=1;
+		retval = iw_read_tiff_file(ctx,readdescr);
 		break;
 
 	case IW_FORMAT_PNM:
@@ -91,10 +96,87 @@ IW_IMPL(int) iw_read_file_by_fmt(struct iw_context *ctx,
 		iw_set_errorf(ctx,"Reading %s files is not supported",s);
 	}
 done:
+	iw_end_stage(ctx,IW_STAGE_READ);
 	return retval;
 }
 
 
+IW_IMPL(int) iw_probe_file_by_fmt(struct iw_context *ctx,
+	struct iw_iodescr *iodescr, int fmt, struct iw_image_info *info)
+{
+	int retval=0;
+	int supported=0;
+
+#if IW_SUPPORT_ZLIB
+	// Needed to correctly report whether a compressed MIFF or TIFF file is
+	// supported.
+	iw_enable_zlib(ctx);
+#endif
+
+	switch(fmt) {
+
+	case IW_FORMAT_PNG:
+#if IW_SUPPORT_PNG == 1
+		supported=1;
+		retval = iw_probe_png_file(ctx,iodescr,info);
+#endif
+		break;
+
+	case IW_FORMAT_JPEG:
+#if IW_SUPPORT_JPEG == 1
+		supported=1;
+		retval = iw_probe_jpeg_file(ctx,iodescr,info);
+#endif
+		break;
+
+	case IW_FORMAT_WEBP:
+#if IW_SUPPORT_WEBP == 1
+		supported=1;
+		retval = iw_probe_webp_file(ctx,iodescr,info);
+#endif
+		break;
+
+	case IW_FORMAT_MIFF:
+		supported=1;
+		retval = iw_probe_miff_file(ctx,iodescr,info);
+		break;
+
+	case IW_FORMAT_GIF:
+		supported=1;
+		retval = iw_probe_gif_file(ctx,iodescr,info);
+		break;
+
+	case IW_FORMAT_BMP:
+		supported=1;
+		retval = iw_probe_bmp_file(ctx,iodescr,info);
+		break;
+
+	case IW_FORMAT_TIFF:
+		supported=1;
+		retval = iw_probe_tiff_file(ctx,iodescr,info);
+		break;
+
+	case IW_FORMAT_PNM:
+	case IW_FORMAT_PAM:
+		supported=1;
+		retval = iw_probe_pnm_file(ctx,iodescr,info);
+		break;
+
+	default:
+		iw_set_errorf(ctx,"Attempt to read unknown file format (%d)",fmt);
+		goto done;
+	}
+
+	if(!supported) {
+		const char *s;
+		s = iw_get_fmt_name(fmt);
+		if(!s) s="(unknown)";
+		iw_set_errorf(ctx,"Reading %s files is not supported",s);
+	}
+done:
+	return retval;
+}
+
 IW_IMPL(int) iw_write_file_by_fmt(struct iw_context *ctx,
 	struct iw_iodescr *writedescr, int fmt)
 {
@@ -107,6 +189,8 @@ IW_IMPL(int) iw_write_file_by_fmt(struct iw_context *ctx,
 
 	iw_set_value(ctx,IW_VAL_OUTPUT_FORMAT,fmt);
 
+	iw_begin_stage(ctx,IW_STAGE_WRITE);
+
 	switch(fmt) {
 
 	case IW_FORMAT_PNG:
@@ -174,9 +258,70 @@ IW_IMPL(int) iw_write_file_by_fmt(struct iw_context *ctx,
 	}
 
 done:
+	iw_end_stage(ctx,IW_STAGE_WRITE);
 	if(!retval) {
 		// Just in case the error hasn't been handled yet:
 		iw_set_error(ctx,"Error writing file");
 	}
 	return retval;
 }
+
+struct iw_render_state {
+	struct iw_context *srcctx;
+	struct iw_render_target *targets;
+};
+
+static void iw_render_one_target(void *userdata, int job)
+{
+	struct iw_render_state *rs = (struct iw_render_state*)userdata;
+	struct iw_render_target *t = &rs->targets[job];
+	struct iw_context *ctx;
+
+	ctx = iw_create_derived_context(rs->srcctx);
+	if(!ctx) {
+		iw_strlcpy(t->errmsg,"Out of memory",sizeof(t->errmsg));
+		return;
+	}
+
+	// The setup function may change the userdata, so don't report anything
+	// to the trace function until after it has run.
+	if(t->setup_fn) {
+		if(!(*t->setup_fn)(ctx,t)) goto done;
+	}
+	iw_trace_begin(ctx,"render_target",job);
+	if(iw_process_image(ctx)) {
+		if(iw_write_file_by_fmt(ctx,t->writedescr,t->fmt)) {
+			t->ok = 1;
+		}
+	}
+	iw_trace_end(ctx,"render_target",job);
+
+done:
+	if(iw_get_errorflag(ctx)) {
+		iw_get_errormsg(ctx,t->errmsg,(int)sizeof(t->errmsg));
+	}
+	iw_get_stats(ctx,&t->stats);
+	iw_destroy_context(ctx);
+}
+
+IW_IMPL(int) iw_render_targets(struct iw_context *srcctx,
+	struct iw_render_target *targets, int num_targets, int num_threads)
+{
+	struct iw_render_state rs;
+	int i;
+
+	for(i=0; i<num_targets; i++) {
+		targets[i].ok = 0;
+		targets[i].errmsg[0] = '\0';
+		iw_zeromem(&targets[i].stats,sizeof(struct iw_stats));
+	}
+
+	rs.srcctx = srcctx;
+	rs.targets = targets;
+	iw_run_parallel(srcctx,num_threads,num_targets,iw_render_one_target,(void*)&rs);
+
+	for(i=0; i<num_targets; i++) {
+		if(!targets[i].ok) return 0;
+	}
+	return 1;
+}
@@ -144,6 +144,11 @@ IW_IMPL(void) iw_set_errorf(struct iw_context *ctx, const char *fmt, ...)
 	va_end(ap);
 }
 
+IW_IMPL(void) iw_clear_error(struct iw_context *ctx)
+{
+	ctx->error_flag = 0;
+}
+
 IW_IMPL(const char*) iw_get_errormsg(struct iw_context *ctx, char *buf, int buflen)
 {
 	if(ctx->error_msg) {
@@ -218,6 +223,28 @@ static void default_resize_settings(struct iw_resize_settings *rs)
 	}
 }
 
+// Set the settings that aren't zero by default.
+static void iw_set_default_settings(struct iw_context *ctx)
+{
+	ctx->max_malloc = IW_DEFAULT_MAX_MALLOC;
+	ctx->max_width = ctx->max_height = IW_DEFAULT_MAX_DIMENSION;
+	ctx->num_threads = 1;
+	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_H]);
+	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_V]);
+	ctx->input_w = -1;
+	ctx->input_h = -1;
+	iw_make_srgb_csdescr_2(&ctx->img1cs);
+	iw_make_srgb_csdescr_2(&ctx->img2cs);
+	ctx->to_grayscale=0;
+	ctx->grayscale_formula = IW_GSF_STANDARD;
+	ctx->req.include_screen = 1;
+	ctx->opt_grayscale = 1;
+	ctx->opt_palette = 1;
+	ctx->opt_16_to_8 = 1;
+	ctx->opt_strip_alpha = 1;
+	ctx->opt_binary_trns = 1;
+}
+
 IW_IMPL(struct iw_context*) iw_create_context(struct iw_init_params *params)
 {
 	struct iw_context *ctx;
@@ -245,49 +272,220 @@ IW_IMPL(struct iw_context*) iw_create_context(struct iw_init_params *params)
 		ctx->freefn = iwpvt_default_free;
 	}
 
-	ctx->max_malloc = IW_DEFAULT_MAX_MALLOC;
-	ctx->max_width = ctx->max_height = IW_DEFAULT_MAX_DIMENSION;
-	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_H]);
-	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_V]);
-	ctx->input_w = -1;
-	ctx->input_h = -1;
-	iw_make_srgb_csdescr_2(&ctx->img1cs);
-	iw_make_srgb_csdescr_2(&ctx->img2cs);
-	ctx->to_grayscale=0;
-	ctx->grayscale_formula = IW_GSF_STANDARD;
-	ctx->req.include_screen = 1;
-	ctx->opt_grayscale = 1;
-	ctx->opt_palette = 1;
-	ctx->opt_16_to_8 = 1;
-	ctx->opt_strip_alpha = 1;
-	ctx->opt_binary_trns = 1;
+	iw_set_default_settings(ctx);
 
 	return ctx;
 }
 
-IW_IMPL(void) iw_destroy_context(struct iw_context *ctx)
+static void iw_free_options(struct iw_context *ctx)
 {
 	int i;
-	if(!ctx) return;
-	if(ctx->req.options) {
-		for(i=0; i<=ctx->req.options_count; i++) {
-			iw_free(ctx, ctx->req.options[i].name);
-			iw_free(ctx, ctx->req.options[i].val);
-		}
-		iw_free(ctx, ctx->req.options);
+	if(!ctx->req.options) return;
+	for(i=0; i<=ctx->req.options_count; i++) {
+		iw_free(ctx, ctx->req.options[i].name);
+		iw_free(ctx, ctx->req.options[i].val);
 	}
-	if(ctx->img1.pixels) iw_free(ctx,ctx->img1.pixels);
-	if(ctx->img2.pixels) iw_free(ctx,ctx->img2.pixels);
+	iw_free(ctx, ctx->req.options);
+	ctx->req.options = NULL;
+	ctx->req.options_count = 0;
+	ctx->req.options_numalloc = 0;
+}
+
+// Free everything that belongs to the current input or output image.
+static void iw_free_image_data(struct iw_context *ctx)
+{
+	if(ctx->img1.pixels && !ctx->img1_pixels_shared) iw_free(ctx,ctx->img1.pixels);
+	ctx->img1.pixels = NULL;
+	iwpvt_scratch_free(ctx,ctx->img2.pixels);
+	ctx->img2.pixels = NULL;
+	iwpvt_scratch_free(ctx,ctx->optctx.tmp_pixels);
+	ctx->optctx.tmp_pixels = NULL;
+	iwpvt_scratch_free(ctx,ctx->optctx.palette);
+	ctx->optctx.palette = NULL;
+	iwpvt_scratch_free(ctx,ctx->input_color_corr_table);
+	ctx->input_color_corr_table = NULL;
+	iwpvt_scratch_free(ctx,ctx->output_rev_color_corr_table);
+	ctx->output_rev_color_corr_table = NULL;
+	iwpvt_scratch_free(ctx,ctx->nearest_color_table);
+	ctx->nearest_color_table = NULL;
+}
+
+IW_IMPL(void) iw_destroy_context(struct iw_context *ctx)
+{
+	if(!ctx) return;
+	iw_free_options(ctx);
+	iw_free_image_data(ctx);
 	if(ctx->error_msg) iw_free(ctx,ctx->error_msg);
-	if(ctx->optctx.tmp_pixels) iw_free(ctx,ctx->optctx.tmp_pixels);
-	if(ctx->optctx.palette) iw_free(ctx,ctx->optctx.palette);
-	if(ctx->input_color_corr_table) iw_free(ctx,ctx->input_color_corr_table);
-	if(ctx->output_rev_color_corr_table) iw_free(ctx,ctx->output_rev_color_corr_table);
-	if(ctx->nearest_color_table) iw_free(ctx,ctx->nearest_color_table);
 	if(ctx->prng) iwpvt_prng_destroy(ctx,ctx->prng);
+	iwpvt_scratch_free_all(ctx);
+	iwpvt_stats_free(ctx);
 	iw_free(ctx,ctx);
 }
 
+// Reset a context to its initial state, except for the things
+// that iw_reset_context() always keeps.
+static void iw_reset_all_settings(struct iw_context *ctx)
+{
+	int caller_api_version = ctx->caller_api_version;
+	iw_mallocfn_type mallocfn = ctx->mallocfn;
+	iw_freefn_type freefn = ctx->freefn;
+	void *userdata = ctx->userdata;
+	iw_translatefn_type translate_fn = ctx->translate_fn;
+	iw_warningfn_type warning_fn = ctx->warning_fn;
+	iw_tracefn_type trace_fn = ctx->trace_fn;
+	struct iw_prng *prng = ctx->prng;
+	char *error_msg = ctx->error_msg;
+	size_t scratch_limit = ctx->scratch_limit;
+	struct iw_scratch_block scratch[IW_SCRATCH_SLOTS];
+
+	iw_free_options(ctx);
+	iwpvt_stats_free(ctx);
+	memcpy(scratch,ctx->scratch,sizeof(scratch));
+
+	iw_zeromem(ctx,sizeof(struct iw_context));
+
+	ctx->caller_api_version = caller_api_version;
+	ctx->mallocfn = mallocfn;
+	ctx->freefn = freefn;
+	ctx->userdata = userdata;
+	ctx->translate_fn = translate_fn;
+	ctx->warning_fn = warning_fn;
+	ctx->trace_fn = trace_fn;
+	ctx->prng = prng;
+	ctx->error_msg = error_msg;
+	ctx->scratch_limit = scratch_limit;
+	memcpy(ctx->scratch,scratch,sizeof(scratch));
+	iw_set_default_settings(ctx);
+}
+
+IW_IMPL(void) iw_reset_context(struct iw_context *ctx, int keep_settings)
+{
+	iw_free_image_data(ctx);
+
+	if(!keep_settings) {
+		iw_reset_all_settings(ctx);
+		return;
+	}
+
+	// Put back the settings that iw_process_image() changed.
+	if(ctx->saved.valid) {
+		ctx->resize_settings[IW_DIMENSION_H] = ctx->saved.resize_settings[IW_DIMENSION_H];
+		ctx->resize_settings[IW_DIMENSION_V] = ctx->saved.resize_settings[IW_DIMENSION_V];
+		ctx->input_start_x = ctx->saved.input_start_x;
+		ctx->input_start_y = ctx->saved.input_start_y;
+		ctx->input_w = ctx->saved.input_w;
+		ctx->input_h = ctx->saved.input_h;
+		ctx->random_seed = ctx->saved.random_seed;
+		ctx->grayscale_formula = ctx->saved.grayscale_formula;
+		ctx->opt_palette = ctx->saved.opt_palette;
+		ctx->opt_binary_trns = ctx->saved.opt_binary_trns;
+		ctx->saved.valid = 0;
+	}
+
+	// Clear the per-image state.
+	ctx->use_count = 0;
+	ctx->error_flag = 0;
+	iw_zeromem(&ctx->img1,sizeof(struct iw_image));
+	ctx->img1_pixels_shared = 0;
+	ctx->img1_partial = 0;
+	ctx->img1_offset_x = 0;
+	ctx->img1_offset_y = 0;
+	ctx->img1_full_width = 0;
+	ctx->img1_full_height = 0;
+	iw_zeromem(ctx->img1_ci,sizeof(ctx->img1_ci));
+	iw_make_srgb_csdescr_2(&ctx->img1cs);
+	ctx->img1_imgtype_logical = 0;
+	ctx->img1_numchannels_physical = 0;
+	ctx->img1_numchannels_logical = 0;
+	ctx->img1_samples_per_pixel = 0;
+	iw_zeromem(ctx->img1_sample_pos,sizeof(ctx->img1_sample_pos));
+	ctx->img1_alpha_channel_index = 0;
+	ctx->img1_bkgd_label_set = 0;
+	iw_zeromem(&ctx->img1_bkgd_label_inputcs,sizeof(struct iw_color));
+	iw_zeromem(&ctx->img1_bkgd_label_lin,sizeof(struct iw_color));
+	iw_zeromem(ctx->intermed_ci,sizeof(ctx->intermed_ci));
+	ctx->intermed_imgtype = 0;
+	ctx->intermed_numchannels = 0;
+	ctx->intermed_alpha_channel_index = 0;
+	ctx->intermed_canvas_width = 0;
+	ctx->intermed_canvas_height = 0;
+	iw_zeromem(&ctx->img2,sizeof(struct iw_image));
+	iw_make_srgb_csdescr_2(&ctx->img2cs);
+	iw_zeromem(ctx->img2_ci,sizeof(ctx->img2_ci));
+	ctx->img2_numchannels = 0;
+	ctx->uses_errdiffdither = 0;
+	ctx->apply_bkgd = 0;
+	ctx->apply_bkgd_strategy = 0;
+	ctx->bkgd_checkerboard = 0;
+	ctx->bkgd_color_source = 0;
+	ctx->bkgd1alpha = 0.0;
+	ctx->bkgd2alpha = 0.0;
+	ctx->input_maxcolorcode_int = 0;
+	ctx->input_maxcolorcode = 0.0;
+	ctx->support_reduced_input_bitdepths = 0;
+	ctx->disable_output_lookup_tables = 0;
+	ctx->reduced_output_maxcolor_flag = 0;
+	iw_zeromem(&ctx->optctx,sizeof(struct iw_opt_ctx));
+	iwpvt_stats_reset(ctx);
+}
+
+IW_IMPL(struct iw_context*) iw_create_derived_context(struct iw_context *srcctx)
+{
+	struct iw_init_params params;
+	struct iw_context *ctx;
+	int i;
+
+	iw_zeromem(&params,sizeof(struct iw_init_params));
+	params.api_version = srcctx->caller_api_version;
+	params.userdata = srcctx->userdata;
+	params.mallocfn = srcctx->mallocfn;
+	params.freefn = srcctx->freefn;
+
+	ctx = iw_create_context(&params);
+	if(!ctx) return NULL;
+
+	ctx->translate_fn = srcctx->translate_fn;
+	ctx->warning_fn = srcctx->warning_fn;
+	ctx->trace_fn = srcctx->trace_fn;
+	ctx->max_malloc = srcctx->max_malloc;
+	ctx->max_width = srcctx->max_width;
+	ctx->max_height = srcctx->max_height;
+	ctx->num_threads = srcctx->num_threads;
+	ctx->zlib_module = srcctx->zlib_module;
+	ctx->statsctx.enabled = srcctx->statsctx.enabled;
+
+	// The input image, and the things the image reader tells us about it.
+	ctx->img1 = srcctx->img1; // struct copy
+	ctx->img1_pixels_shared = 1;
+	ctx->img1_partial = srcctx->img1_partial;
+	ctx->img1_offset_x = srcctx->img1_offset_x;
+	ctx->img1_offset_y = srcctx->img1_offset_y;
+	ctx->img1_full_width = srcctx->img1_full_width;
+	ctx->img1_full_height = srcctx->img1_full_height;
+	ctx->img1cs = srcctx->img1cs;
+	for(i=0;i<IW_CI_COUNT;i++) {
+		ctx->img1_ci[i].maxcolorcode_int = srcctx->img1_ci[i].maxcolorcode_int;
+	}
+	ctx->img1_bkgd_label_set = srcctx->img1_bkgd_label_set;
+	ctx->img1_bkgd_label_inputcs = srcctx->img1_bkgd_label_inputcs;
+
+	return ctx;
+}
+
+IW_IMPL(void) iw_get_stats(struct iw_context *ctx, struct iw_stats *stats)
+{
+	*stats = ctx->statsctx.stats; // struct copy
+}
+
+IW_IMPL(const char*) iw_get_stage_name(int stage)
+{
+	static const char *names[IW_NUM_STAGES] = { "read", "prepare",
+		"vertical", "horizontal", "optimize", "write" };
+
+	if(stage<0 || stage>=IW_NUM_STAGES) return NULL;
+	return names[stage];
+}
+
 IW_IMPL(void) iw_get_output_image(struct iw_context *ctx, struct iw_image *img)
 {
 	int k;
@@ -371,6 +569,15 @@ IW_IMPL(void) iw_set_input_crop(struct iw_context *ctx, int x, int y, int w, int
 	ctx->input_h = h;
 }
 
+IW_IMPL(void) iw_set_output_region(struct iw_context *ctx, int x, int y, int w, int h)
+{
+	ctx->req.region_x = x;
+	ctx->req.region_y = y;
+	ctx->req.region_w = w;
+	ctx->req.region_h = h;
+	ctx->req.region_valid = 1;
+}
+
 IW_IMPL(void) iw_set_output_profile(struct iw_context *ctx, unsigned int n)
 {
 	ctx->output_profile = n;
@@ -612,6 +819,22 @@ IW_IMPL(void) iw_set_max_malloc(struct iw_context *ctx, size_t n)
 	ctx->max_malloc = n;
 }
 
+IW_IMPL(void) iw_set_scratch_pool_limit(struct iw_context *ctx, size_t n)
+{
+	int i;
+
+	ctx->scratch_limit = n;
+
+	// Discard any idle blocks that no longer fit.
+	for(i=0;i<IW_SCRATCH_SLOTS;i++) {
+		if(ctx->scratch[i].mem && !ctx->scratch[i].in_use && ctx->scratch[i].size>n) {
+			iw_free(ctx,ctx->scratch[i].mem);
+			ctx->scratch[i].mem = NULL;
+			ctx->scratch[i].size = 0;
+		}
+	}
+}
+
 IW_IMPL(void) iw_set_random_seed(struct iw_context *ctx, int randomize, int rand_seed)
 {
 	ctx->randomize = randomize;
@@ -638,9 +861,65 @@ IW_IMPL(void) iw_set_warning_fn(struct iw_context *ctx, iw_warningfn_type warnfn
 	ctx->warning_fn = warnfn;
 }
 
+IW_IMPL(void) iw_set_trace_fn(struct iw_context *ctx, iw_tracefn_type tracefn)
+{
+	ctx->trace_fn = tracefn;
+}
+
 IW_IMPL(void) iw_set_input_image(struct iw_context *ctx, const struct iw_image *img)
 {
 	ctx->img1 = *img; // struct copy
+	if(ctx->img1.stride==0) {
+		ctx->img1.firstrow = ctx->img1.pixels;
+		ctx->img1.stride = (ptrdiff_t)ctx->img1.bpr;
+	}
+	ctx->img1_pixels_shared = 0;
+	ctx->img1_partial = 0;
+}
+
+IW_IMPL(int) iw_get_input_crop(struct iw_context *ctx, int full_width, int full_height,
+	int *px, int *py, int *pw, int *ph)
+{
+	int x, y, w, h;
+
+	if(ctx->input_start_x<=0 && ctx->input_start_y<=0 &&
+		ctx->input_w<0 && ctx->input_h<0)
+	{
+		return 0;
+	}
+	if(full_width<1 || full_height<1) return 0;
+
+	// Clip the rectangle in the same way that iw_prepare_processing() will.
+	x = ctx->input_start_x;
+	y = ctx->input_start_y;
+	if(x<0) x=0;
+	if(y<0) y=0;
+	if(x>full_width-1) x=full_width-1;
+	if(y>full_height-1) y=full_height-1;
+	w = ctx->input_w;
+	h = ctx->input_h;
+	if(w<0) w = full_width - x;
+	if(h<0) h = full_height - y;
+	if(w<1) w = 1;
+	if(h<1) h = 1;
+	if(w>full_width-x) w = full_width-x;
+	if(h>full_height-y) h = full_height-y;
+
+	*px = x;
+	*py = y;
+	*pw = w;
+	*ph = h;
+	return 1;
+}
+
+IW_IMPL(void) iw_set_input_image_offset(struct iw_context *ctx, int x, int y,
+	int full_width, int full_height)
+{
+	ctx->img1_offset_x = x;
+	ctx->img1_offset_y = y;
+	ctx->img1_full_width = full_width;
+	ctx->img1_full_height = full_height;
+	ctx->img1_partial = 1;
 }
 
 IW_IMPL(void) iw_set_resize_alg(struct iw_context *ctx, int dimension, int family,
@@ -677,10 +956,28 @@ IW_IMPL(void) iw_reorient_image(struct iw_context *ctx, unsigned int x)
 		tmpd = ctx->img1.density_x;
 		ctx->img1.density_x = ctx->img1.density_y;
 		ctx->img1.density_y = tmpd;
+
+		if(ctx->img1_partial) {
+			tmpi = ctx->img1_offset_x;
+			ctx->img1_offset_x = ctx->img1_offset_y;
+			ctx->img1_offset_y = tmpi;
+			tmpi = ctx->img1_full_width;
+			ctx->img1_full_width = ctx->img1_full_height;
+			ctx->img1_full_height = tmpi;
+		}
 	}
 
 	// Do horizontal and vertical mirroring.
 	ctx->img1.orient_transform ^= (x&0x03);
+
+	if(ctx->img1_partial) {
+		if(x&0x01) {
+			ctx->img1_offset_x = ctx->img1_full_width - ctx->img1_offset_x - ctx->img1.width;
+		}
+		if(x&0x02) {
+			ctx->img1_offset_y = ctx->img1_full_height - ctx->img1_offset_y - ctx->img1.height;
+		}
+	}
 }
 
 IW_IMPL(int) iw_get_sample_size(void)
@@ -859,6 +1156,13 @@ IW_IMPL(void) iw_set_value(struct iw_context *ctx, int code, int n)
 	case IW_VAL_NEGATE_TARGET:
 		ctx->req.negate_target = n;
 		break;
+	case IW_VAL_COLLECT_STATS:
+		if(n) ctx->statsctx.enabled = 1;
+		else iwpvt_stats_free(ctx);
+		break;
+	case IW_VAL_NUM_THREADS:
+		ctx->num_threads = n;
+		break;
 	}
 }
 
@@ -898,11 +1202,13 @@ IW_IMPL(int) iw_get_value(struct iw_context *ctx, int code)
 		ret = ctx->img1.native_grayscale;
 		break;
 	case IW_VAL_INPUT_WIDTH:
-		if(ctx->img1.width<1) ret=1;
+		if(ctx->img1_partial) ret = ctx->img1_full_width;
+		else if(ctx->img1.width<1) ret=1;
 		else ret = ctx->img1.width;
 		break;
 	case IW_VAL_INPUT_HEIGHT:
-		if(ctx->img1.height<1) ret=1;
+		if(ctx->img1_partial) ret = ctx->img1_full_height;
+		else if(ctx->img1.height<1) ret=1;
 		else ret = ctx->img1.height;
 		break;
 	case IW_VAL_INPUT_IMAGE_TYPE:
@@ -956,6 +1262,12 @@ IW_IMPL(int) iw_get_value(struct iw_context *ctx, int code)
 	case IW_VAL_NEGATE_TARGET:
 		ret = ctx->req.negate_target;
 		break;
+	case IW_VAL_COLLECT_STATS:
+		ret = ctx->statsctx.enabled;
+		break;
+	case IW_VAL_NUM_THREADS:
+		ret = ctx->num_threads;
+		break;
 	}
 
 	return ret;
@@ -0,0 +1,824 @@
+// imagew-apitest.c
+// Part of ImageWorsener, Copyright (c) 2011 by Jason Summers.
+// For more information, see the readme.txt file.
+
+// This file implements a program that tests parts of the library API that
+// the imagew utility doesn't use, and is not part of the ImageWorsener
+// library. It is run by tests/runtest.
+//
+// Usage: imagew-apitest <test> [<args>]
+//
+// Tests:
+//   pool
+//     Process a series of same-sized images with one context, using
+//     iw_reset_context() and the scratch memory pool, and check that the
+//     memory allocation hook is not called after the first image.
+//   gifframes <input.gif> <output-prefix>
+//     Read every frame of an animated GIF with the GIF frame reader, and
+//     write each one to <output-prefix>-<n>.png. A description of each frame
+//     is written to <output-prefix>.txt.
+//   probe <output.txt> <input-file>...
+//     Probe each file, and check that the width, height, image type, and bit
+//     depth it reports agree with those of the decoded image. The probed
+//     information is written to <output.txt>.
+//   rendertargets <input-file>
+//     Make several output images from one decoded image with
+//     iw_render_targets(), using 1 and 4 threads, and check that each is the
+//     same as making it from its own copy of the image.
+//   layouts
+//     Supply the same pixels to the library laid out in memory in different
+//     ways (bottom-up, padded rows, channel orders, premultiplied alpha), and
+//     check that the processed images are all the same.
+
+#include "imagew-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IW_INCLUDE_UTIL_FUNCTIONS
+#include "imagew.h"
+
+struct apitest_pool_case {
+	const char *name;
+	int imgtype; // IW_IMGTYPE_*
+	int dst_w, dst_h;
+	int out_depth;
+	int ditherfamily; // IW_DITHERFAMILY_*
+	int dithersubtype;
+	int grayscale;
+	int color_count; // 0 = default
+};
+
+static const struct apitest_pool_case apitest_pool_cases[] = {
+	{ "resize", IW_IMGTYPE_RGB, 77, 55, 8, IW_DITHERFAMILY_NONE, 0, 0, 0 },
+	{ "alpha", IW_IMGTYPE_RGBA, 301, 222, 16, IW_DITHERFAMILY_NONE, 0, 0, 0 },
+	{ "errdiff", IW_IMGTYPE_RGBA, 90, 70, 4, IW_DITHERFAMILY_ERRDIFF, IW_DITHERSUBTYPE_FS, 0, 0 },
+	{ "random", IW_IMGTYPE_RGB, 90, 70, 8, IW_DITHERFAMILY_RANDOM, IW_DITHERSUBTYPE_DEFAULT, 0, 4 },
+	{ "ordered-gray", IW_IMGTYPE_RGB, 64, 48, 8, IW_DITHERFAMILY_ORDERED, IW_DITHERSUBTYPE_DEFAULT, 1, 5 },
+	{ NULL, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+static int apitest_malloc_count;
+
+static void *apitest_mallocfn(void *userdata, unsigned int flags, size_t n)
+{
+	apitest_malloc_count++;
+	if(flags & IW_MALLOCFLAG_ZEROMEM)
+		return calloc(n,1);
+	return malloc(n);
+}
+
+static void apitest_freefn(void *userdata, void *mem)
+{
+	free(mem);
+}
+
+static struct iw_context *apitest_create_context(void)
+{
+	struct iw_init_params init_params;
+
+	memset(&init_params,0,sizeof(struct iw_init_params));
+	init_params.api_version = IW_VERSION_INT;
+	init_params.mallocfn = apitest_mallocfn;
+	init_params.freefn = apitest_freefn;
+	return iw_create_context(&init_params);
+}
+
+static void apitest_print_error(struct iw_context *ctx, const char *name)
+{
+	char errmsg[200];
+
+	printf("pool/%s: error: %s\n",name,iw_get_errormsg(ctx,errmsg,sizeof(errmsg)));
+}
+
+#define APITEST_POOL_SRC_W 200
+#define APITEST_POOL_SRC_H 150
+#define APITEST_POOL_ITERATIONS 4
+
+// Returns 1 if the test passed.
+static int apitest_pool_case(const struct apitest_pool_case *c, iw_byte *pixels)
+{
+	struct iw_context *ctx;
+	struct iw_image img;
+	int numchannels;
+	int count;
+	int i;
+	int retval = 0;
+
+	ctx = apitest_create_context();
+	if(!ctx) return 0;
+	iw_set_scratch_pool_limit(ctx,64*1024*1024);
+
+	numchannels = (c->imgtype==IW_IMGTYPE_RGBA) ? 4 : 3;
+
+	for(i=0; i<APITEST_POOL_ITERATIONS; i++) {
+		count = apitest_malloc_count;
+
+		// The pixels belong to us, so the context doesn't have to copy them.
+		memset(&img,0,sizeof(struct iw_image));
+		img.imgtype = c->imgtype;
+		img.bit_depth = 8;
+		img.width = APITEST_POOL_SRC_W;
+		img.height = APITEST_POOL_SRC_H;
+		img.bpr = numchannels*APITEST_POOL_SRC_W;
+		img.firstrow = pixels;
+		img.stride = (ptrdiff_t)img.bpr;
+		iw_set_input_image(ctx,&img);
+
+		iw_set_output_profile(ctx,iw_get_profile_by_fmt(IW_FORMAT_PNG));
+		iw_set_output_canvas_size(ctx,c->dst_w,c->dst_h);
+		iw_set_output_depth(ctx,c->out_depth);
+		if(c->ditherfamily!=IW_DITHERFAMILY_NONE) {
+			iw_set_dither_type(ctx,IW_CHANNELTYPE_ALL,c->ditherfamily,c->dithersubtype);
+		}
+		if(c->grayscale) {
+			iw_set_value(ctx,IW_VAL_CVT_TO_GRAYSCALE,1);
+		}
+		if(c->color_count) {
+			iw_set_color_count(ctx,IW_CHANNELTYPE_ALL,c->color_count);
+		}
+
+		if(!iw_process_image(ctx)) {
+			apitest_print_error(ctx,c->name);
+			goto done;
+		}
+
+		iw_reset_context(ctx,1);
+
+		count = apitest_malloc_count - count;
+		if(i>0 && count>0) {
+			printf("pool/%s: image %d: %d allocations\n",c->name,i+1,count);
+			goto done;
+		}
+	}
+
+	retval = 1;
+done:
+	iw_destroy_context(ctx);
+	return retval;
+}
+
+static int apitest_pool(void)
+{
+	iw_byte *pixels;
+	unsigned int state = 1;
+	size_t n;
+	size_t i;
+	int failures = 0;
+	int k;
+
+	n = 4*APITEST_POOL_SRC_W*APITEST_POOL_SRC_H;
+	pixels = malloc(n);
+	if(!pixels) return 0;
+	for(i=0; i<n; i++) {
+		state = state*1103515245 + 12345;
+		pixels[i] = (iw_byte)((i/3)%251 + (state>>28));
+	}
+
+	for(k=0; apitest_pool_cases[k].name; k++) {
+		if(!apitest_pool_case(&apitest_pool_cases[k],pixels)) {
+			printf("pool/%s: FAILED\n",apitest_pool_cases[k].name);
+			failures++;
+		}
+	}
+
+	free(pixels);
+	return failures==0;
+}
+
+static int apitest_readfn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	void *buf, size_t nbytes, size_t *pbytesread)
+{
+	*pbytesread = fread(buf,1,nbytes,(FILE*)iodescr->fp);
+	return 1;
+}
+
+static int apitest_writefn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const void *buf, size_t nbytes)
+{
+	fwrite(buf,1,nbytes,(FILE*)iodescr->fp);
+	return 1;
+}
+
+// Write the context's input image, unchanged, to a PNG file.
+static int apitest_write_png(struct iw_context *ctx, const char *fn)
+{
+	struct iw_iodescr writedescr;
+	int retval = 0;
+
+	memset(&writedescr,0,sizeof(struct iw_iodescr));
+	writedescr.write_fn = apitest_writefn;
+	writedescr.fp = (void*)fopen(fn,"wb");
+	if(!writedescr.fp) {
+		iw_set_errorf(ctx,"Failed to open %s for writing",fn);
+		return 0;
+	}
+
+	iw_set_output_profile(ctx,iw_get_profile_by_fmt(IW_FORMAT_PNG));
+	iw_set_output_canvas_size(ctx,iw_get_value(ctx,IW_VAL_INPUT_WIDTH),
+		iw_get_value(ctx,IW_VAL_INPUT_HEIGHT));
+	iw_set_output_depth(ctx,8);
+	if(!iw_process_image(ctx)) goto done;
+	if(!iw_write_file_by_fmt(ctx,&writedescr,IW_FORMAT_PNG)) goto done;
+	retval = 1;
+done:
+	fclose((FILE*)writedescr.fp);
+	return retval;
+}
+
+static int apitest_gifframes(const char *infn, const char *prefix)
+{
+	struct iw_context *ctx = NULL;
+	struct iw_gif_frame_reader *fr = NULL;
+	struct iw_gif_frame_info info;
+	struct iw_iodescr readdescr;
+	FILE *infofp = NULL;
+	char fn[1000];
+	char errmsg[200];
+	int retval = 0;
+
+	memset(&readdescr,0,sizeof(struct iw_iodescr));
+
+	ctx = apitest_create_context();
+	if(!ctx) goto done;
+
+	readdescr.read_fn = apitest_readfn;
+	readdescr.fp = (void*)fopen(infn,"rb");
+	if(!readdescr.fp) {
+		iw_set_errorf(ctx,"Failed to open %s",infn);
+		goto done;
+	}
+
+	iw_snprintf(fn,sizeof(fn),"%s.txt",prefix);
+	infofp = fopen(fn,"w");
+	if(!infofp) {
+		iw_set_errorf(ctx,"Failed to open %s for writing",fn);
+		goto done;
+	}
+
+	fr = iw_open_gif_frame_reader(ctx,&readdescr);
+	if(!fr) goto done;
+
+	while(iw_read_next_gif_frame(ctx,fr,&info)) {
+		fprintf(infofp,"frame %d: %dx%d at %d,%d, delay %d, disposal %d",
+			info.frame_num,info.width,info.height,info.left,info.top,
+			info.delay,info.disposal);
+		if(info.has_transparency) {
+			fprintf(infofp,", transparent color %d",info.trans_color_index);
+		}
+		fprintf(infofp,"\n");
+
+		iw_snprintf(fn,sizeof(fn),"%s-%d.png",prefix,info.frame_num);
+		if(!apitest_write_png(ctx,fn)) goto done;
+	}
+	if(iw_get_errorflag(ctx)) goto done;
+
+	retval = 1;
+done:
+	if(ctx && iw_get_errorflag(ctx)) {
+		printf("gifframes: error: %s\n",iw_get_errormsg(ctx,errmsg,sizeof(errmsg)));
+	}
+	if(fr) iw_close_gif_frame_reader(ctx,fr);
+	if(infofp) fclose(infofp);
+	if(readdescr.fp) fclose((FILE*)readdescr.fp);
+	if(ctx) iw_destroy_context(ctx);
+	return retval;
+}
+
+// Probe one file, then read it, and compare the results.
+// Returns 1 if the test passed.
+static int apitest_probe_file(const char *infn, FILE *infofp)
+{
+	struct iw_context *ctx = NULL;
+	struct iw_iodescr readdescr;
+	struct iw_image_info info;
+	FILE *fp;
+	iw_byte sig[12];
+	size_t sig_len;
+	char errmsg[200];
+	int readdescr_open = 0;
+	int fmt;
+	int imgtype;
+	int retval = 0;
+
+	memset(&info,0,sizeof(struct iw_image_info));
+
+	fp = fopen(infn,"rb");
+	if(!fp) {
+		printf("probe/%s: can't open file\n",infn);
+		return 0;
+	}
+	sig_len = fread(sig,1,sizeof(sig),fp);
+	fclose(fp);
+	fmt = iw_detect_fmt_of_file(sig,sig_len);
+
+	// Some readers (e.g. TIFF) need a seekable file, so map it into memory.
+	ctx = apitest_create_context();
+	if(!ctx) goto done;
+	if(!iw_open_mmap_reader(ctx,&readdescr,infn)) goto done;
+	readdescr_open = 1;
+	if(!iw_probe_file_by_fmt(ctx,&readdescr,fmt,&info)) goto done;
+	(*readdescr.close_fn)(ctx,&readdescr);
+	readdescr_open = 0;
+	iw_destroy_context(ctx);
+
+	fprintf(infofp,"%s: %dx%d, imgtype %d, depth %d%s\n",infn,info.width,info.height,
+		info.imgtype,info.bit_depth,
+		(info.flags&IW_IMAGEINFOFLAG_IMGTYPE_IS_MAX)?" (max)":"");
+
+	ctx = apitest_create_context();
+	if(!ctx) goto done;
+	if(!iw_open_mmap_reader(ctx,&readdescr,infn)) goto done;
+	readdescr_open = 1;
+	if(!iw_read_file_by_fmt(ctx,&readdescr,fmt)) goto done;
+
+	if(iw_get_value(ctx,IW_VAL_INPUT_WIDTH)!=info.width ||
+		iw_get_value(ctx,IW_VAL_INPUT_HEIGHT)!=info.height)
+	{
+		printf("probe/%s: probed size %dx%d, decoded size %dx%d\n",infn,
+			info.width,info.height,iw_get_value(ctx,IW_VAL_INPUT_WIDTH),
+			iw_get_value(ctx,IW_VAL_INPUT_HEIGHT));
+		goto done;
+	}
+
+	// The reader is allowed to choose a type with fewer channels than the
+	// probe reported, if the probe said so.
+	imgtype = iw_get_value(ctx,IW_VAL_INPUT_IMAGE_TYPE);
+	if(imgtype!=info.imgtype && (!(info.flags&IW_IMAGEINFOFLAG_IMGTYPE_IS_MAX) ||
+		iw_imgtype_num_channels(imgtype)>iw_imgtype_num_channels(info.imgtype)))
+	{
+		printf("probe/%s: probed imgtype %d, decoded imgtype %d\n",infn,
+			info.imgtype,imgtype);
+		goto done;
+	}
+
+	if(iw_get_value(ctx,IW_VAL_INPUT_DEPTH)!=info.bit_depth) {
+		printf("probe/%s: probed depth %d, decoded depth %d\n",infn,
+			info.bit_depth,iw_get_value(ctx,IW_VAL_INPUT_DEPTH));
+		goto done;
+	}
+
+	retval = 1;
+done:
+	if(ctx && iw_get_errorflag(ctx)) {
+		printf("probe/%s: error: %s\n",infn,iw_get_errormsg(ctx,errmsg,sizeof(errmsg)));
+	}
+	if(readdescr_open) (*readdescr.close_fn)(ctx,&readdescr);
+	if(ctx) iw_destroy_context(ctx);
+	return retval;
+}
+
+static int apitest_probe(const char *outfn, int num_files, char **files)
+{
+	FILE *infofp;
+	int failures = 0;
+	int i;
+
+	infofp = fopen(outfn,"w");
+	if(!infofp) {
+		printf("probe: can't open %s for writing\n",outfn);
+		return 0;
+	}
+
+	for(i=0; i<num_files; i++) {
+		if(!apitest_probe_file(files[i],infofp)) {
+			printf("probe/%s: FAILED\n",files[i]);
+			failures++;
+		}
+	}
+
+	fclose(infofp);
+	return failures==0;
+}
+
+struct apitest_target_case {
+	const char *name;
+	int fmt; // IW_FORMAT_*
+	int dst_w, dst_h;
+	int out_depth;
+	int grayscale;
+};
+
+static const struct apitest_target_case apitest_target_cases[] = {
+	{ "png", IW_FORMAT_PNG, 20, 20, 8, 0 },
+	{ "png-gray16", IW_FORMAT_PNG, 47, 13, 16, 1 },
+	{ "jpeg", IW_FORMAT_JPEG, 30, 30, 8, 0 },
+	{ "bmp", IW_FORMAT_BMP, 16, 40, 8, 0 },
+	{ NULL, 0, 0, 0, 0, 0 }
+};
+
+#define APITEST_NUM_TARGETS 4
+
+static int apitest_setup_target(struct iw_context *ctx, struct iw_render_target *target)
+{
+	const struct apitest_target_case *c = (const struct apitest_target_case*)target->userdata;
+
+	iw_set_output_profile(ctx,iw_get_profile_by_fmt(c->fmt));
+	iw_set_output_canvas_size(ctx,c->dst_w,c->dst_h);
+	iw_set_output_depth(ctx,c->out_depth);
+	if(c->grayscale) {
+		iw_set_value(ctx,IW_VAL_CVT_TO_GRAYSCALE,1);
+	}
+	return 1;
+}
+
+// Read a file into a new context.
+static struct iw_context *apitest_read_file(const char *infn)
+{
+	struct iw_context *ctx;
+	struct iw_iodescr readdescr;
+	char errmsg[200];
+	int ok = 0;
+
+	ctx = iw_create_context(NULL);
+	if(!ctx) return NULL;
+	if(iw_open_mmap_reader(ctx,&readdescr,infn)) {
+		ok = iw_read_file_by_fmt(ctx,&readdescr,iw_detect_fmt_from_filename(infn));
+		(*readdescr.close_fn)(ctx,&readdescr);
+	}
+	if(!ok) {
+		printf("rendertargets: error: %s\n",iw_get_errormsg(ctx,errmsg,sizeof(errmsg)));
+		iw_destroy_context(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+// Make the image for one target the ordinary way, from its own context.
+// Returns 1 if it is the same as the data written by iw_render_targets().
+static int apitest_check_target(const char *infn, struct iw_render_target *target,
+	const void *data, size_t data_len)
+{
+	const struct apitest_target_case *c = (const struct apitest_target_case*)target->userdata;
+	struct iw_context *ctx;
+	struct iw_iodescr writedescr;
+	void *refdata;
+	size_t refdata_len;
+	int writedescr_open = 0;
+	int retval = 0;
+
+	ctx = apitest_read_file(infn);
+	if(!ctx) return 0;
+	if(!iw_open_mem_writer(ctx,&writedescr,0)) goto done;
+	writedescr_open = 1;
+	apitest_setup_target(ctx,target);
+	if(!iw_process_image(ctx)) goto done;
+	if(!iw_write_file_by_fmt(ctx,&writedescr,c->fmt)) goto done;
+	if(!iw_get_mem_writer_data(ctx,&writedescr,0,&refdata,&refdata_len)) goto done;
+
+	if(refdata_len!=data_len || memcmp(refdata,data,data_len)) {
+		printf("rendertargets/%s: output differs\n",c->name);
+		goto done;
+	}
+	retval = 1;
+done:
+	if(writedescr_open) (*writedescr.close_fn)(ctx,&writedescr);
+	iw_destroy_context(ctx);
+	return retval;
+}
+
+static int apitest_rendertargets(const char *infn)
+{
+	struct iw_context *srcctx;
+	struct iw_render_target targets[APITEST_NUM_TARGETS];
+	struct iw_iodescr writedescrs[APITEST_NUM_TARGETS];
+	static const int thread_counts[2] = { 1, 4 };
+	void *data;
+	size_t data_len;
+	int num_targets;
+	int failures = 0;
+	int i, k;
+
+	srcctx = apitest_read_file(infn);
+	if(!srcctx) return 0;
+
+	// The source context must not be changed by rendering, so render the
+	// targets more than once.
+	for(k=0; k<2; k++) {
+		memset(targets,0,sizeof(targets));
+		memset(writedescrs,0,sizeof(writedescrs));
+		for(num_targets=0; apitest_target_cases[num_targets].name; num_targets++) {
+			i = num_targets;
+			if(!iw_open_mem_writer(srcctx,&writedescrs[i],0)) {
+				failures++;
+				goto done;
+			}
+			targets[i].fmt = apitest_target_cases[i].fmt;
+			targets[i].writedescr = &writedescrs[i];
+			targets[i].setup_fn = apitest_setup_target;
+			targets[i].userdata = (void*)&apitest_target_cases[i];
+		}
+
+		if(!iw_render_targets(srcctx,targets,num_targets,thread_counts[k])) {
+			printf("rendertargets: %d threads: failed\n",thread_counts[k]);
+			failures++;
+		}
+
+		for(i=0; i<num_targets; i++) {
+			if(!targets[i].ok) {
+				printf("rendertargets/%s: error: %s\n",apitest_target_cases[i].name,
+					targets[i].errmsg);
+			}
+			else if(!iw_get_mem_writer_data(srcctx,&writedescrs[i],0,&data,&data_len) ||
+				!apitest_check_target(infn,&targets[i],data,data_len))
+			{
+				printf("rendertargets/%s: %d threads: FAILED\n",
+					apitest_target_cases[i].name,thread_counts[k]);
+				failures++;
+			}
+			(*writedescrs[i].close_fn)(srcctx,&writedescrs[i]);
+		}
+	}
+
+done:
+	iw_destroy_context(srcctx);
+	return failures==0;
+}
+
+// The ways of laying out an input image's rows in memory.
+#define APITEST_ROWS_OWNED    0 // Allocated by us, owned by the library
+#define APITEST_ROWS_TOPDOWN  1
+#define APITEST_ROWS_BOTTOMUP 2 // Negative stride
+#define APITEST_ROWS_PADDED   3 // Stride larger than the row size
+
+struct apitest_layout_case {
+	const char *name;
+	int imgtype; // IW_IMGTYPE_*
+	int rows; // APITEST_ROWS_*
+	int channel_order; // IW_CHANORDER_*
+	int associated_alpha;
+};
+
+// The first case for each image type is the reference for the others.
+static const struct apitest_layout_case apitest_layout_cases[] = {
+	{ "rgba", IW_IMGTYPE_RGBA, APITEST_ROWS_OWNED, IW_CHANORDER_DEFAULT, 0 },
+	{ "rgba-topdown", IW_IMGTYPE_RGBA, APITEST_ROWS_TOPDOWN, IW_CHANORDER_DEFAULT, 0 },
+	{ "rgba-bottomup", IW_IMGTYPE_RGBA, APITEST_ROWS_BOTTOMUP, IW_CHANORDER_DEFAULT, 0 },
+	{ "rgba-padded", IW_IMGTYPE_RGBA, APITEST_ROWS_PADDED, IW_CHANORDER_DEFAULT, 0 },
+	{ "bgra", IW_IMGTYPE_RGBA, APITEST_ROWS_OWNED, IW_CHANORDER_BGR, 0 },
+	{ "argb", IW_IMGTYPE_RGBA, APITEST_ROWS_OWNED, IW_CHANORDER_ARGB, 0 },
+	{ "abgr-padded", IW_IMGTYPE_RGBA, APITEST_ROWS_PADDED, IW_CHANORDER_ABGR, 0 },
+	{ "rgba-premult", IW_IMGTYPE_RGBA, APITEST_ROWS_OWNED, IW_CHANORDER_DEFAULT, 1 },
+	{ "bgra-premult-bottomup", IW_IMGTYPE_RGBA, APITEST_ROWS_BOTTOMUP, IW_CHANORDER_BGR, 1 },
+	{ "rgb", IW_IMGTYPE_RGB, APITEST_ROWS_OWNED, IW_CHANORDER_DEFAULT, 0 },
+	{ "rgb-bottomup", IW_IMGTYPE_RGB, APITEST_ROWS_BOTTOMUP, IW_CHANORDER_DEFAULT, 0 },
+	{ "rgb-padded", IW_IMGTYPE_RGB, APITEST_ROWS_PADDED, IW_CHANORDER_DEFAULT, 0 },
+	{ "bgr", IW_IMGTYPE_RGB, APITEST_ROWS_OWNED, IW_CHANORDER_BGR, 0 },
+	{ "rgbx", IW_IMGTYPE_RGB, APITEST_ROWS_OWNED, IW_CHANORDER_RGBX, 0 },
+	{ "bgrx-bottomup", IW_IMGTYPE_RGB, APITEST_ROWS_BOTTOMUP, IW_CHANORDER_BGRX, 0 },
+	{ "graya", IW_IMGTYPE_GRAYA, APITEST_ROWS_OWNED, IW_CHANORDER_DEFAULT, 0 },
+	{ "graya-bottomup", IW_IMGTYPE_GRAYA, APITEST_ROWS_BOTTOMUP, IW_CHANORDER_DEFAULT, 0 },
+	{ "agray", IW_IMGTYPE_GRAYA, APITEST_ROWS_OWNED, IW_CHANORDER_ARGB, 0 },
+	{ "graya-premult", IW_IMGTYPE_GRAYA, APITEST_ROWS_OWNED, IW_CHANORDER_DEFAULT, 1 },
+	{ NULL, 0, 0, 0, 0 }
+};
+
+#define APITEST_LAYOUT_SRC_W 37
+#define APITEST_LAYOUT_SRC_H 23
+#define APITEST_LAYOUT_DST_W 29
+#define APITEST_LAYOUT_DST_H 31
+#define APITEST_LAYOUT_PADDING 13
+
+// A processed image, saved for comparison.
+struct apitest_layout_result {
+	int imgtype;
+	int bit_depth;
+	size_t bpr;
+	int height;
+	iw_byte *pixels;
+};
+
+// The value of a sample of the test image, where k is 0 to 2 for a color
+// sample, or 3 for alpha.
+// The color samples are multiples of 15, and the alpha samples are chosen so
+// that premultiplying them by alpha gives exact integers.
+static iw_byte apitest_layout_sample(int x, int y, int k)
+{
+	static const iw_byte alphas[5] = { 255, 0, 51, 85, 255 };
+
+	if(k==3) return alphas[(x+2*y)%5];
+	return (iw_byte)(15*((x*7+y*3+k*5)%18));
+}
+
+// Find where each sample (R or gray, G, B, A) goes in a pixel, for the case's
+// channel order. Returns the number of bytes per pixel.
+static int apitest_layout_offsets(const struct apitest_layout_case *c, int *offs)
+{
+	if(IW_IMGTYPE_IS_GRAY(c->imgtype)) {
+		if(c->channel_order==IW_CHANORDER_ARGB) {
+			offs[3] = 0; offs[0] = 1;
+		}
+		else {
+			offs[0] = 0; offs[3] = 1;
+		}
+		return iw_imgtype_num_channels(c->imgtype);
+	}
+
+	switch(c->channel_order) {
+	case IW_CHANORDER_BGR:
+	case IW_CHANORDER_BGRX:
+		offs[2] = 0; offs[1] = 1; offs[0] = 2; offs[3] = 3;
+		break;
+	case IW_CHANORDER_ARGB:
+		offs[3] = 0; offs[0] = 1; offs[1] = 2; offs[2] = 3;
+		break;
+	case IW_CHANORDER_ABGR:
+		offs[3] = 0; offs[2] = 1; offs[1] = 2; offs[0] = 3;
+		break;
+	default:
+		offs[0] = 0; offs[1] = 1; offs[2] = 2; offs[3] = 3;
+	}
+	if(c->channel_order==IW_CHANORDER_RGBX || c->channel_order==IW_CHANORDER_BGRX)
+		return 4;
+	return iw_imgtype_num_channels(c->imgtype);
+}
+
+// Write the test image's rows, in the case's layout.
+static void apitest_layout_fill(const struct apitest_layout_case *c,
+	iw_byte *firstrow, ptrdiff_t stride)
+{
+	int offs[4];
+	int bytes_per_pixel;
+	int has_alpha;
+	int num_colors;
+	iw_byte *pix;
+	unsigned int a, v;
+	int x, y, k;
+
+	bytes_per_pixel = apitest_layout_offsets(c,offs);
+	has_alpha = IW_IMGTYPE_HAS_ALPHA(c->imgtype);
+	num_colors = IW_IMGTYPE_IS_GRAY(c->imgtype) ? 1 : 3;
+
+	for(y=0; y<APITEST_LAYOUT_SRC_H; y++) {
+		for(x=0; x<APITEST_LAYOUT_SRC_W; x++) {
+			pix = firstrow + y*stride + x*bytes_per_pixel;
+			// The unused sample, if any, should be ignored.
+			memset(pix,0x5a,bytes_per_pixel);
+			a = has_alpha ? apitest_layout_sample(x,y,3) : 255;
+			for(k=0; k<num_colors; k++) {
+				v = apitest_layout_sample(x,y,k);
+				if(c->associated_alpha) v = v*a/255;
+				pix[offs[k]] = (iw_byte)v;
+			}
+			if(has_alpha) pix[offs[3]] = (iw_byte)a;
+		}
+	}
+}
+
+// Process the test image, supplied as described by c, and save the result.
+// Returns 1 on success.
+static int apitest_layout_case(const struct apitest_layout_case *c,
+	struct apitest_layout_result *result)
+{
+	struct iw_context *ctx;
+	struct iw_image img;
+	struct iw_image outimg;
+	iw_byte *buf = NULL;
+	size_t buf_size;
+	int offs[4];
+	char errmsg[200];
+	int retval = 0;
+
+	ctx = iw_create_context(NULL);
+	if(!ctx) return 0;
+
+	memset(&img,0,sizeof(struct iw_image));
+	img.imgtype = c->imgtype;
+	img.bit_depth = 8;
+	img.width = APITEST_LAYOUT_SRC_W;
+	img.height = APITEST_LAYOUT_SRC_H;
+	img.channel_order = c->channel_order;
+	img.associated_alpha = c->associated_alpha;
+	img.bpr = apitest_layout_offsets(c,offs)*APITEST_LAYOUT_SRC_W;
+
+	if(c->rows==APITEST_ROWS_OWNED) {
+		img.pixels = iw_malloc_large(ctx,img.bpr,img.height);
+		if(!img.pixels) goto done;
+		apitest_layout_fill(c,img.pixels,(ptrdiff_t)img.bpr);
+	}
+	else {
+		// The rows belong to us, and the context doesn't copy them.
+		img.stride = (ptrdiff_t)img.bpr;
+		if(c->rows==APITEST_ROWS_PADDED) img.stride += APITEST_LAYOUT_PADDING;
+		buf_size = (size_t)img.stride*img.height;
+		buf = malloc(buf_size);
+		if(!buf) goto done;
+		memset(buf,0xcc,buf_size);
+		img.firstrow = buf;
+		if(c->rows==APITEST_ROWS_BOTTOMUP) {
+			img.firstrow = &buf[buf_size-img.bpr];
+			img.stride = -img.stride;
+		}
+		apitest_layout_fill(c,img.firstrow,img.stride);
+	}
+	iw_set_input_image(ctx,&img);
+
+	iw_set_output_profile(ctx,iw_get_profile_by_fmt(IW_FORMAT_PNG));
+	iw_set_output_canvas_size(ctx,APITEST_LAYOUT_DST_W,APITEST_LAYOUT_DST_H);
+	iw_set_output_depth(ctx,8);
+	if(!iw_process_image(ctx)) goto done;
+
+	iw_get_output_image(ctx,&outimg);
+	result->imgtype = outimg.imgtype;
+	result->bit_depth = outimg.bit_depth;
+	result->bpr = outimg.bpr;
+	result->height = outimg.height;
+	result->pixels = malloc(outimg.bpr*outimg.height);
+	if(!result->pixels) goto done;
+	memcpy(result->pixels,outimg.pixels,outimg.bpr*outimg.height);
+
+	retval = 1;
+done:
+	if(iw_get_errorflag(ctx)) {
+		printf("layouts/%s: error: %s\n",c->name,iw_get_errormsg(ctx,errmsg,sizeof(errmsg)));
+	}
+	iw_destroy_context(ctx);
+	free(buf);
+	return retval;
+}
+
+static int apitest_layouts(void)
+{
+	const struct apitest_layout_case *c;
+	struct apitest_layout_result ref;
+	struct apitest_layout_result result;
+	const char *ref_name = NULL;
+	int ref_imgtype = -1;
+	int failures = 0;
+	int k;
+
+	memset(&ref,0,sizeof(struct apitest_layout_result));
+
+	for(k=0; apitest_layout_cases[k].name; k++) {
+		c = &apitest_layout_cases[k];
+		memset(&result,0,sizeof(struct apitest_layout_result));
+		if(!apitest_layout_case(c,&result)) {
+			printf("layouts/%s: FAILED\n",c->name);
+			failures++;
+			continue;
+		}
+
+		if(c->imgtype!=ref_imgtype) {
+			// This is the reference for the following cases.
+			free(ref.pixels);
+			ref = result;
+			ref_imgtype = c->imgtype;
+			ref_name = c->name;
+			continue;
+		}
+
+		if(result.imgtype!=ref.imgtype || result.bit_depth!=ref.bit_depth ||
+			result.bpr!=ref.bpr || result.height!=ref.height ||
+			memcmp(result.pixels,ref.pixels,ref.bpr*ref.height))
+		{
+			printf("layouts/%s: output differs from %s\n",c->name,ref_name);
+			failures++;
+		}
+		free(result.pixels);
+	}
+
+	free(ref.pixels);
+	return failures==0;
+}
+
+static void apitest_usage(void)
+{
+	printf("Usage: imagew-apitest pool\n");
+	printf("       imagew-apitest gifframes <input.gif> <output-prefix>\n");
+	printf("       imagew-apitest probe <output.txt> <input-file>...\n");
+	printf("       imagew-apitest rendertargets <input-file>\n");
+	printf("       imagew-apitest layouts\n");
+}
+
+int main(int argc, char* argv[])
+{
+	int ret;
+
+	if(argc<2) {
+		apitest_usage();
+		return 1;
+	}
+
+	if(!strcmp(argv[1],"pool") && argc==2) {
+		ret = apitest_pool();
+	}
+	else if(!strcmp(argv[1],"gifframes") && argc==4) {
+		ret = apitest_gifframes(argv[2],argv[3]);
+	}
+	else if(!strcmp(argv[1],"probe") && argc>=4) {
+		ret = apitest_probe(argv[2],argc-3,&argv[3]);
+	}
+	else if(!strcmp(argv[1],"rendertargets") && argc==3) {
+		ret = apitest_rendertargets(argv[2]);
+	}
+	else if(!strcmp(argv[1],"layouts") && argc==2) {
+		ret = apitest_layouts();
+	}
+	else {
+		apitest_usage();
+		return 1;
+	}
+
+	return ret ? 0 : 1;
+}
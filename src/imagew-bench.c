@@ -0,0 +1,666 @@
+// imagew-bench.c
+// Part of ImageWorsener, Copyright (c) 2011 by Jason Summers.
+// For more information, see the readme.txt file.
+
+// This file implements a benchmark program, and is not part of the
+// ImageWorsener library.
+//
+// It processes synthetic images of each image type and bit depth, using a
+// variety of resampling filters, scale factors, dithering methods, and
+// output depths, and reports how fast each one is. The results can be
+// saved to a JSON file, and later compared against, to catch performance
+// regressions.
+//
+// Only the core processing (iw_process_image) is measured, except for the
+// "png/" and "jpeg/" benchmarks, which measure how fast each encoding profile
+// (the "png:profile" and "jpeg:profile" options) is, and how small its output
+// is. Nothing is read from or written to files, other than the JSON results.
+
+#include "imagew-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IW_INCLUDE_UTIL_FUNCTIONS
+#include "imagew.h"
+
+#define BENCH_MAX_CASES 500
+
+struct bench_case {
+	char name[80];
+	int imgtype; // IW_IMGTYPE_*
+	int bit_depth;
+	int sampletype; // IW_SAMPLETYPE_*
+	int src_w, src_h;
+	int dst_w, dst_h;
+	int filter; // IW_RESIZETYPE_*
+	double param1, param2;
+	int ditherfamily; // IW_DITHERFAMILY_*
+	int dithersubtype;
+	int out_depth; // 0 = default
+	int color_count; // 0 = default
+	int grayscale; // Convert to grayscale
+	int out_fmt; // If set (IW_FORMAT_*), measure encoding instead.
+	const char *profile; // Encoding profile
+
+	// Results
+	int ok;
+	double time; // Best time, in seconds
+	double stage_time[IW_NUM_STAGES];
+	double mpps; // Input megapixels per second
+	size_t out_size; // Compressed size, for encoding benchmarks
+	double enc_mbps; // Uncompressed megabytes encoded per second
+};
+
+struct bench_params {
+	int quick;
+	int iterations;
+	const char *match;
+	const char *json_fn;
+	const char *baseline_fn;
+	double tolerance; // Allowed slowdown, in percent
+	struct bench_case *cases;
+	int num_cases;
+};
+
+struct bench_filter {
+	const char *name;
+	int family;
+	double param1, param2;
+};
+
+static const struct bench_filter bench_filters[] = {
+	{ "nearest", IW_RESIZETYPE_NEAREST, 0.0, 0.0 },
+	{ "mix", IW_RESIZETYPE_MIX, 0.0, 0.0 },
+	{ "cubic", IW_RESIZETYPE_CUBIC, 0.0, 0.5 },
+	{ "lanczos2", IW_RESIZETYPE_LANCZOS, 2.0, 0.0 },
+	{ "lanczos3", IW_RESIZETYPE_LANCZOS, 3.0, 0.0 },
+	{ "lanczos10", IW_RESIZETYPE_LANCZOS, 10.0, 0.0 },
+	{ NULL, 0, 0.0, 0.0 }
+};
+
+static const char *bench_imgtype_name(int imgtype)
+{
+	switch(imgtype) {
+	case IW_IMGTYPE_GRAY: return "gray";
+	case IW_IMGTYPE_GRAYA: return "graya";
+	case IW_IMGTYPE_RGB: return "rgb";
+	case IW_IMGTYPE_RGBA: return "rgba";
+	}
+	return "unknown";
+}
+
+static int bench_num_channels(int imgtype)
+{
+	switch(imgtype) {
+	case IW_IMGTYPE_GRAYA: return 2;
+	case IW_IMGTYPE_RGB: return 3;
+	case IW_IMGTYPE_RGBA: return 4;
+	}
+	return 1;
+}
+
+static struct bench_case *bench_new_case(struct bench_params *bp)
+{
+	struct bench_case *c;
+
+	if(bp->num_cases>=BENCH_MAX_CASES) return NULL;
+	c = &bp->cases[bp->num_cases++];
+	memset(c,0,sizeof(struct bench_case));
+	c->imgtype = IW_IMGTYPE_RGB;
+	c->bit_depth = 8;
+	c->sampletype = IW_SAMPLETYPE_UINT;
+	c->filter = IW_RESIZETYPE_CUBIC;
+	c->param1 = 0.0;
+	c->param2 = 0.5;
+	return c;
+}
+
+static void bench_set_scale(struct bench_case *c, int w, int h, double scale)
+{
+	c->src_w = w;
+	c->src_h = h;
+	c->dst_w = (int)(0.5+scale*w);
+	c->dst_h = (int)(0.5+scale*h);
+	if(c->dst_w<1) c->dst_w = 1;
+	if(c->dst_h<1) c->dst_h = 1;
+}
+
+static void bench_make_cases(struct bench_params *bp)
+{
+	static const int imgtypes[4] = { IW_IMGTYPE_GRAY, IW_IMGTYPE_GRAYA,
+		IW_IMGTYPE_RGB, IW_IMGTYPE_RGBA };
+	static const int sizes_full[3][2] = { { 320, 240 }, { 1024, 768 }, { 2560, 1600 } };
+	static const int sizes_quick[2][2] = { { 160, 120 }, { 640, 480 } };
+	static const double scales[4] = { 0.25, 0.6, 1.0, 2.5 };
+	static const struct { const char *name; int family; int subtype; } dithers[] = {
+		{ "none", IW_DITHERFAMILY_NONE, 0 },
+		{ "ordered", IW_DITHERFAMILY_ORDERED, IW_DITHERSUBTYPE_DEFAULT },
+		{ "halftone", IW_DITHERFAMILY_ORDERED, IW_DITHERSUBTYPE_HALFTONE },
+		{ "fs", IW_DITHERFAMILY_ERRDIFF, IW_DITHERSUBTYPE_FS },
+		{ "jjn", IW_DITHERFAMILY_ERRDIFF, IW_DITHERSUBTYPE_JJN },
+		{ "random", IW_DITHERFAMILY_RANDOM, IW_DITHERSUBTYPE_DEFAULT },
+		{ NULL, 0, 0 }
+	};
+	static const char *profiles[] = { "default", "fastest", "balanced",
+		"smallest", NULL };
+	int num_sizes;
+	int t, d, z, f, k;
+	int depth;
+	int w, h;
+	struct bench_case *c;
+
+	num_sizes = bp->quick ? 2 : 3;
+	// Filter, scale, and dither tests use the middle size.
+	w = bp->quick ? sizes_quick[1][0] : sizes_full[1][0];
+	h = bp->quick ? sizes_quick[1][1] : sizes_full[1][1];
+
+	// Every input image type and depth, reduced to half size.
+	for(t=0; t<4; t++) {
+		for(d=0; d<3; d++) {
+			depth = (d==0) ? 8 : (d==1) ? 16 : 32;
+			for(z=0; z<num_sizes; z++) {
+				if(!(c = bench_new_case(bp))) return;
+				c->imgtype = imgtypes[t];
+				c->bit_depth = depth;
+				if(depth==32) c->sampletype = IW_SAMPLETYPE_FLOATINGPOINT;
+				if(bp->quick) bench_set_scale(c,sizes_quick[z][0],sizes_quick[z][1],0.5);
+				else bench_set_scale(c,sizes_full[z][0],sizes_full[z][1],0.5);
+				sprintf(c->name,"type/%s%d%s/%dx%d",bench_imgtype_name(c->imgtype),
+					depth,(depth==32)?"f":"",c->src_w,c->src_h);
+			}
+		}
+	}
+
+	// Every filter, at several scale factors.
+	for(f=0; bench_filters[f].name; f++) {
+		for(k=0; k<4; k++) {
+			if(!(c = bench_new_case(bp))) return;
+			bench_set_scale(c,w,h,scales[k]);
+			c->filter = bench_filters[f].family;
+			c->param1 = bench_filters[f].param1;
+			c->param2 = bench_filters[f].param2;
+			sprintf(c->name,"filter/%s/x%.2f",bench_filters[f].name,scales[k]);
+		}
+	}
+
+	// Every dither method, reducing 16-bit to 8-bit, and to 4 colors
+	// per channel.
+	for(k=0; dithers[k].name; k++) {
+		for(z=0; z<2; z++) {
+			if(!(c = bench_new_case(bp))) return;
+			bench_set_scale(c,w,h,0.5);
+			c->ditherfamily = dithers[k].family;
+			c->dithersubtype = dithers[k].subtype;
+			if(z==0) {
+				c->bit_depth = 16;
+				c->out_depth = 8;
+				sprintf(c->name,"dither/%s/rgb16-to-8",dithers[k].name);
+			}
+			else {
+				c->color_count = 4;
+				sprintf(c->name,"dither/%s/rgb8-to-cc4",dithers[k].name);
+			}
+		}
+	}
+
+	// Output depths.
+	for(k=0; k<4; k++) {
+		if(!(c = bench_new_case(bp))) return;
+		bench_set_scale(c,w,h,0.5);
+		c->imgtype = IW_IMGTYPE_RGBA;
+		c->bit_depth = 16;
+		switch(k) {
+		case 0:
+			c->out_depth = 16;
+			break;
+		case 1:
+			c->out_depth = 8;
+			break;
+		case 2:
+			c->grayscale = 1;
+			c->out_depth = 8;
+			break;
+		default:
+			c->grayscale = 1;
+			c->out_depth = 1;
+			c->ditherfamily = IW_DITHERFAMILY_ERRDIFF;
+			c->dithersubtype = IW_DITHERSUBTYPE_FS;
+		}
+		sprintf(c->name,"depth/rgba16-to-%s%d",c->grayscale?"gray":"rgba",c->out_depth);
+	}
+
+	// PNG encoding profiles, with a photo-like image, a grayscale image, a
+	// paletted image, and a bilevel image.
+	for(k=0; profiles[k]; k++) {
+		for(z=0; z<4; z++) {
+			if(!(c = bench_new_case(bp))) return;
+			bench_set_scale(c,w,h,1.0);
+			c->filter = IW_RESIZETYPE_NEAREST;
+			c->out_fmt = IW_FORMAT_PNG;
+			c->profile = profiles[k];
+			switch(z) {
+			case 0:
+				sprintf(c->name,"png/%s/rgb8",c->profile);
+				break;
+			case 1:
+				c->imgtype = IW_IMGTYPE_GRAY;
+				sprintf(c->name,"png/%s/gray8",c->profile);
+				break;
+			case 2:
+				c->color_count = 4;
+				sprintf(c->name,"png/%s/cc4",c->profile);
+				break;
+			default:
+				c->imgtype = IW_IMGTYPE_GRAY;
+				c->color_count = 2;
+				c->ditherfamily = IW_DITHERFAMILY_ERRDIFF;
+				c->dithersubtype = IW_DITHERSUBTYPE_FS;
+				sprintf(c->name,"png/%s/bilevel",c->profile);
+			}
+		}
+	}
+
+	// JPEG encoding profiles, with a color image and a grayscale image.
+	for(k=0; profiles[k]; k++) {
+		for(z=0; z<2; z++) {
+			if(!(c = bench_new_case(bp))) return;
+			bench_set_scale(c,w,h,1.0);
+			c->filter = IW_RESIZETYPE_NEAREST;
+			c->out_fmt = IW_FORMAT_JPEG;
+			c->profile = profiles[k];
+			if(z==1) c->imgtype = IW_IMGTYPE_GRAY;
+			sprintf(c->name,"jpeg/%s/%s8",c->profile,bench_imgtype_name(c->imgtype));
+		}
+	}
+}
+
+// A simple deterministic pseudorandom number generator, so that every run
+// uses the same images.
+static unsigned int bench_rand(unsigned int *state)
+{
+	*state = (*state)*1103515245 + 12345;
+	return ((*state)>>16)&0x7fff;
+}
+
+// Make an image with gradients and some noise, so that it doesn't get
+// optimized into a palette image.
+static iw_byte *bench_make_pixels(struct iw_context *ctx, const struct bench_case *c,
+	size_t *pbpr)
+{
+	int nch;
+	int x, y, ch;
+	size_t bpr;
+	iw_byte *pixels;
+	iw_byte *p;
+	double v;
+	unsigned int state = 1;
+	unsigned int n;
+	iw_float32 fv;
+
+	nch = bench_num_channels(c->imgtype);
+	bpr = iw_calc_bytesperrow(c->src_w,nch*c->bit_depth);
+	pixels = iw_malloc_large(ctx,bpr,c->src_h);
+	if(!pixels) return NULL;
+
+	for(y=0; y<c->src_h; y++) {
+		p = &pixels[y*bpr];
+		for(x=0; x<c->src_w; x++) {
+			for(ch=0; ch<nch; ch++) {
+				if(ch==nch-1 && IW_IMGTYPE_HAS_ALPHA(c->imgtype)) {
+					v = 0.5 + 0.5*((double)x)/c->src_w;
+				}
+				else {
+					v = ((double)((x*(ch+1) + y*(3-ch)) % 512))/511.0;
+					v += ((double)bench_rand(&state))/(32767.0*16.0) - 1.0/32.0;
+				}
+				if(v<0.0) v=0.0;
+				if(v>1.0) v=1.0;
+
+				if(c->sampletype==IW_SAMPLETYPE_FLOATINGPOINT) {
+					fv = (iw_float32)v;
+					memcpy(p,&fv,4);
+					p += 4;
+				}
+				else if(c->bit_depth==16) {
+					n = (unsigned int)(0.5+v*65535.0);
+					*p++ = (iw_byte)(n>>8);
+					*p++ = (iw_byte)(n&0xff);
+				}
+				else {
+					*p++ = (iw_byte)(0.5+v*255.0);
+				}
+			}
+		}
+	}
+
+	*pbpr = bpr;
+	return pixels;
+}
+
+// A write function that just counts the bytes.
+static int bench_write_fn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const void *buf, size_t nbytes)
+{
+	*((size_t*)iodescr->fp) += nbytes;
+	return 1;
+}
+
+// Write the processed image to a "file" of format c->out_fmt, and set
+// c->out_size.
+static int bench_write_image(struct bench_case *c, struct iw_context *ctx)
+{
+	struct iw_iodescr writedescr;
+
+	c->out_size = 0;
+	memset(&writedescr,0,sizeof(struct iw_iodescr));
+	writedescr.fp = (void*)&c->out_size;
+	writedescr.write_fn = bench_write_fn;
+	if(strcmp(c->profile,"default")) {
+		iw_set_option(ctx,(c->out_fmt==IW_FORMAT_JPEG)?"jpeg:profile":"png:profile",
+			c->profile);
+	}
+	return iw_write_file_by_fmt(ctx,&writedescr,c->out_fmt);
+}
+
+static int bench_run_case(struct bench_params *bp, struct bench_case *c)
+{
+	struct iw_context *srcctx = NULL;
+	struct iw_context *ctx = NULL;
+	struct iw_image img;
+	struct iw_image outimg;
+	struct iw_stats st;
+	double t;
+	int i, k;
+	int retval = 0;
+
+	srcctx = iw_create_context(NULL);
+	if(!srcctx) goto done;
+
+	memset(&img,0,sizeof(struct iw_image));
+	img.imgtype = c->imgtype;
+	img.bit_depth = c->bit_depth;
+	img.sampletype = c->sampletype;
+	img.width = c->src_w;
+	img.height = c->src_h;
+	img.pixels = bench_make_pixels(srcctx,c,&img.bpr);
+	if(!img.pixels) goto done;
+	iw_set_input_image(srcctx,&img);
+
+	c->time = -1.0;
+
+	for(i=0; i<bp->iterations; i++) {
+		// The derived context shares the source image, so it doesn't have
+		// to be remade each time.
+		ctx = iw_create_derived_context(srcctx);
+		if(!ctx) goto done;
+
+		iw_set_value(ctx,IW_VAL_COLLECT_STATS,1);
+		iw_set_output_profile(ctx,iw_get_profile_by_fmt(c->out_fmt?c->out_fmt:IW_FORMAT_PNG));
+		iw_set_output_canvas_size(ctx,c->dst_w,c->dst_h);
+		iw_set_resize_alg(ctx,IW_DIMENSION_H,c->filter,1.0,c->param1,c->param2);
+		iw_set_resize_alg(ctx,IW_DIMENSION_V,c->filter,1.0,c->param1,c->param2);
+		if(c->grayscale) iw_set_value(ctx,IW_VAL_CVT_TO_GRAYSCALE,1);
+		if(c->out_depth) iw_set_output_depth(ctx,c->out_depth);
+		if(c->color_count) iw_set_color_count(ctx,IW_CHANNELTYPE_ALL,c->color_count);
+		if(c->ditherfamily!=IW_DITHERFAMILY_NONE) {
+			iw_set_dither_type(ctx,IW_CHANNELTYPE_ALL,c->ditherfamily,c->dithersubtype);
+		}
+
+		if(!iw_process_image(ctx)) goto done;
+		if(c->out_fmt) {
+			if(!bench_write_image(c,ctx)) goto done;
+		}
+
+		iw_get_stats(ctx,&st);
+		t = 0.0;
+		for(k=0; k<IW_NUM_STAGES; k++) {
+			if(c->out_fmt && k!=IW_STAGE_WRITE) continue;
+			t += st.stage[k].wall_time;
+		}
+		if(c->time<0.0 || t<c->time) {
+			c->time = t;
+			for(k=0; k<IW_NUM_STAGES; k++) {
+				c->stage_time[k] = st.stage[k].wall_time;
+			}
+		}
+
+		if(c->out_fmt) {
+			iw_get_output_image(ctx,&outimg);
+			c->enc_mbps = ((double)outimg.bpr)*outimg.height/1000000.0;
+		}
+
+		iw_destroy_context(ctx);
+		ctx = NULL;
+	}
+
+	if(c->time<=0.0) c->time = 0.000001;
+	c->mpps = ((double)c->src_w)*c->src_h/1000000.0/c->time;
+	c->enc_mbps /= c->time;
+	c->ok = 1;
+	retval = 1;
+
+done:
+	if(ctx) {
+		if(iw_get_errorflag(ctx)) {
+			char buf[200];
+			fprintf(stderr,"%s: %s\n",c->name,iw_get_errormsg(ctx,buf,sizeof(buf)));
+		}
+		iw_destroy_context(ctx);
+	}
+	iw_destroy_context(srcctx);
+	return retval;
+}
+
+static int bench_write_json(struct bench_params *bp)
+{
+	FILE *f;
+	int i, k;
+	int first = 1;
+
+	f = fopen(bp->json_fn,"w");
+	if(!f) {
+		fprintf(stderr,"Can't write %s\n",bp->json_fn);
+		return 0;
+	}
+
+	// One benchmark per line, to make it easy to read back in.
+	fprintf(f,"{\"benchmarks\":[\n");
+	for(i=0; i<bp->num_cases; i++) {
+		struct bench_case *c = &bp->cases[i];
+		if(!c->ok) continue;
+		fprintf(f,"%s{\"name\":\"%s\",\"mpps\":%.3f,\"time\":%.6f",
+			first?"":",\n",c->name,c->mpps,c->time);
+		if(c->out_fmt) {
+			fprintf(f,",\"mbps\":%.3f,\"bytes\":%u",c->enc_mbps,(unsigned int)c->out_size);
+		}
+		else {
+			for(k=0; k<IW_NUM_STAGES; k++) {
+				if(k==IW_STAGE_READ || k==IW_STAGE_WRITE) continue;
+				fprintf(f,",\"%s\":%.6f",iw_get_stage_name(k),c->stage_time[k]);
+			}
+		}
+		fprintf(f,"}");
+		first = 0;
+	}
+	fprintf(f,"\n]}\n");
+	fclose(f);
+	return 1;
+}
+
+// Look up a benchmark's speed in the baseline file's contents.
+// Returns 0 if not found.
+static double bench_find_baseline(const char *data, const char *name)
+{
+	char key[100];
+	const char *s;
+	double mpps;
+
+	sprintf(key,"\"name\":\"%s\"",name);
+	s = strstr(data,key);
+	if(!s) return 0.0;
+	s = strstr(s,"\"mpps\":");
+	if(!s) return 0.0;
+	if(sscanf(s+7,"%lf",&mpps)!=1) return 0.0;
+	return mpps;
+}
+
+static char *bench_read_file(const char *fn)
+{
+	FILE *f;
+	char *data = NULL;
+	size_t len = 0;
+	size_t alloc = 0;
+	size_t n;
+
+	f = fopen(fn,"rb");
+	if(!f) return NULL;
+	while(1) {
+		if(alloc-len<4096) {
+			char *newdata;
+			alloc = alloc ? alloc*2 : 65536;
+			newdata = realloc(data,alloc);
+			if(!newdata) { free(data); data=NULL; break; }
+			data = newdata;
+		}
+		n = fread(&data[len],1,alloc-len-1,f);
+		if(n==0) break;
+		len += n;
+	}
+	fclose(f);
+	if(data) data[len] = '\0';
+	return data;
+}
+
+// Returns the number of regressions, or -1 on error.
+static int bench_compare_baseline(struct bench_params *bp)
+{
+	char *data;
+	double base;
+	double pct;
+	int i;
+	int regressions = 0;
+
+	data = bench_read_file(bp->baseline_fn);
+	if(!data) {
+		fprintf(stderr,"Can't read %s\n",bp->baseline_fn);
+		return -1;
+	}
+
+	printf("\nComparison with %s (tolerance %.1f%%):\n",bp->baseline_fn,bp->tolerance);
+	for(i=0; i<bp->num_cases; i++) {
+		struct bench_case *c = &bp->cases[i];
+		if(!c->ok) continue;
+		base = bench_find_baseline(data,c->name);
+		if(base<=0.0) {
+			printf("%-32s (not in baseline)\n",c->name);
+			continue;
+		}
+		pct = 100.0*(c->mpps-base)/base;
+		printf("%-32s %9.2f %9.2f %+7.1f%%%s\n",c->name,base,c->mpps,pct,
+			(pct < -bp->tolerance) ? "  REGRESSION" : "");
+		if(pct < -bp->tolerance) regressions++;
+	}
+	printf("%d regression%s\n",regressions,regressions==1?"":"s");
+
+	free(data);
+	return regressions;
+}
+
+static void bench_usage(void)
+{
+	printf("Usage: imagew-bench [options]\n"
+		"Options:\n"
+		" -quick            Use smaller images\n"
+		" -iterations <n>   Run each benchmark n times, and keep the best time (default 3)\n"
+		" -match <string>   Only run benchmarks whose names contain <string>\n"
+		" -json <file>      Write the results to <file>\n"
+		" -baseline <file>  Compare with results previously written by -json\n"
+		" -tolerance <pct>  Allowed slowdown compared to the baseline (default 10)\n");
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench_params bp;
+	int i;
+	int ret;
+	int failures = 0;
+	int exitcode = 0;
+
+	memset(&bp,0,sizeof(struct bench_params));
+	bp.iterations = 3;
+	bp.tolerance = 10.0;
+
+	for(i=1; i<argc; i++) {
+		if(!strcmp(argv[i],"-quick")) {
+			bp.quick = 1;
+		}
+		else if(!strcmp(argv[i],"-iterations") && i+1<argc) {
+			bp.iterations = atoi(argv[++i]);
+			if(bp.iterations<1) bp.iterations = 1;
+		}
+		else if(!strcmp(argv[i],"-match") && i+1<argc) {
+			bp.match = argv[++i];
+		}
+		else if(!strcmp(argv[i],"-json") && i+1<argc) {
+			bp.json_fn = argv[++i];
+		}
+		else if(!strcmp(argv[i],"-baseline") && i+1<argc) {
+			bp.baseline_fn = argv[++i];
+		}
+		else if(!strcmp(argv[i],"-tolerance") && i+1<argc) {
+			bp.tolerance = atof(argv[++i]);
+		}
+		else {
+			bench_usage();
+			return 1;
+		}
+	}
+
+	bp.cases = calloc(BENCH_MAX_CASES,sizeof(struct bench_case));
+	if(!bp.cases) return 1;
+	bench_make_cases(&bp);
+
+	printf("%-32s %9s %9s %9s %9s %9s %9s\n","benchmark","MP/s","ms",
+		"prepare","vertical","horiz","optimize");
+
+	for(i=0; i<bp.num_cases; i++) {
+		struct bench_case *c = &bp.cases[i];
+
+		if(bp.match && !strstr(c->name,bp.match)) continue;
+
+		if(!bench_run_case(&bp,c)) {
+			printf("%-32s FAILED\n",c->name);
+			failures++;
+			continue;
+		}
+		if(c->out_fmt) {
+			printf("%-32s %9.2f %9.3f %9.2f MB/s %9u bytes\n",c->name,c->mpps,
+				c->time*1000.0,c->enc_mbps,(unsigned int)c->out_size);
+			fflush(stdout);
+			continue;
+		}
+		printf("%-32s %9.2f %9.3f %9.3f %9.3f %9.3f %9.3f\n",c->name,c->mpps,
+			c->time*1000.0,
+			c->stage_time[IW_STAGE_PREPARE]*1000.0,
+			c->stage_time[IW_STAGE_VERTICAL]*1000.0,
+			c->stage_time[IW_STAGE_HORIZONTAL]*1000.0,
+			c->stage_time[IW_STAGE_OPTIMIZE]*1000.0);
+		fflush(stdout);
+	}
+
+	if(failures) exitcode = 1;
+
+	if(bp.json_fn) {
+		if(!bench_write_json(&bp)) exitcode = 1;
+	}
+
+	if(bp.baseline_fn) {
+		ret = bench_compare_baseline(&bp);
+		if(ret!=0) exitcode = 1;
+	}
+
+	free(bp.cases);
+	return exitcode;
+}
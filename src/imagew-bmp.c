@@ -31,6 +31,9 @@ static size_t iwbmp_calc_bpr(int bpp, size_t width)
 	return ((bpp*width+31)/32)*4;
 }
 
+struct iwbmprcontext;
+typedef void (*iwbmpr_convertrowfn_type)(struct iwbmprcontext *rctx, const iw_byte *src, size_t row);
+
 struct iwbmprcontext {
 	struct iw_iodescr *iodescr;
 	struct iw_context *ctx;
@@ -39,6 +42,13 @@ struct iwbmprcontext {
 	int width, height;
 	int topdown;
 	int has_fileheader;
+
+	// If we're only reading part of the image (see iw_get_input_crop()):
+	int use_crop;
+	int crop_x; // First column to read
+	int crop_y; // First row to read
+	int crop_row; // First row to read, in file order
+
 	unsigned int bitcount; // bits per pixel
 	unsigned int compression; // IWBMP_BI_*
 	int uses_bitfields; // 'compression' is BI_BITFIELDS
@@ -59,6 +69,13 @@ struct iwbmprcontext {
 	int bf_low_bit[4];
 	int bf_bits_count[4]; // number of bits in each channel
 
+	// Converts a row of uncompressed pixels. Chosen by
+	// bmpr_choose_row_converter(), once the headers have been read.
+	iwbmpr_convertrowfn_type convertrow_fn;
+	// If set, the rows are used as-is, instead of being converted.
+	int use_native_rows;
+	int native_chanorder; // IW_CHANORDER_*
+
 	struct iw_csdescr csdescr;
 };
 
@@ -82,6 +99,10 @@ static int iwbmp_skip_bytes(struct iwbmprcontext *rctx, size_t n)
 	size_t still_to_read;
 	size_t num_to_read;
 
+	if(rctx->iodescr->seek_fn) {
+		return (*rctx->iodescr->seek_fn)(rctx->ctx,rctx->iodescr,(iw_int64)n,SEEK_CUR);
+	}
+
 	still_to_read = n;
 	while(still_to_read>0) {
 		num_to_read = still_to_read;
@@ -410,10 +431,6 @@ static int iwbmp_read_info_header(struct iwbmprcontext *rctx)
 		goto done;
 	}
 
-	if(!iw_check_image_dimensions(rctx->ctx,rctx->width,rctx->height)) {
-		goto done;
-	}
-
 	retval = 1;
 
 done:
@@ -554,18 +571,20 @@ static int iwbmp_read_palette(struct iwbmprcontext *rctx)
 static void bmpr_convert_row_32_16(struct iwbmprcontext *rctx, const iw_byte *src, size_t row)
 {
 	int i,k;
+	int si; // index of the source pixel
 	unsigned int v,x;
 	int numchannels;
 
 	numchannels = rctx->has_alpha_channel ? 4 : 3;
 
-	for(i=0;i<rctx->width;i++) {
+	for(i=0;i<rctx->img->width;i++) {
+		si = rctx->crop_x + i;
 		if(rctx->bitcount==32) {
-			x = ((unsigned int)src[i*4+0]) | ((unsigned int)src[i*4+1])<<8 |
-				((unsigned int)src[i*4+2])<<16 | ((unsigned int)src[i*4+3])<<24;
+			x = ((unsigned int)src[si*4+0]) | ((unsigned int)src[si*4+1])<<8 |
+				((unsigned int)src[si*4+2])<<16 | ((unsigned int)src[si*4+3])<<24;
 		}
 		else { // 16
-			x = ((unsigned int)src[i*2+0]) | ((unsigned int)src[i*2+1])<<8;
+			x = ((unsigned int)src[si*2+0]) | ((unsigned int)src[si*2+1])<<8;
 		}
 		v = 0;
 		for(k=0;k<numchannels;k++) { // For red, green, blue [, alpha]:
@@ -583,20 +602,49 @@ static void bmpr_convert_row_32_16(struct iwbmprcontext *rctx, const iw_byte *sr
 	}
 }
 
-static void bmpr_convert_row_24(struct iwbmprcontext *rctx,const iw_byte *src, size_t row)
+// Specialized versions of bmpr_convert_row_32_16(), for the most common
+// 16-bit bitfields. They are simple enough for the compiler to vectorize.
+// (The common 32-bit formats, and 24-bit images, don't need converting; see
+// bmpr_choose_row_converter().)
+
+// 16-bit, 5-5-5 (the default for 16-bit images)
+static void bmpr_convert_row_555(struct iwbmprcontext *rctx, const iw_byte *src, size_t row)
 {
 	int i;
-	for(i=0;i<rctx->width;i++) {
-		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = src[i*3+2];
-		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = src[i*3+1];
-		rctx->img->pixels[row*rctx->img->bpr + i*3 + 2] = src[i*3+0];
+	unsigned int x;
+	iw_byte *dst = &rctx->img->pixels[row*rctx->img->bpr];
+
+	src += rctx->crop_x*2;
+	for(i=0;i<rctx->img->width;i++) {
+		x = ((unsigned int)src[i*2+0]) | ((unsigned int)src[i*2+1])<<8;
+		dst[i*3+0] = (iw_byte)((x>>10)&0x1f);
+		dst[i*3+1] = (iw_byte)((x>>5)&0x1f);
+		dst[i*3+2] = (iw_byte)(x&0x1f);
+	}
+}
+
+// 16-bit, 5-6-5
+static void bmpr_convert_row_565(struct iwbmprcontext *rctx, const iw_byte *src, size_t row)
+{
+	int i;
+	unsigned int x;
+	iw_byte *dst = &rctx->img->pixels[row*rctx->img->bpr];
+
+	src += rctx->crop_x*2;
+	for(i=0;i<rctx->img->width;i++) {
+		x = ((unsigned int)src[i*2+0]) | ((unsigned int)src[i*2+1])<<8;
+		dst[i*3+0] = (iw_byte)(x>>11);
+		dst[i*3+1] = (iw_byte)((x>>5)&0x3f);
+		dst[i*3+2] = (iw_byte)(x&0x1f);
 	}
 }
 
 static void bmpr_convert_row_8(struct iwbmprcontext *rctx,const iw_byte *src, size_t row)
 {
 	int i;
-	for(i=0;i<rctx->width;i++) {
+
+	src += rctx->crop_x;
+	for(i=0;i<rctx->img->width;i++) {
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = rctx->palette.entry[src[i]].r;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = rctx->palette.entry[src[i]].g;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 2] = rctx->palette.entry[src[i]].b;
@@ -606,10 +654,12 @@ static void bmpr_convert_row_8(struct iwbmprcontext *rctx,const iw_byte *src, si
 static void bmpr_convert_row_4(struct iwbmprcontext *rctx,const iw_byte *src, size_t row)
 {
 	int i;
+	int si;
 	int pal_index;
 
-	for(i=0;i<rctx->width;i++) {
-		pal_index = (i&0x1) ? src[i/2]&0x0f : src[i/2]>>4;
+	for(i=0;i<rctx->img->width;i++) {
+		si = rctx->crop_x + i;
+		pal_index = (si&0x1) ? src[si/2]&0x0f : src[si/2]>>4;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = rctx->palette.entry[pal_index].r;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = rctx->palette.entry[pal_index].g;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 2] = rctx->palette.entry[pal_index].b;
@@ -619,10 +669,12 @@ static void bmpr_convert_row_4(struct iwbmprcontext *rctx,const iw_byte *src, si
 static void bmpr_convert_row_2(struct iwbmprcontext *rctx,const iw_byte *src, size_t row)
 {
 	int i;
+	int si;
 	int pal_index;
 
-	for(i=0;i<rctx->width;i++) {
-		pal_index = (src[i/4]>>(2*(3-i%4)))&0x03;
+	for(i=0;i<rctx->img->width;i++) {
+		si = rctx->crop_x + i;
+		pal_index = (src[si/4]>>(2*(3-si%4)))&0x03;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = rctx->palette.entry[pal_index].r;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = rctx->palette.entry[pal_index].g;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 2] = rctx->palette.entry[pal_index].b;
@@ -632,16 +684,80 @@ static void bmpr_convert_row_2(struct iwbmprcontext *rctx,const iw_byte *src, si
 static void bmpr_convert_row_1(struct iwbmprcontext *rctx,const iw_byte *src, size_t row)
 {
 	int i;
+	int si;
 	int pal_index;
 
-	for(i=0;i<rctx->width;i++) {
-		pal_index = (src[i/8] & (1<<(7-i%8))) ? 1 : 0;
+	for(i=0;i<rctx->img->width;i++) {
+		si = rctx->crop_x + i;
+		pal_index = (src[si/8] & (1<<(7-si%8))) ? 1 : 0;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = rctx->palette.entry[pal_index].r;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = rctx->palette.entry[pal_index].g;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 2] = rctx->palette.entry[pal_index].b;
 	}
 }
 
+static int bmpr_bitfields_are(struct iwbmprcontext *rctx, unsigned int r,
+	unsigned int g, unsigned int b, unsigned int a)
+{
+	return rctx->bf_mask[0]==r && rctx->bf_mask[1]==g && rctx->bf_mask[2]==b &&
+		(rctx->has_alpha_channel ? rctx->bf_mask[3] : 0)==a;
+}
+
+static void bmpr_choose_row_converter(struct iwbmprcontext *rctx)
+{
+	// For these formats, IW can read the rows directly, so no converter is
+	// needed.
+	rctx->use_native_rows = 1;
+	switch(rctx->bitcount) {
+	case 32:
+		if(bmpr_bitfields_are(rctx,0x00ff0000,0x0000ff00,0x000000ff,0)) {
+			rctx->native_chanorder = IW_CHANORDER_BGRX;
+			return;
+		}
+		if(bmpr_bitfields_are(rctx,0x00ff0000,0x0000ff00,0x000000ff,0xff000000)) {
+			rctx->native_chanorder = IW_CHANORDER_BGR;
+			return;
+		}
+		break;
+	case 24:
+		rctx->native_chanorder = IW_CHANORDER_BGR;
+		return;
+	}
+	rctx->use_native_rows = 0;
+
+	switch(rctx->bitcount) {
+	case 32:
+		rctx->convertrow_fn = bmpr_convert_row_32_16;
+		break;
+	case 16:
+		if(bmpr_bitfields_are(rctx,0x7c00,0x03e0,0x001f,0))
+			rctx->convertrow_fn = bmpr_convert_row_555;
+		else if(bmpr_bitfields_are(rctx,0xf800,0x07e0,0x001f,0))
+			rctx->convertrow_fn = bmpr_convert_row_565;
+		else
+			rctx->convertrow_fn = bmpr_convert_row_32_16;
+		break;
+	case 8: rctx->convertrow_fn = bmpr_convert_row_8; break;
+	case 4: rctx->convertrow_fn = bmpr_convert_row_4; break;
+	case 2: rctx->convertrow_fn = bmpr_convert_row_2; break;
+	case 1: rctx->convertrow_fn = bmpr_convert_row_1; break;
+	default: rctx->convertrow_fn = NULL;
+	}
+}
+
+// Read the rows as they are in the file, without converting them. IW will
+// skip the row padding, and the columns to the left of the crop.
+static int bmpr_read_native_rows(struct iwbmprcontext *rctx, size_t bmp_bpr)
+{
+	rctx->img->bpr = bmp_bpr;
+	rctx->img->channel_order = rctx->native_chanorder;
+	rctx->img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx,rctx->img->bpr,rctx->img->height);
+	if(!rctx->img->pixels) return 0;
+	rctx->img->firstrow = &rctx->img->pixels[(size_t)rctx->crop_x*(rctx->bitcount/8)];
+	rctx->img->stride = (ptrdiff_t)rctx->img->bpr;
+	return iwbmp_read(rctx,rctx->img->pixels,bmp_bpr*(size_t)rctx->img->height);
+}
+
 static int bmpr_read_uncompressed(struct iwbmprcontext *rctx)
 {
 	iw_byte *rowbuf = NULL;
@@ -653,46 +769,40 @@ static int bmpr_read_uncompressed(struct iwbmprcontext *rctx)
 		rctx->img->imgtype = IW_IMGTYPE_RGBA;
 		
 		rctx->img->bit_depth = rctx->need_16bit ? 16 : 8;
-		rctx->img->bpr = iw_calc_bytesperrow(rctx->width,4*rctx->img->bit_depth);
+		rctx->img->bpr = iw_calc_bytesperrow(rctx->img->width,4*rctx->img->bit_depth);
 	}
 	else {
 		rctx->img->imgtype = IW_IMGTYPE_RGB;
 		rctx->img->bit_depth = rctx->need_16bit ? 16 : 8;
-		rctx->img->bpr = iw_calc_bytesperrow(rctx->width,3*rctx->img->bit_depth);
+		rctx->img->bpr = iw_calc_bytesperrow(rctx->img->width,3*rctx->img->bit_depth);
 	}
 
 	bmp_bpr = iwbmp_calc_bpr(rctx->bitcount,rctx->width);
 
+	if(rctx->crop_row>0) {
+		// Skip over the rows we don't need. Rows after the last one we need
+		// are never read.
+		if(!iwbmp_skip_bytes(rctx,bmp_bpr*(size_t)rctx->crop_row)) goto done;
+	}
+
+	if(rctx->use_native_rows) {
+		retval = bmpr_read_native_rows(rctx,bmp_bpr);
+		goto done;
+	}
+
 	rctx->img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx,rctx->img->bpr,rctx->img->height);
 	if(!rctx->img->pixels) goto done;
 
 	rowbuf = iw_malloc(rctx->ctx,bmp_bpr);
+	if(!rowbuf) goto done;
 
 	for(j=0;j<rctx->img->height;j++) {
 		// Read a row of the BMP file.
 		if(!iwbmp_read(rctx,rowbuf,bmp_bpr)) {
 			goto done;
 		}
-		switch(rctx->bitcount) {
-		case 32:
-		case 16:
-			bmpr_convert_row_32_16(rctx,rowbuf,j);
-			break;
-		case 24:
-			bmpr_convert_row_24(rctx,rowbuf,j);
-			break;
-		case 8:
-			bmpr_convert_row_8(rctx,rowbuf,j);
-			break;
-		case 4:
-			bmpr_convert_row_4(rctx,rowbuf,j);
-			break;
-		case 2:
-			bmpr_convert_row_2(rctx,rowbuf,j);
-			break;
-		case 1:
-			bmpr_convert_row_1(rctx,rowbuf,j);
-			break;
+		if(rctx->convertrow_fn) {
+			(*rctx->convertrow_fn)(rctx,rowbuf,j);
 		}
 	}
 
@@ -911,6 +1021,19 @@ static int iwbmp_read_bits(struct iwbmprcontext *rctx)
 	}
 
 	if(rctx->compression==IWBMP_BI_RGB) {
+		int crop_w, crop_h;
+
+		// If the caller only wants part of the image, read only that part.
+		// (The crop is in terms of the image after it has been flipped, if
+		// it is a bottom-up image.)
+		if(iw_get_input_crop(rctx->ctx,rctx->width,rctx->height,
+			&rctx->crop_x,&rctx->crop_y,&crop_w,&crop_h))
+		{
+			rctx->use_crop = 1;
+			rctx->crop_row = rctx->topdown ? rctx->crop_y : rctx->height-rctx->crop_y-crop_h;
+			rctx->img->width = crop_w;
+			rctx->img->height = crop_h;
+		}
 		if(!bmpr_read_uncompressed(rctx)) goto done;
 	}
 	else if(rctx->compression==IWBMP_BI_RLE8 || rctx->compression==IWBMP_BI_RLE4) {
@@ -928,11 +1051,6 @@ done:
 
 static void iwbmpr_misc_config(struct iw_context *ctx, struct iwbmprcontext *rctx)
 {
-	// Have IW flip the image, if necessary.
-	if(!rctx->topdown) {
-		iw_reorient_image(ctx,IW_REORIENT_FLIP_V);
-	}
-
 	// Tell IW the colorspace.
 	iw_set_input_colorspace(ctx,&rctx->csdescr);
 
@@ -973,6 +1091,10 @@ IW_IMPL(int) iw_read_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	}
 	if(!iwbmp_read_info_header(&rctx)) goto done;
 
+	if(!iw_check_image_dimensions(ctx,rctx.width,rctx.height)) {
+		goto done;
+	}
+
 	iwbmp_set_default_bitfields(&rctx);
 	if(rctx.bitfields_nbytes>0) {
 		if(!iwbmp_read_bitfields(&rctx)) goto done;
@@ -981,9 +1103,21 @@ IW_IMPL(int) iw_read_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	if(rctx.palette_entries>0) {
 		if(!iwbmp_read_palette(&rctx)) goto done;
 	}
+	bmpr_choose_row_converter(&rctx);
 	if(!iwbmp_read_bits(&rctx)) goto done;
 
+	if(!rctx.topdown) {
+		// The rows are in bottom-up order. Instead of flipping the image, have
+		// IW read them from the last to the first.
+		if(!img.firstrow) img.firstrow = img.pixels;
+		img.firstrow += (size_t)(img.height-1)*img.bpr;
+		img.stride = -(ptrdiff_t)img.bpr;
+	}
+
 	iw_set_input_image(ctx, &img);
+	if(rctx.use_crop) {
+		iw_set_input_image_offset(ctx,rctx.crop_x,rctx.crop_y,rctx.width,rctx.height);
+	}
 
 	iwbmpr_misc_config(ctx, &rctx);
 
@@ -998,6 +1132,77 @@ done:
 	return retval;
 }
 
+IW_IMPL(int) iw_probe_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info)
+{
+	struct iwbmprcontext rctx;
+	struct iw_image img;
+	int retval = 0;
+
+	iw_zeromem(info,sizeof(struct iw_image_info));
+	iw_zeromem(&rctx,sizeof(struct iwbmprcontext));
+	iw_zeromem(&img,sizeof(struct iw_image));
+
+	rctx.ctx = ctx;
+	rctx.img = &img;
+	rctx.iodescr = iodescr;
+
+	rctx.has_fileheader = !iw_get_value(ctx,IW_VAL_BMP_NO_FILEHEADER);
+	if(rctx.has_fileheader) {
+		if(!iwbmp_read_file_header(&rctx)) goto done;
+	}
+	if(!iwbmp_read_info_header(&rctx)) goto done;
+
+	if(rctx.width<1 || rctx.height<1) {
+		iw_set_error(ctx,"Invalid image dimensions");
+		goto done;
+	}
+
+	// We need the bitfields to know the bit depth of the decoded image.
+	iwbmp_set_default_bitfields(&rctx);
+	if(rctx.bitfields_nbytes>0) {
+		if(!iwbmp_read_bitfields(&rctx)) goto done;
+	}
+
+	if(rctx.compression==IWBMP_BI_RGB) {
+		info->imgtype = rctx.has_alpha_channel ? IW_IMGTYPE_RGBA : IW_IMGTYPE_RGB;
+		info->bit_depth = rctx.need_16bit ? 16 : 8;
+	}
+	else if((rctx.compression==IWBMP_BI_RLE8 && rctx.bitcount==8) ||
+		(rctx.compression==IWBMP_BI_RLE4 && rctx.bitcount==4))
+	{
+		if(rctx.topdown) {
+			iw_set_error(ctx,"Compression not allowed with top-down images");
+			goto done;
+		}
+		// See bmpr_read_rle().
+		info->imgtype = IW_IMGTYPE_RGBA;
+		info->bit_depth = 8;
+		info->flags |= IW_IMAGEINFOFLAG_IMGTYPE_IS_MAX;
+	}
+	else {
+		iw_set_errorf(ctx,"Unsupported BMP compression or image type (%d)",(int)rctx.compression);
+		goto done;
+	}
+
+	info->width = rctx.width;
+	info->height = rctx.height;
+	info->sampletype = IW_SAMPLETYPE_UINT;
+	info->page_count = 1;
+	info->orient_transform = IW_REORIENT_NOCHANGE;
+	retval = 1;
+
+done:
+	if(!retval) {
+		iw_set_error(ctx,"BMP read failed");
+	}
+	return retval;
+}
+
+struct iwbmpwcontext;
+typedef void (*iwbmpw_convertrowfn_type)(struct iwbmpwcontext *wctx, const iw_byte *srcrow,
+	iw_byte *dstrow, int width);
+
 struct iwbmpwcontext {
 	int bmpversion;
 	int include_file_header;
@@ -1122,6 +1327,53 @@ static void bmpw_convert_row_16_32(struct iwbmpwcontext *wctx, const iw_byte *sr
 	}
 }
 
+// Specialized versions of bmpw_convert_row_16_32(), for the most common
+// bitfields, with 8-bit source samples.
+
+// RGB to 16-bit 5-5-5. The samples have already been reduced to 5 bits.
+static void bmpw_convert_row_555(struct iwbmpwcontext *wctx, const iw_byte *srcrow,
+	iw_byte *dstrow, int width)
+{
+	int i;
+	unsigned int v;
+
+	for(i=0;i<width;i++) {
+		v = ((unsigned int)srcrow[i*3+0])<<10 | ((unsigned int)srcrow[i*3+1])<<5 |
+			(unsigned int)srcrow[i*3+2];
+		dstrow[i*2+0] = (iw_byte)(v&0xff);
+		dstrow[i*2+1] = (iw_byte)(v>>8);
+	}
+}
+
+// RGB to 16-bit 5-6-5.
+static void bmpw_convert_row_565(struct iwbmpwcontext *wctx, const iw_byte *srcrow,
+	iw_byte *dstrow, int width)
+{
+	int i;
+	unsigned int v;
+
+	for(i=0;i<width;i++) {
+		v = ((unsigned int)srcrow[i*3+0])<<11 | ((unsigned int)srcrow[i*3+1])<<5 |
+			(unsigned int)srcrow[i*3+2];
+		dstrow[i*2+0] = (iw_byte)(v&0xff);
+		dstrow[i*2+1] = (iw_byte)(v>>8);
+	}
+}
+
+// RGBA to 32-bit B-G-R-A.
+static void bmpw_convert_row_bgra(struct iwbmpwcontext *wctx, const iw_byte *srcrow,
+	iw_byte *dstrow, int width)
+{
+	int i;
+
+	for(i=0;i<width;i++) {
+		dstrow[i*4+0] = srcrow[i*4+2];
+		dstrow[i*4+1] = srcrow[i*4+1];
+		dstrow[i*4+2] = srcrow[i*4+0];
+		dstrow[i*4+3] = srcrow[i*4+3];
+	}
+}
+
 static void bmpw_convert_row_24(struct iwbmpwcontext *wctx, const iw_byte *srcrow,
 	iw_byte *dstrow, int width)
 {
@@ -1990,22 +2242,51 @@ done:
 	return retval;
 }
 
+static int bmpw_bitfields_are(struct iwbmpwcontext *wctx, unsigned int r,
+	unsigned int g, unsigned int b, unsigned int a)
+{
+	return wctx->bf_mask[0]==r && wctx->bf_mask[1]==g && wctx->bf_mask[2]==b &&
+		wctx->bf_mask[3]==a;
+}
+
+// Choose the function to convert rows of a 16- or 32-bit image.
+static iwbmpw_convertrowfn_type bmpw_choose_bitfields_converter(struct iwbmpwcontext *wctx,
+	struct iw_image *img)
+{
+	if(img->bit_depth!=8) return bmpw_convert_row_16_32;
+
+	if(img->imgtype==IW_IMGTYPE_RGB) {
+		if(bmpw_bitfields_are(wctx,0x7c00,0x03e0,0x001f,0))
+			return bmpw_convert_row_555;
+		if(bmpw_bitfields_are(wctx,0xf800,0x07e0,0x001f,0))
+			return bmpw_convert_row_565;
+	}
+	else if(img->imgtype==IW_IMGTYPE_RGBA) {
+		if(bmpw_bitfields_are(wctx,0x00ff0000,0x0000ff00,0x000000ff,0xff000000))
+			return bmpw_convert_row_bgra;
+	}
+	return bmpw_convert_row_16_32;
+}
+
 static void iwbmp_write_pixels_uncompressed(struct iwbmpwcontext *wctx,
 	struct iw_image *img)
 {
 	int j;
 	iw_byte *dstrow = NULL;
 	const iw_byte *srcrow;
+	iwbmpw_convertrowfn_type convert_bitfields_fn;
 
 	dstrow = iw_mallocz(wctx->ctx,wctx->unc_dst_bpr);
 	if(!dstrow) goto done;
 
+	convert_bitfields_fn = bmpw_choose_bitfields_converter(wctx,img);
+
 	for(j=img->height-1;j>=0;j--) {
 		srcrow = &img->pixels[j*img->bpr];
 		switch(wctx->bitcount) {
-		case 32: bmpw_convert_row_16_32(wctx,srcrow,dstrow,img->width); break;
+		case 32: (*convert_bitfields_fn)(wctx,srcrow,dstrow,img->width); break;
 		case 24: bmpw_convert_row_24(wctx,srcrow,dstrow,img->width); break;
-		case 16: bmpw_convert_row_16_32(wctx,srcrow,dstrow,img->width); break;
+		case 16: (*convert_bitfields_fn)(wctx,srcrow,dstrow,img->width); break;
 		case 8: bmpw_convert_row_8(srcrow,dstrow,img->width); break;
 		case 4: bmpw_convert_row_4(srcrow,dstrow,img->width); break;
 		case 1: bmpw_convert_row_1(srcrow,dstrow,img->width); break;
@@ -85,6 +85,15 @@ struct iw_option_struct {
 	char *val;
 };
 
+struct iwcmd_trace_event {
+	int type; // IW_TRACE_*
+	char name[32];
+	int arg;
+	double time;
+	unsigned long thread_id;
+	int seq; // Used when sorting
+};
+
 struct params_struct {
 	struct uri_struct input_uri;
 	struct uri_struct output_uri;
@@ -99,6 +108,7 @@ struct params_struct {
 	int dst_width_req, dst_height_req;
 	int rel_width_flag, rel_height_flag;
 	int noresize_flag;
+	int use_thumbnail;
 	double rel_width, rel_height;
 	int dst_width, dst_height;
 	struct resize_alg resize_alg_x;
@@ -137,6 +147,7 @@ struct params_struct {
 	int no_bkgd_label;
 
 	int use_crop, crop_x, crop_y, crop_w, crop_h;
+	int use_region, region_x, region_y, region_w, region_h;
 	unsigned int reorient;
 	struct iw_color bkgd;
 	struct iw_color bkgd2;
@@ -195,6 +206,22 @@ struct params_struct {
 #define IWCMD_MAX_OPTIONS 32
 	struct iw_option_struct options[IWCMD_MAX_OPTIONS];
 	int options_count;
+
+	int num_threads; // 0 = one per CPU
+	int stats; // Print timing and memory statistics
+	const char *batch_file; // Set if -batch was used
+	const char *trace_file; // Set if -trace was used
+
+	// Trace events recorded while processing the file(s) for this params
+	// struct. Each is only written to by one thread at a time.
+	struct iwcmd_trace_event *trace_events;
+	int trace_events_count;
+	int trace_events_alloc;
+
+	// Additional output files (from "-next"), all made from the same input
+	// image. Only used in the first params struct.
+	struct params_struct *extra_targets;
+	int extra_targets_count;
 };
 
 #ifndef IW_WINDOWS
@@ -389,6 +416,129 @@ static void my_warning_handler(struct iw_context *ctx, const char *msg)
 	}
 }
 
+static void my_trace_fn(struct iw_context *ctx, const struct iw_trace_event *ev)
+{
+	struct params_struct *p;
+	struct iwcmd_trace_event *newevents;
+	struct iwcmd_trace_event *e;
+
+	p = (struct params_struct *)iw_get_userdata(ctx);
+
+	if(p->trace_events_count>=p->trace_events_alloc) {
+		int n = p->trace_events_alloc ? p->trace_events_alloc*2 : 256;
+		newevents = realloc(p->trace_events,n*sizeof(struct iwcmd_trace_event));
+		if(!newevents) return; // Just lose the event.
+		p->trace_events = newevents;
+		p->trace_events_alloc = n;
+	}
+
+	e = &p->trace_events[p->trace_events_count++];
+	e->type = ev->type;
+	iw_strlcpy(e->name,ev->name,sizeof(e->name));
+	e->arg = ev->arg;
+	e->time = ev->time;
+	e->thread_id = ev->thread_id;
+}
+
+static int iwcmd_compare_trace_events(const void *a, const void *b)
+{
+	const struct iwcmd_trace_event *e1 = (const struct iwcmd_trace_event*)a;
+	const struct iwcmd_trace_event *e2 = (const struct iwcmd_trace_event*)b;
+
+	if(e1->time < e2->time) return -1;
+	if(e1->time > e2->time) return 1;
+	return e1->seq - e2->seq;
+}
+
+// Copy the trace events of p, and of its extra targets, to events[*pcount]
+// and following. If events is NULL, just count them.
+static void iwcmd_gather_trace_events(const struct params_struct *p,
+	struct iwcmd_trace_event *events, int *pcount)
+{
+	int i;
+
+	if(events) {
+		for(i=0; i<p->trace_events_count; i++) {
+			events[*pcount] = p->trace_events[i]; // struct copy
+			events[*pcount].seq = *pcount;
+			(*pcount)++;
+		}
+	}
+	else {
+		*pcount += p->trace_events_count;
+	}
+
+	for(i=0; i<p->extra_targets_count; i++) {
+		iwcmd_gather_trace_events(&p->extra_targets[i],events,pcount);
+	}
+}
+
+// Write the trace events from all the given params structs to p->trace_file,
+// in Chrome's "trace event" JSON format.
+static int iwcmd_write_trace(struct params_struct *p, struct params_struct **plist, int num)
+{
+	struct iwcmd_trace_event *events = NULL;
+	unsigned long tids[64];
+	int num_tids = 0;
+	int num_events = 0;
+	int tid;
+	int i, k;
+	double t0;
+	FILE *fp = NULL;
+	char errmsg[200];
+	int retval = 0;
+
+	for(i=0; i<num; i++) {
+		iwcmd_gather_trace_events(plist[i],NULL,&num_events);
+	}
+	if(num_events>0) {
+		events = malloc(num_events*sizeof(struct iwcmd_trace_event));
+		if(!events) goto done;
+	}
+	num_events = 0;
+	for(i=0; i<num; i++) {
+		iwcmd_gather_trace_events(plist[i],events,&num_events);
+	}
+	if(num_events>0) {
+		qsort(events,num_events,sizeof(struct iwcmd_trace_event),iwcmd_compare_trace_events);
+	}
+
+	fp = iwcmd_fopen(p->trace_file,"w",errmsg,sizeof(errmsg));
+	if(!fp) {
+		iwcmd_error(p,"Failed to open %s for writing: %s\n",p->trace_file,errmsg);
+		goto done;
+	}
+
+	t0 = num_events>0 ? events[0].time : 0.0;
+	fprintf(fp,"{\"traceEvents\":[");
+	for(i=0; i<num_events; i++) {
+		// Number the threads in the order they are first seen.
+		tid = 0;
+		for(k=0; k<num_tids; k++) {
+			if(tids[k]==events[i].thread_id) { tid=k+1; break; }
+		}
+		if(!tid) {
+			if(num_tids<64) tids[num_tids++] = events[i].thread_id;
+			tid = num_tids;
+		}
+
+		fprintf(fp,"%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+			i?",":"",events[i].name,events[i].type==IW_TRACE_BEGIN?"B":"E",
+			(events[i].time-t0)*1000000.0,tid);
+		if(events[i].arg>=0) {
+			fprintf(fp,",\"args\":{\"arg\":%d}",events[i].arg);
+		}
+		fprintf(fp,"}");
+	}
+	fprintf(fp,"\n]}\n");
+
+	retval = 1;
+done:
+	if(fp) fclose(fp);
+	free(events);
+	return retval;
+}
+
 // This is used to process the parameter of -infmt/-outfmt.
 static int get_fmt_from_name(const char *s)
 {
@@ -422,6 +572,18 @@ static int detect_fmt_of_file(struct params_struct *p, FILE *fp)
 	return iw_detect_fmt_of_file((const iw_byte*)p->input_initial_bytes,p->input_initial_bytes_stored);
 }
 
+// Detects the file format of an input file that is mapped into memory.
+static int detect_fmt_of_mem_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
+{
+	const void *mem = NULL;
+	iw_int64 memsize = 0;
+
+	if(!iodescr->getmem_fn) return IW_FORMAT_UNKNOWN;
+	if(!(*iodescr->getmem_fn)(ctx,iodescr,&mem,&memsize)) return IW_FORMAT_UNKNOWN;
+	if(memsize<2) return IW_FORMAT_UNKNOWN;
+	return iw_detect_fmt_of_file((const iw_byte*)mem,(size_t)(memsize>12 ? 12 : memsize));
+}
+
 // Updates p->dst_width and p->dst_height.
 // Returns 0 if we fit to width, 1 if we fit to height.
 static int do_bestfit(struct params_struct *p)
@@ -494,24 +656,6 @@ static int my_readfn(struct iw_context *ctx, struct iw_iodescr *iodescr, void *b
 	return 1;
 }
 
-static int my_getfilesizefn(struct iw_context *ctx, struct iw_iodescr *iodescr, iw_int64 *pfilesize)
-{
-	int ret;
-	long lret;
-	struct params_struct *p = (struct params_struct *)iw_get_userdata(ctx);
-
-	FILE *fp = (FILE*)iodescr->fp;
-
-	// TODO: Rewrite this to support >4GB file sizes.
-	ret=fseek(fp,0,SEEK_END);
-	if(ret!=0) return 0;
-	lret=ftell(fp);
-	if(lret<0) return 0;
-	*pfilesize = (iw_int64)lret;
-	fseek(fp,(long)p->input_initial_bytes_stored,SEEK_SET);
-	return 1;
-}
-
 static int my_seekfn(struct iw_context *ctx, struct iw_iodescr *iodescr, iw_int64 offset, int whence)
 {
 	FILE *fp = (FILE*)iodescr->fp;
@@ -1041,41 +1185,12 @@ static void iwcmd_set_bitdepth(struct params_struct *p, struct iw_context *ctx)
 	}
 }
 
-static int iwcmd_run(struct params_struct *p)
+// Decide on the output format as early as possible, so we can give up
+// quickly if it's not supported.
+static int iwcmd_decide_output_fmt(struct params_struct *p, struct iw_context *ctx)
 {
-	int retval = 0;
-	struct iw_context *ctx = NULL;
-	//int imgtype_read;
-	struct iw_iodescr readdescr;
-	struct iw_iodescr writedescr;
-	char errmsg[200];
-	struct iw_init_params init_params;
 	const char *s;
-	unsigned int profile;
-	int i;
-	int k;
-	int tmpflag;
-
-	memset(&init_params,0,sizeof(struct iw_init_params));
-	memset(&readdescr,0,sizeof(struct iw_iodescr));
-	memset(&writedescr,0,sizeof(struct iw_iodescr));
-
-	if(!p->noinfo) {
-		iwcmd_message(p,"%s \xe2\x86\x92 %s\n",p->input_uri.filename,p->output_uri.filename);
-	}
-
-	init_params.api_version = IW_VERSION_INT;
-	init_params.userdata = (void*)p;
-	init_params.mallocfn = my_mallocfn;
-	init_params.freefn = my_freefn;
-
-	ctx = iw_create_context(&init_params);
-	if(!ctx) goto done;
 
-	iw_set_warning_fn(ctx,my_warning_handler);
-
-	// Decide on the output format as early as possible, so we can give up
-	// quickly if it's not supported.
 	if(p->outfmt==IW_FORMAT_UNKNOWN) {
 		if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
 			p->outfmt=iw_detect_fmt_from_filename(p->output_uri.filename);
@@ -1087,21 +1202,28 @@ static int iwcmd_run(struct params_struct *p)
 
 	if(p->outfmt==IW_FORMAT_UNKNOWN) {
 		iw_set_error(ctx,"Unknown output format; use -outfmt.");
-		goto done;
+		return 0;
 	}
 	else if(!iw_is_output_fmt_supported(p->outfmt)) {
 		s = iw_get_fmt_name(p->outfmt);
 		if(!s) s="(unknown)";
 		iw_set_errorf(ctx,"Writing %s files is not supported.",s);
-		goto done;
+		return 0;
 	}
 
 	if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
 		if(p->outfmt!=IW_FORMAT_BMP) {
 			iw_set_error(ctx,"Only BMP images can be copied to the clipboard");
-			goto done;
+			return 0;
 		}
 	}
+	return 1;
+}
+
+// Settings that must be made before the input file is read.
+static void iwcmd_set_early_options(struct params_struct *p, struct iw_context *ctx)
+{
+	int i;
 
 	for(i=0; i<p->options_count; i++) {
 		iw_set_option(ctx, p->options[i].name, p->options[i].val);
@@ -1117,6 +1239,8 @@ static int iwcmd_run(struct params_struct *p)
 		iw_set_random_seed(ctx,p->randomize, p->random_seed);
 	}
 
+	if(p->stats) iw_set_value(ctx,IW_VAL_COLLECT_STATS,1);
+
 	if(p->sample_type>=0) iw_set_value(ctx,IW_VAL_OUTPUT_SAMPLE_TYPE,p->sample_type);
 	if(p->no_gamma) iw_set_value(ctx,IW_VAL_DISABLE_GAMMA,1);
 	if(p->intclamp) iw_set_value(ctx,IW_VAL_INT_CLAMP,1);
@@ -1137,15 +1261,19 @@ static int iwcmd_run(struct params_struct *p)
 	if(p->page_to_read>0) iw_set_value(ctx,IW_VAL_PAGE_TO_READ,p->page_to_read);
 	if(p->include_screen>=0) iw_set_value(ctx,IW_VAL_INCLUDE_SCREEN,p->include_screen);
 	if(p->negate) iw_set_value(ctx,IW_VAL_NEGATE_TARGET,1);
+}
+
+static int iwcmd_read_input(struct params_struct *p, struct iw_context *ctx)
+{
+	struct iw_iodescr readdescr;
+	int retval = 0;
+
+	memset(&readdescr,0,sizeof(struct iw_iodescr));
 
 	if(p->input_uri.scheme==IWCMD_SCHEME_FILE) {
-		readdescr.read_fn = my_readfn;
-		readdescr.getfilesize_fn = my_getfilesizefn;
-		readdescr.fp = (void*)iwcmd_fopen(p->input_uri.filename, "rb", errmsg, sizeof(errmsg));
-		if(!readdescr.fp) {
-			iw_set_errorf(ctx,"Failed to open %s for reading: %s", p->input_uri.filename, errmsg);
-			goto done;
-		}
+		// Map the file into memory, so that decoders that need the whole
+		// file at once can use it without making a copy.
+		if(!iw_open_mmap_reader(ctx, &readdescr, p->input_uri.filename)) goto done;
 	}
 	else if(p->input_uri.scheme==IWCMD_SCHEME_STDIN) {
 #ifdef IW_WINDOWS
@@ -1171,6 +1299,8 @@ static int iwcmd_run(struct params_struct *p)
 	if(p->infmt==IW_FORMAT_UNKNOWN) {
 		switch(p->input_uri.scheme) {
 		case IWCMD_SCHEME_FILE:
+			p->infmt=detect_fmt_of_mem_file(ctx,&readdescr);
+			break;
 		case IWCMD_SCHEME_STDIN:
 			p->infmt=detect_fmt_of_file(p,(FILE*)readdescr.fp);
 			break;
@@ -1190,10 +1320,75 @@ static int iwcmd_run(struct params_struct *p)
 
 	if(!iw_read_file_by_fmt(ctx,&readdescr,p->infmt)) goto done;
 
-	if(p->input_uri.scheme==IWCMD_SCHEME_FILE) {
+	retval = 1;
+
+done:
+	if(readdescr.close_fn) {
+		(*readdescr.close_fn)(ctx,&readdescr);
+	}
+	else if(readdescr.fp && !retval) {
 		fclose((FILE*)readdescr.fp);
 	}
-	readdescr.fp=NULL;
+	return retval;
+}
+
+// Tell the JPEG reader the size of the box the image will be fitted into, so
+// that it can decide whether its Exif thumbnail is large enough to use.
+static void iwcmd_set_thumbnail_hint(struct params_struct *p, struct iw_context *ctx)
+{
+	char buf[40];
+	int w, h, tmp;
+
+	if(p->use_crop || p->noresize_flag || p->rel_width_flag || p->rel_height_flag)
+		return;
+
+	w = p->dst_width_req>0 ? p->dst_width_req : 0;
+	h = p->dst_height_req>0 ? p->dst_height_req : 0;
+	if(w==0 && h==0) return;
+	// With an exact size, the shape of the image may change, and the box
+	// doesn't tell us how large the thumbnail would need to be.
+	if(w>0 && h>0 && !p->bestfit) return;
+
+	if(p->reorient & IW_REORIENT_TRANSPOSE) {
+		// The size refers to the image after it has been reoriented.
+		tmp = w; w = h; h = tmp;
+	}
+
+	sprintf(buf,"%d,%d",w,h);
+	iw_set_option(ctx,"jpeg:thumbnail",buf);
+}
+
+// Tell the file reader about things that let it avoid decoding parts of the
+// image we won't use. These settings are all made again, in their final form,
+// by iwcmd_setup_processing(). Only appropriate when there is just one target.
+static void iwcmd_set_read_hints(struct params_struct *p, struct iw_context *ctx)
+{
+	if(p->use_crop && !p->reorient) {
+		iw_set_input_crop(ctx,p->crop_x,p->crop_y,p->crop_w,p->crop_h);
+	}
+
+	if((p->grayscale && !p->condgrayscale) ||
+		p->outfmt==IW_FORMAT_PGM || p->outfmt==IW_FORMAT_PBM)
+	{
+		iw_set_value(ctx,IW_VAL_CVT_TO_GRAYSCALE,1);
+		if(p->grayscale_formula>=0) {
+			iw_set_value(ctx,IW_VAL_GRAYSCALE_FORMULA,p->grayscale_formula);
+		}
+		if(p->no_gamma) iw_set_value(ctx,IW_VAL_DISABLE_GAMMA,1);
+	}
+
+	if(p->use_thumbnail) {
+		iwcmd_set_thumbnail_hint(p,ctx);
+	}
+}
+
+// Everything that needs to be done between reading the input image, and
+// calling iw_process_image().
+static int iwcmd_setup_processing(struct params_struct *p, struct iw_context *ctx)
+{
+	unsigned int profile;
+	int k;
+	int tmpflag;
 
 	if(p->reorient) {
 		iw_reorient_image(ctx,p->reorient);
@@ -1396,8 +1591,9 @@ static int iwcmd_run(struct params_struct *p)
 	if(p->use_crop) {
 		iw_set_input_crop(ctx,p->crop_x,p->crop_y,p->crop_w,p->crop_h);
 	}
-
-	if(!iw_process_image(ctx)) goto done;
+	if(p->use_region) {
+		iw_set_output_region(ctx,p->region_x,p->region_y,p->region_w,p->region_h);
+	}
 
 	if(p->compression>0) {
 		iw_set_value(ctx,IW_VAL_COMPRESSION,p->compression);
@@ -1406,33 +1602,152 @@ static int iwcmd_run(struct params_struct *p)
 		iw_set_value(ctx,IW_VAL_OUTPUT_INTERLACED,1);
 	}
 
+	return 1;
+}
+
+static int iwcmd_open_output(struct params_struct *p, struct iw_context *ctx,
+	struct iw_iodescr *writedescr)
+{
+	char errmsg[200];
+
 	if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
-		writedescr.write_fn = my_writefn;
-		writedescr.seek_fn = my_seekfn;
-		writedescr.fp = (void*)iwcmd_fopen(p->output_uri.filename, "wb", errmsg, sizeof(errmsg));
-		if(!writedescr.fp) {
+		writedescr->write_fn = my_writefn;
+		writedescr->seek_fn = my_seekfn;
+		writedescr->fp = (void*)iwcmd_fopen(p->output_uri.filename, "wb", errmsg, sizeof(errmsg));
+		if(!writedescr->fp) {
 			iw_set_errorf(ctx,"Failed to open %s for writing: %s", p->output_uri.filename, errmsg);
-			goto done;
+			return 0;
 		}
 	}
 	else if(p->output_uri.scheme==IWCMD_SCHEME_STDOUT) {
 #ifdef IW_WINDOWS
 		_setmode(_fileno(stdout),_O_BINARY);
 #endif
-		writedescr.write_fn = my_writefn;
-		writedescr.fp = (void*)stdout;
+		writedescr->write_fn = my_writefn;
+		writedescr->fp = (void*)stdout;
 	}
 #ifdef IW_WINDOWS
 	else if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
-		writedescr.write_fn = my_clipboard_writefn;
-		writedescr.seek_fn = my_clipboard_w_seekfn;
+		writedescr->write_fn = my_clipboard_writefn;
+		writedescr->seek_fn = my_clipboard_w_seekfn;
 	}
 #endif
 	else {
 		iw_set_error(ctx,"Unsupported output scheme");
-		goto done;
+		return 0;
+	}
+	return 1;
+}
+
+// Print s as a JSON string.
+static void iwcmd_print_json_string(struct params_struct *p, const char *s)
+{
+	char buf[200];
+	size_t n = 0;
+
+	buf[n++] = '"';
+	for(; *s; s++) {
+		if(n > sizeof(buf)-10) {
+			buf[n] = '\0';
+			iwcmd_message(p,"%s",buf);
+			n = 0;
+		}
+		if(*s=='"' || *s=='\\') {
+			buf[n++] = '\\';
+			buf[n++] = *s;
+		}
+		else if((unsigned char)*s < 0x20) {
+			sprintf(&buf[n],"\\u%04x",(unsigned int)(unsigned char)*s);
+			n += 6;
+		}
+		else {
+			buf[n++] = *s;
+		}
+	}
+	buf[n++] = '"';
+	buf[n] = '\0';
+	iwcmd_message(p,"%s",buf);
+}
+
+static void iwcmd_print_stats_json(struct params_struct *p, const struct iw_stats *st)
+{
+	int i;
+
+	iwcmd_message(p,"{\"stages\":{");
+	for(i=0; i<IW_NUM_STAGES; i++) {
+		iwcmd_message(p,"%s\"%s\":{\"count\":%d,\"wall_time\":%.6f,\"cpu_time\":%.6f}",
+			i?",":"",iw_get_stage_name(i),st->stage[i].count,
+			st->stage[i].wall_time,st->stage[i].cpu_time);
+	}
+	iwcmd_message(p,"},\"alloc_count\":%.0f,\"peak_bytes\":%.0f,"
+		"\"taps\":{\"horizontal\":%.0f,\"vertical\":%.0f}}",
+		(double)st->alloc_count,(double)st->peak_bytes,
+		(double)st->taps[IW_DIMENSION_H],(double)st->taps[IW_DIMENSION_V]);
+}
+
+static struct iw_context *iwcmd_create_context(struct params_struct *p)
+{
+	struct iw_context *ctx;
+	struct iw_init_params init_params;
+
+	memset(&init_params,0,sizeof(struct iw_init_params));
+	init_params.api_version = IW_VERSION_INT;
+	init_params.userdata = (void*)p;
+	init_params.mallocfn = my_mallocfn;
+	init_params.freefn = my_freefn;
+
+	ctx = iw_create_context(&init_params);
+	if(!ctx) return NULL;
+
+	iw_set_warning_fn(ctx,my_warning_handler);
+	return ctx;
+}
+
+// If reusable_ctx is not NULL, it is a fresh (or freshly reset) context to
+// use, instead of creating one. The caller is responsible for resetting or
+// destroying it afterward.
+static int iwcmd_run(struct params_struct *p, struct iw_context *reusable_ctx)
+{
+	int retval = 0;
+	struct iw_context *ctx = NULL;
+	//int imgtype_read;
+	struct iw_iodescr writedescr;
+	char errmsg[200];
+
+	memset(&writedescr,0,sizeof(struct iw_iodescr));
+
+	if(!p->noinfo) {
+		iwcmd_message(p,"%s \xe2\x86\x92 %s\n",p->input_uri.filename,p->output_uri.filename);
+	}
+
+	if(reusable_ctx) {
+		ctx = reusable_ctx;
+		iw_set_userdata(ctx,(void*)p);
+	}
+	else {
+		ctx = iwcmd_create_context(p);
+		if(!ctx) goto done;
 	}
 
+	iw_set_trace_fn(ctx,p->trace_file?my_trace_fn:NULL);
+
+	if(!iwcmd_decide_output_fmt(p,ctx)) goto done;
+
+	iwcmd_set_early_options(p,ctx);
+
+	// With only one output file, let the encoder use the threads.
+	iw_set_value(ctx,IW_VAL_NUM_THREADS,p->num_threads);
+
+	iwcmd_set_read_hints(p,ctx);
+
+	if(!iwcmd_read_input(p,ctx)) goto done;
+
+	if(!iwcmd_setup_processing(p,ctx)) goto done;
+
+	if(!iw_process_image(ctx)) goto done;
+
+	if(!iwcmd_open_output(p,ctx,&writedescr)) goto done;
+
 	if(!iw_write_file_by_fmt(ctx,&writedescr,p->outfmt)) goto done;
 
 	if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
@@ -1445,13 +1760,25 @@ static int iwcmd_run(struct params_struct *p)
 #endif
 	writedescr.fp=NULL;
 
+	if(p->stats) {
+		struct iw_stats st;
+
+		iw_get_stats(ctx,&st);
+		iwcmd_message(p,"{\"input\":");
+		iwcmd_print_json_string(p,p->input_uri.filename);
+		iwcmd_message(p,",\"output\":");
+		iwcmd_print_json_string(p,p->output_uri.filename);
+		iwcmd_message(p,",\"stats\":");
+		iwcmd_print_stats_json(p,&st);
+		iwcmd_message(p,"}\n");
+	}
+
 	retval = 1;
 
 done:
 #ifdef IW_WINDOWS
 	iwcmd_close_clipboard_r(p,ctx);
 #endif
-	if(readdescr.fp) fclose((FILE*)readdescr.fp);
 	if(writedescr.fp) fclose((FILE*)writedescr.fp);
 
 	if(ctx) {
@@ -1460,14 +1787,133 @@ done:
 		}
 	}
 
-	iw_destroy_context(ctx);
+	if(ctx!=reusable_ctx) iw_destroy_context(ctx);
 
-	for(i=0; i<p->options_count; i++) {
-		free(p->options[i].name);
-		free(p->options[i].val);
+	return retval;
+}
+
+static int iwcmd_setup_target(struct iw_context *ctx, struct iw_render_target *target)
+{
+	struct params_struct *p = (struct params_struct*)target->userdata;
+
+	// Messages and warnings should go through this target's params.
+	iw_set_userdata(ctx,(void*)p);
+	iwcmd_set_early_options(p,ctx);
+	return iwcmd_setup_processing(p,ctx);
+}
+
+// Read the input file once, and write each of the output files (from
+// "-next") from it.
+// reusable_ctx is as for iwcmd_run(). It is only used to read the file.
+static int iwcmd_run_multi(struct params_struct *p, struct iw_context *reusable_ctx)
+{
+	int retval = 0;
+	struct iw_context *ctx = NULL;
+	struct params_struct **tp = NULL;
+	struct iw_render_target *targets = NULL;
+	struct iw_iodescr *writedescrs = NULL;
+	char errmsg[200];
+	int num_targets;
+	int i;
+
+	num_targets = 1+p->extra_targets_count;
+	tp = calloc(num_targets,sizeof(struct params_struct*));
+	targets = calloc(num_targets,sizeof(struct iw_render_target));
+	writedescrs = calloc(num_targets,sizeof(struct iw_iodescr));
+	if(!tp || !targets || !writedescrs) goto done;
+
+	tp[0] = p;
+	for(i=1; i<num_targets; i++) {
+		tp[i] = &p->extra_targets[i-1];
+	}
+
+	if(reusable_ctx) {
+		ctx = reusable_ctx;
+		iw_set_userdata(ctx,(void*)p);
+	}
+	else {
+		ctx = iwcmd_create_context(p);
+		if(!ctx) goto done;
+	}
+
+	iw_set_trace_fn(ctx,p->trace_file?my_trace_fn:NULL);
+
+	for(i=0; i<num_targets; i++) {
+		if(!iwcmd_decide_output_fmt(tp[i],ctx)) goto done;
+		if(tp[i]->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
+			iw_set_error(ctx,"Can't copy to the clipboard when writing multiple files");
+			goto done;
+		}
+	}
+
+	// The first output file's settings are the ones used to read the file.
+	iwcmd_set_early_options(p,ctx);
+
+	if(!iwcmd_read_input(p,ctx)) goto done;
+
+	for(i=0; i<num_targets; i++) {
+		if(!tp[i]->noinfo) {
+			iwcmd_message(tp[i],"%s \xe2\x86\x92 %s\n",p->input_uri.filename,tp[i]->output_uri.filename);
+		}
+		if(!iwcmd_open_output(tp[i],ctx,&writedescrs[i])) goto done;
+		targets[i].fmt = tp[i]->outfmt;
+		targets[i].writedescr = &writedescrs[i];
+		targets[i].setup_fn = iwcmd_setup_target;
+		targets[i].userdata = (void*)tp[i];
+	}
+
+	retval = iw_render_targets(ctx,targets,num_targets,p->num_threads);
+
+	for(i=0; i<num_targets; i++) {
+		if(!targets[i].ok) {
+			iwcmd_error(tp[i],"imagew error: %s: %s\n",tp[i]->output_uri.filename,
+				targets[i].errmsg[0] ? targets[i].errmsg : "Failed");
+		}
+	}
+
+	if(p->stats) {
+		struct iw_stats st;
+
+		// The reading is done in the main context, and everything else
+		// in the targets' contexts.
+		iw_get_stats(ctx,&st);
+		iwcmd_message(p,"{\"input\":");
+		iwcmd_print_json_string(p,p->input_uri.filename);
+		iwcmd_message(p,",\"stats\":");
+		iwcmd_print_stats_json(p,&st);
+		iwcmd_message(p,",\"outputs\":[");
+		for(i=0; i<num_targets; i++) {
+			iwcmd_message(p,"%s{\"output\":",i?",":"");
+			iwcmd_print_json_string(p,tp[i]->output_uri.filename);
+			iwcmd_message(p,",\"ok\":%s,\"stats\":",targets[i].ok?"true":"false");
+			iwcmd_print_stats_json(p,&targets[i].stats);
+			iwcmd_message(p,"}");
+		}
+		iwcmd_message(p,"]}\n");
+	}
+
+done:
+#ifdef IW_WINDOWS
+	iwcmd_close_clipboard_r(p,ctx);
+#endif
+	if(writedescrs) {
+		for(i=0; i<num_targets; i++) {
+			if(writedescrs[i].fp && tp[i]->output_uri.scheme==IWCMD_SCHEME_FILE) {
+				fclose((FILE*)writedescrs[i].fp);
+			}
+		}
 	}
-	p->options_count=0;
 
+	if(ctx) {
+		if(iw_get_errorflag(ctx)) {
+			iwcmd_error(p,"imagew error: %s\n",iw_get_errormsg(ctx,errmsg,sizeof(errmsg)));
+		}
+	}
+
+	if(ctx!=reusable_ctx) iw_destroy_context(ctx);
+	free(tp);
+	free(targets);
+	free(writedescrs);
 	return retval;
 }
 
@@ -2025,6 +2471,8 @@ static void usage_message(struct params_struct *p)
 {
 	iwcmd_message(p,
 		"Usage: imagew [-w <width>] [-h <height>] [options] <in-file> <out-file>\n"
+		"          [-next [options] <out-file> ...]\n"
+		"       imagew [options] -batch <job-file>\n"
 		"Options include -filter, -grayscale, -depth, -cc, -dither, -bkgd, -cs,\n"
 		" -crop, -quiet, -version.\n"
 		"See the ImageWorsener documentation for more information.\n"
@@ -2066,15 +2514,16 @@ enum iwcmd_param_types {
  PT_BLUR, PT_BLUR_X, PT_BLUR_Y,
  PT_DITHER, PT_DITHERCOLOR, PT_DITHERALPHA, PT_DITHERRED, PT_DITHERGREEN, PT_DITHERBLUE, PT_DITHERGRAY,
  PT_CC, PT_CCCOLOR, PT_CCALPHA, PT_CCRED, PT_CCGREEN, PT_CCBLUE, PT_CCGRAY,
- PT_BKGD, PT_BKGD2, PT_CHECKERSIZE, PT_CHECKERORG, PT_CROP, PT_REORIENT,
+ PT_BKGD, PT_BKGD2, PT_CHECKERSIZE, PT_CHECKERORG, PT_CROP, PT_REGION, PT_REORIENT,
  PT_OFFSET_R_H, PT_OFFSET_G_H, PT_OFFSET_B_H, PT_OFFSET_R_V, PT_OFFSET_G_V,
  PT_OFFSET_B_V, PT_OFFSET_RB_H, PT_OFFSET_RB_V, PT_TRANSLATE, PT_IMAGESIZE,
  PT_COMPRESS, PT_JPEGQUALITY, PT_JPEGSAMPLING, PT_JPEGARITH, PT_BMPTRNS, PT_BMPVERSION,
  PT_WEBPQUALITY, PT_ZIPCMPRLEVEL, PT_INTERLACE, PT_COLORTYPE, PT_NEGATE,
  PT_RANDSEED, PT_INFMT, PT_OUTFMT, PT_EDGE_POLICY, PT_EDGE_POLICY_X,
  PT_EDGE_POLICY_Y, PT_GRAYSCALEFORMULA,
- PT_DENSITY_POLICY, PT_PAGETOREAD, PT_INCLUDESCREEN, PT_NOINCLUDESCREEN,
- PT_BESTFIT, PT_NOBESTFIT, PT_NORESIZE, PT_GRAYSCALE, PT_CONDGRAYSCALE, PT_NOGAMMA,
+ PT_DENSITY_POLICY, PT_PAGETOREAD, PT_INCLUDESCREEN, PT_NOINCLUDESCREEN, PT_THREADS, PT_BATCH,
+ PT_STATS, PT_TRACE,
+ PT_BESTFIT, PT_NOBESTFIT, PT_NORESIZE, PT_USETHUMBNAIL, PT_GRAYSCALE, PT_CONDGRAYSCALE, PT_NOGAMMA,
  PT_INTCLAMP, PT_NOCSLABEL, PT_NOOPT, PT_USEBKGDLABEL, PT_BKGDLABEL, PT_NOBKGDLABEL,
  PT_MSGSTOSTDOUT, PT_MSGSTOSTDERR,
  PT_QUIET, PT_NOWARN, PT_NOINFO, PT_VERSION, PT_HELP, PT_ENCODING
@@ -2137,6 +2586,7 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"checkersize",PT_CHECKERSIZE,1},
 		{"checkerorigin",PT_CHECKERORG,1},
 		{"crop",PT_CROP,1},
+		{"region",PT_REGION,1},
 		{"reorient",PT_REORIENT,1},
 		{"offsetred",PT_OFFSET_R_H,1},
 		{"offsetgreen",PT_OFFSET_G_H,1},
@@ -2151,6 +2601,8 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"compress",PT_COMPRESS,1},
 		{"colortype",PT_COLORTYPE,1},
 		{"page",PT_PAGETOREAD,1},
+		{"threads",PT_THREADS,1},
+		{"batch",PT_BATCH,1},
 		{"jpegquality",PT_JPEGQUALITY,1},
 		{"jpegsampling",PT_JPEGSAMPLING,1},
 		{"webpquality",PT_WEBPQUALITY,1},
@@ -2173,6 +2625,7 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"bestfit",PT_BESTFIT,0},
 		{"nobestfit",PT_NOBESTFIT,0},
 		{"noresize",PT_NORESIZE,0},
+		{"usethumbnail",PT_USETHUMBNAIL,0},
 		{"grayscale",PT_GRAYSCALE,0},
 		{"condgrayscale",PT_CONDGRAYSCALE,0},
 		{"nogamma",PT_NOGAMMA,0},
@@ -2188,6 +2641,8 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"quiet",PT_QUIET,0},
 		{"nowarn",PT_NOWARN,0},
 		{"noinfo",PT_NOINFO,0},
+		{"stats",PT_STATS,0},
+		{"trace",PT_TRACE,1},
 		{"msgstostdout",PT_MSGSTOSTDOUT,0},
 		{"msgstostderr",PT_MSGSTOSTDERR,0},
 		{"version",PT_VERSION,0},
@@ -2224,6 +2679,9 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 	case PT_NORESIZE:
 		p->noresize_flag=1;
 		break;
+	case PT_USETHUMBNAIL:
+		p->use_thumbnail=1;
+		break;
 	case PT_GRAYSCALE:
 		p->grayscale=1;
 		break;
@@ -2274,6 +2732,9 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 	case PT_NOINFO:
 		p->noinfo=1;
 		break;
+	case PT_STATS:
+		p->stats=1;
+		break;
 	case PT_MSGSTOSTDOUT:
 	case PT_MSGSTOSTDERR:
 		// Already handled.
@@ -2562,6 +3023,12 @@ static int process_option_arg(struct params_struct *p, struct parsestate_struct
 		iwcmd_parse_int_4(v,&p->crop_x,&p->crop_y,&p->crop_w,&p->crop_h);
 		p->use_crop=1;
 		break;
+	case PT_REGION:
+		p->region_x = p->region_y = 0;
+		p->region_w = p->region_h = -1;
+		iwcmd_parse_int_4(v,&p->region_x,&p->region_y,&p->region_w,&p->region_h);
+		p->use_region=1;
+		break;
 	case PT_REORIENT:
 		if(iwcmd_option_reorient(p,v) < 0)
 			return 0;
@@ -2619,6 +3086,15 @@ static int process_option_arg(struct params_struct *p, struct parsestate_struct
 	case PT_PAGETOREAD:
 		p->page_to_read = iw_parse_int(v);
 		break;
+	case PT_THREADS:
+		p->num_threads = iw_parse_int(v);
+		break;
+	case PT_BATCH:
+		p->batch_file = v;
+		break;
+	case PT_TRACE:
+		p->trace_file = v;
+		break;
 	case PT_JPEGQUALITY:
 		add_opt(p, "jpeg:quality", v);
 		break;
@@ -2897,19 +3373,118 @@ static int parse_uri(struct params_struct *p, struct uri_struct *u, unsigned int
 #define IWCMD_ACTION_USAGE_SUCCESS  2
 #define IWCMD_ACTION_USAGE_FAIL     3
 #define IWCMD_ACTION_SHOWVERSION    4
+#define IWCMD_ACTION_BATCH          5
 
-// Returns an IWCMD_ACTION code.
-static int iwcmd_read_commandline(struct params_struct *p, int argc, char* argv[])
+// Process the arguments starting at argv[*pargi], until the end of the
+// command line, or a "-next" option.
+// On return, *pargi is the index of the next argument to process, and
+// *pfound_next says whether we stopped at a "-next".
+static int iwcmd_parse_args(struct params_struct *p, struct parsestate_struct *ps,
+	int argc, char* argv[], int *pargi, int *pfound_next)
 {
-	struct parsestate_struct ps;
 	int i;
 	const char *optname;
 
-	memset(&ps,0,sizeof(struct parsestate_struct));
-	ps.param_type=PT_NONE;
-	ps.untagged_param_count=0;
-	ps.printversion=0;
-	ps.showhelp=0;
+	*pfound_next = 0;
+
+	for(i=*pargi;i<argc;i++) {
+		if(ps->param_type==PT_NONE && argv[i][0]=='-' && argv[i][1]!='\0') {
+			optname = &argv[i][1];
+			// If the second char is also a '-', ignore it.
+			if(argv[i][1]=='-')
+				optname = &argv[i][2];
+			if(!strcmp(optname,"next")) {
+				*pfound_next = 1;
+				i++;
+				break;
+			}
+			if(!process_option_name(p, ps, optname)) {
+				return 0;
+			}
+		}
+		else {
+			// Process a parameter of the previous option.
+
+			if(!process_option_arg(p, ps, argv[i])) {
+				return 0;
+			}
+
+			ps->param_type = PT_NONE;
+		}
+	}
+
+	*pargi = i;
+	return 1;
+}
+
+// Make dst a copy of src, not including any extra output files.
+static void iwcmd_copy_params(struct params_struct *dst, const struct params_struct *src)
+{
+	int i;
+
+	*dst = *src; // struct copy
+	dst->extra_targets = NULL;
+	dst->extra_targets_count = 0;
+	dst->trace_events = NULL;
+	dst->trace_events_count = 0;
+	dst->trace_events_alloc = 0;
+
+	// The options strings must not be shared.
+	dst->options_count = 0;
+	for(i=0; i<src->options_count; i++) {
+		add_opt(dst, src->options[i].name, src->options[i].val);
+	}
+}
+
+// Add an output file, whose settings start out as a copy of the first
+// output file's settings.
+static struct params_struct *iwcmd_add_extra_target(struct params_struct *p)
+{
+	struct params_struct *newtargets;
+	struct params_struct *t;
+
+	newtargets = realloc(p->extra_targets,
+		(p->extra_targets_count+1)*sizeof(struct params_struct));
+	if(!newtargets) return NULL;
+	p->extra_targets = newtargets;
+
+	t = &p->extra_targets[p->extra_targets_count];
+	iwcmd_copy_params(t,p);
+	t->output_uri.uri = NULL;
+	t->bestfit_option = -1;
+
+	p->extra_targets_count++;
+	return t;
+}
+
+static void iwcmd_free_params(struct params_struct *p)
+{
+	int i;
+
+	for(i=0; i<p->extra_targets_count; i++) {
+		iwcmd_free_params(&p->extra_targets[i]);
+	}
+	free(p->extra_targets);
+	p->extra_targets = NULL;
+	p->extra_targets_count = 0;
+	free(p->trace_events);
+	p->trace_events = NULL;
+	p->trace_events_count = 0;
+	p->trace_events_alloc = 0;
+
+	for(i=0; i<p->options_count; i++) {
+		free(p->options[i].name);
+		free(p->options[i].val);
+	}
+	p->options_count=0;
+}
+
+static int iwcmd_parse_commandline(struct params_struct *p, int argc, char* argv[], int argi);
+
+// Returns an IWCMD_ACTION code.
+static int iwcmd_read_commandline(struct params_struct *p, int argc, char* argv[])
+{
+	int i;
 
 	// Pre-scan command line to figure out where to print error messages.
 	for(i=1;i<argc;i++) {
@@ -2927,25 +3502,25 @@ static int iwcmd_read_commandline(struct params_struct *p, int argc, char* argv[
 		return IWCMD_ACTION_EXIT_FAIL;
 	}
 
-	for(i=1;i<argc;i++) {
-		if(ps.param_type==PT_NONE && argv[i][0]=='-' && argv[i][1]!='\0') {
-			optname = &argv[i][1];
-			// If the second char is also a '-', ignore it.
-			if(argv[i][1]=='-')
-				optname = &argv[i][2];
-			if(!process_option_name(p, &ps, optname)) {
-				return IWCMD_ACTION_EXIT_FAIL;
-			}
-		}
-		else {
-			// Process a parameter of the previous option.
+	return iwcmd_parse_commandline(p,argc,argv,1);
+}
 
-			if(!process_option_arg(p, &ps, argv[i])) {
-				return IWCMD_ACTION_EXIT_FAIL;
-			}
+// Parse the arguments starting at argv[argi]. Also used for the lines of
+// a batch file.
+// Returns an IWCMD_ACTION code.
+static int iwcmd_parse_commandline(struct params_struct *p, int argc, char* argv[], int argi)
+{
+	struct parsestate_struct ps;
+	struct params_struct *t;
+	int i;
+	int found_next;
 
-			ps.param_type = PT_NONE;
-		}
+	memset(&ps,0,sizeof(struct parsestate_struct));
+	ps.param_type=PT_NONE;
+
+	i=argi;
+	if(!iwcmd_parse_args(p,&ps,argc,argv,&i,&found_next)) {
+		return IWCMD_ACTION_EXIT_FAIL;
 	}
 
 	if(ps.showhelp) {
@@ -2956,6 +3531,14 @@ static int iwcmd_read_commandline(struct params_struct *p, int argc, char* argv[
 		return IWCMD_ACTION_SHOWVERSION;
 	}
 
+	if(p->batch_file) {
+		// The files to process are in the batch file.
+		if(ps.untagged_param_count!=0 || ps.param_type!=PT_NONE || found_next) {
+			return IWCMD_ACTION_USAGE_FAIL;
+		}
+		return IWCMD_ACTION_BATCH;
+	}
+
 	if(ps.untagged_param_count!=2 || ps.param_type!=PT_NONE) {
 		return IWCMD_ACTION_USAGE_FAIL;
 	}
@@ -2970,6 +3553,30 @@ static int iwcmd_read_commandline(struct params_struct *p, int argc, char* argv[
 	// Make sure it doesn't matter where on the command line -bestfit/-nobestfit
 	// were given.
 	if(p->bestfit_option>=0) p->bestfit = p->bestfit_option;
+
+	// Each "-next" starts another output file, whose settings are those of
+	// the first output file, plus any options that follow the "-next".
+	while(found_next) {
+		t = iwcmd_add_extra_target(p);
+		if(!t) return IWCMD_ACTION_EXIT_FAIL;
+
+		memset(&ps,0,sizeof(struct parsestate_struct));
+		ps.param_type=PT_NONE;
+		ps.untagged_param_count=1; // The input file was already given.
+		if(!iwcmd_parse_args(t,&ps,argc,argv,&i,&found_next)) {
+			return IWCMD_ACTION_EXIT_FAIL;
+		}
+		if(ps.untagged_param_count!=2 || ps.param_type!=PT_NONE) {
+			return IWCMD_ACTION_USAGE_FAIL;
+		}
+		if(!parse_uri(t,&t->output_uri,1)) {
+			return IWCMD_ACTION_EXIT_FAIL;
+		}
+		if(t->bestfit_option>=0) t->bestfit = t->bestfit_option;
+		// -threads applies to the whole command, wherever it appears.
+		if(t->num_threads!=p->num_threads) p->num_threads = t->num_threads;
+	}
+
 	return IWCMD_ACTION_RUN;
 }
 
@@ -3005,6 +3612,308 @@ static void init_params(struct params_struct *p)
 	p->grayscale_formula = -1;
 }
 
+#define IWCMD_BATCH_MAX_ARGS 256
+
+// The most memory each batch worker will keep for reuse by its next job.
+#define IWCMD_BATCH_SCRATCH_LIMIT (64*1024*1024)
+
+struct iwcmd_batch_job {
+	int lineno;
+	char *line; // Modified by tokenizing; argv points into it.
+	int argc;
+	char **argv;
+	struct params_struct p;
+	int action; // IWCMD_ACTION_*
+	int ok;
+};
+
+struct iwcmd_batch_state {
+	struct params_struct *p; // The settings from the command line.
+	FILE *fp;
+	struct iw_mutex *lock; // Protects the fields below.
+	int lineno;
+	int eof;
+	int failed;
+	// Finished jobs. Only kept if we need them to write a trace file.
+	struct iwcmd_batch_job **done_jobs;
+	int num_done_jobs;
+	int done_jobs_alloc;
+};
+
+// Read one line from fp, without its newline, into a new NUL-terminated
+// buffer. Returns NULL at end of file, or if memory runs out (in which case
+// *perr is set).
+static char *iwcmd_read_batch_line(FILE *fp, int *perr)
+{
+	char *line = NULL;
+	char *newline;
+	size_t len = 0;
+	size_t alloc = 0;
+
+	while(1) {
+		if(len+1 >= alloc) {
+			alloc = alloc ? alloc*2 : 256;
+			newline = realloc(line,alloc);
+			if(!newline) {
+				free(line);
+				*perr = 1;
+				return NULL;
+			}
+			line = newline;
+		}
+		if(!fgets(&line[len],(int)(alloc-len),fp)) break;
+		len += strlen(&line[len]);
+		if(len>0 && line[len-1]=='\n') {
+			line[len-1] = '\0';
+			return line;
+		}
+	}
+
+	// End of file (or a read error).
+	if(len==0) {
+		free(line);
+		return NULL;
+	}
+	line[len] = '\0';
+	return line;
+}
+
+// Split a line into arguments, in place. Arguments are separated by
+// whitespace, and may be quoted with "" or ''.
+// Returns the number of arguments, or -1 if there are too many.
+static int iwcmd_split_batch_line(char *line, char **argv, int max_args)
+{
+	char *src = line;
+	char *dst;
+	char quote;
+	int argc = 0;
+
+	while(1) {
+		while(*src==' ' || *src=='\t' || *src=='\r') src++;
+		if(*src=='\0') break;
+		if(argc>=max_args) return -1;
+
+		argv[argc++] = dst = src;
+		quote = '\0';
+		while(*src!='\0') {
+			if(quote) {
+				if(*src==quote) { quote='\0'; src++; continue; }
+			}
+			else {
+				if(*src==' ' || *src=='\t' || *src=='\r') { src++; break; }
+				if(*src=='"' || *src=='\'') { quote = *src; src++; continue; }
+			}
+			*dst++ = *src++;
+		}
+		// This can overwrite the separator we just skipped, but never
+		// anything we haven't read yet.
+		*dst = '\0';
+	}
+	return argc;
+}
+
+// Read the next job from the batch file, waiting for it if necessary.
+// Returns NULL if there are no more jobs.
+static struct iwcmd_batch_job *iwcmd_next_batch_job(struct iwcmd_batch_state *bs)
+{
+	struct iwcmd_batch_job *job = NULL;
+	char *line;
+	char *s;
+	int err = 0;
+
+	iw_lock_mutex(bs->lock);
+	while(!bs->eof) {
+		line = iwcmd_read_batch_line(bs->fp,&err);
+		if(!line) {
+			if(err) bs->failed = 1;
+			bs->eof = 1;
+			break;
+		}
+		bs->lineno++;
+
+		s = line;
+		while(*s==' ' || *s=='\t') s++;
+		if(*s=='\0' || *s=='\r' || *s=='#') {
+			free(line);
+			continue;
+		}
+
+		job = calloc(1,sizeof(struct iwcmd_batch_job));
+		if(!job) {
+			free(line);
+			bs->failed = 1;
+			bs->eof = 1;
+			break;
+		}
+		job->lineno = bs->lineno;
+		job->line = line;
+		break;
+	}
+	iw_unlock_mutex(bs->lock);
+	return job;
+}
+
+static void iwcmd_free_batch_job(struct iwcmd_batch_job *job)
+{
+	if(job->argv) {
+		free(job->argv);
+		iwcmd_free_params(&job->p);
+	}
+	free(job->line);
+	free(job);
+}
+
+// Parse the job's arguments, and run it with the given context, which may
+// be NULL.
+static void iwcmd_run_batch_job(struct iwcmd_batch_state *bs, struct iwcmd_batch_job *job,
+	struct iw_context *ctx)
+{
+	struct params_struct *p = bs->p;
+	char *argvbuf[IWCMD_BATCH_MAX_ARGS];
+
+	job->argc = iwcmd_split_batch_line(job->line,argvbuf,IWCMD_BATCH_MAX_ARGS);
+	if(job->argc<0) {
+		iwcmd_error(p,"Batch file line %d: Too many arguments\n",job->lineno);
+		return;
+	}
+	job->argv = malloc((job->argc+1)*sizeof(char*));
+	if(!job->argv) return;
+	memcpy(job->argv,argvbuf,job->argc*sizeof(char*));
+	job->argv[job->argc] = NULL;
+
+	iwcmd_copy_params(&job->p,p);
+	job->p.batch_file = NULL;
+	// Don't let a job with -next start its own threads, unless asked to.
+	job->p.num_threads = 1;
+
+	job->action = iwcmd_parse_commandline(&job->p,job->argc,job->argv,0);
+	if(job->action==IWCMD_ACTION_BATCH || job->action==IWCMD_ACTION_USAGE_FAIL) {
+		iwcmd_error(p,"Batch file line %d: Bad arguments\n",job->lineno);
+	}
+
+	if(job->action==IWCMD_ACTION_RUN) {
+		if(job->p.extra_targets_count>0)
+			job->ok = iwcmd_run_multi(&job->p,ctx);
+		else
+			job->ok = iwcmd_run(&job->p,ctx);
+	}
+}
+
+static void iwcmd_finish_batch_job(struct iwcmd_batch_state *bs, struct iwcmd_batch_job *job)
+{
+	struct iwcmd_batch_job **newlist;
+	int keep = 0;
+
+	// Write a status line for each job, to standard output. Do it in a
+	// single call, so that it won't be split up by other threads.
+	fprintf(stdout,"%d %s\n",job->lineno,job->ok?"ok":"failed");
+	fflush(stdout);
+
+	iw_lock_mutex(bs->lock);
+	if(!job->ok) bs->failed = 1;
+	if(bs->p->trace_file) {
+		if(bs->num_done_jobs>=bs->done_jobs_alloc) {
+			int n = bs->done_jobs_alloc ? bs->done_jobs_alloc*2 : 64;
+			newlist = realloc(bs->done_jobs,n*sizeof(struct iwcmd_batch_job*));
+			if(newlist) {
+				bs->done_jobs = newlist;
+				bs->done_jobs_alloc = n;
+			}
+		}
+		if(bs->num_done_jobs<bs->done_jobs_alloc) {
+			bs->done_jobs[bs->num_done_jobs++] = job;
+			keep = 1;
+		}
+	}
+	iw_unlock_mutex(bs->lock);
+
+	if(!keep) iwcmd_free_batch_job(job);
+}
+
+// Each worker thread runs jobs until there are none left, using the same
+// context for all of them.
+static void iwcmd_batch_worker(void *userdata, int workerindex)
+{
+	struct iwcmd_batch_state *bs = (struct iwcmd_batch_state*)userdata;
+	struct iwcmd_batch_job *job;
+	struct iw_context *ctx;
+
+	// If this fails, each job will just create its own context.
+	ctx = iwcmd_create_context(bs->p);
+	if(ctx) iw_set_scratch_pool_limit(ctx,IWCMD_BATCH_SCRATCH_LIMIT);
+
+	while((job = iwcmd_next_batch_job(bs)) != NULL) {
+		iwcmd_run_batch_job(bs,job,ctx);
+		if(ctx) iw_reset_context(ctx,0);
+		iwcmd_finish_batch_job(bs,job);
+	}
+
+	iw_destroy_context(ctx);
+}
+
+// Run the jobs in a batch file. Each nonblank line that doesn't start with
+// "#" has the usual command-line arguments for one run of imagew, and
+// inherits the settings from the real command line.
+// Jobs are started as soon as their lines are read, so the batch file can be
+// a pipe that is written to over time.
+static int iwcmd_run_batch(struct params_struct *p)
+{
+	struct iwcmd_batch_state bs;
+	struct iw_context *ctx = NULL;
+	struct params_struct **plist;
+	char errmsg[200];
+	int num_workers;
+	int retval = 0;
+	int i;
+
+	memset(&bs,0,sizeof(struct iwcmd_batch_state));
+	bs.p = p;
+
+	if(!strcmp(p->batch_file,"-")) {
+		bs.fp = stdin;
+	}
+	else {
+		bs.fp = iwcmd_fopen(p->batch_file, "rb", errmsg, sizeof(errmsg));
+		if(!bs.fp) {
+			iwcmd_error(p,"Failed to open %s: %s\n",p->batch_file,errmsg);
+			goto done;
+		}
+	}
+
+	// This context is only used to allocate the thread pool and the lock.
+	ctx = iw_create_context(NULL);
+	if(!ctx) goto done;
+
+	bs.lock = iw_create_mutex(ctx);
+	if(!bs.lock) goto done;
+
+	num_workers = p->num_threads;
+	if(num_workers<1) num_workers = iw_get_num_cpus();
+	iw_run_parallel(ctx,num_workers,num_workers,iwcmd_batch_worker,(void*)&bs);
+
+	retval = bs.failed ? 0 : 1;
+
+	if(p->trace_file) {
+		plist = malloc((bs.num_done_jobs+1)*sizeof(struct params_struct*));
+		if(!plist) { retval = 0; goto done; }
+		for(i=0; i<bs.num_done_jobs; i++) {
+			plist[i] = &bs.done_jobs[i]->p;
+		}
+		if(!iwcmd_write_trace(p,plist,bs.num_done_jobs)) retval = 0;
+		free(plist);
+	}
+
+done:
+	for(i=0; i<bs.num_done_jobs; i++) {
+		iwcmd_free_batch_job(bs.done_jobs[i]);
+	}
+	free(bs.done_jobs);
+	if(bs.fp && bs.fp!=stdin) fclose(bs.fp);
+	if(ctx) iw_destroy_mutex(ctx,bs.lock);
+	iw_destroy_context(ctx);
+	return retval;
+}
+
 static int iwcmd_main(int argc, char* argv[])
 {
 	struct params_struct p;
@@ -3015,7 +3924,21 @@ static int iwcmd_main(int argc, char* argv[])
 	ret = iwcmd_read_commandline(&p,argc,argv);
 
 	if(ret==IWCMD_ACTION_RUN) {
-		ret=iwcmd_run(&p);
+		struct params_struct *pp = &p;
+
+		if(p.extra_targets_count>0)
+			ret=iwcmd_run_multi(&p,NULL);
+		else
+			ret=iwcmd_run(&p,NULL);
+		if(p.trace_file) {
+			if(!iwcmd_write_trace(&p,&pp,1)) ret=0;
+		}
+		iwcmd_free_params(&p);
+		return ret?0:1;
+	}
+	else if(ret==IWCMD_ACTION_BATCH) {
+		ret=iwcmd_run_batch(&p);
+		iwcmd_free_params(&p);
 		return ret?0:1;
 	}
 	else if(ret==IWCMD_ACTION_USAGE_SUCCESS) {
@@ -53,6 +53,12 @@
 #define IW_SUPPORT_WEBP 0
 #endif
 
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+#define IW_SUPPORT_THREADS 1
+#else
+#define IW_SUPPORT_THREADS 0
+#endif
+
 #else
 // Not using autoconf
 
@@ -74,6 +80,9 @@
 #ifndef IW_SUPPORT_WEBP
 #define IW_SUPPORT_WEBP 1
 #endif
+#ifndef IW_SUPPORT_THREADS
+#define IW_SUPPORT_THREADS 1
+#endif
 
 #endif
 
@@ -3,11 +3,13 @@
 // For more information, see the readme.txt file.
 
 // This is a self-contained GIF image decoder.
-// It supports a single image only, so it does not support animated GIFs,
-// or any GIF where the main image is constructed from multiple sub-images.
+// iw_read_gif_file() reads a single image only. To play through an animated
+// GIF, or any GIF where the main image is constructed from multiple
+// sub-images, use the frame reader (iw_open_gif_frame_reader()).
 
 #include "imagew-config.h"
 
+#include <stdio.h> // for SEEK_CUR
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,13 +37,36 @@ struct iwgifrcontext {
 	int has_bg_color;
 	int bg_color_index;
 	int trans_color_index;
+	int delay; // From the graphic control extension, in 1/100 seconds
+	int disposal; // From the graphic control extension
+
+	// If set, every image is painted onto the same screen, which persists
+	// from one image to the next (see iw_read_next_gif_frame()).
+	int frame_mode;
+	struct iw_palette global_colortable; // Used only in frame_mode
+	int visible_rows; // Number of rows of the image that are on the screen
+	int prev_disposal; // The disposal method of the previous image
+	iw_byte *saved_area; // The screen under the image, for disposal method 3
 
 	size_t pixels_set; // Number of pixels decoded so far
 	size_t total_npixels; // Total number of pixels in the "image" (not the "screen")
 
+	// The palette indices of the visible part of the row currently being
+	// decoded. Only rows (and parts of rows) that are on the screen are kept,
+	// so that the memory used doesn't depend on the image size.
+	iw_byte *rowbuf;
+	int cur_row; // The row being decoded (in decoding order)
+	int cur_col; // The number of pixels of cur_row decoded so far
+	int visible_cols; // Number of columns of the image that are on the screen
+
 	iw_byte **row_pointers;
 
 	struct iw_palette colortable;
+	iw_byte palbytes[256][4]; // The colortable, as RGBA samples
+
+	// If set, we're only probing the file, and this is where to put the
+	// information we find.
+	struct iw_image_info *probe_info;
 
 	// A buffer used when reading the GIF file.
 	// The largest block we need to read is a 256-color palette.
@@ -136,8 +161,17 @@ static int iwgif_skip_subblocks(struct iwgifrcontext *rctx)
 		// A size of 0 marks the end of the subblocks.
 		if(subblock_size==0) return 1;
 
-		// Read the subblock's data
-		if(!iwgif_read(rctx,rctx->rbuf,(size_t)subblock_size)) return 0;
+		// Skip the subblock's data
+		if(rctx->iodescr->seek_fn) {
+			if(!(*rctx->iodescr->seek_fn)(rctx->ctx,rctx->iodescr,
+				(iw_int64)subblock_size,SEEK_CUR))
+			{
+				return 0;
+			}
+		}
+		else {
+			if(!iwgif_read(rctx,rctx->rbuf,(size_t)subblock_size)) return 0;
+		}
 	}
 }
 
@@ -161,6 +195,8 @@ static int iwgif_read_graphic_control_ext(struct iwgifrcontext *rctx)
 	if(rctx->has_transparency) {
 		rctx->trans_color_index = (int)rctx->rbuf[4];
 	}
+	rctx->disposal = (int)((rctx->rbuf[1]>>2)&0x07);
+	rctx->delay = (int)iw_get_ui16le(&rctx->rbuf[2]);
 
 	retval=1;
 done:
@@ -195,55 +231,86 @@ done:
 	return retval;
 }
 
-// Set the (rctx->pixels_set + offset)th pixel in the logical image to the
-// color represented by palette entry #coloridx.
-static void iwgif_record_pixel(struct iwgifrcontext *rctx, unsigned int coloridx,
-		int offset)
+// Make the table used by iwgif_expand_row().
+static void iwgif_make_palbytes(struct iwgifrcontext *rctx)
 {
-	struct iw_image *img;
-	unsigned int r,g,b,a;
-	size_t pixnum;
-	size_t xi,yi; // position in image coordinates
-	size_t xs,ys; // position in screen coordinates
-	iw_byte *ptr;
-
-	img = rctx->img;
-
-	// Figure out which pixel to set.
+	int i;
 
-	pixnum = rctx->pixels_set + offset;
-	xi = pixnum%rctx->image_width;
-	yi = pixnum/rctx->image_width;
-	xs = rctx->image_left + xi;
-	ys = rctx->image_top + yi;
+	// Illegal palette indices become (transparent) black, the same as the
+	// screen's background.
+	iw_zeromem(rctx->palbytes,sizeof(rctx->palbytes));
+	for(i=0;i<rctx->colortable.num_entries && i<256;i++) {
+		rctx->palbytes[i][0] = rctx->colortable.entry[i].r;
+		rctx->palbytes[i][1] = rctx->colortable.entry[i].g;
+		rctx->palbytes[i][2] = rctx->colortable.entry[i].b;
+		rctx->palbytes[i][3] = rctx->colortable.entry[i].a;
+	}
+}
 
-	// Make sure the coordinate is within the image, and on the screen.
-	if(yi>=(size_t)rctx->image_height) return;
-	if(xs>=(size_t)rctx->screen_width) return;
-	if(ys>=(size_t)rctx->screen_height) return;
+// Convert the first npixels palette indices in rowbuf, which hold the given
+// row (in decoding order), to RGB or RGBA, and copy them to the screen.
+static void iwgif_expand_row(struct iwgifrcontext *rctx, int row, size_t npixels)
+{
+	const iw_byte *src;
+	iw_byte *dst;
+	size_t i;
 
-	// Because of how we de-interlace, it's not obvious whether the Y coordinate
-	// is on the screen. The easiest way is to check if the row pointer is NULL.
-	if(rctx->row_pointers[yi]==NULL) return;
+	// Because of how we de-interlace, it's not obvious whether the row is on
+	// the screen. The easiest way is to check if the row pointer is NULL.
+	dst = rctx->row_pointers[row];
+	if(!dst) return;
 
-	// Figure out what color to set the pixel to.
+	if(npixels > (size_t)rctx->visible_cols) npixels = (size_t)rctx->visible_cols;
+	src = rctx->rowbuf;
 
-	if(coloridx<(unsigned int)rctx->colortable.num_entries) {
-		r=rctx->colortable.entry[coloridx].r;
-		g=rctx->colortable.entry[coloridx].g;
-		b=rctx->colortable.entry[coloridx].b;
-		a=rctx->colortable.entry[coloridx].a;
+	if(rctx->frame_mode) {
+		// Transparent pixels (and illegal palette indices) leave the screen
+		// as it was. GIF palette colors are otherwise always opaque.
+		for(i=0;i<npixels;i++) {
+			if(rctx->palbytes[src[i]][3]==0) continue;
+			memcpy(&dst[4*i],rctx->palbytes[src[i]],4);
+		}
+	}
+	else if(rctx->bytes_per_pixel==4) {
+		for(i=0;i<npixels;i++) {
+			memcpy(&dst[4*i],rctx->palbytes[src[i]],4);
+		}
 	}
 	else {
-		return; // Illegal palette index
+		for(i=0;i<npixels;i++) {
+			memcpy(&dst[3*i],rctx->palbytes[src[i]],3);
+		}
 	}
+}
 
-	// Set the pixel.
+// Append n palette indices to the image, and copy each row to the screen
+// as it is completed.
+static void iwgif_record_pixels(struct iwgifrcontext *rctx, const iw_byte *src,
+	size_t n)
+{
+	size_t k, m;
+
+	while(n>0 && rctx->cur_row < rctx->image_height) {
+		k = (size_t)(rctx->image_width - rctx->cur_col);
+		if(k>n) k=n;
+
+		// Keep only the pixels that are on the screen.
+		if(rctx->cur_col < rctx->visible_cols && rctx->row_pointers[rctx->cur_row]) {
+			m = (size_t)(rctx->visible_cols - rctx->cur_col);
+			if(m>k) m=k;
+			memcpy(&rctx->rowbuf[rctx->cur_col],src,m);
+		}
+
+		src += k;
+		n -= k;
+		rctx->cur_col += (int)k;
+		rctx->pixels_set += k;
 
-	ptr = &rctx->row_pointers[yi][rctx->bytes_per_pixel*xi];
-	ptr[0]=r; ptr[1]=g; ptr[2]=b;
-	if(img->imgtype==IW_IMGTYPE_RGBA) {
-		ptr[3]=a;
+		if(rctx->cur_col >= rctx->image_width) {
+			iwgif_expand_row(rctx,rctx->cur_row,(size_t)rctx->image_width);
+			rctx->cur_row++;
+			rctx->cur_col = 0;
+		}
 	}
 }
 
@@ -274,6 +341,10 @@ struct lzwdeccontext {
 
 	unsigned int ct_used; // Number of items used in the code table
 	struct lzw_tableentry ct[4096]; // Code table
+
+	// A code's string is assembled here (from right to left), before being
+	// added to the image.
+	iw_byte stack[4096];
 };
 
 static void lzw_init(struct lzwdeccontext *d, unsigned int root_codesize)
@@ -302,26 +373,29 @@ static void lzw_clear(struct lzwdeccontext *d)
 	d->oldcode=0;
 }
 
-// Decode an LZW code to one or more pixels, and record it in the image.
+// Decode an LZW code to one or more pixels, and record them in the image.
 static void lzw_emit_code(struct iwgifrcontext *rctx, struct lzwdeccontext *d,
 		unsigned int first_code)
 {
 	unsigned int code;
-	code = first_code;
+	iw_byte *p;
 
-	// An LZW code may decode to more than one pixel. Note that the pixels for
-	// an LZW code are decoded in reverse order (right to left).
+	if(rctx->pixels_set >= rctx->total_npixels) return;
 
+	// An LZW code may decode to more than one pixel. The pixels for a code
+	// are found in reverse order (right to left), by following the chain of
+	// parent codes.
+	code = first_code;
+	p = &d->stack[4096];
 	while(1) {
-		iwgif_record_pixel(rctx, (unsigned int)d->ct[code].lastchar, (int)(d->ct[code].length-1));
+		*(--p) = d->ct[code].lastchar;
 		if(d->ct[code].length<=1) break;
 		// The codes are structured as a "forest" (multiple trees).
 		// Go to the parent code, which will have a length 1 less than this one.
 		code = (unsigned int)d->ct[code].parent;
 	}
 
-	// Track the total number of pixels decoded in this image.
-	rctx->pixels_set += d->ct[first_code].length;
+	iwgif_record_pixels(rctx,p,(size_t)d->ct[first_code].length);
 }
 
 // Add a code to the dictionary.
@@ -429,27 +503,25 @@ static int lzw_process_bytes(struct iwgifrcontext *rctx, struct lzwdeccontext *d
 	iw_byte *data, size_t data_size)
 {
 	size_t i;
-	int b;
+	unsigned int code;
 	int retval=0;
 
 	for(i=0;i<data_size;i++) {
-		// Look at the bits one at a time.
-		for(b=0;b<8;b++) {
+		// Codes are stored least-significant bit first.
+		d->pending_code |= ((unsigned int)data[i])<<d->bits_in_pending_code;
+		d->bits_in_pending_code += 8;
+
+		// Process each complete LZW code that we now have.
+		while(d->bits_in_pending_code >= d->current_codesize) {
 			if(d->eoi_flag) { // Stop if we've seen an EOI (end of image) code.
 				retval=1;
 				goto done;
 			}
 
-			if(data[i]&(1<<b))
-				d->pending_code |= 1<<d->bits_in_pending_code;
-			d->bits_in_pending_code++;
-
-			// When we get enough bits to form a complete LZW code, process it.
-			if(d->bits_in_pending_code >= d->current_codesize) {
-				if(!lzw_process_code(rctx,d,d->pending_code)) goto done;
-				d->pending_code=0;
-				d->bits_in_pending_code=0;
-			}
+			code = d->pending_code & ((1U<<d->current_codesize)-1);
+			d->pending_code >>= d->current_codesize;
+			d->bits_in_pending_code -= d->current_codesize;
+			if(!lzw_process_code(rctx,d,code)) goto done;
 		}
 	}
 	retval=1;
@@ -498,7 +570,8 @@ static int iwgif_init_screen(struct iwgifrcontext *rctx)
 	}
 
 	// Allocate IW image
-	if(rctx->has_transparency || bg_visible) {
+	// In frame_mode, later images may be transparent even if this one isn't.
+	if(rctx->has_transparency || bg_visible || rctx->frame_mode) {
 		rctx->bytes_per_pixel=4;
 		img->imgtype = IW_IMGTYPE_RGBA;
 	}
@@ -572,6 +645,41 @@ static int iwgif_make_row_pointers(struct iwgifrcontext *rctx)
 	return 1;
 }
 
+// Record information about the image whose header is in rctx->rbuf, as
+// iwgif_init_screen() would interpret it.
+static void iwgif_record_probe_info(struct iwgifrcontext *rctx)
+{
+	struct iw_image_info *info = rctx->probe_info;
+	int image_left, image_top;
+	int image_width, image_height;
+	int bg_visible = 0;
+
+	image_left = (int)iw_get_ui16le(&rctx->rbuf[0]);
+	image_top = (int)iw_get_ui16le(&rctx->rbuf[2]);
+	image_width = (int)iw_get_ui16le(&rctx->rbuf[4]);
+	image_height = (int)iw_get_ui16le(&rctx->rbuf[6]);
+
+	if(rctx->include_screen) {
+		info->width = rctx->screen_width;
+		info->height = rctx->screen_height;
+		if(image_left>0 || image_top>0 ||
+			(image_left+image_width < rctx->screen_width) ||
+			(image_top+image_height < rctx->screen_height) )
+		{
+			bg_visible = 1;
+		}
+	}
+	else {
+		info->width = image_width;
+		info->height = image_height;
+	}
+
+	info->imgtype = (rctx->has_transparency || bg_visible) ?
+		IW_IMGTYPE_RGBA : IW_IMGTYPE_RGB;
+	info->bit_depth = 8;
+	info->sampletype = IW_SAMPLETYPE_UINT;
+}
+
 static int iwgif_skip_image(struct iwgifrcontext *rctx)
 {
 	int has_local_ct;
@@ -582,6 +690,10 @@ static int iwgif_skip_image(struct iwgifrcontext *rctx)
 	// Read image header information
 	if(!iwgif_read(rctx,rctx->rbuf,9)) goto done;
 
+	if(rctx->probe_info && rctx->page==rctx->pages_seen) {
+		iwgif_record_probe_info(rctx);
+	}
+
 	has_local_ct = (int)((rctx->rbuf[8]>>7)&0x01);
 	if(has_local_ct) {
 		local_ct_size = (int)(rctx->rbuf[8]&0x07);
@@ -609,10 +721,69 @@ done:
 	return retval;
 }
 
+// Save the part of the screen that the current image will cover, so that
+// it can be restored (disposal method 3).
+static int iwgif_save_area(struct iwgifrcontext *rctx)
+{
+	struct iw_image *img = rctx->img;
+	size_t rowsize;
+	int j;
+
+	if(rctx->saved_area) {
+		iw_free(rctx->ctx,rctx->saved_area);
+		rctx->saved_area = NULL;
+	}
+	if(rctx->visible_cols<1 || rctx->visible_rows<1) return 1;
+
+	rowsize = 4*(size_t)rctx->visible_cols;
+	rctx->saved_area = (iw_byte*)iw_malloc_large(rctx->ctx,rowsize,rctx->visible_rows);
+	if(!rctx->saved_area) return 0;
+	for(j=0;j<rctx->visible_rows;j++) {
+		memcpy(&rctx->saved_area[j*rowsize],
+			&img->pixels[(size_t)(rctx->image_top+j)*img->bpr + 4*(size_t)rctx->image_left],
+			rowsize);
+	}
+	return 1;
+}
+
+// Before painting the next image, do what the previous image's disposal
+// method says to do with the area it covered.
+static void iwgif_dispose_image(struct iwgifrcontext *rctx)
+{
+	struct iw_image *img = rctx->img;
+	size_t rowsize;
+	iw_byte *dst;
+	int j;
+
+	if(rctx->prev_disposal!=2 && rctx->prev_disposal!=3) goto done;
+	if(rctx->visible_cols<1 || rctx->visible_rows<1) goto done;
+
+	rowsize = 4*(size_t)rctx->visible_cols;
+	for(j=0;j<rctx->visible_rows;j++) {
+		dst = &img->pixels[(size_t)(rctx->image_top+j)*img->bpr + 4*(size_t)rctx->image_left];
+		if(rctx->prev_disposal==3 && rctx->saved_area) {
+			// Restore to previous
+			memcpy(dst,&rctx->saved_area[j*rowsize],rowsize);
+		}
+		else {
+			// Restore to background. Like the area not covered by any image,
+			// the background is transparent.
+			iw_zeromem(dst,rowsize);
+		}
+	}
+
+done:
+	if(rctx->saved_area) {
+		iw_free(rctx->ctx,rctx->saved_area);
+		rctx->saved_area = NULL;
+	}
+	rctx->prev_disposal = 0;
+}
+
 static int iwgif_read_image(struct iwgifrcontext *rctx)
 {
 	int retval=0;
-	struct lzwdeccontext d;
+	struct lzwdeccontext *d = NULL;
 	size_t subblocksize;
 	int has_local_ct;
 	int local_ct_size;
@@ -635,6 +806,11 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 
 	rctx->interlaced = (int)((rctx->rbuf[8]>>6)&0x01);
 
+	if(rctx->frame_mode) {
+		// Undo the previous image's local color table and transparency.
+		rctx->colortable = rctx->global_colortable;
+	}
+
 	has_local_ct = (int)((rctx->rbuf[8]>>7)&0x01);
 	if(has_local_ct) {
 		local_ct_size = (int)(rctx->rbuf[8]&0x07);
@@ -642,9 +818,9 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 	}
 
 	if(has_local_ct) {
-		// We only support one image, so we don't need to keep both a global and a
-		// local color table. If an image has both, the local table will overwrite
-		// the global one.
+		// Except in frame_mode, we only read one image, so we don't need to keep
+		// both a global and a local color table. If an image has both, the local
+		// table will overwrite the global one.
 		if(!iwgif_read_color_table(rctx,&rctx->colortable)) goto done;
 	}
 
@@ -672,11 +848,31 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 	if(!iwgif_init_screen(rctx)) goto done;
 
 	rctx->total_npixels = (size_t)rctx->image_width * (size_t)rctx->image_height;
+	rctx->pixels_set = 0;
+	rctx->cur_row = 0;
+	rctx->cur_col = 0;
 
 	if(!iwgif_make_row_pointers(rctx)) goto done;
 
-	lzw_init(&d,root_codesize);
-	lzw_clear(&d);
+	rctx->visible_cols = rctx->screen_width - rctx->image_left;
+	if(rctx->visible_cols > rctx->image_width) rctx->visible_cols = rctx->image_width;
+	if(rctx->visible_cols < 0) rctx->visible_cols = 0;
+	rctx->visible_rows = rctx->screen_height - rctx->image_top;
+	if(rctx->visible_rows > rctx->image_height) rctx->visible_rows = rctx->image_height;
+	if(rctx->visible_rows < 0) rctx->visible_rows = 0;
+	iwgif_make_palbytes(rctx);
+
+	if(rctx->frame_mode && rctx->disposal==3) {
+		if(!iwgif_save_area(rctx)) goto done;
+	}
+
+	rctx->rowbuf = (iw_byte*)iw_malloc(rctx->ctx, (size_t)rctx->visible_cols + 1);
+	if(!rctx->rowbuf) goto done;
+
+	d = (struct lzwdeccontext*)iw_malloc(rctx->ctx, sizeof(struct lzwdeccontext));
+	if(!d) goto done;
+	lzw_init(d,root_codesize);
+	lzw_clear(d);
 
 	while(1) {
 		// Read size of next subblock
@@ -686,18 +882,34 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 
 		// Read next subblock
 		if(!iwgif_read(rctx,rctx->rbuf,subblocksize)) goto done;
-		if(!lzw_process_bytes(rctx,&d,rctx->rbuf,subblocksize)) goto done;
+		if(!lzw_process_bytes(rctx,d,rctx->rbuf,subblocksize)) goto done;
 
-		if(d.eoi_flag) break;
+		if(d->eoi_flag) break;
 
 		// Stop if we reached the end of the image. We don't care if we've read an
 		// EOI code or not.
 		if(rctx->pixels_set >= rctx->total_npixels) break;
 	}
 
+	if(rctx->frame_mode && subblocksize!=0) {
+		// More images may follow, so skip the rest of this image's data.
+		if(!iwgif_skip_subblocks(rctx)) goto done;
+	}
+
+	// If the image data ended early, copy the part of the last row that was
+	// decoded.
+	if(rctx->cur_col>0 && rctx->cur_row < rctx->image_height) {
+		iwgif_expand_row(rctx,rctx->cur_row,(size_t)rctx->cur_col);
+	}
+
 	retval=1;
 
 done:
+	if(d) iw_free(rctx->ctx,d);
+	if(rctx->rowbuf) {
+		iw_free(rctx->ctx,rctx->rowbuf);
+		rctx->rowbuf = NULL;
+	}
 	return retval;
 }
 
@@ -768,6 +980,94 @@ done:
 	return retval;
 }
 
+// Read the file, without decoding any images, and count the images.
+static int iwgif_probe_main(struct iwgifrcontext *rctx)
+{
+	int retval=0;
+
+	if(!iwgif_read_file_header(rctx)) goto done;
+	if(!iwgif_read_screen_descriptor(rctx)) goto done;
+	if(!iwgif_read_color_table(rctx,&rctx->colortable)) goto done;
+
+	while(1) {
+		// Read block type
+		if(!iwgif_read(rctx,rctx->rbuf,1)) {
+			// Tolerate a missing trailer, as long as we found the image.
+			if(rctx->page <= rctx->pages_seen) break;
+			goto done;
+		}
+
+		if(rctx->rbuf[0]==0x21) { // extension
+			if(!iwgif_read_extension(rctx)) goto done;
+		}
+		else if(rctx->rbuf[0]==0x2c) { // image
+			rctx->pages_seen++;
+			if(!iwgif_skip_image(rctx)) goto done;
+		}
+		else if(rctx->rbuf[0]==0x3b) { // file trailer
+			break;
+		}
+		else {
+			iw_set_error(rctx->ctx,"Invalid or unsupported GIF file");
+			goto done;
+		}
+	}
+
+	if(rctx->pages_seen==0) {
+		iw_set_error(rctx->ctx,"No image in file");
+		goto done;
+	}
+	if(rctx->page > rctx->pages_seen) {
+		iw_set_error(rctx->ctx,"Image not found");
+		goto done;
+	}
+	rctx->probe_info->page_count = rctx->pages_seen;
+
+	retval=1;
+done:
+	return retval;
+}
+
+IW_IMPL(int) iw_probe_gif_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info)
+{
+	struct iw_image img;
+	struct iwgifrcontext *rctx = NULL;
+	int retval=0;
+
+	iw_zeromem(info,sizeof(struct iw_image_info));
+	iw_zeromem(&img,sizeof(struct iw_image));
+	rctx = iw_mallocz(ctx,sizeof(struct iwgifrcontext));
+	if(!rctx) goto done;
+
+	rctx->ctx = ctx;
+	rctx->iodescr = iodescr;
+	rctx->img = &img;
+	rctx->probe_info = info;
+
+	rctx->page = iw_get_value(ctx,IW_VAL_PAGE_TO_READ);
+	if(rctx->page<1) rctx->page = 1;
+
+	rctx->include_screen = iw_get_value(ctx,IW_VAL_INCLUDE_SCREEN);
+
+	if(!iwgif_probe_main(rctx))
+		goto done;
+
+	if(info->width<1 || info->height<1) {
+		iw_set_error(ctx,"Invalid image dimensions");
+		goto done;
+	}
+
+	retval = 1;
+
+done:
+	if(!retval) {
+		iw_set_error(ctx,"Failed to read GIF file");
+	}
+	if(rctx) iw_free(ctx,rctx);
+	return retval;
+}
+
 IW_IMPL(int) iw_read_gif_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
 {
 	struct iw_image img;
@@ -814,3 +1114,159 @@ done:
 
 	return retval;
 }
+
+struct iw_gif_frame_reader {
+	struct iwgifrcontext rctx;
+	struct iw_image screen;
+	int finished;
+};
+
+IW_IMPL(struct iw_gif_frame_reader*) iw_open_gif_frame_reader(struct iw_context *ctx,
+	struct iw_iodescr *iodescr)
+{
+	struct iw_gif_frame_reader *fr = NULL;
+	struct iwgifrcontext *rctx;
+	int i;
+	int retval=0;
+
+	fr = iw_mallocz(ctx,sizeof(struct iw_gif_frame_reader));
+	if(!fr) goto done;
+	rctx = &fr->rctx;
+
+	rctx->ctx = ctx;
+	rctx->iodescr = iodescr;
+	rctx->img = &fr->screen;
+	rctx->frame_mode = 1;
+	rctx->include_screen = 1;
+	iw_make_srgb_csdescr_2(&rctx->csdescr);
+
+	// Make all colors opaque by default.
+	for(i=0;i<256;i++) {
+		rctx->colortable.entry[i].a=255;
+	}
+
+	if(!iwgif_read_file_header(rctx)) goto done;
+	if(!iwgif_read_screen_descriptor(rctx)) goto done;
+	if(!iwgif_read_color_table(rctx,&rctx->colortable)) goto done;
+	rctx->global_colortable = rctx->colortable;
+
+	retval=1;
+
+done:
+	if(!retval) {
+		iw_set_error(ctx,"Failed to read GIF file");
+		if(fr) {
+			iw_free(ctx,fr);
+			fr = NULL;
+		}
+	}
+	return fr;
+}
+
+IW_IMPL(int) iw_read_next_gif_frame(struct iw_context *ctx, struct iw_gif_frame_reader *fr,
+	struct iw_gif_frame_info *info)
+{
+	struct iwgifrcontext *rctx = &fr->rctx;
+	struct iw_image img;
+	int frame_found=0;
+	int ok=0;
+
+	iw_zeromem(info,sizeof(struct iw_gif_frame_info));
+	iw_zeromem(&img,sizeof(struct iw_image));
+	if(fr->finished) return 0;
+
+	rctx->ctx = ctx;
+	if(rctx->pages_seen>0) {
+		iwgif_dispose_image(rctx);
+	}
+
+	// Extensions before the next image apply to it.
+	rctx->page = rctx->pages_seen+1;
+
+	while(!frame_found) {
+		// Read block type
+		if(!iwgif_read(rctx,rctx->rbuf,1)) {
+			// Tolerate a missing trailer, as long as we found an image.
+			if(rctx->pages_seen>0) break;
+			goto done;
+		}
+
+		if(rctx->rbuf[0]==0x21) { // extension
+			if(!iwgif_read_extension(rctx)) goto done;
+		}
+		else if(rctx->rbuf[0]==0x2c) { // image
+			rctx->pages_seen++;
+			if(!iwgif_read_image(rctx)) goto done;
+			frame_found=1;
+		}
+		else if(rctx->rbuf[0]==0x3b) { // file trailer
+			if(rctx->pages_seen==0) {
+				iw_set_error(ctx,"No image in file");
+				goto done;
+			}
+			break;
+		}
+		else {
+			iw_set_error(ctx,"Invalid or unsupported GIF file");
+			goto done;
+		}
+	}
+
+	if(!frame_found) {
+		ok=1;
+		fr->finished=1;
+		goto done;
+	}
+
+	info->frame_num = rctx->pages_seen;
+	info->left = rctx->image_left;
+	info->top = rctx->image_top;
+	info->width = rctx->image_width;
+	info->height = rctx->image_height;
+	info->delay = rctx->delay;
+	info->disposal = rctx->disposal;
+	info->has_transparency = rctx->has_transparency;
+	info->trans_color_index = rctx->trans_color_index;
+
+	// The graphic control extension's scope is the image that follows it,
+	// except that its disposal method is carried out before the next image.
+	rctx->prev_disposal = rctx->disposal;
+	rctx->has_transparency = 0;
+	rctx->trans_color_index = 0;
+	rctx->disposal = 0;
+	rctx->delay = 0;
+
+	// The screen will be modified by later frames, so give IW a copy of it.
+	img = fr->screen;
+	img.pixels = (iw_byte*)iw_malloc_large(ctx, img.bpr, img.height);
+	if(!img.pixels) goto done;
+	memcpy(img.pixels,fr->screen.pixels,img.bpr*img.height);
+
+	iw_reset_context(ctx,1);
+	iw_set_input_image(ctx, &img);
+	iw_set_input_colorspace(ctx,&rctx->csdescr);
+	if(rctx->has_bg_color) {
+		iw_set_input_bkgd_label(ctx,
+			((double)rctx->global_colortable.entry[rctx->bg_color_index].r)/255.0,
+			((double)rctx->global_colortable.entry[rctx->bg_color_index].g)/255.0,
+			((double)rctx->global_colortable.entry[rctx->bg_color_index].b)/255.0);
+	}
+
+	ok=1;
+
+done:
+	if(!ok) {
+		iw_set_error(ctx,"Failed to read GIF file");
+		fr->finished=1;
+	}
+	return ok && frame_found;
+}
+
+IW_IMPL(void) iw_close_gif_frame_reader(struct iw_context *ctx, struct iw_gif_frame_reader *fr)
+{
+	if(!fr) return;
+	if(fr->rctx.row_pointers) iw_free(ctx,fr->rctx.row_pointers);
+	if(fr->rctx.saved_area) iw_free(ctx,fr->rctx.saved_area);
+	if(fr->screen.pixels) iw_free(ctx,fr->screen.pixels);
+	iw_free(ctx,fr);
+}
@@ -47,6 +47,13 @@ struct iw_resize_settings {
 	double translate; // Amount to move the image, before applying any channel offsets.
 	double channel_offset[3]; // Indexed by IW_CHANNELTYPE_[Red..Blue]
 	struct iw_rr_ctx *rrctx;
+
+	// The full output size in this dimension, the range of output pixels to
+	// compute, and the range of input pixels that they depend on.
+	// Set by iw_prepare_processing().
+	int out_size;
+	int out_region_start, out_region_size;
+	int in_region_start, in_region_size;
 };
 
 struct iw_channelinfo_in {
@@ -119,6 +126,45 @@ struct iw_opt_ctx {
 	unsigned int bkgdlabel[4]; // Indexed by IW_CHANNELTYPE_[RED..ALPHA]
 };
 
+// A buffer in the scratch memory pool. See iwpvt_scratch_alloc().
+#define IW_SCRATCH_SLOTS 16
+struct iw_scratch_block {
+	void *mem;
+	size_t size;
+	int in_use;
+};
+
+// Settings that iw_process_image() may modify, so that
+// iw_reset_context() can put them back.
+struct iw_saved_settings {
+	int valid;
+	struct iw_resize_settings resize_settings[2];
+	int input_start_x, input_start_y, input_w, input_h;
+	int random_seed;
+	int grayscale_formula;
+	iw_byte opt_palette;
+	iw_byte opt_binary_trns;
+};
+
+// A memory block being tracked for statistics.
+struct iw_stats_memblock {
+	void *mem;
+	size_t size;
+};
+
+struct iw_stats_ctx {
+	int enabled;
+	struct iw_stats stats;
+	double stage_start_wall[IW_NUM_STAGES];
+	double stage_start_cpu[IW_NUM_STAGES];
+
+	// Blocks currently allocated, so we know their size when freed.
+	struct iw_stats_memblock *blocks;
+	int blocks_used;
+	int blocks_alloc;
+	size_t cur_bytes;
+};
+
 struct iw_option_struct {
 	char *name;
 	char *val;
@@ -166,6 +212,9 @@ struct iw_req_struct {
 	int interlaced;
 	int bmp_no_fileheader;
 
+	int region_valid; // Set by iw_set_output_region()
+	int region_x, region_y, region_w, region_h;
+
 	struct iw_option_struct *options;
 	int options_count;
 	int options_numalloc;
@@ -186,11 +235,24 @@ struct iw_context {
 	struct iw_channelinfo_in img1_ci[IW_CI_COUNT];
 
 	struct iw_image img1;
+	int img1_pixels_shared; // img1.pixels belongs to another context
+
+	// Set if the file reader decoded only part of the image (see
+	// iw_get_input_crop()). img1 is then the rectangle at img1_offset_x,
+	// img1_offset_y of an img1_full_width x img1_full_height image.
+	int img1_partial;
+	int img1_offset_x, img1_offset_y;
+	int img1_full_width, img1_full_height;
 	struct iw_csdescr img1cs;
 	int img1_imgtype_logical;
 
 	int img1_numchannels_physical;
 	int img1_numchannels_logical;
+	// Samples per pixel in img1, including any unused padding sample.
+	int img1_samples_per_pixel;
+	// The position within each pixel of each (physical) input channel,
+	// taking img1.channel_order into account.
+	int img1_sample_pos[IW_CI_COUNT];
 	int img1_alpha_channel_index;
 
 	// The suggested background color read from the input file.
@@ -237,6 +299,7 @@ struct iw_context {
 	void *userdata;
 	iw_translatefn_type translate_fn;
 	iw_warningfn_type warning_fn;
+	iw_tracefn_type trace_fn;
 
 	int input_maxcolorcode_int;  // Based on the source image's full bitdepth
 	double input_maxcolorcode;
@@ -256,6 +319,7 @@ struct iw_context {
 
 	size_t max_malloc;
 	int max_width, max_height;
+	int num_threads; // IW_VAL_NUM_THREADS
 
 	int error_flag;
 	char *error_msg;
@@ -278,6 +342,15 @@ struct iw_context {
 	int canvas_width, canvas_height;
 	int input_start_x, input_start_y, input_w, input_h;
 
+	// The position of img2 in the full output image, if only part of it is
+	// being computed.
+	int region_x, region_y;
+	// If an output region was requested, but we have to compute the whole
+	// image anyway (because of the dithering method), the region to crop
+	// from the final image.
+	int region_crop_late;
+	int crop_x, crop_y, crop_w, crop_h;
+
 	struct iw_req_struct req;
 
 	// Color correction tables, to improve performance.
@@ -290,6 +363,13 @@ struct iw_context {
 	double *nearest_color_table;
 
 	struct iw_zlib_module *zlib_module;
+
+	struct iw_saved_settings saved;
+
+	struct iw_stats_ctx statsctx;
+
+	size_t scratch_limit; // Max bytes of idle scratch memory to keep. 0=disabled.
+	struct iw_scratch_block scratch[IW_SCRATCH_SLOTS];
 };
 
 // Defined imagew-util.c
@@ -301,12 +381,24 @@ int iwpvt_util_randomize(struct iw_prng *prng); // Returns the random seed that
 void* iwpvt_default_malloc(void *userdata, unsigned int flags, size_t n);
 void iwpvt_default_free(void *userdata, void *mem);
 char* iwpvt_strdup_dbl(struct iw_context *ctx, double n);
+void *iwpvt_scratch_alloc(struct iw_context *ctx, unsigned int flags, size_t n1, size_t n2);
+void *iwpvt_scratch_realloc(struct iw_context *ctx, void *oldmem,
+	size_t oldmem_size, size_t newmem_size);
+void iwpvt_scratch_free(struct iw_context *ctx, void *mem);
+void iwpvt_scratch_free_all(struct iw_context *ctx);
+void iwpvt_stats_track(struct iw_context *ctx, void *mem, size_t n);
+void iwpvt_stats_untrack(struct iw_context *ctx, void *mem);
+void iwpvt_stats_reset(struct iw_context *ctx);
+void iwpvt_stats_free(struct iw_context *ctx);
 
 // Defined in imagew-resize.c
 struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
   struct iw_resize_settings *rs, int channeltype, int num_in_pix, int num_out_pix);
 void iwpvt_resize_rows_done(struct iw_rr_ctx *rrctx);
 void iwpvt_resize_row_main(struct iw_rr_ctx *rrctx, iw_tmpsample *in_pix, iw_tmpsample *out_pix);
+int iwpvt_resize_row_taps(struct iw_rr_ctx *rrctx);
+void iwpvt_resize_input_range(struct iw_context *ctx, struct iw_resize_settings *rs,
+  int num_in_pix, int *pstart, int *psize);
 
 // Defined in imagew-opt.c
 void iwpvt_optimize_image(struct iw_context *ctx);
@@ -0,0 +1,427 @@
+// imagew-io.c
+// Part of ImageWorsener, Copyright (c) 2011 by Jason Summers.
+// For more information, see the readme.txt file.
+
+// Built-in I/O descriptors, for applications that keep their files in
+// memory, or that want to read files via memory-mapping.
+
+#include "imagew-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef IW_WINDOWS
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#define IW_INCLUDE_UTIL_FUNCTIONS
+#include "imagew.h"
+
+#define IWMEMIO_KIND_READ  1
+#define IWMEMIO_KIND_MMAP  2
+#define IWMEMIO_KIND_WRITE 3
+
+// The state of a memory-backed iodescr. Pointed to by iodescr->fp.
+struct iwmemiostate {
+	int kind;
+	iw_byte *mem;
+	// For readers, the size of the data. For writers, the number of bytes
+	// that have been written (the high water mark).
+	size_t size;
+	size_t alloc; // Writers only
+	size_t capacity_hint; // Writers only
+	size_t pos;
+	// For IWMEMIO_KIND_MMAP: Set if mem is a mapping; otherwise mem was
+	// allocated with iw_malloc.
+	int is_mapped;
+#ifdef IW_WINDOWS
+	HANDLE fh;
+	HANDLE maph;
+#endif
+};
+
+// Returns 0 if the new position would be negative, or would not fit in a size_t.
+static int iwmemio_calc_pos(struct iwmemiostate *st, iw_int64 offset, int whence,
+	size_t *pnewpos)
+{
+	iw_int64 base;
+	iw_int64 newpos;
+
+	switch(whence) {
+	case SEEK_SET: base = 0; break;
+	case SEEK_CUR: base = (iw_int64)st->pos; break;
+	case SEEK_END: base = (iw_int64)st->size; break;
+	default: return 0;
+	}
+
+	newpos = base + offset;
+	if(newpos<0) return 0;
+	if((iw_int64)(size_t)newpos != newpos) return 0;
+	*pnewpos = (size_t)newpos;
+	return 1;
+}
+
+static int iwmemio_seekfn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	iw_int64 offset, int whence)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+	size_t newpos;
+
+	if(!iwmemio_calc_pos(st,offset,whence,&newpos)) return 0;
+	st->pos = newpos;
+	return 1;
+}
+
+static int iwmemio_tellfn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	iw_int64 *pfileptr)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+	*pfileptr = (iw_int64)st->pos;
+	return 1;
+}
+
+static int iwmemio_getfilesizefn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	iw_int64 *pfilesize)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+	*pfilesize = (iw_int64)st->size;
+	return 1;
+}
+
+static int iwmemio_readfn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	void *buf, size_t nbytes, size_t *pbytesread)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+	size_t nbytes_to_return;
+
+	if(st->pos >= st->size) {
+		*pbytesread = 0;
+		return 1;
+	}
+
+	nbytes_to_return = nbytes;
+	if(nbytes_to_return > st->size - st->pos)
+		nbytes_to_return = st->size - st->pos;
+	memcpy(buf,&st->mem[st->pos],nbytes_to_return);
+	st->pos += nbytes_to_return;
+	*pbytesread = nbytes_to_return;
+	return 1;
+}
+
+static int iwmemio_getmemfn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const void **pmem, iw_int64 *psize)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+	*pmem = (const void*)st->mem;
+	*psize = (iw_int64)st->size;
+	return 1;
+}
+
+// Make sure at least 'needed' bytes are allocated.
+static int iwmemio_w_reserve(struct iw_context *ctx, struct iwmemiostate *st, size_t needed)
+{
+	size_t newalloc;
+	iw_byte *newmem;
+
+	if(needed <= st->alloc) return 1;
+
+	// Grow geometrically, so that a long sequence of small writes doesn't
+	// lead to quadratic behavior.
+	newalloc = st->alloc*2;
+	if(newalloc < st->capacity_hint) newalloc = st->capacity_hint;
+	if(newalloc < 4096) newalloc = 4096;
+	if(newalloc < needed) newalloc = needed;
+
+	newmem = (iw_byte*)iw_realloc(ctx,st->mem,st->size,newalloc);
+	if(!newmem) {
+		st->mem = NULL;
+		st->size = 0;
+		st->alloc = 0;
+		return 0;
+	}
+	st->mem = newmem;
+	st->alloc = newalloc;
+	return 1;
+}
+
+static int iwmemio_writefn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const void *buf, size_t nbytes)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+
+	if(nbytes > ((size_t)-1) - st->pos) {
+		iw_set_error(ctx,"Output file too large");
+		return 0;
+	}
+	if(!iwmemio_w_reserve(ctx,st,st->pos+nbytes)) return 0;
+
+	if(st->pos > st->size) {
+		// We previously seeked past the end of the data. Fill in the gap.
+		iw_zeromem(&st->mem[st->size],st->pos - st->size);
+	}
+
+	memcpy(&st->mem[st->pos],buf,nbytes);
+	st->pos += nbytes;
+	if(st->pos > st->size) st->size = st->pos;
+	return 1;
+}
+
+#ifdef IW_WINDOWS
+
+static void iwmemio_unmap(struct iw_context *ctx, struct iwmemiostate *st)
+{
+	if(st->mem) UnmapViewOfFile(st->mem);
+	if(st->maph) CloseHandle(st->maph);
+	if(st->fh!=INVALID_HANDLE_VALUE) CloseHandle(st->fh);
+	st->mem = NULL;
+	st->maph = NULL;
+	st->fh = INVALID_HANDLE_VALUE;
+}
+
+static int iwmemio_map_file(struct iw_context *ctx, struct iwmemiostate *st, const char *fn)
+{
+	WCHAR *fnW = NULL;
+	int fnW_len;
+	LARGE_INTEGER filesize;
+	int retval=0;
+
+	st->fh = INVALID_HANDLE_VALUE;
+	st->is_mapped = 1;
+
+	fnW_len = MultiByteToWideChar(CP_UTF8,0,fn,-1,NULL,0);
+	if(fnW_len<1) goto done;
+	fnW = (WCHAR*)iw_malloc(ctx,fnW_len*sizeof(WCHAR));
+	if(!fnW) goto done;
+	MultiByteToWideChar(CP_UTF8,0,fn,-1,fnW,fnW_len);
+
+	st->fh = CreateFileW(fnW,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL|FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+	if(st->fh==INVALID_HANDLE_VALUE) {
+		iw_set_errorf(ctx,"Failed to open %s for reading",fn);
+		goto done;
+	}
+
+	if(!GetFileSizeEx(st->fh,&filesize)) goto done;
+	if((LONGLONG)(size_t)filesize.QuadPart != filesize.QuadPart) {
+		iw_set_errorf(ctx,"%s is too large to map into memory",fn);
+		goto done;
+	}
+	st->size = (size_t)filesize.QuadPart;
+
+	if(st->size>0) {
+		st->maph = CreateFileMappingW(st->fh,NULL,PAGE_READONLY,0,0,NULL);
+		if(!st->maph) goto done;
+		st->mem = (iw_byte*)MapViewOfFile(st->maph,FILE_MAP_READ,0,0,0);
+		if(!st->mem) goto done;
+	}
+
+	retval=1;
+done:
+	if(!retval) {
+		iw_set_errorf(ctx,"Failed to map %s into memory",fn);
+		iwmemio_unmap(ctx,st);
+	}
+	iw_free(ctx,fnW);
+	return retval;
+}
+
+#else
+
+static void iwmemio_unmap(struct iw_context *ctx, struct iwmemiostate *st)
+{
+	if(st->mem) {
+		if(st->is_mapped)
+			munmap((void*)st->mem,st->size);
+		else
+			iw_free(ctx,st->mem);
+	}
+	st->mem = NULL;
+}
+
+// Used for files that can't be memory-mapped, such as pipes.
+static int iwmemio_slurp_fd(struct iw_context *ctx, struct iwmemiostate *st, int fd,
+	const char *fn)
+{
+	ssize_t n;
+
+	while(1) {
+		if(!iwmemio_w_reserve(ctx,st,st->size+65536)) return 0;
+		n = read(fd,&st->mem[st->size],st->alloc - st->size);
+		if(n<0) {
+			if(errno==EINTR) continue;
+			iw_set_errorf(ctx,"Failed to read %s: %s",fn,strerror(errno));
+			return 0;
+		}
+		if(n==0) break;
+		st->size += (size_t)n;
+	}
+	return 1;
+}
+
+static int iwmemio_map_file(struct iw_context *ctx, struct iwmemiostate *st, const char *fn)
+{
+	int fd;
+	struct stat sb;
+	void *m;
+	int retval=0;
+
+	fd = open(fn,O_RDONLY);
+	if(fd<0) {
+		iw_set_errorf(ctx,"Failed to open %s for reading: %s",fn,strerror(errno));
+		return 0;
+	}
+
+	if(fstat(fd,&sb)!=0) goto done;
+
+	if(!S_ISREG(sb.st_mode)) {
+		retval = iwmemio_slurp_fd(ctx,st,fd,fn);
+		goto done;
+	}
+
+	if((off_t)(size_t)sb.st_size != sb.st_size) {
+		iw_set_errorf(ctx,"%s is too large to map into memory",fn);
+		goto done;
+	}
+
+	if(sb.st_size>0) {
+		m = mmap(NULL,(size_t)sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if(m==MAP_FAILED) {
+			retval = iwmemio_slurp_fd(ctx,st,fd,fn);
+			goto done;
+		}
+		st->mem = (iw_byte*)m;
+		st->size = (size_t)sb.st_size;
+		st->is_mapped = 1;
+#ifdef POSIX_MADV_SEQUENTIAL
+		posix_madvise(m,st->size,POSIX_MADV_SEQUENTIAL);
+#endif
+	}
+
+	retval=1;
+done:
+	// The mapping remains valid after the file is closed.
+	close(fd);
+	if(!retval) iwmemio_unmap(ctx,st);
+	return retval;
+}
+
+#endif
+
+static int iwmemio_closefn(struct iw_context *ctx, struct iw_iodescr *iodescr)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+
+	if(!st) return 1;
+
+	switch(st->kind) {
+	case IWMEMIO_KIND_MMAP:
+		iwmemio_unmap(ctx,st);
+		break;
+	case IWMEMIO_KIND_WRITE:
+		iw_free(ctx,st->mem);
+		break;
+	}
+	iw_free(ctx,st);
+	iodescr->fp = NULL;
+	return 1;
+}
+
+static struct iwmemiostate *iwmemio_init(struct iw_context *ctx,
+	struct iw_iodescr *iodescr, int kind)
+{
+	struct iwmemiostate *st;
+
+	iw_zeromem(iodescr,sizeof(struct iw_iodescr));
+	st = (struct iwmemiostate*)iw_mallocz(ctx,sizeof(struct iwmemiostate));
+	if(!st) return NULL;
+	st->kind = kind;
+	iodescr->fp = (void*)st;
+	iodescr->close_fn = iwmemio_closefn;
+	iodescr->seek_fn = iwmemio_seekfn;
+	iodescr->tell_fn = iwmemio_tellfn;
+	iodescr->getfilesize_fn = iwmemio_getfilesizefn;
+	if(kind==IWMEMIO_KIND_WRITE) {
+		iodescr->write_fn = iwmemio_writefn;
+	}
+	else {
+		iodescr->read_fn = iwmemio_readfn;
+		iodescr->getmem_fn = iwmemio_getmemfn;
+	}
+	return st;
+}
+
+IW_IMPL(int) iw_open_mem_reader(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const void *mem, size_t memsize)
+{
+	struct iwmemiostate *st;
+
+	st = iwmemio_init(ctx,iodescr,IWMEMIO_KIND_READ);
+	if(!st) return 0;
+	// We never write to this memory.
+	st->mem = (iw_byte*)mem;
+	st->size = memsize;
+	return 1;
+}
+
+IW_IMPL(int) iw_open_mmap_reader(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const char *fn)
+{
+	struct iwmemiostate *st;
+
+	st = iwmemio_init(ctx,iodescr,IWMEMIO_KIND_MMAP);
+	if(!st) return 0;
+	if(!iwmemio_map_file(ctx,st,fn)) {
+		iw_free(ctx,st);
+		iw_zeromem(iodescr,sizeof(struct iw_iodescr));
+		return 0;
+	}
+	return 1;
+}
+
+IW_IMPL(int) iw_open_mem_writer(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	size_t capacity_hint)
+{
+	struct iwmemiostate *st;
+
+	st = iwmemio_init(ctx,iodescr,IWMEMIO_KIND_WRITE);
+	if(!st) return 0;
+	st->capacity_hint = capacity_hint;
+	return 1;
+}
+
+IW_IMPL(void) iw_set_mem_writer_capacity_hint(struct iw_context *ctx,
+	struct iw_iodescr *iodescr, size_t capacity_hint)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+	if(!st || st->kind!=IWMEMIO_KIND_WRITE) return;
+	st->capacity_hint = capacity_hint;
+}
+
+IW_IMPL(int) iw_get_mem_writer_data(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	unsigned int flags, void **pmem, size_t *psize)
+{
+	struct iwmemiostate *st = (struct iwmemiostate*)iodescr->fp;
+
+	*pmem = NULL;
+	*psize = 0;
+	if(!st || st->kind!=IWMEMIO_KIND_WRITE) return 0;
+
+	*pmem = (void*)st->mem;
+	*psize = st->size;
+
+	if(flags & IW_MEMIOFLAG_DETACH) {
+		// The caller now owns the memory.
+		st->mem = NULL;
+		st->size = 0;
+		st->alloc = 0;
+		st->pos = 0;
+	}
+	return 1;
+}
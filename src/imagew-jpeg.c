@@ -22,6 +22,13 @@
 #error "Wrong JSAMPLE size"
 #endif
 
+// libjpeg-turbo 1.5 and later can skip rows and columns while decoding.
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER>=1005000
+#define IWJPEG_SUPPORT_PARTIAL_DECODE 1
+#else
+#define IWJPEG_SUPPORT_PARTIAL_DECODE 0
+#endif
+
 struct my_error_mgr {
 	struct jpeg_error_mgr pub;
 	jmp_buf setjmp_buffer;
@@ -50,12 +57,17 @@ struct iwjpegrcontext {
 	unsigned int exif_orientation; // 0 means not set
 	double exif_density_x, exif_density_y; // -1.0 means not set.
 	unsigned int exif_density_unit; // 0 means not set
+	// The JPEG thumbnail image from Exif IFD1, if any. Points into a saved
+	// marker.
+	const iw_byte *exif_thumb;
+	size_t exif_thumb_len;
 };
 
 struct iw_exif_state {
 	int endian;
 	const iw_byte *d;
 	size_t d_len;
+	unsigned int thumb_pos, thumb_len;
 };
 
 static unsigned int get_exif_ui16(struct iw_exif_state *e, unsigned int pos)
@@ -127,8 +139,10 @@ static int get_exif_tag_dbl_value(struct iw_exif_state *e, unsigned int tag_pos,
 	return 1;
 }
 
-static void iwjpeg_scan_exif_ifd(struct iwjpegrcontext *rctx,
-	struct iw_exif_state *e, iw_uint32 ifd)
+// ifd_num is 0 for the primary image's IFD, or 1 for the thumbnail's IFD.
+// Returns the offset of the next IFD, or 0.
+static iw_uint32 iwjpeg_scan_exif_ifd(struct iwjpegrcontext *rctx,
+	struct iw_exif_state *e, iw_uint32 ifd, int ifd_num)
 {
 	unsigned int tag_count;
 	unsigned int i;
@@ -137,16 +151,33 @@ static void iwjpeg_scan_exif_ifd(struct iwjpegrcontext *rctx,
 	unsigned int v;
 	double v_dbl;
 
-	if(ifd<8 || e->d_len<18 || ifd>e->d_len-18) return;
+	if(ifd<8 || e->d_len<18 || ifd>e->d_len-18) return 0;
 
 	tag_count = get_exif_ui16(e, ifd);
-	if(tag_count>1000) return; // Sanity check.
+	if(tag_count>1000) return 0; // Sanity check.
 
 	for(i=0;i<tag_count;i++) {
 		tag_pos = ifd+2+i*12;
-		if(tag_pos+12 > e->d_len) return; // Avoid overruns.
+		if(tag_pos+12 > e->d_len) return 0; // Avoid overruns.
 		tag_id = get_exif_ui16(e, tag_pos);
 
+		if(ifd_num==1) {
+			switch(tag_id) {
+			case 513: // 513 = JPEGInterchangeFormat
+				if(get_exif_tag_int_value(e,tag_pos,&v)) {
+					e->thumb_pos = v;
+				}
+				break;
+
+			case 514: // 514 = JPEGInterchangeFormatLength
+				if(get_exif_tag_int_value(e,tag_pos,&v)) {
+					e->thumb_len = v;
+				}
+				break;
+			}
+			continue;
+		}
+
 		switch(tag_id) {
 		case 274: // 274 = Orientation
 			if(get_exif_tag_int_value(e,tag_pos,&v)) {
@@ -173,6 +204,8 @@ static void iwjpeg_scan_exif_ifd(struct iwjpegrcontext *rctx,
 			break;
 		}
 	}
+
+	return get_exif_ui32(e, ifd+2+tag_count*12);
 }
 
 static void iwjpeg_scan_exif(struct iwjpegrcontext *rctx,
@@ -191,7 +224,16 @@ static void iwjpeg_scan_exif(struct iwjpegrcontext *rctx,
 
 	ifd = get_exif_ui32(&e, 4);
 
-	iwjpeg_scan_exif_ifd(rctx,&e,ifd);
+	ifd = iwjpeg_scan_exif_ifd(rctx,&e,ifd,0);
+	if(ifd) {
+		iwjpeg_scan_exif_ifd(rctx,&e,ifd,1);
+		if(e.thumb_pos>0 && e.thumb_len>0 && e.thumb_pos<d_len &&
+			e.thumb_len<=d_len-e.thumb_pos)
+		{
+			rctx->exif_thumb = &d[e.thumb_pos];
+			rctx->exif_thumb_len = e.thumb_len;
+		}
+	}
 }
 
 // Look at the saved JPEG markers.
@@ -287,6 +329,18 @@ static void handle_exif_density(struct iwjpegrcontext *rctx, struct iw_image *im
 	}
 }
 
+// Returns the IW_REORIENT_* code corresponding to the Exif orientation.
+static unsigned int iwjpeg_get_orient_transform(struct iwjpegrcontext *rctx)
+{
+	static const unsigned int exif_orient_to_transform[9] =
+	   { 0,0, 1,3,2,4,5,7,6 };
+
+	if(rctx->exif_orientation>=2 && rctx->exif_orientation<=8) {
+		return exif_orient_to_transform[rctx->exif_orientation];
+	}
+	return IW_REORIENT_NOCHANGE;
+}
+
 static void my_init_source_fn(j_decompress_ptr cinfo)
 {
 	struct iwjpegrcontext *rctx = (struct iwjpegrcontext*)cinfo->src;
@@ -392,7 +446,155 @@ static void convert_cmyk_to_rbg(struct iw_context *ctx, const JSAMPLE *src,
 	}
 }
 
-IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
+// Decide whether to have libjpeg decode only the luma channel of a color
+// image, because it is going to be converted to grayscale anyway. This skips
+// the chroma decoding, upsampling, and color conversion.
+// The luma channel is not quite the same as what IW would compute from the
+// decoded RGB samples, even with "-gsf c -nogamma", so this is only done if
+// the caller says that it is good enough.
+static int iwjpeg_want_gray_decode(struct iw_context *ctx,
+	struct jpeg_decompress_struct *cinfo)
+{
+	const char *optv;
+
+	if(cinfo->jpeg_color_space!=JCS_YCbCr) return 0;
+	if(!iw_get_value(ctx,IW_VAL_CVT_TO_GRAYSCALE)) return 0;
+
+	optv = iw_get_option(ctx, "jpeg:fastgray");
+	if(optv && iw_parse_int(optv)) return 1;
+	return 0;
+}
+
+// Apply the Exif orientation, if any, to the image that was read.
+static void iwjpeg_handle_orientation(struct iw_context *ctx, struct iwjpegrcontext *rctx)
+{
+	if(iwjpeg_get_orient_transform(rctx)!=IW_REORIENT_NOCHANGE) {
+		// An Exif marker indicated an unusual image orientation.
+
+		if(rctx->is_jfif) {
+			// The presence of a JFIF marker implies a particular orientation.
+			// If there's also an Exif marker that says something different,
+			// I'm not sure what we're supposed to do.
+			iw_warning(ctx,"JPEG image has an ambiguous orientation");
+		}
+		iw_reorient_image(ctx,iwjpeg_get_orient_transform(rctx));
+	}
+}
+
+// Find the dimensions of the (thumbnail) JPEG image in d, by looking for
+// its SOF marker.
+static int iwjpeg_get_thumbnail_size(const iw_byte *d, size_t d_len,
+	unsigned int *pw, unsigned int *ph)
+{
+	size_t pos;
+	unsigned int marker;
+
+	if(d_len<4 || d[0]!=0xff || d[1]!=0xd8) return 0;
+	// If it doesn't end with an EOI marker, it is probably truncated, and it's
+	// better to use the main image than to fail.
+	if(d[d_len-2]!=0xff || d[d_len-1]!=0xd9) return 0;
+	pos = 2;
+
+	while(pos+4 <= d_len) {
+		if(d[pos]!=0xff) return 0;
+		marker = d[pos+1];
+		if(marker==0xff) { // Fill byte
+			pos++;
+			continue;
+		}
+		if(marker>=0xc0 && marker<=0xcf && marker!=0xc4 && marker!=0xc8 &&
+			marker!=0xcc)
+		{
+			if(pos+9 > d_len) return 0;
+			*ph = iw_get_ui16be(&d[pos+5]);
+			*pw = iw_get_ui16be(&d[pos+7]);
+			return (*pw>0 && *ph>0);
+		}
+		if(marker==0xd9 || marker==0xda) return 0;
+		pos += 2 + iw_get_ui16be(&d[pos+2]);
+	}
+	return 0;
+}
+
+// Decide whether to decode the Exif thumbnail instead of the main image.
+// The "jpeg:thumbnail" option is the size of the box that the caller will
+// fit the image into. The thumbnail is used if it has the same shape as the
+// main image, and is large enough that it won't have to be enlarged.
+static int iwjpeg_want_thumbnail(struct iw_context *ctx, struct iwjpegrcontext *rctx,
+	struct jpeg_decompress_struct *cinfo)
+{
+	const char *optv;
+	double box[2];
+	unsigned int tw, th; // Thumbnail size
+	unsigned int ow, oh; // Thumbnail size, after orientation
+	unsigned int w, h;
+	int x, y, cw, ch;
+	double diff;
+
+	optv = iw_get_option(ctx, "jpeg:thumbnail");
+	if(!optv) return 0;
+	if(!rctx->exif_thumb) return 0;
+
+	w = (unsigned int)cinfo->image_width;
+	h = (unsigned int)cinfo->image_height;
+
+	// Crop coordinates refer to the main image.
+	if(iw_get_input_crop(ctx,(int)w,(int)h,&x,&y,&cw,&ch)) return 0;
+
+	box[0] = 0.0;
+	box[1] = 0.0;
+	iw_parse_number_list(optv, 2, box);
+	if(box[0]<1.0 && box[1]<1.0) return 0;
+
+	if(!iwjpeg_get_thumbnail_size(rctx->exif_thumb,rctx->exif_thumb_len,&tw,&th))
+		return 0;
+	if(tw>=w || th>=h) return 0;
+
+	// Allow for the thumbnail's dimensions to be rounded off by one pixel.
+	// Thumbnails with a different shape are probably letterboxed.
+	diff = fabs((double)tw*(double)h - (double)th*(double)w);
+	if(diff > (double)(w>h ? w : h)) return 0;
+
+	ow = tw;
+	oh = th;
+	if(iwjpeg_get_orient_transform(rctx) & 0x04) {
+		// The orientation transform includes a transpose.
+		ow = th;
+		oh = tw;
+	}
+
+	if(box[0]>=1.0 && (double)ow>=box[0]) return 1;
+	if(box[1]>=1.0 && (double)oh>=box[1]) return 1;
+	return 0;
+}
+
+static int iwjpeg_read(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	int is_thumbnail);
+
+// Read the Exif thumbnail image, as the input image.
+// Returns 0 if the thumbnail is unusable, in which case the main image should
+// be read instead. Any error that reading it caused is cleared.
+static int iwjpeg_read_thumbnail(struct iw_context *ctx, struct iwjpegrcontext *rctx)
+{
+	struct iw_iodescr memdescr;
+	int had_error;
+	int retval;
+
+	had_error = iw_get_errorflag(ctx);
+	if(!iw_open_mem_reader(ctx,&memdescr,rctx->exif_thumb,rctx->exif_thumb_len))
+		return 0;
+	iw_trace_begin(ctx,"jpeg_read_thumbnail",-1);
+	retval = iwjpeg_read(ctx,&memdescr,1);
+	iw_trace_end(ctx,"jpeg_read_thumbnail",-1);
+	(*memdescr.close_fn)(ctx,&memdescr);
+	if(!retval && !had_error) {
+		iw_clear_error(ctx);
+	}
+	return retval;
+}
+
+static int iwjpeg_read(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	int is_thumbnail)
 {
 	int retval=0;
 	struct jpeg_decompress_struct cinfo;
@@ -406,6 +608,10 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 	struct iwjpegrcontext rctx;
 	JSAMPLE *tmprow = NULL;
 	int cmyk_flag = 0;
+	int gray_decode = 0;
+	int use_crop = 0;
+	int crop_x=0, crop_y=0, crop_w=0, crop_h=0;
+	JDIMENSION full_width, full_height;
 	int ret;
 
 	iw_zeromem(&img,sizeof(struct iw_image));
@@ -466,6 +672,21 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 
 	iwjpeg_read_saved_markers(&rctx,&cinfo);
 
+	if(!is_thumbnail && iwjpeg_want_thumbnail(ctx,&rctx,&cinfo)) {
+		// The thumbnail is stored in the same orientation as the main image.
+		// If it can't be read, fall back to the main image.
+		if(iwjpeg_read_thumbnail(ctx,&rctx)) {
+			iwjpeg_handle_orientation(ctx,&rctx);
+			retval=1;
+			goto done;
+		}
+	}
+
+	if(iwjpeg_want_gray_decode(ctx,&cinfo)) {
+		cinfo.out_color_space = JCS_GRAYSCALE;
+		gray_decode = 1;
+	}
+
 	jpeg_start_decompress(&cinfo);
 
 	colorspace=cinfo.out_color_space;
@@ -478,7 +699,9 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 
 	if(colorspace==JCS_GRAYSCALE && numchannels==1) {
 		img.imgtype = IW_IMGTYPE_GRAY;
-		img.native_grayscale = 1;
+		// If we asked libjpeg for grayscale, the image is still a color image
+		// as far as the caller is concerned.
+		if(!gray_decode) img.native_grayscale = 1;
 	}
 	else if((colorspace==JCS_RGB) && numchannels==3) {
 		img.imgtype = IW_IMGTYPE_RGB;
@@ -492,12 +715,48 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 		goto done;
 	}
 
-	img.width = cinfo.output_width;
-	img.height = cinfo.output_height;
-	if(!iw_check_image_dimensions(ctx,img.width,img.height)) {
+	full_width = cinfo.output_width;
+	full_height = cinfo.output_height;
+	if(!iw_check_image_dimensions(ctx,(int)full_width,(int)full_height)) {
 		goto done;
 	}
 
+	img.width = (int)full_width;
+	img.height = (int)full_height;
+
+#if IWJPEG_SUPPORT_PARTIAL_DECODE
+	// If the caller only wants part of the image, skip the rows and columns
+	// we don't need. The crop coordinates refer to the image before any Exif
+	// orientation is applied, so don't try this if there is one.
+	if(iwjpeg_get_orient_transform(&rctx)==IW_REORIENT_NOCHANGE &&
+		iw_get_input_crop(ctx,(int)full_width,(int)full_height,&crop_x,&crop_y,&crop_w,&crop_h))
+	{
+		JDIMENSION xoffset, xwidth;
+		int margin;
+
+		use_crop = 1;
+
+		// Include an extra iMCU on each side, so that the columns we need
+		// are upsampled the same way as they would be in the full image.
+		// libjpeg may widen the range further, to align it to an iMCU.
+		margin = cinfo.max_h_samp_factor * DCTSIZE;
+		xoffset = (crop_x>margin) ? (JDIMENSION)(crop_x-margin) : 0;
+		xwidth = (JDIMENSION)(crop_x+crop_w+margin) - xoffset;
+		if(xoffset+xwidth > full_width) xwidth = full_width - xoffset;
+		jpeg_crop_scanline(&cinfo, &xoffset, &xwidth);
+		crop_x = (int)xoffset;
+		img.width = (int)cinfo.output_width;
+		img.height = crop_h;
+
+		if(crop_y>0) {
+			if(jpeg_skip_scanlines(&cinfo, (JDIMENSION)crop_y) != (JDIMENSION)crop_y) {
+				iw_set_error(ctx,"Error reading JPEG file");
+				goto done;
+			}
+		}
+	}
+#endif
+
 	img.bit_depth = 8;
 	img.bpr = iw_calc_bytesperrow(img.width,img.bit_depth*numchannels);
 
@@ -511,9 +770,16 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 		if(!tmprow) goto done;
 	}
 
+	iw_trace_begin(ctx,"jpeg_read_scanlines",-1);
 	while(cinfo.output_scanline < cinfo.output_height) {
 		rownum=cinfo.output_scanline;
-		jsamprow = &img.pixels[img.bpr * rownum];
+		if(use_crop) {
+			if((int)rownum >= crop_y+crop_h) break;
+			jsamprow = &img.pixels[img.bpr * (rownum-crop_y)];
+		}
+		else {
+			jsamprow = &img.pixels[img.bpr * rownum];
+		}
 		if(cmyk_flag) {
 			// read into tmprow, then convert and copy to img.pixels
 			jpeg_read_scanlines(&cinfo, &tmprow, 1);
@@ -524,31 +790,35 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 			jpeg_read_scanlines(&cinfo, &jsamprow, 1);
 		}
 		if(cinfo.output_scanline<=rownum) {
+			iw_trace_end(ctx,"jpeg_read_scanlines",-1);
 			iw_set_error(ctx,"Error reading JPEG file");
 			goto done;
 		}
 	}
-	jpeg_finish_decompress(&cinfo);
+	iw_trace_end(ctx,"jpeg_read_scanlines",-1);
+	if(cinfo.output_scanline < cinfo.output_height) {
+		// We don't need the rest of the image.
+		jpeg_abort_decompress(&cinfo);
+	}
+	else {
+		jpeg_finish_decompress(&cinfo);
+	}
+
+	// libjpeg only warns about corrupt or truncated data. That's good enough
+	// for the main image, but a damaged thumbnail shouldn't be used.
+	if(is_thumbnail && jerr.pub.num_warnings>0) goto done;
 
 	handle_exif_density(&rctx, &img);
 
 	iw_set_input_image(ctx, &img);
 	// The contents of img no longer belong to us.
 	img.pixels = NULL;
+	if(use_crop) {
+		iw_set_input_image_offset(ctx,crop_x,crop_y,(int)full_width,(int)full_height);
+	}
 
-	if(rctx.exif_orientation>=2 && rctx.exif_orientation<=8) {
-		static const unsigned int exif_orient_to_transform[9] =
-		   { 0,0, 1,3,2,4,5,7,6 };
-
-		// An Exif marker indicated an unusual image orientation.
-
-		if(rctx.is_jfif) {
-			// The presence of a JFIF marker implies a particular orientation.
-			// If there's also an Exif marker that says something different,
-			// I'm not sure what we're supposed to do.
-			iw_warning(ctx,"JPEG image has an ambiguous orientation");
-		}
-		iw_reorient_image(ctx,exif_orient_to_transform[rctx.exif_orientation]);
+	if(!is_thumbnail) {
+		iwjpeg_handle_orientation(ctx,&rctx);
 	}
 
 	retval=1;
@@ -561,6 +831,103 @@ done:
 	return retval;
 }
 
+IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
+{
+	return iwjpeg_read(ctx,iodescr,0);
+}
+
+IW_IMPL(int) iw_probe_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info)
+{
+	int retval=0;
+	struct jpeg_decompress_struct cinfo;
+	struct my_error_mgr jerr;
+	int cinfo_valid=0;
+	struct iwjpegrcontext rctx;
+	int ret;
+
+	iw_zeromem(info,sizeof(struct iw_image_info));
+	iw_zeromem(&cinfo,sizeof(struct jpeg_decompress_struct));
+	iw_zeromem(&jerr,sizeof(struct my_error_mgr));
+	iw_zeromem(&rctx,sizeof(struct iwjpegrcontext));
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_error_exit;
+	jerr.pub.output_message = my_output_message;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		char buffer[JMSG_LENGTH_MAX];
+
+		(*cinfo.err->format_message) ((j_common_ptr)&cinfo, buffer);
+
+		iw_set_errorf(ctx,"libjpeg reports read error: %s",buffer);
+
+		goto done;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	cinfo_valid=1;
+
+	rctx.pub.init_source = my_init_source_fn;
+	rctx.pub.fill_input_buffer = my_fill_input_buffer_fn;
+	rctx.pub.skip_input_data = my_skip_input_data_fn;
+	rctx.pub.resync_to_restart = jpeg_resync_to_restart;
+	rctx.pub.term_source = my_term_source_fn;
+	rctx.ctx = ctx;
+	rctx.iodescr = iodescr;
+	// We only need the header, so use a small buffer to avoid reading much
+	// more of the file than necessary.
+	rctx.buffer_len = 4096;
+	rctx.buffer = iw_malloc(ctx, rctx.buffer_len);
+	if(!rctx.buffer) goto done;
+	cinfo.src = (struct jpeg_source_mgr*)&rctx;
+
+	jpeg_save_markers(&cinfo, 0xe1, 65535);
+
+	ret = jpeg_read_header(&cinfo, TRUE);
+	if(ret != JPEG_HEADER_OK) {
+		iw_set_error(ctx, "Unexpected libjpeg error");
+		goto done;
+	}
+	jpeg_calc_output_dimensions(&cinfo);
+
+	iwjpeg_read_saved_markers(&rctx,&cinfo);
+
+	// See iw_read_jpeg_file().
+	if(cinfo.out_color_space==JCS_GRAYSCALE && cinfo.output_components==1) {
+		info->imgtype = IW_IMGTYPE_GRAY;
+		info->native_grayscale = 1;
+	}
+	else if((cinfo.out_color_space==JCS_RGB && cinfo.output_components==3) ||
+		(cinfo.out_color_space==JCS_CMYK && cinfo.output_components==4))
+	{
+		info->imgtype = IW_IMGTYPE_RGB;
+	}
+	else {
+		iw_set_error(ctx,"Unsupported type of JPEG");
+		goto done;
+	}
+
+	info->width = (int)cinfo.output_width;
+	info->height = (int)cinfo.output_height;
+	info->bit_depth = 8;
+	info->sampletype = IW_SAMPLETYPE_UINT;
+	info->page_count = 1;
+	info->orient_transform = iwjpeg_get_orient_transform(&rctx);
+	if(info->orient_transform & 0x04) {
+		// The orientation transform includes a transpose.
+		info->width = (int)cinfo.output_height;
+		info->height = (int)cinfo.output_width;
+	}
+
+	retval=1;
+
+done:
+	if(cinfo_valid) jpeg_destroy_decompress(&cinfo);
+	if(rctx.buffer) iw_free(ctx,rctx.buffer);
+	return retval;
+}
+
 ////////////////////////////////////
 
 struct iwjpegwcontext {
@@ -634,88 +1001,42 @@ static void my_term_destination_fn(j_compress_ptr cinfo)
 	}
 }
 
-IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iodescr)
+// Encoding profiles, selected with the "jpeg:profile" option. They set the
+// defaults for the "jpeg:dct" and "jpeg:optimize" options.
+#define IWJPEG_PROFILE_DEFAULT  0
+#define IWJPEG_PROFILE_FASTEST  1 // Fast integer DCT
+#define IWJPEG_PROFILE_BALANCED 2 // Optimized Huffman tables
+// Optimized Huffman tables, and whichever of baseline and progressive mode
+// makes the smaller file.
+#define IWJPEG_PROFILE_SMALLEST 3
+
+static int iwjpeg_get_profile(struct iw_context *ctx)
+{
+	const char *optv;
+
+	optv = iw_get_option(ctx, "jpeg:profile");
+	if(!optv) return IWJPEG_PROFILE_DEFAULT;
+	if(!strcmp(optv,"fastest")) return IWJPEG_PROFILE_FASTEST;
+	if(!strcmp(optv,"balanced")) return IWJPEG_PROFILE_BALANCED;
+	if(!strcmp(optv,"smallest")) return IWJPEG_PROFILE_SMALLEST;
+	iw_warningf(ctx,"Unknown JPEG profile \"%s\"",optv);
+	return IWJPEG_PROFILE_DEFAULT;
+}
+
+// Set the compression parameters, other than the image dimensions and input
+// color space, from the options in ctx.
+static void iwjpeg_set_params(struct iw_context *ctx, struct jpeg_compress_struct *cinfo,
+	const struct iw_image *img, J_COLOR_SPACE in_colortype, int jpeg_cmpts,
+	int profile, int progressive)
 {
-	int retval=0;
-	struct jpeg_compress_struct cinfo;
-	struct my_error_mgr jerr;
-	J_COLOR_SPACE in_colortype; // Color type of the data we give to libjpeg
-	int jpeg_cmpts;
-	int compress_created = 0;
-	int compress_started = 0;
-	JSAMPROW *row_pointers = NULL;
-	int is_grayscale;
-	int j;
-	struct iw_image img;
 	int jpeg_quality;
 	int samp_factor_h, samp_factor_v;
 	int disable_subsampling = 0;
-	struct iwjpegwcontext wctx;
+	int n;
 	const char *optv;
 	int ret;
 
-	iw_zeromem(&cinfo,sizeof(struct jpeg_compress_struct));
-	iw_zeromem(&jerr,sizeof(struct my_error_mgr));
-	iw_zeromem(&wctx,sizeof(struct iwjpegwcontext));
-
-	iw_get_output_image(ctx,&img);
-
-	if(IW_IMGTYPE_HAS_ALPHA(img.imgtype)) {
-		iw_set_error(ctx,"Internal: Transparency not supported with JPEG output");
-		goto done;
-	}
-
-	if(img.bit_depth!=8) {
-		iw_set_errorf(ctx,"Internal: Precision %d not supported with JPEG output",img.bit_depth);
-		goto done;
-	}
-
-	is_grayscale = IW_IMGTYPE_IS_GRAY(img.imgtype);
-
-	if(is_grayscale) {
-		in_colortype=JCS_GRAYSCALE;
-		jpeg_cmpts=1;
-	}
-	else {
-		in_colortype=JCS_RGB;
-		jpeg_cmpts=3;
-	}
-
-	cinfo.err = jpeg_std_error(&jerr.pub);
-	jerr.pub.error_exit = my_error_exit;
-
-	if (setjmp(jerr.setjmp_buffer)) {
-		char buffer[JMSG_LENGTH_MAX];
-
-		(*cinfo.err->format_message) ((j_common_ptr)&cinfo, buffer);
-
-		iw_set_errorf(ctx,"libjpeg reports write error: %s",buffer);
-
-		goto done;
-	}
-
-	jpeg_create_compress(&cinfo);
-	compress_created=1;
-
-	// Set up our custom destination manager.
-	wctx.pub.init_destination = my_init_destination_fn;
-	wctx.pub.empty_output_buffer = my_empty_output_buffer_fn;
-	wctx.pub.term_destination = my_term_destination_fn;
-	wctx.ctx = ctx;
-	wctx.iodescr = iodescr;
-	wctx.buffer_len = 32768;
-	wctx.buffer = iw_malloc(ctx,wctx.buffer_len);
-	if(!wctx.buffer) goto done;
-	// Our wctx is organized so it can double as a
-	// 'struct jpeg_destination_mgr'.
-	cinfo.dest = (struct jpeg_destination_mgr*)&wctx;
-
-	cinfo.image_width = img.width;
-	cinfo.image_height = img.height;
-	cinfo.input_components = jpeg_cmpts;
-	cinfo.in_color_space = in_colortype;
-
-	jpeg_set_defaults(&cinfo);
+	jpeg_set_defaults(cinfo);
 
 	optv = iw_get_option(ctx, "jpeg:block");
 	if(optv) {
@@ -724,7 +1045,7 @@ IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iode
 		// Note: This might not work if DCT_SCALING_SUPPORTED was not defined when
 		// libjpeg was compiled, but that symbol is not normally exposed to
 		// applications.
-		cinfo.block_size = iw_parse_int(optv);
+		cinfo->block_size = iw_parse_int(optv);
 #else
 		iw_warning(ctx, "Setting block size is not supported by this version of libjpeg");
 #endif
@@ -732,26 +1053,26 @@ IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iode
 
 	optv = iw_get_option(ctx, "jpeg:arith");
 	if(optv)
-		cinfo.arith_code = iw_parse_int(optv) ? TRUE : FALSE;
+		cinfo->arith_code = iw_parse_int(optv) ? TRUE : FALSE;
 	else
-		cinfo.arith_code = FALSE;
+		cinfo->arith_code = FALSE;
 
 	optv = iw_get_option(ctx, "jpeg:colortype");
 	if(optv) {
 		if(!strcmp(optv, "rgb")) {
 			if(in_colortype==JCS_RGB) {
-				jpeg_set_colorspace(&cinfo,JCS_RGB);
+				jpeg_set_colorspace(cinfo,JCS_RGB);
 				disable_subsampling = 1;
 			}
 		}
 		else if(!strcmp(optv, "rgb1")) {
 			if(in_colortype==JCS_RGB) {
 #if JPEG_LIB_VERSION_MAJOR >= 9
-				cinfo.color_transform = JCT_SUBTRACT_GREEN;
+				cinfo->color_transform = JCT_SUBTRACT_GREEN;
 #else
 				iw_warning(ctx, "Color type rgb1 is not supported by this version of libjpeg");
 #endif
-				jpeg_set_colorspace(&cinfo,JCS_RGB);
+				jpeg_set_colorspace(cinfo,JCS_RGB);
 				disable_subsampling = 1;
 			}
 		}
@@ -761,13 +1082,13 @@ IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iode
 	if(optv && iw_parse_int(optv)) {
 #if (JPEG_LIB_VERSION_MAJOR>9 || \
 	(JPEG_LIB_VERSION_MAJOR==9 && JPEG_LIB_VERSION_MINOR>=1))
-		jpeg_set_colorspace(&cinfo, JCS_BG_YCC);
+		jpeg_set_colorspace(cinfo, JCS_BG_YCC);
 #else
 		iw_warning(ctx, "Big gamut YCC is not supported by this version of libjpeg");
 #endif
 	}
 
-	iwjpg_set_density(ctx,&cinfo,&img);
+	iwjpg_set_density(ctx,cinfo,img);
 
 	optv = iw_get_option(ctx, "jpeg:quality");
 	if(optv)
@@ -776,7 +1097,7 @@ IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iode
 		jpeg_quality = 0;
 
 	if(jpeg_quality>0) {
-		jpeg_set_quality(&cinfo,jpeg_quality,0);
+		jpeg_set_quality(cinfo,jpeg_quality,0);
 	}
 
 	if(jpeg_cmpts>1 && !disable_subsampling) {
@@ -810,29 +1131,415 @@ IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iode
 
 		if(samp_factor_h>0) {
 			if(samp_factor_h>4) samp_factor_h=4;
-			cinfo.comp_info[0].h_samp_factor = samp_factor_h;
+			cinfo->comp_info[0].h_samp_factor = samp_factor_h;
 		}
 		if(samp_factor_v>0) {
 			if(samp_factor_v>4) samp_factor_v=4;
-			cinfo.comp_info[0].v_samp_factor = samp_factor_v;
+			cinfo->comp_info[0].v_samp_factor = samp_factor_v;
 		}
 	}
 
-	if(iw_get_value(ctx,IW_VAL_OUTPUT_INTERLACED)) {
-		jpeg_simple_progression(&cinfo);
+	switch(profile) {
+	case IWJPEG_PROFILE_FASTEST:
+		cinfo->dct_method = JDCT_IFAST;
+		break;
+	case IWJPEG_PROFILE_BALANCED:
+	case IWJPEG_PROFILE_SMALLEST:
+		cinfo->optimize_coding = TRUE;
+		break;
+	}
+
+	optv = iw_get_option(ctx, "jpeg:dct");
+	if(optv) {
+		if(!strcmp(optv, "islow")) cinfo->dct_method = JDCT_ISLOW;
+		else if(!strcmp(optv, "ifast")) cinfo->dct_method = JDCT_IFAST;
+		else if(!strcmp(optv, "float")) cinfo->dct_method = JDCT_FLOAT;
+		else iw_warningf(ctx,"Unknown DCT method \"%s\"",optv);
 	}
 
-	row_pointers = (JSAMPROW*)iw_malloc(ctx, img.height * sizeof(JSAMPROW));
-	if(!row_pointers) goto done;
+	optv = iw_get_option(ctx, "jpeg:optimize");
+	if(optv) {
+		cinfo->optimize_coding = iw_parse_int(optv) ? TRUE : FALSE;
+	}
 
-	for(j=0;j<img.height;j++) {
-		row_pointers[j] = &img.pixels[j*img.bpr];
+	optv = iw_get_option(ctx, "jpeg:smoothing");
+	if(optv) {
+		n = iw_parse_int(optv);
+		if(n<0) n=0;
+		if(n>100) n=100;
+		cinfo->smoothing_factor = n;
+	}
+
+	if(progressive) {
+		jpeg_simple_progression(cinfo);
+	}
+}
+
+// Parallel encoding: The image is split into horizontal stripes, each a
+// whole number of MCU rows high, which are compressed at the same time by
+// separate libjpeg objects. The restart interval is set to the size of a
+// stripe, so the stripes can be joined together with restart markers, and the
+// result is an ordinary baseline JPEG file.
+// This only works with the standard Huffman tables, and without progressive
+// mode or smoothing.
+// The stripes are always the same height, so that the file doesn't depend on
+// the number of threads.
+
+// Smaller images aren't worth the trouble.
+#define IWJPEG_MIN_PARALLEL_SIZE 1048576
+
+// The height of a stripe, in pixels. Rounded down to a whole number of MCU
+// rows.
+#define IWJPEG_STRIPE_HEIGHT 256
+
+struct iwjpeg_stripes_ctx;
+
+// A destination manager that writes to a memory buffer, which grows as
+// needed. It is used from other threads, so memory is only allocated while
+// holding the stripes context's lock.
+struct iwjpeg_memdest {
+	struct jpeg_destination_mgr pub; // This field must be first.
+	struct iwjpeg_stripes_ctx *sctx;
+	JOCTET *buffer;
+	size_t buffer_len;
+	size_t used;
+};
+
+struct iwjpeg_stripe {
+	struct jpeg_compress_struct cinfo;
+	struct my_error_mgr jerr;
+	struct iwjpeg_memdest dest;
+	int created;
+	int y_start;
+	int height;
+	int ok;
+};
+
+struct iwjpeg_stripes_ctx {
+	struct iw_context *ctx;
+	struct iw_mutex *lock; // Protects ctx's memory allocator.
+	struct iwjpeg_stripe *stripes;
+	int num_stripes;
+	JSAMPROW *row_pointers;
+};
+
+static void my_memdest_init_fn(j_compress_ptr cinfo)
+{
+	struct iwjpeg_memdest *dest = (struct iwjpeg_memdest*)cinfo->dest;
+
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = dest->buffer_len;
+}
+
+// The buffer is full. Double its size.
+static boolean my_memdest_empty_fn(j_compress_ptr cinfo)
+{
+	struct iwjpeg_memdest *dest = (struct iwjpeg_memdest*)cinfo->dest;
+	size_t new_len;
+
+	new_len = dest->buffer_len*2;
+	iw_lock_mutex(dest->sctx->lock);
+	dest->buffer = iw_realloc_ex(dest->sctx->ctx,IW_MALLOCFLAG_NOERRORS,
+		dest->buffer,dest->buffer_len,new_len);
+	iw_unlock_mutex(dest->sctx->lock);
+	if(!dest->buffer) {
+		dest->buffer_len = 0;
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	}
+
+	dest->pub.next_output_byte = &dest->buffer[dest->buffer_len];
+	dest->pub.free_in_buffer = new_len - dest->buffer_len;
+	dest->buffer_len = new_len;
+	return TRUE;
+}
+
+static void my_memdest_term_fn(j_compress_ptr cinfo)
+{
+	struct iwjpeg_memdest *dest = (struct iwjpeg_memdest*)cinfo->dest;
+
+	dest->used = dest->buffer_len - dest->pub.free_in_buffer;
+}
+
+static void iwjpeg_stripe_job(void *userdata, int job)
+{
+	struct iwjpeg_stripes_ctx *sctx = (struct iwjpeg_stripes_ctx*)userdata;
+	struct iwjpeg_stripe *st = &sctx->stripes[job];
+
+	if(setjmp(st->jerr.setjmp_buffer)) {
+		jpeg_abort_compress(&st->cinfo);
+		return;
+	}
+
+	jpeg_start_compress(&st->cinfo, TRUE);
+	jpeg_write_scanlines(&st->cinfo, &sctx->row_pointers[st->y_start], st->height);
+	jpeg_finish_compress(&st->cinfo);
+	st->ok = 1;
+}
+
+// Find the entropy-coded data in a JPEG stream written by libjpeg, which runs
+// from the end of the SOS segment to the EOI marker. Also finds the SOF
+// segment. Returns 0 if the stream isn't as expected.
+static int iwjpeg_find_scan_data(const JOCTET *d, size_t len,
+	size_t *pscan_start, size_t *psof_pos)
+{
+	size_t pos = 2;
+	size_t seglen;
+	int marker;
+
+	*psof_pos = 0;
+	if(len<4 || d[0]!=0xff || d[1]!=0xd8) return 0;
+	if(d[len-2]!=0xff || d[len-1]!=0xd9) return 0;
+
+	while(pos+4 <= len) {
+		if(d[pos]!=0xff) return 0;
+		marker = d[pos+1];
+		seglen = ((size_t)d[pos+2]<<8) | d[pos+3];
+		if(marker==0xc0 || marker==0xc1) {
+			*psof_pos = pos;
+		}
+		if(marker==0xda) {
+			*pscan_start = pos+2+seglen;
+			return (*psof_pos>0 && *pscan_start<=len-2);
+		}
+		pos += 2+seglen;
+	}
+	return 0;
+}
+
+// Decide whether to use iwjpeg_write_parallel(). This changes the file (it
+// adds restart markers), so it is only done if the caller asked for it,
+// either with the "jpeg:stripes" option, or by setting the number of threads
+// to 2 or more. Returns the number of threads to use, or 0 if we shouldn't.
+static int iwjpeg_num_threads_to_use(struct iw_context *ctx,
+	struct jpeg_compress_struct *cinfo, const struct iw_image *img)
+{
+	int num_threads;
+	const char *optv;
+
+	num_threads = iw_get_value(ctx,IW_VAL_NUM_THREADS);
+	optv = iw_get_option(ctx,"jpeg:stripes");
+	if(optv) {
+		if(!iw_parse_int(optv)) return 0;
+		if(num_threads<1) num_threads = iw_get_num_cpus();
+	}
+	else {
+		if(num_threads<2) return 0;
+	}
+
+	if((size_t)img->height * img->bpr < IWJPEG_MIN_PARALLEL_SIZE) return 0;
+	if(cinfo->arith_code || cinfo->optimize_coding || cinfo->scan_info ||
+		cinfo->smoothing_factor)
+	{
+		return 0;
+	}
+	// These experimental options could change the MCU size, or make every
+	// stripe report the same warning.
+	if(iw_get_option(ctx,"jpeg:block") || iw_get_option(ctx,"jpeg:bgycc")) return 0;
+	optv = iw_get_option(ctx,"jpeg:colortype");
+	if(optv && !strcmp(optv,"rgb1")) return 0;
+	return num_threads;
+}
+
+// Write the whole JPEG file, compressing stripes of the image in parallel.
+// cinfo has been set up for the whole image, but not started.
+// Returns 0 if it couldn't be done, in which case nothing was written.
+static int iwjpeg_write_parallel(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct jpeg_compress_struct *cinfo, const struct iw_image *img,
+	JSAMPROW *row_pointers, J_COLOR_SPACE in_colortype, int jpeg_cmpts, int profile,
+	int num_threads)
+{
+	struct iwjpeg_stripes_ctx sctx;
+	struct iwjpeg_stripe *st;
+	int max_h_samp = 1, max_v_samp = 1;
+	int mcu_w, mcu_h;
+	int mcus_per_row, mcu_rows;
+	int stripe_mcu_rows;
+	unsigned int restart_interval;
+	size_t scan_start, sof_pos;
+	size_t buffer_len;
+	iw_byte marker[2];
+	int i, k;
+	int retval = 0;
+
+	iw_zeromem(&sctx,sizeof(struct iwjpeg_stripes_ctx));
+
+	// Figure out the MCU size. A single-component image is not interleaved,
+	// and its MCU is one block.
+	if(cinfo->num_components>1) {
+		for(i=0;i<cinfo->num_components;i++) {
+			if(cinfo->comp_info[i].h_samp_factor>max_h_samp) max_h_samp = cinfo->comp_info[i].h_samp_factor;
+			if(cinfo->comp_info[i].v_samp_factor>max_v_samp) max_v_samp = cinfo->comp_info[i].v_samp_factor;
+		}
+	}
+	mcu_w = max_h_samp*DCTSIZE;
+	mcu_h = max_v_samp*DCTSIZE;
+	mcus_per_row = (img->width+mcu_w-1)/mcu_w;
+	mcu_rows = (img->height+mcu_h-1)/mcu_h;
+
+	stripe_mcu_rows = IWJPEG_STRIPE_HEIGHT/mcu_h;
+	// The restart interval is a 16-bit number of MCUs.
+	if((size_t)stripe_mcu_rows*mcus_per_row > 65535) {
+		stripe_mcu_rows = 65535/mcus_per_row;
+	}
+	if(stripe_mcu_rows<1) goto done;
+	restart_interval = (unsigned int)(stripe_mcu_rows*mcus_per_row);
+	sctx.num_stripes = (mcu_rows+stripe_mcu_rows-1)/stripe_mcu_rows;
+	if(sctx.num_stripes<2) goto done;
+
+	sctx.ctx = ctx;
+	sctx.row_pointers = row_pointers;
+	sctx.lock = iw_create_mutex(ctx);
+	if(!sctx.lock) goto done;
+	sctx.stripes = iw_malloc_ex(ctx,IW_MALLOCFLAG_ZEROMEM|IW_MALLOCFLAG_NOERRORS,
+		sctx.num_stripes*sizeof(struct iwjpeg_stripe));
+	if(!sctx.stripes) goto done;
+
+	for(k=0;k<sctx.num_stripes;k++) {
+		st = &sctx.stripes[k];
+		st->y_start = k*stripe_mcu_rows*mcu_h;
+		st->height = img->height - st->y_start;
+		if(st->height > stripe_mcu_rows*mcu_h) st->height = stripe_mcu_rows*mcu_h;
+
+		// The compressed stripe will usually be smaller than this. If not, the
+		// buffer will be made bigger.
+		buffer_len = (size_t)st->height*img->bpr/4 + 65536;
+		st->dest.sctx = &sctx;
+		st->dest.buffer = iw_malloc_ex(ctx,IW_MALLOCFLAG_NOERRORS,buffer_len);
+		if(!st->dest.buffer) goto done;
+		st->dest.buffer_len = buffer_len;
+		st->dest.pub.init_destination = my_memdest_init_fn;
+		st->dest.pub.empty_output_buffer = my_memdest_empty_fn;
+		st->dest.pub.term_destination = my_memdest_term_fn;
+
+		st->cinfo.err = jpeg_std_error(&st->jerr.pub);
+		st->jerr.pub.error_exit = my_error_exit;
+		if(setjmp(st->jerr.setjmp_buffer)) {
+			goto done;
+		}
+		jpeg_create_compress(&st->cinfo);
+		st->created = 1;
+		st->cinfo.dest = (struct jpeg_destination_mgr*)&st->dest;
+		st->cinfo.image_width = img->width;
+		st->cinfo.image_height = st->height;
+		st->cinfo.input_components = jpeg_cmpts;
+		st->cinfo.in_color_space = in_colortype;
+		iwjpeg_set_params(ctx,&st->cinfo,img,in_colortype,jpeg_cmpts,profile,0);
+		st->cinfo.restart_interval = restart_interval;
+	}
+
+	iw_trace_begin(ctx,"jpeg_write_stripes",-1);
+	iw_run_parallel(ctx,num_threads,sctx.num_stripes,iwjpeg_stripe_job,(void*)&sctx);
+	iw_trace_end(ctx,"jpeg_write_stripes",-1);
+
+	for(k=0;k<sctx.num_stripes;k++) {
+		st = &sctx.stripes[k];
+		if(!st->ok) goto done;
+		if(!iwjpeg_find_scan_data(st->dest.buffer,st->dest.used,&scan_start,&sof_pos))
+			goto done;
+	}
+
+	// Write the first stripe's headers, with the height changed to that of
+	// the whole image.
+	st = &sctx.stripes[0];
+	iwjpeg_find_scan_data(st->dest.buffer,st->dest.used,&scan_start,&sof_pos);
+	st->dest.buffer[sof_pos+5] = (JOCTET)(img->height>>8);
+	st->dest.buffer[sof_pos+6] = (JOCTET)(img->height&0xff);
+	(*iodescr->write_fn)(ctx,iodescr,st->dest.buffer,scan_start);
+
+	// Write each stripe's compressed data, followed by a restart marker (or,
+	// for the last stripe, the EOI marker).
+	for(k=0;k<sctx.num_stripes;k++) {
+		st = &sctx.stripes[k];
+		iwjpeg_find_scan_data(st->dest.buffer,st->dest.used,&scan_start,&sof_pos);
+		(*iodescr->write_fn)(ctx,iodescr,&st->dest.buffer[scan_start],st->dest.used-2-scan_start);
+		marker[0] = 0xff;
+		marker[1] = (k<sctx.num_stripes-1) ? (iw_byte)(0xd0+(k%8)) : 0xd9;
+		(*iodescr->write_fn)(ctx,iodescr,marker,2);
+	}
+
+	retval = 1;
+
+done:
+	if(sctx.stripes) {
+		for(k=0;k<sctx.num_stripes;k++) {
+			st = &sctx.stripes[k];
+			if(st->created) jpeg_destroy_compress(&st->cinfo);
+			if(st->dest.buffer) iw_free(ctx,st->dest.buffer);
+		}
+		iw_free(ctx,sctx.stripes);
+	}
+	if(sctx.lock) iw_destroy_mutex(ctx,sctx.lock);
+	return retval;
+}
+
+static int iwjpeg_write_main(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const struct iw_image *img, JSAMPROW *row_pointers, J_COLOR_SPACE in_colortype,
+	int jpeg_cmpts, int profile, int progressive)
+{
+	int retval=0;
+	struct jpeg_compress_struct cinfo;
+	struct my_error_mgr jerr;
+	int compress_created = 0;
+	int compress_started = 0;
+	struct iwjpegwcontext wctx;
+	int num_threads;
+
+	iw_zeromem(&cinfo,sizeof(struct jpeg_compress_struct));
+	iw_zeromem(&jerr,sizeof(struct my_error_mgr));
+	iw_zeromem(&wctx,sizeof(struct iwjpegwcontext));
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_error_exit;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		char buffer[JMSG_LENGTH_MAX];
+
+		(*cinfo.err->format_message) ((j_common_ptr)&cinfo, buffer);
+
+		iw_set_errorf(ctx,"libjpeg reports write error: %s",buffer);
+
+		goto done;
+	}
+
+	jpeg_create_compress(&cinfo);
+	compress_created=1;
+
+	// Set up our custom destination manager.
+	wctx.pub.init_destination = my_init_destination_fn;
+	wctx.pub.empty_output_buffer = my_empty_output_buffer_fn;
+	wctx.pub.term_destination = my_term_destination_fn;
+	wctx.ctx = ctx;
+	wctx.iodescr = iodescr;
+	wctx.buffer_len = 32768;
+	wctx.buffer = iw_malloc(ctx,wctx.buffer_len);
+	if(!wctx.buffer) goto done;
+	// Our wctx is organized so it can double as a
+	// 'struct jpeg_destination_mgr'.
+	cinfo.dest = (struct jpeg_destination_mgr*)&wctx;
+
+	cinfo.image_width = img->width;
+	cinfo.image_height = img->height;
+	cinfo.input_components = jpeg_cmpts;
+	cinfo.in_color_space = in_colortype;
+
+	iwjpeg_set_params(ctx,&cinfo,img,in_colortype,jpeg_cmpts,profile,progressive);
+
+	num_threads = iwjpeg_num_threads_to_use(ctx,&cinfo,img);
+	if(num_threads>0) {
+		if(iwjpeg_write_parallel(ctx,iodescr,&cinfo,img,row_pointers,
+			in_colortype,jpeg_cmpts,profile,num_threads))
+		{
+			retval=1;
+			goto done;
+		}
 	}
 
 	jpeg_start_compress(&cinfo, TRUE);
 	compress_started=1;
 
-	jpeg_write_scanlines(&cinfo, row_pointers, img.height);
+	iw_trace_begin(ctx,"jpeg_write_scanlines",-1);
+	jpeg_write_scanlines(&cinfo, row_pointers, img->height);
+	iw_trace_end(ctx,"jpeg_write_scanlines",-1);
 
 	retval=1;
 
@@ -843,13 +1550,105 @@ done:
 	if(compress_created)
 		jpeg_destroy_compress(&cinfo);
 
-	if(row_pointers) iw_free(ctx,row_pointers);
-
 	if(wctx.buffer) iw_free(ctx,wctx.buffer);
 
 	return retval;
 }
 
+// For the "smallest" profile: Compress the image both in baseline and in
+// progressive mode, and write whichever file is smaller.
+static int iwjpeg_write_smallest(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const struct iw_image *img, JSAMPROW *row_pointers, J_COLOR_SPACE in_colortype,
+	int jpeg_cmpts, int profile)
+{
+	struct iw_iodescr memdescr[2];
+	void *mem[2];
+	size_t memsize[2];
+	int k;
+	int retval=0;
+
+	iw_zeromem(memdescr,sizeof(memdescr));
+
+	for(k=0; k<2; k++) {
+		if(!iw_open_mem_writer(ctx,&memdescr[k],0)) goto done;
+		if(!iwjpeg_write_main(ctx,&memdescr[k],img,row_pointers,in_colortype,
+			jpeg_cmpts,profile,k))
+		{
+			goto done;
+		}
+		iw_get_mem_writer_data(ctx,&memdescr[k],0,&mem[k],&memsize[k]);
+	}
+
+	k = (memsize[1]<memsize[0]) ? 1 : 0;
+	(*iodescr->write_fn)(ctx,iodescr,mem[k],memsize[k]);
+	retval=1;
+
+done:
+	for(k=0; k<2; k++) {
+		if(memdescr[k].close_fn) (*memdescr[k].close_fn)(ctx,&memdescr[k]);
+	}
+	return retval;
+}
+
+IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iodescr)
+{
+	int retval=0;
+	J_COLOR_SPACE in_colortype; // Color type of the data we give to libjpeg
+	int jpeg_cmpts;
+	JSAMPROW *row_pointers = NULL;
+	int is_grayscale;
+	int j;
+	struct iw_image img;
+	int profile;
+	int progressive;
+
+	iw_get_output_image(ctx,&img);
+
+	if(IW_IMGTYPE_HAS_ALPHA(img.imgtype)) {
+		iw_set_error(ctx,"Internal: Transparency not supported with JPEG output");
+		goto done;
+	}
+
+	if(img.bit_depth!=8) {
+		iw_set_errorf(ctx,"Internal: Precision %d not supported with JPEG output",img.bit_depth);
+		goto done;
+	}
+
+	is_grayscale = IW_IMGTYPE_IS_GRAY(img.imgtype);
+
+	if(is_grayscale) {
+		in_colortype=JCS_GRAYSCALE;
+		jpeg_cmpts=1;
+	}
+	else {
+		in_colortype=JCS_RGB;
+		jpeg_cmpts=3;
+	}
+
+	row_pointers = (JSAMPROW*)iw_malloc(ctx, img.height * sizeof(JSAMPROW));
+	if(!row_pointers) goto done;
+
+	for(j=0;j<img.height;j++) {
+		row_pointers[j] = &img.pixels[j*img.bpr];
+	}
+
+	profile = iwjpeg_get_profile(ctx);
+	progressive = iw_get_value(ctx,IW_VAL_OUTPUT_INTERLACED) ? 1 : 0;
+
+	if(profile==IWJPEG_PROFILE_SMALLEST && !progressive) {
+		retval = iwjpeg_write_smallest(ctx,iodescr,&img,row_pointers,in_colortype,
+			jpeg_cmpts,profile);
+	}
+	else {
+		retval = iwjpeg_write_main(ctx,iodescr,&img,row_pointers,in_colortype,
+			jpeg_cmpts,profile,progressive);
+	}
+
+done:
+	if(row_pointers) iw_free(ctx,row_pointers);
+	return retval;
+}
+
 IW_IMPL(char*) iw_get_libjpeg_version_string(char *s, int s_len)
 {
 	struct jpeg_error_mgr jerr;
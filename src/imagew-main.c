@@ -126,21 +126,27 @@ static void iw_put_float32(iw_byte *m, iw_float32 s)
 	}
 }
 
+// Returns a pointer to physical row y of the input image.
+static IW_INLINE const iw_byte *get_raw_row(struct iw_context *ctx, int y)
+{
+	return ctx->img1.firstrow + (ptrdiff_t)y*ctx->img1.stride;
+}
+
 static iw_tmpsample get_raw_sample_flt32(struct iw_context *ctx,
 	   int x, int y, int channel)
 {
 	size_t z;
-	z = y*ctx->img1.bpr + (ctx->img1_numchannels_physical*x + channel)*4;
-	return (iw_tmpsample)iw_get_float32(&ctx->img1.pixels[z]);
+	z = (ctx->img1_samples_per_pixel*x + ctx->img1_sample_pos[channel])*4;
+	return (iw_tmpsample)iw_get_float32(&get_raw_row(ctx,y)[z]);
 }
 
 static IW_INLINE unsigned int get_raw_sample_16(struct iw_context *ctx,
 	   int x, int y, int channel)
 {
-	size_t z;
+	const iw_byte *p;
 	unsigned short tmpui16;
-	z = y*ctx->img1.bpr + (ctx->img1_numchannels_physical*x + channel)*2;
-	tmpui16 = ( ((unsigned short)(ctx->img1.pixels[z+0])) <<8) | ctx->img1.pixels[z+1];
+	p = &get_raw_row(ctx,y)[(ctx->img1_samples_per_pixel*x + ctx->img1_sample_pos[channel])*2];
+	tmpui16 = ( ((unsigned short)(p[0])) <<8) | p[1];
 	return tmpui16;
 }
 
@@ -148,7 +154,7 @@ static IW_INLINE unsigned int get_raw_sample_8(struct iw_context *ctx,
 	   int x, int y, int channel)
 {
 	unsigned short tmpui8;
-	tmpui8 = ctx->img1.pixels[y*ctx->img1.bpr + ctx->img1_numchannels_physical*x + channel];
+	tmpui8 = get_raw_row(ctx,y)[ctx->img1_samples_per_pixel*x + ctx->img1_sample_pos[channel]];
 	return tmpui8;
 }
 
@@ -157,7 +163,7 @@ static IW_INLINE unsigned int get_raw_sample_4(struct iw_context *ctx,
 	   int x, int y)
 {
 	unsigned short tmpui8;
-	tmpui8 = ctx->img1.pixels[y*ctx->img1.bpr + x/2];
+	tmpui8 = get_raw_row(ctx,y)[x/2];
 	if(x&0x1)
 		tmpui8 = tmpui8&0x0f;
 	else
@@ -170,7 +176,7 @@ static IW_INLINE unsigned int get_raw_sample_2(struct iw_context *ctx,
 	   int x, int y)
 {
 	unsigned short tmpui8;
-	tmpui8 = ctx->img1.pixels[y*ctx->img1.bpr + x/4];
+	tmpui8 = get_raw_row(ctx,y)[x/4];
 	tmpui8 = ( tmpui8 >> ((3-x%4)*2) ) & 0x03;
 	return tmpui8;
 }
@@ -180,7 +186,7 @@ static IW_INLINE unsigned int get_raw_sample_1(struct iw_context *ctx,
 	   int x, int y)
 {
 	unsigned short tmpui8;
-	tmpui8 = ctx->img1.pixels[y*ctx->img1.bpr + x/8];
+	tmpui8 = get_raw_row(ctx,y)[x/8];
 	if(tmpui8 & (1<<(7-x%8))) return 1;
 	return 0;
 }
@@ -382,6 +388,42 @@ static iw_tmpsample get_sample_cvt_to_linear(struct iw_context *ctx,
 	return cvt_int_sample_to_linear(ctx,v1,csdescr);
 }
 
+// Converts a sample with associated alpha to unassociated alpha.
+static IW_INLINE iw_tmpsample unassoc_sample(iw_tmpsample s, iw_tmpsample alpha)
+{
+	s /= alpha;
+	if(s>1.0) s=1.0; // Invalid, but can happen.
+	return s;
+}
+
+// Like get_sample_cvt_to_linear(), but for an input image whose color
+// samples have associated alpha. The returned sample has associated alpha.
+// alpha is the sample's (raw) opacity.
+static iw_tmpsample get_assoc_sample_cvt_to_linear(struct iw_context *ctx,
+	   int x, int y, int channel, const struct iw_csdescr *csdescr, iw_tmpsample alpha)
+{
+	iw_tmpsample r,g,b;
+	int ch;
+
+	if(csdescr->cstype==IW_CSTYPE_LINEAR) {
+		// The sample is already in the form we need.
+		return get_sample_cvt_to_linear(ctx,x,y,channel,csdescr);
+	}
+
+	if(alpha<=0.0) return 0.0;
+
+	// The color was multiplied by alpha in a nonlinear colorspace. We have to
+	// undo that, convert to linear, then multiply again.
+	ch = ctx->intermed_ci[channel].corresponding_input_channel;
+	if(ctx->intermed_ci[channel].cvt_to_grayscale) {
+		r = x_to_linear_sample(unassoc_sample(get_raw_sample(ctx,x,y,ch+0),alpha),csdescr);
+		g = x_to_linear_sample(unassoc_sample(get_raw_sample(ctx,x,y,ch+1),alpha),csdescr);
+		b = x_to_linear_sample(unassoc_sample(get_raw_sample(ctx,x,y,ch+2),alpha),csdescr);
+		return iw_color_to_grayscale(ctx,r,g,b)*alpha;
+	}
+	return x_to_linear_sample(unassoc_sample(get_raw_sample(ctx,x,y,ch),alpha),csdescr)*alpha;
+}
+
 // s is from 0.0 to 65535.0
 static IW_INLINE void put_raw_sample_16(struct iw_context *ctx, double s,
 	   int x, int y, int channel)
@@ -744,7 +786,8 @@ static void put_sample_convert_from_linear(struct iw_context *ctx, iw_tmpsample
 		}
 	}
 	else if(ditherfamily==IW_DITHERFAMILY_ORDERED) {
-		dd=iw_ordered_dither(ctx->img2_ci[channel].dithersubtype, d_floor/(d_floor+d_ceil),x,y);
+		dd=iw_ordered_dither(ctx->img2_ci[channel].dithersubtype, d_floor/(d_floor+d_ceil),
+			ctx->region_x+x,ctx->region_y+y);
 		s_full = dd ? s_cvt_ceil_full : s_cvt_floor_full;
 	}
 	else if(ditherfamily==IW_DITHERFAMILY_RANDOM) {
@@ -833,6 +876,7 @@ static int iw_process_cols_to_intermediate(struct iw_context *ctx, int channel,
 	iw_tmpsample *inpix_tofree = NULL;
 	iw_tmpsample *outpix_tofree = NULL;
 	int is_alpha_channel;
+	int input_is_assoc;
 	struct iw_resize_settings *rs = NULL;
 	struct iw_channelinfo_intermed *int_ci;
 
@@ -840,41 +884,64 @@ static int iw_process_cols_to_intermediate(struct iw_context *ctx, int channel,
 	iw_tmpsample *out_pix;
 	int num_in_pix;
 	int num_out_pix;
+	int x0, y0;
 
 	int_ci = &ctx->intermed_ci[channel];
 	is_alpha_channel = (int_ci->channeltype==IW_CHANNELTYPE_ALPHA);
+	rs=&ctx->resize_settings[IW_DIMENSION_V];
 
-	num_in_pix = ctx->input_h;
-	inpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_in_pix * sizeof(iw_tmpsample));
+	// Input color samples that already have associated alpha do not need to
+	// be multiplied by alpha.
+	input_is_assoc = ctx->img1.associated_alpha && !is_alpha_channel &&
+		IW_IMGTYPE_HAS_ALPHA(ctx->img1.imgtype) &&
+		(int_ci->need_unassoc_alpha_processing ||
+		(ctx->apply_bkgd && ctx->apply_bkgd_strategy==IW_BKGD_STRATEGY_EARLY));
+
+	// Only the input rows that affect the output region are read.
+	num_in_pix = rs->in_region_size;
+	inpix_tofree = (iw_tmpsample*)iwpvt_scratch_alloc(ctx, 0, num_in_pix, sizeof(iw_tmpsample));
 	if(!inpix_tofree) goto done;
 	in_pix = inpix_tofree;
 
 	num_out_pix = ctx->intermed_canvas_height;
-	outpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_out_pix * sizeof(iw_tmpsample));
+	outpix_tofree = (iw_tmpsample*)iwpvt_scratch_alloc(ctx, 0, num_out_pix, sizeof(iw_tmpsample));
 	if(!outpix_tofree) goto done;
 	out_pix = outpix_tofree;
 
-	rs=&ctx->resize_settings[IW_DIMENSION_V];
-
 	// If the resize context for this dimension already exists, we should be
 	// able to reuse it. Otherwise, create a new one.
 	if(!rs->rrctx) {
 		// TODO: The use of the word "rows" here is misleading, because we are
 		// actually resizing columns.
 		rs->rrctx = iwpvt_resize_rows_init(ctx,rs,int_ci->channeltype,
-			num_in_pix, num_out_pix);
+			ctx->input_h, rs->out_size);
 		if(!rs->rrctx) goto done;
 	}
 
-	for(i=0;i<ctx->input_w;i++) {
+	// The intermediate image only has the columns that the horizontal pass
+	// will need.
+	x0 = ctx->resize_settings[IW_DIMENSION_H].in_region_start;
+	y0 = rs->in_region_start;
+
+	for(i=0;i<ctx->intermed_canvas_width;i++) {
 
 		// Read a column of pixels into ctx->in_pix
-		for(j=0;j<ctx->input_h;j++) {
+		for(j=0;j<num_in_pix;j++) {
+
+			if(input_is_assoc) {
+				tmp_alpha = get_raw_sample(ctx,x0+i,y0+j,ctx->img1_alpha_channel_index);
+				in_pix[j] = get_assoc_sample_cvt_to_linear(ctx,x0+i,y0+j,channel,in_csdescr,tmp_alpha);
+				if(!int_ci->need_unassoc_alpha_processing) {
+					// "Early" background color application.
+					in_pix[j] += (1.0-tmp_alpha)*(int_ci->bkgd_color_lin);
+				}
+				continue;
+			}
 
-			in_pix[j] = get_sample_cvt_to_linear(ctx,i,j,channel,in_csdescr);
+			in_pix[j] = get_sample_cvt_to_linear(ctx,x0+i,y0+j,channel,in_csdescr);
 
 			if(int_ci->need_unassoc_alpha_processing) { // We need opacity information also
-				tmp_alpha = get_raw_sample(ctx,i,j,ctx->img1_alpha_channel_index);
+				tmp_alpha = get_raw_sample(ctx,x0+i,y0+j,ctx->img1_alpha_channel_index);
 
 				// Multiply color amount by opacity
 				in_pix[j] *= tmp_alpha;
@@ -883,7 +950,7 @@ static int iw_process_cols_to_intermediate(struct iw_context *ctx, int channel,
 				// We're doing "Early" background color application.
 				// All intermediate channels will need the background color
 				// applied to them.
-				tmp_alpha = get_raw_sample(ctx,i,j,ctx->img1_alpha_channel_index);
+				tmp_alpha = get_raw_sample(ctx,x0+i,y0+j,ctx->img1_alpha_channel_index);
 				in_pix[j] = (tmp_alpha)*(in_pix[j]) +
 					(1.0-tmp_alpha)*(int_ci->bkgd_color_lin);
 			}
@@ -908,6 +975,11 @@ static int iw_process_cols_to_intermediate(struct iw_context *ctx, int channel,
 		}
 	}
 
+	if(ctx->statsctx.enabled) {
+		ctx->statsctx.stats.taps[IW_DIMENSION_V] +=
+			(iw_uint64)iwpvt_resize_row_taps(rs->rrctx) * ctx->intermed_canvas_width;
+	}
+
 	retval=1;
 
 done:
@@ -917,8 +989,8 @@ done:
 		iwpvt_resize_rows_done(rs->rrctx);
 		rs->rrctx = NULL;
 	}
-	if(inpix_tofree) iw_free(ctx,inpix_tofree);
-	if(outpix_tofree) iw_free(ctx,outpix_tofree);
+	if(inpix_tofree) iwpvt_scratch_free(ctx,inpix_tofree);
+	if(outpix_tofree) iwpvt_scratch_free(ctx,outpix_tofree);
 	return retval;
 }
 
@@ -973,11 +1045,11 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 	is_alpha_channel = (int_ci->channeltype==IW_CHANNELTYPE_ALPHA);
 	bkgd_has_transparency = iw_bkgd_has_transparency(ctx);
 
-	inpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_in_pix * sizeof(iw_tmpsample));
+	inpix_tofree = (iw_tmpsample*)iwpvt_scratch_alloc(ctx, 0, num_in_pix, sizeof(iw_tmpsample));
 	in_pix = inpix_tofree;
 
 	// We need an output buffer.
-	outpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_out_pix * sizeof(iw_tmpsample));
+	outpix_tofree = (iw_tmpsample*)iwpvt_scratch_alloc(ctx, 0, num_out_pix, sizeof(iw_tmpsample));
 	if(!outpix_tofree) goto done;
 	out_pix = outpix_tofree;
 
@@ -1023,7 +1095,7 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 	// able to reuse it. Otherwise, create a new one.
 	if(!rs->rrctx) {
 		rs->rrctx = iwpvt_resize_rows_init(ctx,rs,int_ci->channeltype,
-			num_in_pix, num_out_pix);
+			ctx->input_w, rs->out_size);
 		if(!rs->rrctx) goto done;
 	}
 
@@ -1076,8 +1148,8 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 			tmpsamp = out_pix[i];
 
 			if(ctx->bkgd_checkerboard) {
-				alt_bkgd = (((ctx->bkgd_check_origin[IW_DIMENSION_H]+i)/ctx->bkgd_check_size)%2) !=
-					(((ctx->bkgd_check_origin[IW_DIMENSION_V]+j)/ctx->bkgd_check_size)%2);
+				alt_bkgd = (((ctx->bkgd_check_origin[IW_DIMENSION_H]+ctx->region_x+i)/ctx->bkgd_check_size)%2) !=
+					(((ctx->bkgd_check_origin[IW_DIMENSION_V]+ctx->region_y+j)/ctx->bkgd_check_size)%2);
 			}
 
 			if(bkgd_has_transparency) {
@@ -1135,6 +1207,11 @@ here:
 		;
 	}
 
+	if(ctx->statsctx.enabled) {
+		ctx->statsctx.stats.taps[IW_DIMENSION_H] +=
+			(iw_uint64)iwpvt_resize_row_taps(rs->rrctx) * ctx->intermed_canvas_height;
+	}
+
 	retval=1;
 
 done:
@@ -1144,8 +1221,8 @@ done:
 		iwpvt_resize_rows_done(rs->rrctx);
 		rs->rrctx = NULL;
 	}
-	if(inpix_tofree) iw_free(ctx,inpix_tofree);
-	if(outpix_tofree) iw_free(ctx,outpix_tofree);
+	if(inpix_tofree) iwpvt_scratch_free(ctx,inpix_tofree);
+	if(outpix_tofree) iwpvt_scratch_free(ctx,outpix_tofree);
 
 	return retval;
 }
@@ -1153,15 +1230,22 @@ done:
 static int iw_process_one_channel(struct iw_context *ctx, int intermed_channel,
   const struct iw_csdescr *in_csdescr, const struct iw_csdescr *out_csdescr)
 {
-	if(!iw_process_cols_to_intermediate(ctx,intermed_channel,in_csdescr)) {
-		return 0;
-	}
+	int ret;
 
-	if(!iw_process_rows_intermediate_to_final(ctx,intermed_channel,out_csdescr)) {
-		return 0;
-	}
+	iw_trace_begin(ctx,"channel",intermed_channel);
 
-	return 1;
+	iw_begin_stage(ctx,IW_STAGE_VERTICAL);
+	ret = iw_process_cols_to_intermediate(ctx,intermed_channel,in_csdescr);
+	iw_end_stage(ctx,IW_STAGE_VERTICAL);
+	if(!ret) goto done;
+
+	iw_begin_stage(ctx,IW_STAGE_HORIZONTAL);
+	ret = iw_process_rows_intermediate_to_final(ctx,intermed_channel,out_csdescr);
+	iw_end_stage(ctx,IW_STAGE_HORIZONTAL);
+
+done:
+	iw_trace_end(ctx,"channel",intermed_channel);
+	return ret;
 }
 
 // Potentially make a lookup table for color correction.
@@ -1180,7 +1264,7 @@ static void iw_make_x_to_linear_table(struct iw_context *ctx, double **ptable,
 	// Don't make a table if the image is really small.
 	if( ((size_t)img->width)*img->height <= 512 ) return;
 
-	tbl = iw_malloc(ctx,ncolors*sizeof(double));
+	tbl = iwpvt_scratch_alloc(ctx,0,ncolors,sizeof(double));
 	if(!tbl) return;
 
 	for(i=0;i<ncolors;i++) {
@@ -1212,7 +1296,7 @@ static void iw_make_nearest_color_table(struct iw_context *ctx, double **ptable,
 	// Don't make a table if the image is really small.
 	if( ((size_t)img->width)*img->height <= 512 ) return;
 
-	tbl = iw_malloc(ctx,nentries*sizeof(double));
+	tbl = iwpvt_scratch_alloc(ctx,0,nentries,sizeof(double));
 	if(!tbl) return;
 
 	// Table stores the maximum value for the given entry.
@@ -1361,6 +1445,34 @@ static void negate_target_image(struct iw_context *ctx)
 	}
 }
 
+// Replace the output image with the part of it selected by
+// iw_set_output_region().
+static int crop_target_image(struct iw_context *ctx)
+{
+	iw_byte *newpixels;
+	size_t newbpr;
+	size_t bytes_per_pixel;
+	int j;
+
+	bytes_per_pixel = (size_t)(ctx->img2.bit_depth*ctx->img2_numchannels/8);
+	newbpr = iw_calc_bytesperrow(ctx->crop_w,ctx->img2.bit_depth*ctx->img2_numchannels);
+	newpixels = iwpvt_scratch_alloc(ctx, 0, newbpr, ctx->crop_h);
+	if(!newpixels) return 0;
+
+	for(j=0; j<ctx->crop_h; j++) {
+		memcpy(&newpixels[j*newbpr],
+			&ctx->img2.pixels[(ctx->crop_y+j)*ctx->img2.bpr + ctx->crop_x*bytes_per_pixel],
+			ctx->crop_w*bytes_per_pixel);
+	}
+
+	iwpvt_scratch_free(ctx,ctx->img2.pixels);
+	ctx->img2.pixels = newpixels;
+	ctx->img2.width = ctx->crop_w;
+	ctx->img2.height = ctx->crop_h;
+	ctx->img2.bpr = newbpr;
+	return 1;
+}
+
 static int iw_process_internal(struct iw_context *ctx)
 {
 	int channel;
@@ -1373,26 +1485,26 @@ static int iw_process_internal(struct iw_context *ctx)
 	ctx->intermediate32=NULL;
 	ctx->intermediate_alpha32=NULL;
 	ctx->final_alpha32=NULL;
-	ctx->intermed_canvas_width = ctx->input_w;
-	ctx->intermed_canvas_height = ctx->img2.height;
+	ctx->intermed_canvas_width = ctx->resize_settings[IW_DIMENSION_H].in_region_size;
+	ctx->intermed_canvas_height = ctx->resize_settings[IW_DIMENSION_V].out_region_size;
 
 	iw_make_linear_csdescr(&csdescr_linear);
 
 	ctx->img2.bpr = iw_calc_bytesperrow(ctx->img2.width,ctx->img2.bit_depth*ctx->img2_numchannels);
 
-	ctx->img2.pixels = iw_malloc_large(ctx, ctx->img2.bpr, ctx->img2.height);
+	ctx->img2.pixels = iwpvt_scratch_alloc(ctx, 0, ctx->img2.bpr, ctx->img2.height);
 	if(!ctx->img2.pixels) {
 		goto done;
 	}
 
-	ctx->intermediate32 = (iw_float32*)iw_malloc_large(ctx, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
+	ctx->intermediate32 = (iw_float32*)iwpvt_scratch_alloc(ctx, 0, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
 	if(!ctx->intermediate32) {
 		goto done;
 	}
 
 	if(ctx->uses_errdiffdither) {
 		for(k=0;k<IW_DITHER_MAXROWS;k++) {
-			ctx->dither_errors[k] = (double*)iw_malloc(ctx, ctx->img2.width * sizeof(double));
+			ctx->dither_errors[k] = (double*)iwpvt_scratch_alloc(ctx, 0, ctx->img2.width, sizeof(double));
 			if(!ctx->dither_errors[k]) goto done;
 		}
 	}
@@ -1405,11 +1517,11 @@ static int iw_process_internal(struct iw_context *ctx)
 
 	// If an alpha channel is present, we have to process it first.
 	if(IW_IMGTYPE_HAS_ALPHA(ctx->intermed_imgtype)) {
-		ctx->intermediate_alpha32 = (iw_float32*)iw_malloc_large(ctx, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
+		ctx->intermediate_alpha32 = (iw_float32*)iwpvt_scratch_alloc(ctx, 0, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
 		if(!ctx->intermediate_alpha32) {
 			goto done;
 		}
-		ctx->final_alpha32 = (iw_float32*)iw_malloc_large(ctx, ctx->img2.width * ctx->img2.height, sizeof(iw_float32));
+		ctx->final_alpha32 = (iw_float32*)iwpvt_scratch_alloc(ctx, 0, ctx->img2.width * ctx->img2.height, sizeof(iw_float32));
 		if(!ctx->final_alpha32) {
 			goto done;
 		}
@@ -1436,14 +1548,18 @@ static int iw_process_internal(struct iw_context *ctx)
 		negate_target_image(ctx);
 	}
 
+	if(ctx->region_crop_late) {
+		if(!crop_target_image(ctx)) goto done;
+	}
+
 	retval=1;
 
 done:
-	if(ctx->intermediate32) { iw_free(ctx,ctx->intermediate32); ctx->intermediate32=NULL; }
-	if(ctx->intermediate_alpha32) { iw_free(ctx,ctx->intermediate_alpha32); ctx->intermediate_alpha32=NULL; }
-	if(ctx->final_alpha32) { iw_free(ctx,ctx->final_alpha32); ctx->final_alpha32=NULL; }
+	if(ctx->intermediate32) { iwpvt_scratch_free(ctx,ctx->intermediate32); ctx->intermediate32=NULL; }
+	if(ctx->intermediate_alpha32) { iwpvt_scratch_free(ctx,ctx->intermediate_alpha32); ctx->intermediate_alpha32=NULL; }
+	if(ctx->final_alpha32) { iwpvt_scratch_free(ctx,ctx->final_alpha32); ctx->final_alpha32=NULL; }
 	for(k=0;k<IW_DITHER_MAXROWS;k++) {
-		if(ctx->dither_errors[k]) { iw_free(ctx,ctx->dither_errors[k]); ctx->dither_errors[k]=NULL; }
+		if(ctx->dither_errors[k]) { iwpvt_scratch_free(ctx,ctx->dither_errors[k]); ctx->dither_errors[k]=NULL; }
 	}
 	// The 'resize contexts' are usually kept around so that they can be reused.
 	// Now that we're done with everything, free them.
@@ -1875,6 +1991,70 @@ static void init_channel_info(struct iw_context *ctx)
 	}
 }
 
+// Work out where each input channel's samples are, from img1.channel_order.
+static int init_input_layout(struct iw_context *ctx)
+{
+	int i;
+	int n;
+	int has_alpha;
+	int ok = 1;
+
+	n = ctx->img1_numchannels_physical;
+	has_alpha = IW_IMGTYPE_HAS_ALPHA(ctx->img1.imgtype);
+	ctx->img1_samples_per_pixel = n;
+	for(i=0;i<n;i++) {
+		ctx->img1_sample_pos[i] = i;
+	}
+
+	if(ctx->img1.channel_order==IW_CHANORDER_DEFAULT) {
+		return 1;
+	}
+	if(ctx->img1.bit_depth<8) {
+		ok = 0;
+	}
+
+	switch(ctx->img1.channel_order) {
+	case IW_CHANORDER_BGR:
+		if(IW_IMGTYPE_IS_GRAY(ctx->img1.imgtype)) { ok = 0; break; }
+		ctx->img1_sample_pos[0] = 2;
+		ctx->img1_sample_pos[2] = 0;
+		break;
+	case IW_CHANORDER_ARGB:
+	case IW_CHANORDER_ABGR:
+		if(!has_alpha) { ok = 0; break; }
+		if(ctx->img1.channel_order==IW_CHANORDER_ABGR) {
+			if(IW_IMGTYPE_IS_GRAY(ctx->img1.imgtype)) { ok = 0; break; }
+			ctx->img1_sample_pos[0] = 3;
+			ctx->img1_sample_pos[1] = 2;
+			ctx->img1_sample_pos[2] = 1;
+		}
+		else {
+			for(i=0;i<n-1;i++) {
+				ctx->img1_sample_pos[i] = i+1;
+			}
+		}
+		ctx->img1_sample_pos[n-1] = 0;
+		break;
+	case IW_CHANORDER_RGBX:
+	case IW_CHANORDER_BGRX:
+		if(ctx->img1.imgtype!=IW_IMGTYPE_RGB) { ok = 0; break; }
+		ctx->img1_samples_per_pixel = 4;
+		if(ctx->img1.channel_order==IW_CHANORDER_BGRX) {
+			ctx->img1_sample_pos[0] = 2;
+			ctx->img1_sample_pos[2] = 0;
+		}
+		break;
+	default:
+		ok = 0;
+	}
+
+	if(!ok) {
+		iw_set_error(ctx,"Unsupported channel order for this image type");
+		return 0;
+	}
+	return 1;
+}
+
 // Set the weights for the grayscale algorithm, if needed.
 static void prepare_grayscale(struct iw_context *ctx)
 {
@@ -1890,6 +2070,91 @@ static void prepare_grayscale(struct iw_context *ctx)
 	}
 }
 
+// Decide which part of the output image to compute, and which part of the
+// input image is needed for that.
+static int prepare_output_region(struct iw_context *ctx)
+{
+	struct iw_resize_settings *rs;
+	int x, y, w, h;
+	int num_in_pix;
+	int dimension;
+	int i;
+
+	x = 0;
+	y = 0;
+	w = ctx->img2.width;
+	h = ctx->img2.height;
+	ctx->region_crop_late = 0;
+
+	if(ctx->req.region_valid) {
+		x = ctx->req.region_x;
+		y = ctx->req.region_y;
+		w = ctx->req.region_w;
+		h = ctx->req.region_h;
+		if(w<0) w = ctx->img2.width-x;
+		if(h<0) h = ctx->img2.height-y;
+		if(x<0) { w += x; x = 0; }
+		if(y<0) { h += y; y = 0; }
+		if(w>ctx->img2.width-x) w = ctx->img2.width-x;
+		if(h>ctx->img2.height-y) h = ctx->img2.height-y;
+		if(w<1 || h<1) {
+			iw_set_error(ctx,"Output region is outside the image");
+			return 0;
+		}
+
+		// Error-diffusion and random dithering depend on all the pixels that
+		// were processed before the current one, so to get the same result,
+		// we have to compute the whole image, then crop it.
+		for(i=0;i<ctx->img2_numchannels;i++) {
+			if(ctx->img2_ci[i].ditherfamily==IW_DITHERFAMILY_ERRDIFF ||
+				ctx->img2_ci[i].ditherfamily==IW_DITHERFAMILY_RANDOM)
+			{
+				ctx->region_crop_late = 1;
+			}
+		}
+	}
+
+	if(ctx->region_crop_late) {
+		ctx->crop_x = x;
+		ctx->crop_y = y;
+		ctx->crop_w = w;
+		ctx->crop_h = h;
+		x = 0;
+		y = 0;
+		w = ctx->img2.width;
+		h = ctx->img2.height;
+	}
+
+	ctx->region_x = x;
+	ctx->region_y = y;
+
+	for(dimension=0;dimension<2;dimension++) {
+		rs = &ctx->resize_settings[dimension];
+		if(dimension==IW_DIMENSION_H) {
+			rs->out_size = ctx->img2.width;
+			rs->out_region_start = x;
+			rs->out_region_size = w;
+			num_in_pix = ctx->input_w;
+		}
+		else {
+			rs->out_size = ctx->img2.height;
+			rs->out_region_start = y;
+			rs->out_region_size = h;
+			num_in_pix = ctx->input_h;
+		}
+
+		rs->in_region_start = 0;
+		rs->in_region_size = num_in_pix;
+		if(rs->out_region_size<rs->out_size) {
+			iwpvt_resize_input_range(ctx,rs,num_in_pix,&rs->in_region_start,&rs->in_region_size);
+		}
+	}
+
+	ctx->img2.width = w;
+	ctx->img2.height = h;
+	return 1;
+}
+
 // Set up some things before we do the resize, and check to make
 // sure everything looks okay.
 static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
@@ -1937,11 +2202,19 @@ static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
 	}
 
 	init_channel_info(ctx);
+	if(!init_input_layout(ctx)) {
+		return 0;
+	}
 
 	ctx->img2.width = w;
 	ctx->img2.height = h;
 
 	// Figure out the region of the source image to read from.
+	if(ctx->img1_partial) {
+		// The crop was (mostly) done by the file reader.
+		ctx->input_start_x -= ctx->img1_offset_x;
+		ctx->input_start_y -= ctx->img1_offset_y;
+	}
 	if(ctx->input_start_x<0) ctx->input_start_x=0;
 	if(ctx->input_start_y<0) ctx->input_start_y=0;
 	if(ctx->input_start_x>ctx->img1.width-1) ctx->input_start_x=ctx->img1.width-1;
@@ -2240,9 +2513,28 @@ static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
 		}
 	}
 
+	if(!prepare_output_region(ctx)) return 0;
+
 	return 1;
 }
 
+// Remember the settings that iw_prepare_processing() may change, for the
+// benefit of iw_reset_context().
+static void iw_save_settings(struct iw_context *ctx)
+{
+	ctx->saved.resize_settings[IW_DIMENSION_H] = ctx->resize_settings[IW_DIMENSION_H];
+	ctx->saved.resize_settings[IW_DIMENSION_V] = ctx->resize_settings[IW_DIMENSION_V];
+	ctx->saved.input_start_x = ctx->input_start_x;
+	ctx->saved.input_start_y = ctx->input_start_y;
+	ctx->saved.input_w = ctx->input_w;
+	ctx->saved.input_h = ctx->input_h;
+	ctx->saved.random_seed = ctx->random_seed;
+	ctx->saved.grayscale_formula = ctx->grayscale_formula;
+	ctx->saved.opt_palette = ctx->opt_palette;
+	ctx->saved.opt_binary_trns = ctx->opt_binary_trns;
+	ctx->saved.valid = 1;
+}
+
 IW_IMPL(int) iw_process_image(struct iw_context *ctx)
 {
 	int ret;
@@ -2254,13 +2546,19 @@ IW_IMPL(int) iw_process_image(struct iw_context *ctx)
 	}
 	ctx->use_count++;
 
+	iw_save_settings(ctx);
+
+	iw_begin_stage(ctx,IW_STAGE_PREPARE);
 	ret = iw_prepare_processing(ctx,ctx->canvas_width,ctx->canvas_height);
+	iw_end_stage(ctx,IW_STAGE_PREPARE);
 	if(!ret) goto done;
 
 	ret = iw_process_internal(ctx);
 	if(!ret) goto done;
 
+	iw_begin_stage(ctx,IW_STAGE_OPTIMIZE);
 	iwpvt_optimize_image(ctx);
+	iw_end_stage(ctx,IW_STAGE_OPTIMIZE);
 
 	retval = 1;
 done:
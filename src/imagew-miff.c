@@ -7,6 +7,7 @@
 
 #include "imagew-config.h"
 
+#include <stdio.h> // for SEEK_CUR
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
@@ -14,6 +15,14 @@
 #define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
 
+// Zip-compressed images at least this large (uncompressed) may be compressed
+// or decompressed using multiple threads.
+#define IWMIFF_MIN_PARALLEL_SIZE 1048576
+// When using multiple threads, the approximate amount of uncompressed data to
+// process at a time.
+#define IWMIFF_BAND_SIZE 4194304
+#define IWMIFF_WINDOW_SIZE 32768
+
 struct iwmiffrcontext {
 	int host_endian;
 	struct iw_iodescr *iodescr;
@@ -21,6 +30,7 @@ struct iwmiffrcontext {
 	struct iw_image *img;
 	int read_error_flag;
 	int error_flag;
+	int probe_only; // Don't send any information to the context.
 	int has_alpha;
 	int is_grayscale;
 	int profile_length;
@@ -38,6 +48,11 @@ struct iwmiffrcontext {
 	// it means zlib compression is not supported.
 	struct iw_zlib_module *zmod;
 	struct iw_zlib_context *zctx;
+
+	// If we're only reading part of the image (see iw_get_input_crop()):
+	int use_crop;
+	int crop_x, crop_y;
+	int full_width, full_height;
 };
 
 static int iwmiff_read(struct iwmiffrcontext *rctx,
@@ -277,7 +292,8 @@ static void iwmiff_found_attribute(struct iwmiffrcontext *rctx,
 		}
 	}
 	else if(!strcmp(name,"background-color")) {
-		iwmiff_parse_bkgd_color(rctx,val);
+		if(!rctx->probe_only)
+			iwmiff_parse_bkgd_color(rctx,val);
 	}
 	else if(!strcmp(name,"quantum:format")) {
 		if(iw_stricmp(val,"floating-point")) {
@@ -458,6 +474,11 @@ static int iwmiff_skip_bytes(struct iwmiffrcontext *rctx, size_t n)
 	iw_byte buf[2048];
 	size_t amt;
 	size_t remaining = n;
+
+	if(rctx->iodescr->seek_fn) {
+		return (*rctx->iodescr->seek_fn)(rctx->ctx,rctx->iodescr,(iw_int64)n,SEEK_CUR);
+	}
+
 	while(remaining>0) {
 		amt = remaining;
 		if(amt>2048) amt=2048;
@@ -467,6 +488,18 @@ static int iwmiff_skip_bytes(struct iwmiffrcontext *rctx, size_t n)
 	return 1;
 }
 
+// Skip over a row of pixels. buf is a buffer of size rowsize that may be
+// used for temporary storage.
+static int iwmiff_skip_row(struct iwmiffrcontext *rctx, iw_byte *buf, size_t rowsize)
+{
+	if(rctx->compression==IW_COMPRESSION_ZIP) {
+		// The rows are all part of the same zlib stream, so we still have to
+		// decompress them.
+		return iwmiff_read_zip_compressed_row(rctx,buf,rowsize);
+	}
+	return iwmiff_skip_bytes(rctx,rowsize);
+}
+
 // Skip over the ICC color profile, if present.
 static int iwmiff_read_icc_profile(struct iwmiffrcontext *rctx)
 {
@@ -474,14 +507,162 @@ static int iwmiff_read_icc_profile(struct iwmiffrcontext *rctx)
 	return iwmiff_skip_bytes(rctx,(size_t)rctx->profile_length);
 }
 
+// Decide whether to decompress the rows using multiple threads.
+// Returns the number of threads to use, or 0 if we shouldn't.
+static int iwmiff_num_threads_to_use(struct iw_context *ctx,
+	struct iw_zlib_module *zmod, size_t rowsize, int nrows)
+{
+	int num_threads;
+
+	num_threads = iw_get_value(ctx,IW_VAL_NUM_THREADS);
+	if(num_threads<1) num_threads = iw_get_num_cpus();
+	if(num_threads<2) return 0;
+
+	if(!zmod || !zmod->mt_init) return 0;
+	if(rowsize*(size_t)nrows < IWMIFF_MIN_PARALLEL_SIZE) return 0;
+	return num_threads;
+}
+
+static void iwmiffr_convert_row(struct iwmiffrcontext *rctx,
+  const iw_byte *src, iw_byte *dst, int nsamples)
+{
+	// There are two possibilities for {miff_bitdepth, img->bit_depth}:
+	//  32->32, 64->32
+	if(rctx->miff_bitdepth==64) {
+		iwmiffr_convert_row64_32(rctx,src,dst,nsamples);
+	}
+	else if(rctx->miff_bitdepth==32) {
+		iwmiffr_convert_row32(rctx,src,dst,nsamples);
+	}
+}
+
+// Read and decompress the first nrows rows of Zip-compressed pixels using
+// multiple threads, and convert the ones after rctx->crop_y.
+// Each row is decompressed on its own, on the assumption that it doesn't
+// refer to data in the previous rows, as is the case for files written by
+// iwmiff_write_pixels_mt(). Rows that do refer to earlier data (as in files
+// written in the usual way) are then decompressed again, one at a time. If
+// that happens to most rows, we stop trying to do it in parallel.
+static int iwmiff_read_pixels_mt(struct iwmiffrcontext *rctx,
+	size_t rowsize, size_t src_offset, int samples_per_row, int nrows,
+	int num_threads)
+{
+	struct iw_image *img = rctx->img;
+	struct iw_zlib_mt *mz = NULL;
+	struct iw_zlib_piece *pieces = NULL;
+	iw_byte *ubuf = NULL; // The last 32K of previous rows, then this band's rows
+	iw_byte *cbuf = NULL;
+	size_t maxcmprsize;
+	size_t cmprsize;
+	size_t cpos;
+	size_t winlen = 0;
+	size_t keep;
+	int band_rows;
+	int row, n, k, j;
+	int speculate = 1;
+	int num_redone;
+	int retval = 0;
+
+	band_rows = (int)(IWMIFF_BAND_SIZE/rowsize);
+	if(band_rows<1) band_rows = 1;
+	if(band_rows>nrows) band_rows = nrows;
+
+	// See iwmiff_read_zip_compressed_row().
+	maxcmprsize = rowsize+100+rowsize/1024;
+
+	ubuf = iw_malloc_large(rctx->ctx,IWMIFF_WINDOW_SIZE+rowsize*band_rows,1);
+	if(!ubuf) goto done;
+	cbuf = iw_malloc_large(rctx->ctx,maxcmprsize,band_rows);
+	if(!cbuf) goto done;
+	pieces = iw_mallocz(rctx->ctx,band_rows*sizeof(struct iw_zlib_piece));
+	if(!pieces) goto done;
+
+	mz = rctx->zmod->mt_init(rctx->ctx,num_threads,0);
+	if(!mz) goto done;
+
+	for(row=0;row<nrows;row+=n) {
+		n = nrows-row;
+		if(n>band_rows) n = band_rows;
+
+		// Read this band's compressed rows.
+		cpos = 0;
+		for(k=0;k<n;k++) {
+			cmprsize = iwmiff_read_uint32(rctx);
+			if(rctx->read_error_flag) goto done;
+			if(cmprsize > maxcmprsize) {
+				iw_set_error(rctx->ctx,"MIFF: Unsupported file or invalid Zip-compressed data");
+				goto done;
+			}
+			if(!iwmiff_read(rctx,&cbuf[cpos],cmprsize)) goto done;
+
+			iw_zeromem(&pieces[k],sizeof(struct iw_zlib_piece));
+			pieces[k].src = &cbuf[cpos];
+			pieces[k].srclen = cmprsize;
+			pieces[k].dst = &ubuf[IWMIFF_WINDOW_SIZE+rowsize*k];
+			pieces[k].dstlen = rowsize;
+			pieces[k].zlib_header = (row+k==0);
+			cpos += cmprsize;
+		}
+
+		if(speculate) {
+			if(!rctx->zmod->mt_run(mz,pieces,n)) goto done;
+		}
+
+		// Redo any rows that need the data that precedes them, which is now
+		// available.
+		num_redone = 0;
+		for(k=0;k<n;k++) {
+			if(pieces[k].ok) continue;
+			num_redone++;
+			pieces[k].dictlen = winlen + rowsize*k;
+			if(pieces[k].dictlen>IWMIFF_WINDOW_SIZE) pieces[k].dictlen = IWMIFF_WINDOW_SIZE;
+			pieces[k].dict = &ubuf[IWMIFF_WINDOW_SIZE+rowsize*k-pieces[k].dictlen];
+			if(!rctx->zmod->mt_run(mz,&pieces[k],1)) goto done;
+			if(!pieces[k].ok) {
+				iw_set_error(rctx->ctx,"zlib decompression failed");
+				goto done;
+			}
+		}
+		if(num_redone > n/2) {
+			// Apparently this file wasn't written that way. Don't waste any
+			// more time on it.
+			speculate = 0;
+		}
+
+		for(k=0;k<n;k++) {
+			j = row+k-rctx->crop_y;
+			if(j<0) continue;
+			iwmiffr_convert_row(rctx,&ubuf[IWMIFF_WINDOW_SIZE+rowsize*k+src_offset],
+				&img->pixels[j*img->bpr],samples_per_row);
+		}
+
+		// Keep the last 32K of data, for the next band.
+		keep = winlen + rowsize*n;
+		if(keep>IWMIFF_WINDOW_SIZE) keep = IWMIFF_WINDOW_SIZE;
+		memmove(&ubuf[IWMIFF_WINDOW_SIZE-keep],&ubuf[IWMIFF_WINDOW_SIZE+rowsize*n-keep],keep);
+		winlen = keep;
+	}
+
+	retval = 1;
+done:
+	if(mz) rctx->zmod->mt_end(mz);
+	if(pieces) iw_free(rctx->ctx,pieces);
+	if(cbuf) iw_free(rctx->ctx,cbuf);
+	if(ubuf) iw_free(rctx->ctx,ubuf);
+	return retval;
+}
+
 static int iwmiff_read_pixels(struct iwmiffrcontext *rctx)
 {
 	int samples_per_pixel;
 	int samples_per_row;
 	size_t tmprowsize;
+	size_t src_offset = 0;
 	iw_byte *tmprow = NULL;
 	int retval=0;
 	int j;
+	int crop_w, crop_h;
+	int num_threads = 0;
 	struct iw_image *img;
 
 	img = rctx->img;
@@ -493,23 +674,50 @@ static int iwmiff_read_pixels(struct iwmiffrcontext *rctx)
 	tmprow = iw_mallocz(rctx->ctx,tmprowsize);
 	if(!tmprow) goto done;
 
-	img->bpr = tmprowsize;
+	// If the caller only wants part of the image, convert only the columns
+	// and rows it needs.
+	rctx->full_width = img->width;
+	rctx->full_height = img->height;
+	if(iw_get_input_crop(rctx->ctx,img->width,img->height,
+		&rctx->crop_x,&rctx->crop_y,&crop_w,&crop_h))
+	{
+		rctx->use_crop = 1;
+		src_offset = (rctx->miff_bitdepth/8)*samples_per_pixel*(size_t)rctx->crop_x;
+		img->width = crop_w;
+		img->height = crop_h;
+		samples_per_row = samples_per_pixel * img->width;
+	}
+
+	if(rctx->compression==IW_COMPRESSION_ZIP) {
+		num_threads = iwmiff_num_threads_to_use(rctx->ctx,rctx->zmod,tmprowsize,
+			rctx->crop_y+img->height);
+	}
+
+	if(!num_threads) {
+		for(j=0;j<rctx->crop_y;j++) {
+			if(!iwmiff_skip_row(rctx,tmprow,tmprowsize)) goto done;
+		}
+	}
+
+	img->bpr = (rctx->miff_bitdepth/8)*samples_per_row;
 
 	img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
 	if(!img->pixels) goto done;
 
+	if(num_threads) {
+		if(!iwmiff_read_pixels_mt(rctx,tmprowsize,src_offset,samples_per_row,
+			rctx->crop_y+img->height,num_threads))
+		{
+			goto done;
+		}
+		retval=1;
+		goto done;
+	}
+
 	for(j=0;j<img->height;j++) {
 		if(!iwmiff_read_and_uncompress_row(rctx,tmprow,tmprowsize))
 			goto done;
-
-		// There are two possibilities for {miff_bitdepth, img->bit_depth}:
-		//  32->32, 64->32
-		if(rctx->miff_bitdepth==64) {
-			iwmiffr_convert_row64_32(rctx,tmprow,&img->pixels[j*img->bpr],samples_per_row);
-		}
-		else if(rctx->miff_bitdepth==32) {
-			iwmiffr_convert_row32(rctx,tmprow,&img->pixels[j*img->bpr],samples_per_row);
-		}
+		iwmiffr_convert_row(rctx,&tmprow[src_offset],&img->pixels[j*img->bpr],samples_per_row);
 	}
 
 	retval=1;
@@ -581,6 +789,10 @@ IW_IMPL(int) iw_read_miff_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 		goto done;
 
 	iw_set_input_image(ctx, &img);
+	if(rctx.use_crop) {
+		iw_set_input_image_offset(ctx,rctx.crop_x,rctx.crop_y,
+			rctx.full_width,rctx.full_height);
+	}
 
 	iw_set_input_colorspace(ctx,&rctx.csdescr);
 
@@ -594,6 +806,58 @@ done:
 	return retval;
 }
 
+IW_IMPL(int) iw_probe_miff_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info)
+{
+	struct iw_image img;
+	struct iwmiffrcontext rctx;
+	int retval=0;
+
+	iw_zeromem(info,sizeof(struct iw_image_info));
+	iw_zeromem(&rctx,sizeof(struct iwmiffrcontext));
+	iw_zeromem(&img,sizeof(struct iw_image));
+
+	rctx.ctx = ctx;
+	rctx.iodescr = iodescr;
+	rctx.img = &img;
+	rctx.compression = IW_COMPRESSION_NONE;
+	rctx.zmod = iw_get_zlib_module(ctx);
+	rctx.probe_only = 1;
+
+	if(!iwmiff_read_header(&rctx))
+		goto done;
+
+	if(img.bit_depth!=32) {
+		iw_set_error(ctx, "MIFF: Unsupported or unset bit depth");
+		goto done;
+	}
+
+	if(img.width<1 || img.height<1) {
+		iw_set_error(ctx, "Invalid image dimensions");
+		goto done;
+	}
+
+	info->width = img.width;
+	info->height = img.height;
+	if(rctx.is_grayscale) {
+		info->imgtype = rctx.has_alpha ? IW_IMGTYPE_GRAYA : IW_IMGTYPE_GRAY;
+		info->native_grayscale = 1;
+	}
+	else {
+		info->imgtype = rctx.has_alpha ? IW_IMGTYPE_RGBA : IW_IMGTYPE_RGB;
+	}
+	info->bit_depth = 32;
+	info->sampletype = IW_SAMPLETYPE_FLOATINGPOINT;
+	info->page_count = 1;
+	retval = 1;
+
+done:
+	if(!retval) {
+		iw_set_error(ctx,"Failed to read MIFF file");
+	}
+	return retval;
+}
+
 struct iwmiffwcontext {
 	int has_alpha;
 	int host_endian;
@@ -785,6 +1049,71 @@ static int iwmiff_compress_and_write_row(struct iwmiffwcontext *wctx,
 	return 0;
 }
 
+// Compress and write the rows using multiple threads. Each row is compressed
+// on its own, so that it can be decompressed on its own. Together, they still
+// form a single zlib stream, like the rows written by
+// iwmiff_write_zip_compressed_row().
+static int iwmiff_write_pixels_mt(struct iwmiffwcontext *wctx,
+	size_t dstbpr, int num_channels, int num_threads)
+{
+	struct iw_image *img = wctx->img;
+	struct iw_zlib_mt *mz = NULL;
+	struct iw_zlib_piece *pieces = NULL;
+	iw_byte *ubuf = NULL;
+	iw_byte *cbuf = NULL;
+	size_t cbuf_rowsize;
+	int band_rows;
+	int row, n, k;
+	int retval = 0;
+
+	band_rows = (int)(IWMIFF_BAND_SIZE/dstbpr);
+	if(band_rows<1) band_rows = 1;
+	if(band_rows>img->height) band_rows = img->height;
+
+	cbuf_rowsize = dstbpr+100+dstbpr/1024;
+
+	ubuf = iw_malloc_large(wctx->ctx,dstbpr,band_rows);
+	if(!ubuf) goto done;
+	cbuf = iw_malloc_large(wctx->ctx,cbuf_rowsize,band_rows);
+	if(!cbuf) goto done;
+	pieces = iw_mallocz(wctx->ctx,band_rows*sizeof(struct iw_zlib_piece));
+	if(!pieces) goto done;
+
+	mz = wctx->zmod->mt_init(wctx->ctx,num_threads,1);
+	if(!mz) goto done;
+
+	for(row=0;row<img->height;row+=n) {
+		n = img->height-row;
+		if(n>band_rows) n = band_rows;
+
+		for(k=0;k<n;k++) {
+			iwmiffw_convert_row32(wctx,&img->pixels[(row+k)*img->bpr],&ubuf[dstbpr*k],
+				img->width*num_channels);
+			iw_zeromem(&pieces[k],sizeof(struct iw_zlib_piece));
+			pieces[k].src = &ubuf[dstbpr*k];
+			pieces[k].srclen = dstbpr;
+			pieces[k].dst = &cbuf[cbuf_rowsize*k];
+			pieces[k].dstlen = cbuf_rowsize;
+			pieces[k].zlib_header = (row+k==0);
+		}
+
+		if(!wctx->zmod->mt_run(mz,pieces,n)) goto done;
+
+		for(k=0;k<n;k++) {
+			iwmiff_write_uint32(wctx,(unsigned int)pieces[k].dstused);
+			iwmiff_write(wctx,pieces[k].dst,pieces[k].dstused);
+		}
+	}
+
+	retval = 1;
+done:
+	if(mz) wctx->zmod->mt_end(mz);
+	if(pieces) iw_free(wctx->ctx,pieces);
+	if(cbuf) iw_free(wctx->ctx,cbuf);
+	if(ubuf) iw_free(wctx->ctx,ubuf);
+	return retval;
+}
+
 static int iwmiff_write_main(struct iwmiffwcontext *wctx)
 {
 	struct iw_image *img;
@@ -795,6 +1124,8 @@ static int iwmiff_write_main(struct iwmiffwcontext *wctx)
 	int bytes_per_sample;
 	int num_channels;
 	int cmpr_req;
+	int num_threads;
+	const char *optv;
 	int retval=0;
 
 	img = wctx->img;
@@ -847,6 +1178,19 @@ static int iwmiff_write_main(struct iwmiffwcontext *wctx)
 
 	iwmiff_write_header(wctx);
 
+	// Compressing the rows independently changes the file (it makes it
+	// larger), so it is only done if the caller asks for it. The file doesn't
+	// depend on the number of threads.
+	optv = iw_get_option(wctx->ctx, "miff:independentrows");
+	if(optv && iw_parse_int(optv) && wctx->compression==IW_COMPRESSION_ZIP &&
+		wctx->zmod->mt_init)
+	{
+		num_threads = iw_get_value(wctx->ctx,IW_VAL_NUM_THREADS);
+		if(num_threads<1) num_threads = iw_get_num_cpus();
+		retval = iwmiff_write_pixels_mt(wctx,dstbpr,num_channels,num_threads);
+		goto done;
+	}
+
 	dstrow = iw_mallocz(wctx->ctx,dstbpr);
 	if(!dstrow) goto done;
 
@@ -249,7 +249,7 @@ static void iw_opt_16_to_8(struct iw_context *ctx, struct iw_opt_ctx *optctx, in
 	if(!ctx->opt_16_to_8) return;
 
 	newbpr = iw_calc_bytesperrow(optctx->width,8*spp);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
+	newpixels = iwpvt_scratch_alloc(ctx, 0, newbpr, optctx->height);
 	if(!newpixels) return;
 
 	for(j=0;j<optctx->height;j++) {
@@ -260,7 +260,7 @@ static void iw_opt_16_to_8(struct iw_context *ctx, struct iw_opt_ctx *optctx, in
 	}
 
 	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
+	if(optctx->tmp_pixels) iwpvt_scratch_free(ctx,optctx->tmp_pixels);
 
 	// Attach our new image
 	optctx->tmp_pixels = newpixels;
@@ -289,7 +289,7 @@ static void iw_opt_copychannels_8(struct iw_context *ctx, struct iw_opt_ctx *opt
 	newnc = iw_imgtype_num_channels(new_imgtype);
 
 	newbpr = iw_calc_bytesperrow(optctx->width,8*newnc);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
+	newpixels = iwpvt_scratch_alloc(ctx, 0, newbpr, optctx->height);
 	if(!newpixels) return;
 
 	for(j=0;j<optctx->height;j++) {
@@ -303,7 +303,7 @@ static void iw_opt_copychannels_8(struct iw_context *ctx, struct iw_opt_ctx *opt
 	}
 
 	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
+	if(optctx->tmp_pixels) iwpvt_scratch_free(ctx,optctx->tmp_pixels);
 
 	// Attach our new image
 	optctx->tmp_pixels = newpixels;
@@ -326,7 +326,7 @@ static void iw_opt_copychannels_16(struct iw_context *ctx, struct iw_opt_ctx *op
 	newnc = iw_imgtype_num_channels(new_imgtype);
 
 	newbpr = iw_calc_bytesperrow(optctx->width,16*newnc);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
+	newpixels = iwpvt_scratch_alloc(ctx, 0, newbpr, optctx->height);
 	if(!newpixels) return;
 
 	for(j=0;j<optctx->height;j++) {
@@ -345,7 +345,7 @@ static void iw_opt_copychannels_16(struct iw_context *ctx, struct iw_opt_ctx *op
 	}
 
 	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
+	if(optctx->tmp_pixels) iwpvt_scratch_free(ctx,optctx->tmp_pixels);
 
 	// Attach our new image
 	optctx->tmp_pixels = newpixels;
@@ -439,7 +439,7 @@ static void iwopt_try_rgb8_binary_trns(struct iw_context *ctx, struct iw_opt_ctx
 	// get messy.
 	// Instead, I'll make a transparency mask, then strip the alpha
 	// channel, then use the mask to patch up the new image.
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
+	trns_mask = iwpvt_scratch_alloc(ctx, 0, optctx->width, optctx->height);
 	if(!trns_mask) goto done;
 
 	for(j=0;j<optctx->height;j++) {
@@ -484,7 +484,7 @@ static void iwopt_try_rgb8_binary_trns(struct iw_context *ctx, struct iw_opt_ctx
 	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192;
 
 done:
-	if(trns_mask) iw_free(ctx,trns_mask);
+	if(trns_mask) iwpvt_scratch_free(ctx,trns_mask);
 }
 
 static void iwopt_try_rgb16_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
@@ -501,7 +501,7 @@ static void iwopt_try_rgb16_binary_trns(struct iw_context *ctx, struct iw_opt_ct
 
 	iw_zeromem(clr_used,256);
 
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
+	trns_mask = iwpvt_scratch_alloc(ctx, 0, optctx->width, optctx->height);
 	if(!trns_mask) goto done;
 
 	for(j=0;j<optctx->height;j++) {
@@ -552,7 +552,7 @@ static void iwopt_try_rgb16_binary_trns(struct iw_context *ctx, struct iw_opt_ct
 	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192*256+192;
 
 done:
-	if(trns_mask) iw_free(ctx,trns_mask);
+	if(trns_mask) iwpvt_scratch_free(ctx,trns_mask);
 }
 
 static void iwopt_try_gray8_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
@@ -569,7 +569,7 @@ static void iwopt_try_gray8_binary_trns(struct iw_context *ctx, struct iw_opt_ct
 
 	iw_zeromem(clr_used,256);
 
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
+	trns_mask = iwpvt_scratch_alloc(ctx, 0, optctx->width, optctx->height);
 	if(!trns_mask) goto done;
 
 	for(j=0;j<optctx->height;j++) {
@@ -612,7 +612,7 @@ static void iwopt_try_gray8_binary_trns(struct iw_context *ctx, struct iw_opt_ct
 	optctx->colorkey[IW_CHANNELTYPE_BLUE] = key_clr;
 
 done:
-	if(trns_mask) iw_free(ctx,trns_mask);
+	if(trns_mask) iwpvt_scratch_free(ctx,trns_mask);
 }
 
 static void iwopt_try_gray16_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
@@ -629,7 +629,7 @@ static void iwopt_try_gray16_binary_trns(struct iw_context *ctx, struct iw_opt_c
 
 	iw_zeromem(clr_used,256);
 
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
+	trns_mask = iwpvt_scratch_alloc(ctx, 0, optctx->width, optctx->height);
 	if(!trns_mask) goto done;
 
 	for(j=0;j<optctx->height;j++) {
@@ -676,7 +676,7 @@ static void iwopt_try_gray16_binary_trns(struct iw_context *ctx, struct iw_opt_c
 	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192*256+key_clr;
 
 done:
-	if(trns_mask) iw_free(ctx,trns_mask);
+	if(trns_mask) iwpvt_scratch_free(ctx,trns_mask);
 }
 
 ////////////////////
@@ -809,7 +809,7 @@ static void iwopt_convert_to_palette_image(struct iw_context *ctx, struct iw_opt
 	spp = iw_imgtype_num_channels(optctx->imgtype);
 
 	newbpr = optctx->width;
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
+	newpixels = iwpvt_scratch_alloc(ctx, 0, newbpr, optctx->height);
 	if(!newpixels) return;
 
 	for(y=0;y<optctx->height;y++) {
@@ -853,7 +853,7 @@ static void iwopt_convert_to_palette_image(struct iw_context *ctx, struct iw_opt
 	}
 
 	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
+	if(optctx->tmp_pixels) iwpvt_scratch_free(ctx,optctx->tmp_pixels);
 
 	// Attach our new image
 	optctx->tmp_pixels = newpixels;
@@ -1031,7 +1031,7 @@ static void iwopt_try_pal_lowgray_optimization(struct iw_context *ctx, struct iw
 		return;
 	}
 
-	optctx->palette = iw_malloc(ctx,sizeof(struct iw_palette));
+	optctx->palette = iwpvt_scratch_alloc(ctx,0,sizeof(struct iw_palette),1);
 	if(!optctx->palette) return;
 
 	optctx->palette->num_entries=0;
@@ -1102,7 +1102,7 @@ static void iwopt_try_pal_lowgray_optimization(struct iw_context *ctx, struct iw
 
 done:
 	if(optctx->imgtype!=IW_IMGTYPE_PALETTE) {
-		iw_free(ctx,optctx->palette);
+		iwpvt_scratch_free(ctx,optctx->palette);
 		optctx->palette = NULL;
 	}
 }
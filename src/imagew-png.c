@@ -12,6 +12,7 @@
 #include <math.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
@@ -253,15 +254,31 @@ static void iw_read_ancillary_data(struct iwpngrcontext *rctx)
 	iwpng_read_bkgd(rctx);
 }
 
+// Returns the IW_IMGTYPE_* corresponding to a libpng color type (after
+// palette expansion), or -1 if not supported.
+static int iwpng_color_type_to_imgtype(int color_type)
+{
+	switch(color_type) {
+	case PNG_COLOR_TYPE_GRAY:       return IW_IMGTYPE_GRAY;
+	case PNG_COLOR_TYPE_GRAY_ALPHA: return IW_IMGTYPE_GRAYA;
+	case PNG_COLOR_TYPE_RGB:        return IW_IMGTYPE_RGB;
+	case PNG_COLOR_TYPE_RGB_ALPHA:  return IW_IMGTYPE_RGBA;
+	}
+	return -1;
+}
+
 IW_IMPL(int) iw_read_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
 {
 	png_uint_32 width, height;
 	int interlace_type;
-	iw_byte **row_pointers = NULL;
+	iw_byte *rowbuf = NULL;
 	int i;
+	int pass, num_passes;
+	int use_crop = 0;
+	int crop_x, crop_y, crop_w, crop_h;
+	size_t full_bpr;
 	jmp_buf jbuf;
 	struct errstruct errinfo;
-	int is_supported;
 	int has_trns;
 	int need_update_info;
 	int numchannels=0;
@@ -335,6 +352,10 @@ IW_IMPL(int) iw_read_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 		need_update_info=1;
 	}
 
+	// This has to be called before png_read_update_info(). It returns 1 for
+	// non-interlaced images.
+	num_passes = png_set_interlace_handling(png_ptr);
+
 	if(need_update_info) {
 		// Update things to reflect any transformations done above.
 		png_read_update_info(png_ptr, info_ptr);
@@ -344,36 +365,13 @@ IW_IMPL(int) iw_read_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 
 	img.bit_depth = rctx.bit_depth;
 
-	is_supported=0;
-
-	switch(rctx.color_type) {
-	case PNG_COLOR_TYPE_GRAY:
-		img.imgtype = IW_IMGTYPE_GRAY;
-		numchannels = 1;
-		is_supported=1;
-		break;
-	case PNG_COLOR_TYPE_GRAY_ALPHA:
-		img.imgtype = IW_IMGTYPE_GRAYA;
-		numchannels = 2;
-		is_supported=1;
-		break;
-	case PNG_COLOR_TYPE_RGB:
-		img.imgtype = IW_IMGTYPE_RGB;
-		numchannels = 3;
-		is_supported=1;
-		break;
-	case PNG_COLOR_TYPE_RGB_ALPHA:
-		img.imgtype = IW_IMGTYPE_RGBA;
-		numchannels = 4;
-		is_supported=1;
-		break;
-	}
-
-	if(!is_supported) {
+	img.imgtype = iwpng_color_type_to_imgtype(rctx.color_type);
+	if(img.imgtype<0) {
 		iw_set_errorf(ctx,"This PNG image type (color type=%d, bit depth=%d) is not supported",
 			(int)rctx.color_type,(int)rctx.bit_depth);
 		goto done;
 	}
+	numchannels = iw_imgtype_num_channels(img.imgtype);
 
 	iw_read_ancillary_data(&rctx);
 
@@ -382,26 +380,70 @@ IW_IMPL(int) iw_read_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 		png_set_shift(png_ptr, &rctx.sbit);
 	}
 
-	img.width = width;
-	img.height = height;
+	// If the caller only wants part of the image, decode only the rows we
+	// need, and keep only the columns we need. Interlaced images have to be
+	// decoded in full.
+	if(interlace_type==PNG_INTERLACE_NONE &&
+		iw_get_input_crop(ctx,(int)width,(int)height,&crop_x,&crop_y,&crop_w,&crop_h))
+	{
+		use_crop = 1;
+		if(img.bit_depth<8) {
+			// Don't bother with columns that don't start on a byte boundary.
+			crop_x = 0;
+			crop_w = (int)width;
+		}
+	}
+	else {
+		crop_x = 0;
+		crop_y = 0;
+		crop_w = (int)width;
+		crop_h = (int)height;
+	}
+
+	img.width = crop_w;
+	img.height = crop_h;
 	img.bpr = iw_calc_bytesperrow(img.width,img.bit_depth*numchannels);
 
 	img.pixels = (iw_byte*)iw_malloc_large(ctx, img.bpr,img.height);
 	if(!img.pixels) {
 		goto done;
 	}
-	row_pointers = (iw_byte**)iw_malloc(ctx, img.height * sizeof(iw_byte*));
-	if(!row_pointers) goto done;
 
-	for(i=0;i<img.height;i++) {
-		row_pointers[i] = &img.pixels[img.bpr*i];
-	}
+	if(use_crop) {
+		full_bpr = iw_calc_bytesperrow((int)width,img.bit_depth*numchannels);
+		rowbuf = (iw_byte*)iw_malloc(ctx, full_bpr);
+		if(!rowbuf) goto done;
+
+		iw_trace_begin(ctx,"png_read_rows",-1);
+		for(i=0;i<crop_y+crop_h;i++) {
+			png_read_row(png_ptr, rowbuf, NULL);
+			if(i>=crop_y) {
+				memcpy(&img.pixels[img.bpr*(i-crop_y)],
+					&rowbuf[(size_t)crop_x*(img.bit_depth/8)*numchannels],img.bpr);
+			}
+		}
+		iw_trace_end(ctx,"png_read_rows",-1);
 
-	png_read_image(png_ptr, row_pointers);
+		// Any remaining rows are never decoded, so don't call png_read_end().
+	}
+	else {
+		// Read the rows one at a time. Each pass of an interlaced image
+		// fills in more of the pixels of each row.
+		iw_trace_begin(ctx,"png_read_rows",-1);
+		for(pass=0;pass<num_passes;pass++) {
+			for(i=0;i<img.height;i++) {
+				png_read_row(png_ptr, &img.pixels[img.bpr*i], NULL);
+			}
+		}
+		iw_trace_end(ctx,"png_read_rows",-1);
 
-	png_read_end(png_ptr, info_ptr);
+		png_read_end(png_ptr, info_ptr);
+	}
 
 	iw_set_input_image(ctx, &img);
+	if(use_crop) {
+		iw_set_input_image_offset(ctx,crop_x,crop_y,(int)width,(int)height);
+	}
 
 	retval = 1;
 
@@ -413,7 +455,90 @@ done:
 	if(png_ptr) {
 		png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
 	}
-	if(row_pointers) iw_free(ctx,row_pointers);
+	if(rowbuf) iw_free(ctx,rowbuf);
+	return retval;
+}
+
+IW_IMPL(int) iw_probe_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info)
+{
+	png_uint_32 width, height;
+	jmp_buf jbuf;
+	struct errstruct errinfo;
+	int has_trns;
+	int retval=0;
+	png_structp png_ptr = NULL;
+	png_infop  info_ptr = NULL;
+	struct iwpngrcontext rctx;
+
+	iw_zeromem(info,sizeof(struct iw_image_info));
+	iw_zeromem(&rctx,sizeof(struct iwpngrcontext));
+
+	errinfo.jbufp = &jbuf;
+	errinfo.ctx = ctx;
+	errinfo.write_flag=0;
+
+	if(setjmp(jbuf)) {
+		goto done;
+	}
+
+	png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+		(void*)(&errinfo), my_png_error_fn, my_png_warning_fn,
+		(void*)ctx, my_png_malloc_fn, my_png_free_fn);
+	if(!png_ptr) goto done;
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if(!info_ptr) goto done;
+
+	rctx.ctx = ctx;
+	rctx.iodescr = iodescr;
+	rctx.png_ptr = png_ptr;
+	rctx.info_ptr = info_ptr;
+	png_set_read_fn(png_ptr, (void*)&rctx, my_png_read_fn);
+
+	// This reads everything up to the first IDAT chunk.
+	png_read_info(png_ptr, info_ptr);
+
+	png_get_IHDR(png_ptr, info_ptr, &width, &height, &rctx.bit_depth, &rctx.color_type,
+		NULL, NULL, NULL);
+
+	if(!(rctx.color_type&PNG_COLOR_MASK_COLOR)) {
+		info->native_grayscale = 1;
+	}
+
+	// Predict the transformations that iw_read_png_file() will tell libpng to
+	// make.
+	has_trns=png_get_valid(png_ptr,info_ptr,PNG_INFO_tRNS);
+	if(rctx.color_type==PNG_COLOR_TYPE_PALETTE) {
+		rctx.color_type = has_trns ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+		rctx.bit_depth = 8;
+	}
+	else if(has_trns && !(rctx.color_type&PNG_COLOR_MASK_ALPHA)) {
+		rctx.color_type |= PNG_COLOR_MASK_ALPHA;
+		if(rctx.bit_depth<8) rctx.bit_depth = 8;
+	}
+
+	info->imgtype = iwpng_color_type_to_imgtype(rctx.color_type);
+	if(info->imgtype<0) {
+		iw_set_errorf(ctx,"This PNG image type (color type=%d, bit depth=%d) is not supported",
+			(int)rctx.color_type,(int)rctx.bit_depth);
+		goto done;
+	}
+
+	info->width = (int)width;
+	info->height = (int)height;
+	info->bit_depth = rctx.bit_depth;
+	info->sampletype = IW_SAMPLETYPE_UINT;
+	info->page_count = 1;
+	retval = 1;
+
+done:
+	if(!retval) {
+		iw_set_error(ctx,"Read failed");
+	}
+	if(png_ptr) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+	}
 	return retval;
 }
 
@@ -428,6 +553,15 @@ struct iwpngwcontext {
 
 	int bkgd_pal_entry_valid;
 	int bkgd_pal_entry; // Write the background color to this palette entry.
+
+	// Compression settings, set by iwpng_choose_settings().
+	int cmprlevel; // -1 = zlib's default
+	int strategy; // A zlib strategy, or -1 for libpng's default
+	int filter_mask; // PNG_FILTER_* flags, or 0 for libpng's default
+
+	// Buffers used by iwpng_write_idat_parallel().
+	iw_byte *filtered;
+	iw_byte *scratch;
 };
 
 static void iwpng_set_phys(struct iwpngwcontext *wctx)
@@ -606,10 +740,571 @@ static void my_png_flush_fn(png_structp png_ptr)
 {
 }
 
+// Parallel encoding: Instead of having libpng filter and compress the image,
+// we filter the rows ourselves (in parallel), compress the result with the
+// zlib module's parallel compressor, and have libpng write that as IDAT
+// chunks. This is done a band of rows at a time, so the filtered and
+// compressed data for the whole image is never in memory at once.
+
+// Smaller images aren't worth the trouble.
+#define IWPNG_MIN_PARALLEL_SIZE 1048576
+#define IWPNG_IDAT_SIZE 1048576
+#define IWPNG_BAND_SIZE 4194304
+
+struct iwpng_filter_ctx {
+	const struct iw_image *img;
+	int bit_depth; // PNG bit depth
+	int filter_mask; // PNG_FILTER_* flags. Ignored if bit_depth<8.
+	int multi_filter; // Set if filter_mask has more than one filter.
+	size_t rowbytes; // Not including the filter-type byte
+	size_t filter_bpp; // Bytes per pixel, rounded up to 1
+	iw_byte *filtered; // band_height rows of 1+rowbytes bytes
+	iw_byte *scratch; // 4*rowbytes bytes per job, if multi_filter
+	int num_jobs;
+	int band_start; // The rows currently being filtered
+	int band_height;
+};
+
+static const int iwpng_filter_flags[5] = { PNG_FILTER_NONE, PNG_FILTER_SUB,
+	PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH };
+
+static iw_byte iwpng_paeth(iw_byte a, iw_byte b, iw_byte c)
+{
+	int p, pa, pb, pc;
+
+	p = (int)a + (int)b - (int)c;
+	pa = abs(p-(int)a);
+	pb = abs(p-(int)b);
+	pc = abs(p-(int)c);
+	if(pa<=pb && pa<=pc) return a;
+	if(pb<=pc) return b;
+	return c;
+}
+
+// The heuristic libpng uses to choose a filter: the sum of the absolute
+// values of the filtered bytes, taken as signed numbers.
+static size_t iwpng_filter_cost(const iw_byte *row, size_t n)
+{
+	size_t i;
+	size_t cost = 0;
+
+	for(i=0;i<n;i++) {
+		cost += (row[i]<128) ? row[i] : 256-row[i];
+	}
+	return cost;
+}
+
+// Filter a row of an image with a bit depth of 8 or more, using the filter
+// in fctx->filter_mask that does best according to iwpng_filter_cost().
+// prev is NULL for the first row. dst[0] is set to the filter type.
+static void iwpng_filter_row(struct iwpng_filter_ctx *fctx, const iw_byte *cur,
+	const iw_byte *prev, iw_byte *scratch, iw_byte *dst)
+{
+	size_t i;
+	size_t n = fctx->rowbytes;
+	size_t bpp = fctx->filter_bpp;
+	iw_byte a, b, c;
+	const iw_byte *best = NULL;
+	size_t best_cost = 0;
+	size_t cost;
+	int best_type = 0;
+	int k;
+
+	for(k=0;k<=4;k++) {
+		iw_byte *f;
+
+		if(!(fctx->filter_mask & iwpng_filter_flags[k])) continue;
+
+		if(k==0) {
+			if(!fctx->multi_filter) {
+				best = cur;
+				break;
+			}
+			cost = iwpng_filter_cost(cur,n);
+			if(!best || cost<best_cost) {
+				best = cur;
+				best_type = 0;
+				best_cost = cost;
+			}
+			continue;
+		}
+
+		// With only one filter to try, filter directly into dst.
+		f = fctx->multi_filter ? &scratch[(k-1)*n] : &dst[1];
+		for(i=0;i<n;i++) {
+			a = (i>=bpp) ? cur[i-bpp] : 0;
+			b = prev ? prev[i] : 0;
+			c = (prev && i>=bpp) ? prev[i-bpp] : 0;
+			switch(k) {
+			case 1: f[i] = (iw_byte)(cur[i]-a); break;
+			case 2: f[i] = (iw_byte)(cur[i]-b); break;
+			case 3: f[i] = (iw_byte)(cur[i]-(iw_byte)(((unsigned int)a+(unsigned int)b)/2)); break;
+			default: f[i] = (iw_byte)(cur[i]-iwpng_paeth(a,b,c)); break;
+			}
+		}
+		if(!fctx->multi_filter) {
+			best = f;
+			best_type = k;
+			break;
+		}
+		cost = iwpng_filter_cost(f,n);
+		if(!best || cost<best_cost) {
+			best = f;
+			best_type = k;
+			best_cost = cost;
+		}
+	}
+
+	if(!best) best = cur;
+	dst[0] = (iw_byte)best_type;
+	if(best!=&dst[1]) memcpy(&dst[1],best,n);
+}
+
+// Pack a row of 1-byte samples into a row with 1, 2, or 4 bits per sample.
+static void iwpng_pack_row(struct iwpng_filter_ctx *fctx, const iw_byte *src,
+	iw_byte *dst)
+{
+	int i;
+	int bd = fctx->bit_depth;
+	int pixels_per_byte = 8/bd;
+	unsigned int mask = (1U<<bd)-1;
+
+	iw_zeromem(dst,fctx->rowbytes);
+	for(i=0;i<fctx->img->width;i++) {
+		dst[i/pixels_per_byte] |= (iw_byte)((src[i]&mask) <<
+			(8-bd-(i%pixels_per_byte)*bd));
+	}
+}
+
+// Write row j of the image, filtered, to dst (1+rowbytes bytes).
+static void iwpng_filter_image_row(struct iwpng_filter_ctx *fctx, int j,
+	iw_byte *scratch, iw_byte *dst)
+{
+	const struct iw_image *img = fctx->img;
+
+	if(fctx->bit_depth<8) {
+		dst[0] = 0;
+		iwpng_pack_row(fctx,&img->pixels[img->bpr*j],&dst[1]);
+	}
+	else {
+		iwpng_filter_row(fctx,&img->pixels[img->bpr*j],
+			(j>0) ? &img->pixels[img->bpr*(j-1)] : NULL,scratch,dst);
+	}
+}
+
+static void iwpng_filter_job(void *userdata, int job)
+{
+	struct iwpng_filter_ctx *fctx = (struct iwpng_filter_ctx*)userdata;
+	int j, j1, j2;
+
+	j1 = (int)(((double)fctx->band_height*job)/fctx->num_jobs);
+	j2 = (int)(((double)fctx->band_height*(job+1))/fctx->num_jobs);
+
+	for(j=j1;j<j2;j++) {
+		iwpng_filter_image_row(fctx,fctx->band_start+j,
+			fctx->scratch ? &fctx->scratch[4*fctx->rowbytes*job] : NULL,
+			&fctx->filtered[(1+fctx->rowbytes)*(size_t)j]);
+	}
+}
+
+// The filters libpng uses by default.
+static int iwpng_default_filter_mask(int lpng_color_type, int lpng_bit_depth)
+{
+	if(lpng_color_type!=PNG_COLOR_TYPE_PALETTE && lpng_bit_depth>=8)
+		return PNG_ALL_FILTERS;
+	return PNG_FILTER_NONE;
+}
+
+// The zlib strategy libpng uses by default, with the given filters.
+static int iwpng_default_strategy(int filter_mask)
+{
+#ifdef PNG_Z_DEFAULT_STRATEGY
+	return (filter_mask==PNG_FILTER_NONE) ? PNG_Z_DEFAULT_NOFILTER_STRATEGY :
+		PNG_Z_DEFAULT_STRATEGY;
+#else
+	return (filter_mask==PNG_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+#endif
+}
+
+static void iwpng_init_filter_ctx(struct iwpngwcontext *wctx,
+	struct iwpng_filter_ctx *fctx, int lpng_color_type, int lpng_bit_depth,
+	int filter_mask)
+{
+	int num_channels;
+	int k;
+	int num_filters = 0;
+
+	iw_zeromem(fctx,sizeof(struct iwpng_filter_ctx));
+
+	switch(lpng_color_type) {
+	case PNG_COLOR_TYPE_RGB_ALPHA: num_channels = 4; break;
+	case PNG_COLOR_TYPE_RGB: num_channels = 3; break;
+	case PNG_COLOR_TYPE_GRAY_ALPHA: num_channels = 2; break;
+	default: num_channels = 1;
+	}
+
+	fctx->img = wctx->img;
+	fctx->bit_depth = lpng_bit_depth;
+	fctx->filter_mask = filter_mask;
+	for(k=0;k<=4;k++) {
+		if(filter_mask & iwpng_filter_flags[k]) num_filters++;
+	}
+	fctx->multi_filter = (lpng_bit_depth>=8 && num_filters>1);
+	fctx->rowbytes = iw_calc_bytesperrow(wctx->img->width,lpng_bit_depth*num_channels);
+	fctx->filter_bpp = (lpng_bit_depth*num_channels+7)/8;
+}
+
+// Decide whether to use iwpng_write_idat_parallel(). The compressed data is
+// not the same as libpng's, so this is only done if the caller set the number
+// of threads to 2 or more; the default (0) means to write the file serially.
+// Returns the number of threads to use, or 0 if we shouldn't.
+static int iwpng_num_threads_to_use(struct iwpngwcontext *wctx,
+	int lpng_interlace_type)
+{
+	struct iw_zlib_module *zmod;
+	int num_threads;
+
+	num_threads = iw_get_value(wctx->ctx,IW_VAL_NUM_THREADS);
+	if(num_threads<2) return 0;
+
+	zmod = iw_get_zlib_module(wctx->ctx);
+	if(!zmod || !zmod->pdeflate_init) return 0;
+
+	if(lpng_interlace_type!=PNG_INTERLACE_NONE) return 0;
+	// We'd have to do the png_set_shift() transformation ourselves.
+	if(wctx->img->reduced_maxcolors) return 0;
+	if((size_t)wctx->img->height * wctx->img->bpr < IWPNG_MIN_PARALLEL_SIZE) return 0;
+	return num_threads;
+}
+
+// Write the IDAT and IEND chunks, doing the filtering and compression in
+// multiple threads.
+static int iwpng_write_idat_parallel(struct iwpngwcontext *wctx,
+	int lpng_color_type, int lpng_bit_depth, int num_threads)
+{
+	struct iwpng_filter_ctx fctx;
+	struct iw_zlib_module *zmod;
+	struct iw_zlib_pdeflate *pz = NULL;
+	const iw_byte *zdata;
+	size_t zlen;
+	size_t pos, n;
+	int filter_mask;
+	int strategy;
+	int band_rows;
+	int j;
+	int ret;
+	int retval = 0;
+
+	// Use the same default filters and strategy that libpng would.
+	filter_mask = wctx->filter_mask;
+	if(!filter_mask) {
+		filter_mask = iwpng_default_filter_mask(lpng_color_type,lpng_bit_depth);
+	}
+	strategy = (wctx->strategy>=0) ? wctx->strategy : iwpng_default_strategy(filter_mask);
+
+	iwpng_init_filter_ctx(wctx,&fctx,lpng_color_type,lpng_bit_depth,filter_mask);
+
+	band_rows = (int)(IWPNG_BAND_SIZE/(1+fctx.rowbytes));
+	if(band_rows<1) band_rows = 1;
+	if(band_rows>wctx->img->height) band_rows = wctx->img->height;
+	fctx.num_jobs = num_threads*4;
+	if(fctx.num_jobs>band_rows) fctx.num_jobs = band_rows;
+
+	wctx->filtered = iw_malloc_large(wctx->ctx,1+fctx.rowbytes,band_rows);
+	if(!wctx->filtered) goto done;
+	fctx.filtered = wctx->filtered;
+	if(fctx.multi_filter) {
+		wctx->scratch = iw_malloc_large(wctx->ctx,4*fctx.rowbytes,fctx.num_jobs);
+		if(!wctx->scratch) goto done;
+		fctx.scratch = wctx->scratch;
+	}
+
+	zmod = iw_get_zlib_module(wctx->ctx);
+	pz = (*zmod->pdeflate_init)(wctx->ctx,num_threads,wctx->cmprlevel,strategy);
+	if(!pz) goto done;
+
+	for(j=0; j<wctx->img->height; j+=band_rows) {
+		fctx.band_start = j;
+		fctx.band_height = wctx->img->height - j;
+		if(fctx.band_height>band_rows) fctx.band_height = band_rows;
+
+		iw_trace_begin(wctx->ctx,"png_filter_rows",-1);
+		iw_run_parallel(wctx->ctx,num_threads,fctx.num_jobs,iwpng_filter_job,(void*)&fctx);
+		iw_trace_end(wctx->ctx,"png_filter_rows",-1);
+
+		iw_trace_begin(wctx->ctx,"png_deflate",-1);
+		ret = (*zmod->pdeflate_write)(pz,wctx->filtered,
+			(1+fctx.rowbytes)*(size_t)fctx.band_height,
+			(j+fctx.band_height>=wctx->img->height),&zdata,&zlen);
+		iw_trace_end(wctx->ctx,"png_deflate",-1);
+		if(!ret) goto done;
+
+		for(pos=0; pos<zlen; pos+=n) {
+			n = zlen-pos;
+			if(n>IWPNG_IDAT_SIZE) n=IWPNG_IDAT_SIZE;
+			png_write_chunk(wctx->png_ptr,(png_bytep)"IDAT",(png_bytep)&zdata[pos],n);
+		}
+	}
+
+	// We can't use png_write_end(), because libpng doesn't know we wrote
+	// any image data.
+	png_write_chunk(wctx->png_ptr,(png_bytep)"IEND",NULL,0);
+	retval = 1;
+
+done:
+	if(pz) (*zmod->pdeflate_end)(pz);
+	return retval;
+}
+
+// Encoding profiles, selected with the "png:profile" option.
+#define IWPNG_PROFILE_DEFAULT  0
+#define IWPNG_PROFILE_FASTEST  1
+#define IWPNG_PROFILE_BALANCED 2
+#define IWPNG_PROFILE_SMALLEST 3
+
+// The "smallest" profile compresses up to this many bytes of sample rows
+// (but no more than 1/IWPNG_TRIAL_FRACTION of the image, unless the whole
+// image fits) with each combination of filters and strategy.
+#define IWPNG_TRIAL_SIZE 131072
+#define IWPNG_TRIAL_FRACTION 8
+#define IWPNG_TRIAL_BAND_ROWS 8
+
+// Filter rows of the image into dst. If num_bands is 0, all the rows are
+// used. Otherwise, num_bands bands of band_rows rows each, spread evenly over
+// the image.
+static void iwpng_trial_filter(struct iwpng_filter_ctx *fctx, int num_bands,
+	int band_rows, iw_byte *scratch, iw_byte *dst)
+{
+	const struct iw_image *img = fctx->img;
+	int b, j, j1;
+	size_t n = 0;
+
+	if(num_bands==0) {
+		for(j=0;j<img->height;j++) {
+			iwpng_filter_image_row(fctx,j,scratch,&dst[(1+fctx->rowbytes)*(size_t)j]);
+		}
+		return;
+	}
+
+	for(b=0;b<num_bands;b++) {
+		j1 = (int)(((double)(img->height-band_rows)*b)/num_bands);
+		for(j=j1;j<j1+band_rows;j++) {
+			iwpng_filter_image_row(fctx,j,scratch,&dst[(1+fctx->rowbytes)*n]);
+			n++;
+		}
+	}
+}
+
+static int iwpng_trial_compress(struct iwpngwcontext *wctx, const iw_byte *src,
+	size_t srclen, int num_threads, int strategy, size_t *plen)
+{
+	struct iw_zlib_module *zmod;
+	iw_byte *zbuf;
+
+	zmod = iw_get_zlib_module(wctx->ctx);
+	if(!(*zmod->deflate_parallel)(wctx->ctx,src,srclen,num_threads,wctx->cmprlevel,
+		strategy,&zbuf,plen))
+	{
+		return 0;
+	}
+	iw_free(wctx->ctx,zbuf);
+	return 1;
+}
+
+// Choose the filters and zlib strategy that best compress a sample of the
+// image's rows, at the compression level that will really be used. libpng's
+// default settings are one of the candidates, and anything else has to do
+// better than them. If the sample is not the whole image, the winner is then
+// checked against the default settings using the whole image.
+// On return, wctx->filter_mask and ->strategy are either set, or left at
+// libpng's defaults. Returns 0 if it couldn't be done.
+static int iwpng_trial_settings(struct iwpngwcontext *wctx,
+	int lpng_color_type, int lpng_bit_depth)
+{
+	static const int filter_masks[6] = { PNG_FILTER_NONE, PNG_FILTER_SUB,
+		PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS };
+	static const int strategies[3] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+	struct iw_zlib_module *zmod;
+	struct iwpng_filter_ctx fctx;
+	const struct iw_image *img = wctx->img;
+	iw_byte *sample = NULL;
+	iw_byte *scratch = NULL;
+	size_t len;
+	size_t best_len;
+	size_t default_len;
+	size_t sample_size;
+	int num_bands, band_rows;
+	int num_masks;
+	int default_mask, default_strategy;
+	int best_mask, best_strategy;
+	int num_threads;
+	int m, k;
+	int retval = 0;
+
+	zmod = iw_get_zlib_module(wctx->ctx);
+	if(!zmod || !zmod->deflate_parallel) goto done;
+
+	// Filtering isn't possible, in the way we do it, for bit depths under 8.
+	num_masks = (lpng_bit_depth<8) ? 1 : 6;
+
+	iwpng_init_filter_ctx(wctx,&fctx,lpng_color_type,lpng_bit_depth,PNG_ALL_FILTERS);
+
+	if((1+fctx.rowbytes)*(size_t)img->height <= IWPNG_TRIAL_SIZE) {
+		// The whole image is small enough to use as the sample.
+		num_bands = 0;
+		band_rows = img->height;
+	}
+	else {
+		// Use bands of consecutive rows, spread evenly over the image, so that
+		// the UP, AVG, and PAETH filters work as they will in the real image.
+		band_rows = IWPNG_TRIAL_BAND_ROWS;
+		if(band_rows>img->height) band_rows = img->height;
+		num_bands = (int)(IWPNG_TRIAL_SIZE/((1+fctx.rowbytes)*band_rows));
+		if(num_bands*band_rows > img->height/IWPNG_TRIAL_FRACTION)
+			num_bands = img->height/IWPNG_TRIAL_FRACTION/band_rows;
+		if(num_bands<1) num_bands = 1;
+	}
+	sample_size = (1+fctx.rowbytes)*(size_t)(num_bands ? num_bands*band_rows : img->height);
+
+	sample = iw_malloc_large(wctx->ctx,sample_size,1);
+	if(!sample) goto done;
+	scratch = iw_malloc_large(wctx->ctx,4,fctx.rowbytes);
+	if(!scratch) goto done;
+
+	default_mask = iwpng_default_filter_mask(lpng_color_type,lpng_bit_depth);
+	default_strategy = iwpng_default_strategy(default_mask);
+
+	// First, the default settings.
+	fctx.filter_mask = default_mask;
+	fctx.multi_filter = (default_mask==PNG_ALL_FILTERS);
+	iwpng_trial_filter(&fctx,num_bands,band_rows,scratch,sample);
+	if(!iwpng_trial_compress(wctx,sample,sample_size,1,default_strategy,&default_len))
+		goto done;
+	best_len = default_len;
+	best_mask = default_mask;
+	best_strategy = default_strategy;
+
+	for(m=0;m<num_masks;m++) {
+		fctx.filter_mask = filter_masks[m];
+		fctx.multi_filter = (filter_masks[m]==PNG_ALL_FILTERS);
+		iwpng_trial_filter(&fctx,num_bands,band_rows,scratch,sample);
+
+		for(k=0;k<3;k++) {
+			if(filter_masks[m]==default_mask && strategies[k]==default_strategy) continue;
+			if(!iwpng_trial_compress(wctx,sample,sample_size,1,strategies[k],&len))
+				goto done;
+			if(len<best_len) {
+				best_len = len;
+				best_mask = filter_masks[m];
+				best_strategy = strategies[k];
+			}
+		}
+	}
+
+	if(best_mask==default_mask && best_strategy==default_strategy) {
+		retval = 1;
+		goto done;
+	}
+
+	if(num_bands>0) {
+		// A sample doesn't always predict how well the whole image will
+		// compress, so compress the whole image with both settings.
+		iw_free(wctx->ctx,sample);
+		sample_size = (1+fctx.rowbytes)*(size_t)img->height;
+		sample = iw_malloc_large(wctx->ctx,1+fctx.rowbytes,img->height);
+		if(!sample) goto done;
+
+		num_threads = iw_get_value(wctx->ctx,IW_VAL_NUM_THREADS);
+
+		fctx.filter_mask = default_mask;
+		fctx.multi_filter = (default_mask==PNG_ALL_FILTERS);
+		iwpng_trial_filter(&fctx,0,0,scratch,sample);
+		if(!iwpng_trial_compress(wctx,sample,sample_size,num_threads,default_strategy,&default_len))
+			goto done;
+
+		if(best_mask!=default_mask) {
+			fctx.filter_mask = best_mask;
+			fctx.multi_filter = (best_mask==PNG_ALL_FILTERS);
+			iwpng_trial_filter(&fctx,0,0,scratch,sample);
+		}
+		if(!iwpng_trial_compress(wctx,sample,sample_size,num_threads,best_strategy,&best_len))
+			goto done;
+
+		if(best_len>=default_len) {
+			retval = 1;
+			goto done;
+		}
+	}
+
+	wctx->filter_mask = best_mask;
+	wctx->strategy = best_strategy;
+	retval = 1;
+done:
+	if(sample) iw_free(wctx->ctx,sample);
+	if(scratch) iw_free(wctx->ctx,scratch);
+	return retval;
+}
+
+// Set wctx->cmprlevel, ->strategy, and ->filter_mask.
+static void iwpng_choose_settings(struct iwpngwcontext *wctx,
+	int lpng_color_type, int lpng_bit_depth, int lpng_interlace_type)
+{
+	int profile = IWPNG_PROFILE_DEFAULT;
+	int is_indexed;
+	const char *optv;
+
+	// Paletted and bilevel images usually aren't helped by filtering, and
+	// compress quickly with run-length encoding (though often not as well,
+	// if they are dithered). Other images are assumed to be photo-like.
+	is_indexed = (lpng_color_type==PNG_COLOR_TYPE_PALETTE || lpng_bit_depth<8);
+
+	optv = iw_get_option(wctx->ctx, "png:profile");
+	if(optv) {
+		if(!strcmp(optv,"fastest")) profile = IWPNG_PROFILE_FASTEST;
+		else if(!strcmp(optv,"balanced")) profile = IWPNG_PROFILE_BALANCED;
+		else if(!strcmp(optv,"smallest")) profile = IWPNG_PROFILE_SMALLEST;
+		else iw_warningf(wctx->ctx,"Unknown PNG profile \"%s\"",optv);
+	}
+
+	wctx->cmprlevel = 9;
+	wctx->strategy = -1;
+	wctx->filter_mask = 0;
+
+	switch(profile) {
+	case IWPNG_PROFILE_FASTEST:
+		wctx->cmprlevel = 1;
+		wctx->filter_mask = is_indexed ? PNG_FILTER_NONE : PNG_FILTER_SUB;
+		wctx->strategy = is_indexed ? Z_RLE : Z_FILTERED;
+		break;
+	case IWPNG_PROFILE_BALANCED:
+		// libpng's default filters and strategy work well enough.
+		wctx->cmprlevel = 6;
+		break;
+	}
+
+	// An explicit compression level overrides the profile's.
+	optv = iw_get_option(wctx->ctx, "deflate:cmprlevel");
+	if(optv) {
+		wctx->cmprlevel = iw_parse_int(optv);
+	}
+
+	// The trial compression filters the rows the way they are in the image,
+	// which isn't how they will be written if the image is interlaced, or if
+	// libpng has to shift the samples. In those cases, just use the defaults.
+	if(profile==IWPNG_PROFILE_SMALLEST && lpng_interlace_type==PNG_INTERLACE_NONE &&
+		!wctx->img->reduced_maxcolors)
+	{
+		// If this fails, we'll just use the default filters and strategy.
+		iw_trace_begin(wctx->ctx,"png_trial_compress",-1);
+		iwpng_trial_settings(wctx,lpng_color_type,lpng_bit_depth);
+		iw_trace_end(wctx->ctx,"png_trial_compress",-1);
+	}
+}
+
 IW_IMPL(int) iw_write_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
 {
-	iw_byte **row_pointers = NULL;
 	int i;
+	int pass, num_passes;
 	jmp_buf jbuf;
 	struct errstruct errinfo;
 	int lpng_color_type;
@@ -623,9 +1318,8 @@ IW_IMPL(int) iw_write_png_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 	const struct iw_palette *iwpal = NULL;
 	int no_cslabel;
 	int palette_is_gray;
-	int cmprlevel;
+	int num_threads;
 	struct iwpngwcontext wctx;
-	const char *optv;
 
 	iw_zeromem(&wctx,sizeof(struct iwpngwcontext));
 
@@ -645,15 +1339,6 @@ IW_IMPL(int) iw_write_png_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 		(void*)ctx, my_png_malloc_fn, my_png_free_fn);
 	if(!png_ptr) goto done;
 
-	cmprlevel = 9;
-	optv = iw_get_option(ctx, "deflate:cmprlevel");
-	if(optv) {
-		cmprlevel = iw_parse_int(optv);
-	}
-	if(cmprlevel >= 0) {
-		png_set_compression_level(png_ptr, cmprlevel);
-	}
-
 	png_set_compression_buffer_size(png_ptr, 1048576);
 
 	info_ptr = png_create_info_struct(png_ptr);
@@ -749,22 +1434,42 @@ IW_IMPL(int) iw_write_png_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 		png_set_shift(png_ptr,&sbit);
 	}
 
-	png_write_info(png_ptr, info_ptr);
-
-	row_pointers = (iw_byte**)iw_malloc(ctx, img.height * sizeof(iw_byte*));
-	if(!row_pointers) goto done;
-
-	for(i=0;i<img.height;i++) {
-		row_pointers[i] = &img.pixels[img.bpr*i];
+	iwpng_choose_settings(&wctx, lpng_color_type, lpng_bit_depth, lpng_interlace_type);
+	if(wctx.cmprlevel >= 0) {
+		png_set_compression_level(png_ptr, wctx.cmprlevel);
+	}
+	if(wctx.strategy >= 0) {
+		png_set_compression_strategy(png_ptr, wctx.strategy);
+	}
+	if(wctx.filter_mask) {
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, wctx.filter_mask);
 	}
 
-	if(lpng_bit_depth<8) {
-		png_set_packing(png_ptr);
+	png_write_info(png_ptr, info_ptr);
+
+	num_threads = iwpng_num_threads_to_use(&wctx, lpng_interlace_type);
+	if(num_threads>0) {
+		if(!iwpng_write_idat_parallel(&wctx, lpng_color_type, lpng_bit_depth, num_threads))
+			goto done;
 	}
+	else {
+		if(lpng_bit_depth<8) {
+			png_set_packing(png_ptr);
+		}
 
-	png_write_image(png_ptr, row_pointers);
+		// Hand the rows to libpng one at a time. An interlaced image has to
+		// be supplied once per pass.
+		num_passes = png_set_interlace_handling(png_ptr);
+		iw_trace_begin(ctx,"png_write_rows",-1);
+		for(pass=0;pass<num_passes;pass++) {
+			for(i=0;i<img.height;i++) {
+				png_write_row(png_ptr, &img.pixels[img.bpr*i]);
+			}
+		}
+		iw_trace_end(ctx,"png_write_rows",-1);
 
-	png_write_end(png_ptr, info_ptr);
+		png_write_end(png_ptr, info_ptr);
+	}
 
 	retval = 1;
 
@@ -775,7 +1480,8 @@ done:
 	if(png_ptr) {
 		png_destroy_write_struct(&png_ptr, &info_ptr);
 	}
-	if(row_pointers) iw_free(ctx,row_pointers);
+	if(wctx.filtered) iw_free(ctx,wctx.filtered);
+	if(wctx.scratch) iw_free(ctx,wctx.scratch);
 	return retval;
 }
 
@@ -4,6 +4,7 @@
 
 #include "imagew-config.h"
 
+#include <stdio.h> // for SEEK_CUR
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
@@ -19,6 +20,11 @@ struct iwpnmrcontext {
 	int file_format;
 	int color_count;
 	int num_channels_pam;
+
+	// If we're only reading part of the image (see iw_get_input_crop()):
+	int use_crop;
+	int crop_x, crop_y;
+	int full_width, full_height;
 };
 
 static int iwpnm_read_byte(struct iwpnmrcontext *rctx, iw_byte *b)
@@ -52,6 +58,24 @@ static int iwpnm_read(struct iwpnmrcontext *rctx,
 	return 1;
 }
 
+static int iwpnm_skip_bytes(struct iwpnmrcontext *rctx, size_t n)
+{
+	iw_byte buf[1024];
+	size_t num_to_read;
+
+	if(rctx->iodescr->seek_fn) {
+		return (*rctx->iodescr->seek_fn)(rctx->ctx,rctx->iodescr,(iw_int64)n,SEEK_CUR);
+	}
+
+	while(n>0) {
+		num_to_read = n;
+		if(num_to_read>sizeof(buf)) num_to_read=sizeof(buf);
+		if(!iwpnm_read(rctx,buf,num_to_read)) return 0;
+		n -= num_to_read;
+	}
+	return 1;
+}
+
 static int iwpnm_is_whitespace(iw_byte b)
 {
 	return (b==9 || b==10 || b==13 || b==32);
@@ -105,118 +129,123 @@ static int iwpnm_read_next_token(struct iwpnmrcontext *rctx,
 	return 0;
 }
 
-// Read a binary PBM/PGM/PPM/PAM bitmap.
-static int iwpnm_read_pnm_bitmap(struct iwpnmrcontext *rctx)
+// Decide on the image type and bit depth to use, based on the header.
+// Sets *ppnm_bpr to the number of bytes per row in the file.
+static int iwpnm_set_image_type(struct iwpnmrcontext *rctx, int *ppnm_bpr)
 {
-	int i,j;
-	int pnm_bytesperpix;
-	int pnm_bpr;
-	int retval = 0;
+	int pnm_channels;
 
 	if(rctx->file_format_code==4) { // PBM
 		rctx->img->imgtype = IW_IMGTYPE_GRAY;
 		rctx->img->native_grayscale = 1;
 		rctx->img->bit_depth = 1;
-		pnm_bpr = (rctx->img->width+7)/8;
+		*ppnm_bpr = (rctx->img->width+7)/8;
+		return 1;
 	}
-	else if(rctx->file_format_code==5 ||
+
+	if(rctx->file_format_code==5 ||
 		(rctx->file_format_code==7 && rctx->num_channels_pam==1))  // PGM or PAM-GRAYSCALE
 	{
 		rctx->img->imgtype = IW_IMGTYPE_GRAY;
 		rctx->img->native_grayscale = 1;
-		if(rctx->color_count>=256) {
-			rctx->img->bit_depth = 16;
-			pnm_bytesperpix = 2;
-		}
-		else {
-			rctx->img->bit_depth = 8;
-			pnm_bytesperpix = 1;
-		}
-		pnm_bpr = pnm_bytesperpix * rctx->img->width;
-		if(rctx->color_count!=255 && rctx->color_count!=65535) {
-			iw_set_input_max_color_code(rctx->ctx, 0, rctx->color_count);
-		}
 	}
 	else if(rctx->file_format_code==6 ||
 		(rctx->file_format_code==7 && rctx->num_channels_pam==3)) // PPM or PAM-RGB
 	{
 		rctx->img->imgtype = IW_IMGTYPE_RGB;
-		if(rctx->color_count>=256) {
-			rctx->img->bit_depth = 16;
-			pnm_bytesperpix = 6;
-		}
-		else {
-			rctx->img->bit_depth = 8;
-			pnm_bytesperpix = 3;
-		}
-		pnm_bpr = pnm_bytesperpix * rctx->img->width;
-		if(rctx->color_count!=255 && rctx->color_count!=65535) {
-			iw_set_input_max_color_code(rctx->ctx, 0, rctx->color_count);
-			iw_set_input_max_color_code(rctx->ctx, 1, rctx->color_count);
-			iw_set_input_max_color_code(rctx->ctx, 2, rctx->color_count);
-		}
 	}
 	else if(rctx->file_format_code==7 && rctx->num_channels_pam==2) { // PAM-GRAYSCALE_ALPHA
 		rctx->img->imgtype = IW_IMGTYPE_GRAYA;
-		if(rctx->color_count>=256) {
-			rctx->img->bit_depth = 16;
-			pnm_bytesperpix = 4;
-		}
-		else {
-			rctx->img->bit_depth = 8;
-			pnm_bytesperpix = 2;
-		}
-		pnm_bpr = pnm_bytesperpix * rctx->img->width;
-		if(rctx->color_count!=255 && rctx->color_count!=65535) {
-			iw_set_input_max_color_code(rctx->ctx, 0, rctx->color_count);
-			iw_set_input_max_color_code(rctx->ctx, 1, rctx->color_count);
-		}
 	}
 	else if(rctx->file_format_code==7 && rctx->num_channels_pam==4) { // PAM-RGB_ALPHA
 		rctx->img->imgtype = IW_IMGTYPE_RGBA;
-		if(rctx->color_count>=256) {
-			rctx->img->bit_depth = 16;
-			pnm_bytesperpix = 8;
-		}
-		else {
-			rctx->img->bit_depth = 8;
-			pnm_bytesperpix = 4;
-		}
-		pnm_bpr = pnm_bytesperpix * rctx->img->width;
-		if(rctx->color_count!=255 && rctx->color_count!=65535) {
-			iw_set_input_max_color_code(rctx->ctx, 0, rctx->color_count);
-			iw_set_input_max_color_code(rctx->ctx, 1, rctx->color_count);
-			iw_set_input_max_color_code(rctx->ctx, 2, rctx->color_count);
-			iw_set_input_max_color_code(rctx->ctx, 3, rctx->color_count);
-		}
 	}
-
 	else {
 		iw_set_error(rctx->ctx,"Unsupported PNM/PAM image type");
-		goto done;
+		return 0;
+	}
+
+	pnm_channels = iw_imgtype_num_channels(rctx->img->imgtype);
+	rctx->img->bit_depth = (rctx->color_count>=256) ? 16 : 8;
+	*ppnm_bpr = pnm_channels * (rctx->img->bit_depth/8) * rctx->img->width;
+	return 1;
+}
+
+// Read a binary PBM/PGM/PPM/PAM bitmap.
+static int iwpnm_read_pnm_bitmap(struct iwpnmrcontext *rctx)
+{
+	int i,j;
+	int k;
+	int pnm_bpr = 0;
+	int crop_w, crop_h;
+	size_t col_offset = 0;
+	iw_byte *rowbuf = NULL;
+	iw_byte *dstrow;
+	int retval = 0;
+
+	if(!iwpnm_set_image_type(rctx,&pnm_bpr)) goto done;
+
+	if(rctx->file_format_code!=4 &&
+		rctx->color_count!=255 && rctx->color_count!=65535)
+	{
+		for(k=0;k<iw_imgtype_num_channels(rctx->img->imgtype);k++) {
+			iw_set_input_max_color_code(rctx->ctx, k, rctx->color_count);
+		}
 	}
 
 	rctx->img->bpr = pnm_bpr;
 
+	// If the caller only wants part of the image, read only the rows it
+	// needs, and (except for PBM) keep only the columns it needs.
+	rctx->full_width = rctx->img->width;
+	rctx->full_height = rctx->img->height;
+	if(iw_get_input_crop(rctx->ctx,rctx->full_width,rctx->full_height,
+		&rctx->crop_x,&rctx->crop_y,&crop_w,&crop_h))
+	{
+		rctx->use_crop = 1;
+		if(rctx->file_format_code==4) {
+			rctx->crop_x = 0;
+		}
+		else {
+			col_offset = (size_t)rctx->crop_x * (pnm_bpr/rctx->full_width);
+			rctx->img->width = crop_w;
+			rctx->img->bpr = (size_t)crop_w * (pnm_bpr/rctx->full_width);
+		}
+		rctx->img->height = crop_h;
+
+		if(rctx->img->width != rctx->full_width) {
+			rowbuf = iw_malloc(rctx->ctx,pnm_bpr);
+			if(!rowbuf) goto done;
+		}
+
+		if(!iwpnm_skip_bytes(rctx,(size_t)pnm_bpr*rctx->crop_y)) goto done;
+	}
+
 	rctx->img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx,rctx->img->bpr,rctx->img->height);
 	if(!rctx->img->pixels) goto done;
 
 	for(j=0;j<rctx->img->height;j++) {
+		dstrow = &rctx->img->pixels[j*rctx->img->bpr];
 		// Binary PNM files are identical or very similar to our internal format,
 		// so we can read them directly.
-		if(!iwpnm_read(rctx, &rctx->img->pixels[j*rctx->img->bpr], pnm_bpr)) {
-			goto done;
+		if(rowbuf) {
+			if(!iwpnm_read(rctx, rowbuf, pnm_bpr)) goto done;
+			memcpy(dstrow, &rowbuf[col_offset], rctx->img->bpr);
+		}
+		else {
+			if(!iwpnm_read(rctx, dstrow, pnm_bpr)) goto done;
 		}
 		if(rctx->file_format_code==4) {
 			// PBM images need to be inverted.
 			for(i=0;i<pnm_bpr;i++) {
-				rctx->img->pixels[j*rctx->img->bpr+i] = 255-rctx->img->pixels[j*rctx->img->bpr+i];
+				dstrow[i] = 255-dstrow[i];
 			}
 		}
 	}
 
 	retval = 1;
 done:
+	if(rowbuf) iw_free(rctx->ctx,rowbuf);
 	return retval;
 }
 
@@ -468,6 +497,10 @@ IW_IMPL(int) iw_read_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	iw_set_input_image(ctx, img);
 	// The contents of img no longer belong to us.
 	img->pixels = NULL;
+	if(rctx->use_crop) {
+		iw_set_input_image_offset(ctx,rctx->crop_x,rctx->crop_y,
+			rctx->full_width,rctx->full_height);
+	}
 
 	retval = 1;
 
@@ -485,6 +518,45 @@ IW_IMPL(int) iw_read_pam_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	return iw_read_pnm_file(ctx, iodescr);
 }
 
+IW_IMPL(int) iw_probe_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info)
+{
+	struct iwpnmrcontext rctx;
+	struct iw_image img;
+	int pnm_bpr;
+	int retval = 0;
+
+	iw_zeromem(info,sizeof(struct iw_image_info));
+	iw_zeromem(&rctx,sizeof(struct iwpnmrcontext));
+	iw_zeromem(&img,sizeof(struct iw_image));
+
+	rctx.ctx = ctx;
+	rctx.img = &img;
+	rctx.iodescr = iodescr;
+
+	if(!iwpnm_read_header(&rctx)) {
+		iw_set_error(ctx, "Error parsing header");
+		goto done;
+	}
+	if(img.width<1 || img.height<1) {
+		iw_set_error(ctx, "Invalid image dimensions");
+		goto done;
+	}
+	if(!iwpnm_set_image_type(&rctx,&pnm_bpr)) goto done;
+
+	info->width = img.width;
+	info->height = img.height;
+	info->imgtype = img.imgtype;
+	info->bit_depth = img.bit_depth;
+	info->sampletype = IW_SAMPLETYPE_UINT;
+	info->native_grayscale = img.native_grayscale;
+	info->page_count = 1;
+	retval = 1;
+
+done:
+	return retval;
+}
+
 struct iwpnmwcontext {
 	struct iw_iodescr *iodescr;
 	struct iw_context *ctx;
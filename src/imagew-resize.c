@@ -30,6 +30,11 @@ struct iw_rr_ctx {
 
 	int num_in_pix;
 	int num_out_pix;
+	// Only output pixels out_start through out_start+out_count-1 are computed.
+	// out_pix[0] is output pixel out_start, and in_pix[0] is input pixel
+	// in_start.
+	int out_start, out_count;
+	int in_start;
 	iw_tmpsample *in_pix; // A single row of source samples to resample.
 	iw_tmpsample *out_pix; // The resulting resampled row.
 
@@ -192,8 +197,8 @@ static void weightlist_ensure_alloc(struct iw_rr_ctx *rrctx, int n)
 	old_alloc = rrctx->wl_alloc;
 	rrctx->wl_alloc = n+32;
 
-	// Note that rrctx->wl may be NULL, which iw_realloc() allows.
-	rrctx->wl = iw_realloc(rrctx->ctx,rrctx->wl,
+	// Note that rrctx->wl may be NULL, which iwpvt_scratch_realloc() allows.
+	rrctx->wl = iwpvt_scratch_realloc(rrctx->ctx,rrctx->wl,
 		sizeof(struct iw_weight_struct)*old_alloc,
 		sizeof(struct iw_weight_struct)*rrctx->wl_alloc);
 
@@ -206,13 +211,15 @@ static void weightlist_ensure_alloc(struct iw_rr_ctx *rrctx, int n)
 static void weightlist_free(struct iw_rr_ctx *rrctx)
 {
 	if(rrctx->wl) {
-		iw_free(rrctx->ctx,rrctx->wl);
+		iwpvt_scratch_free(rrctx->ctx,rrctx->wl);
 		rrctx->wl = NULL;
 		rrctx->wl_alloc = 0;
 		rrctx->wl_used = 0;
 	}
 }
 
+// src_pix and dst_pix are full-image pixel numbers, except that src_pix can
+// be -1.
 static void weightlist_add_weight(struct iw_rr_ctx *rrctx, int src_pix, int dst_pix, double v)
 {
 	if(v==0.0) return;
@@ -220,8 +227,8 @@ static void weightlist_add_weight(struct iw_rr_ctx *rrctx, int src_pix, int dst_
 		weightlist_ensure_alloc(rrctx,rrctx->wl_used+1);
 		if(!rrctx->wl) return;
 	}
-	rrctx->wl[rrctx->wl_used].src_pix = src_pix;
-	rrctx->wl[rrctx->wl_used].dst_pix = dst_pix;
+	rrctx->wl[rrctx->wl_used].src_pix = (src_pix>=0) ? src_pix-rrctx->in_start : -1;
+	rrctx->wl[rrctx->wl_used].dst_pix = dst_pix-rrctx->out_start;
 	rrctx->wl[rrctx->wl_used].weight = v;
 	rrctx->wl_used++;
 }
@@ -266,13 +273,13 @@ static void iw_create_weightlist_std(struct iw_context *ctx, struct iw_rr_ctx *r
 	reduction_factor *= rrctx->blur_factor;
 
 	// Estimate the size of the weight list we'll need.
-	est_nweights = (int)(2.0*rrctx->radius*reduction_factor*rrctx->num_out_pix);
+	est_nweights = (int)(2.0*rrctx->radius*reduction_factor*rrctx->out_count);
 	weightlist_ensure_alloc(rrctx,est_nweights);
 	if(!rrctx->wl) {
 		return;
 	}
 
-	for(out_pix=0;out_pix<rrctx->num_out_pix;out_pix++) {
+	for(out_pix=rrctx->out_start;out_pix<rrctx->out_start+rrctx->out_count;out_pix++) {
 		out_pix_center = (0.5+(double)out_pix-rrctx->offset)/rrctx->out_true_size;
 		pos_in_inpix = out_pix_center*(double)rrctx->num_in_pix -0.5;
 
@@ -350,7 +357,7 @@ static void iw_resize_row_std(struct iw_rr_ctx *rrctx)
 
 	if(!rrctx->wl) return;
 
-	for(i=0;i<rrctx->num_out_pix;i++) {
+	for(i=0;i<rrctx->out_count;i++) {
 		rrctx->out_pix[i] = 0.0;
 	}
 
@@ -374,21 +381,25 @@ static void iw_resize_row_std(struct iw_rr_ctx *rrctx)
 // that uses a weightlist, we use a special algorithm for it. For one thing,
 // this ensures that it does literally use the nearest neighbor, and is not
 // affected by blur settings.
-static void iw_resize_row_nearest(struct iw_rr_ctx *rrctx)
+static int iw_nearest_src_pix(struct iw_rr_ctx *rrctx, int out_pix)
 {
-	int out_pix;
 	double out_pix_center;
 	int input_pixel;
-	int pix_to_read;
 
-	for(out_pix=0;out_pix<rrctx->num_out_pix;out_pix++) {
-		out_pix_center = (0.5+(double)out_pix-rrctx->offset)/(double)rrctx->num_out_pix;
-		input_pixel = (int)floor(out_pix_center*(double)rrctx->num_in_pix);
+	out_pix_center = (0.5+(double)out_pix-rrctx->offset)/(double)rrctx->num_out_pix;
+	input_pixel = (int)floor(out_pix_center*(double)rrctx->num_in_pix);
+
+	if(input_pixel<0) return 0;
+	if(input_pixel>rrctx->num_in_pix-1) return rrctx->num_in_pix-1;
+	return input_pixel;
+}
+
+static void iw_resize_row_nearest(struct iw_rr_ctx *rrctx)
+{
+	int i;
 
-		if(input_pixel<0) pix_to_read=0;
-		else if(input_pixel>rrctx->num_in_pix-1) pix_to_read = rrctx->num_in_pix-1;
-		else pix_to_read = input_pixel;
-		rrctx->out_pix[out_pix] = rrctx->in_pix[pix_to_read];
+	for(i=0;i<rrctx->out_count;i++) {
+		rrctx->out_pix[i] = rrctx->in_pix[iw_nearest_src_pix(rrctx,rrctx->out_start+i)-rrctx->in_start];
 	}
 }
 
@@ -399,9 +410,11 @@ static void iw_resize_row_nearest(struct iw_rr_ctx *rrctx)
 static void iw_resize_row_null(struct iw_rr_ctx *rrctx)
 {
 	int i;
-	for(i=0;i<rrctx->num_out_pix;i++) {
-		if(i<rrctx->num_in_pix) {
-			rrctx->out_pix[i] =rrctx->in_pix[i];
+	int out_pix;
+	for(i=0;i<rrctx->out_count;i++) {
+		out_pix = rrctx->out_start+i;
+		if(out_pix<rrctx->num_in_pix) {
+			rrctx->out_pix[i] =rrctx->in_pix[out_pix-rrctx->in_start];
 		}
 		else {
 			rrctx->out_pix[i] = 0.0;
@@ -415,7 +428,7 @@ struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
 {
 	struct iw_rr_ctx *rrctx = NULL;
 
-	rrctx = iw_mallocz(ctx,sizeof(struct iw_rr_ctx));
+	rrctx = iwpvt_scratch_alloc(ctx,IW_MALLOCFLAG_ZEROMEM,sizeof(struct iw_rr_ctx),1);
 	if(!rrctx) goto done;
 
 	// rrctx stores the internal settings we'll use to resize (the current
@@ -429,6 +442,9 @@ struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
 
 	rrctx->num_in_pix = num_in_pix;
 	rrctx->num_out_pix = num_out_pix;
+	rrctx->out_start = rs->out_region_start;
+	rrctx->out_count = rs->out_region_size;
+	rrctx->in_start = rs->in_region_start;
 	rrctx->out_true_size = rs->out_true_size;
 
 	// Gather filter-specific information.
@@ -559,7 +575,78 @@ void iwpvt_resize_rows_done(struct iw_rr_ctx *rrctx)
 {
 	if(!rrctx) return;
 	weightlist_free(rrctx);
-	iw_free(rrctx->ctx,rrctx);
+	iwpvt_scratch_free(rrctx->ctx,rrctx);
+}
+
+// The number of input samples used to resize one row, for statistics.
+int iwpvt_resize_row_taps(struct iw_rr_ctx *rrctx)
+{
+	if(!rrctx || !rrctx->resizerow_fn) return 0;
+	if(rrctx->resizerow_fn==iw_resize_row_std) return rrctx->wl_used;
+	if(rrctx->resizerow_fn==iw_resize_row_nearest) return rrctx->out_count;
+	return 0;
+}
+
+// Update *pfirst and *plast to include the input pixels used by rrctx.
+static void iw_update_input_range(struct iw_rr_ctx *rrctx, int *pfirst, int *plast)
+{
+	int i;
+	int first = -1, last = -1;
+
+	if(rrctx->resizerow_fn==iw_resize_row_std) {
+		for(i=0;i<rrctx->wl_used;i++) {
+			if(rrctx->wl[i].src_pix<0) continue;
+			if(first<0 || rrctx->wl[i].src_pix<first) first = rrctx->wl[i].src_pix;
+			if(rrctx->wl[i].src_pix>last) last = rrctx->wl[i].src_pix;
+		}
+	}
+	else if(rrctx->resizerow_fn==iw_resize_row_nearest) {
+		// The source pixel never decreases as the output pixel increases.
+		if(rrctx->out_count>0) {
+			first = iw_nearest_src_pix(rrctx,rrctx->out_start);
+			last = iw_nearest_src_pix(rrctx,rrctx->out_start+rrctx->out_count-1);
+		}
+	}
+	else if(rrctx->resizerow_fn==iw_resize_row_null) {
+		if(rrctx->out_start<rrctx->num_in_pix) {
+			first = rrctx->out_start;
+			last = rrctx->out_start+rrctx->out_count-1;
+			if(last>rrctx->num_in_pix-1) last = rrctx->num_in_pix-1;
+		}
+	}
+
+	if(first<0) return;
+	if(*pfirst<0 || first<*pfirst) *pfirst = first;
+	if(last>*plast) *plast = last;
+}
+
+// Figure out which input pixels are needed to compute the output pixels in
+// rs's output region. rs->in_region_start must be 0.
+void iwpvt_resize_input_range(struct iw_context *ctx, struct iw_resize_settings *rs,
+  int num_in_pix, int *pstart, int *psize)
+{
+	struct iw_rr_ctx *rrctx;
+	int first = -1, last = -1;
+	int channeltype;
+	int num_channeltypes;
+
+	// Channel offsets make the red, green, and blue channels use different
+	// input pixels. (Channel type 3 is not offset.)
+	num_channeltypes = rs->use_offset ? 4 : 1;
+
+	for(channeltype=0;channeltype<num_channeltypes;channeltype++) {
+		rrctx = iwpvt_resize_rows_init(ctx,rs,channeltype,num_in_pix,rs->out_size);
+		if(!rrctx) break;
+		iw_update_input_range(rrctx,&first,&last);
+		iwpvt_resize_rows_done(rrctx);
+	}
+
+	if(first<0) {
+		// No input pixels are needed, but it's simpler to pretend one is.
+		first = last = 0;
+	}
+	*pstart = first;
+	*psize = last-first+1;
 }
 
 void iwpvt_resize_row_main(struct iw_rr_ctx *rrctx, iw_tmpsample *in_pix, iw_tmpsample *out_pix)
@@ -0,0 +1,256 @@
+// imagew-thread.c
+// Part of ImageWorsener, Copyright (c) 2011 by Jason Summers.
+// For more information, see the readme.txt file.
+
+// A minimal portable worker pool, for running independent jobs in parallel.
+// If thread support is disabled, the jobs are simply run one at a time.
+
+#include "imagew-config.h"
+
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#endif
+
+#include <stdlib.h>
+
+#define IW_INCLUDE_UTIL_FUNCTIONS
+#include "imagew.h"
+
+struct iwthr_pool {
+	iw_paralleljobfn_type fn;
+	void *userdata;
+	int num_jobs;
+	int next_job;
+#if IW_SUPPORT_THREADS == 1
+	int use_lock;
+#ifdef IW_WINDOWS
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+#endif
+};
+
+// Returns the index of the next job to run, or -1 if there are none left.
+static int iwthr_get_next_job(struct iwthr_pool *pool)
+{
+	int job;
+
+#if IW_SUPPORT_THREADS == 1
+	if(pool->use_lock) {
+#ifdef IW_WINDOWS
+		EnterCriticalSection(&pool->lock);
+#else
+		pthread_mutex_lock(&pool->lock);
+#endif
+	}
+#endif
+
+	if(pool->next_job < pool->num_jobs) {
+		job = pool->next_job++;
+	}
+	else {
+		job = -1;
+	}
+
+#if IW_SUPPORT_THREADS == 1
+	if(pool->use_lock) {
+#ifdef IW_WINDOWS
+		LeaveCriticalSection(&pool->lock);
+#else
+		pthread_mutex_unlock(&pool->lock);
+#endif
+	}
+#endif
+
+	return job;
+}
+
+static void iwthr_run_jobs(struct iwthr_pool *pool)
+{
+	int job;
+
+	while((job = iwthr_get_next_job(pool)) >= 0) {
+		(*pool->fn)(pool->userdata, job);
+	}
+}
+
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+static DWORD WINAPI iwthr_worker_main(LPVOID arg)
+{
+	iwthr_run_jobs((struct iwthr_pool*)arg);
+	return 0;
+}
+#else
+static void *iwthr_worker_main(void *arg)
+{
+	iwthr_run_jobs((struct iwthr_pool*)arg);
+	return NULL;
+}
+#endif
+#endif
+
+IW_IMPL(int) iw_get_num_cpus(void)
+{
+	int n = 1;
+
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	n = (int)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+#endif
+
+	if(n<1) n=1;
+	return n;
+}
+
+IW_IMPL(void) iw_run_parallel(struct iw_context *ctx, int num_threads, int num_jobs,
+	iw_paralleljobfn_type fn, void *userdata)
+{
+	struct iwthr_pool pool;
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+	HANDLE *threads = NULL;
+#else
+	pthread_t *threads = NULL;
+#endif
+	int num_started = 0;
+	int i;
+#endif
+
+	if(num_jobs<1) return;
+
+	iw_zeromem(&pool,sizeof(struct iwthr_pool));
+	pool.fn = fn;
+	pool.userdata = userdata;
+	pool.num_jobs = num_jobs;
+
+	if(num_threads<1) num_threads = iw_get_num_cpus();
+	if(num_threads>num_jobs) num_threads = num_jobs;
+
+#if IW_SUPPORT_THREADS == 1
+	if(num_threads>1) {
+		threads = iw_malloc_ex(ctx,IW_MALLOCFLAG_NOERRORS,(num_threads-1)*sizeof(*threads));
+	}
+
+	if(threads) {
+#ifdef IW_WINDOWS
+		InitializeCriticalSection(&pool.lock);
+#else
+		pthread_mutex_init(&pool.lock,NULL);
+#endif
+		pool.use_lock = 1;
+
+		// The calling thread also runs jobs, so start one fewer worker thread
+		// than requested. If a thread can't be started, we just make do with
+		// the ones we have.
+		for(i=0; i<num_threads-1; i++) {
+#ifdef IW_WINDOWS
+			threads[num_started] = CreateThread(NULL,0,iwthr_worker_main,(LPVOID)&pool,0,NULL);
+			if(!threads[num_started]) break;
+#else
+			if(pthread_create(&threads[num_started],NULL,iwthr_worker_main,(void*)&pool)) break;
+#endif
+			num_started++;
+		}
+
+		iwthr_run_jobs(&pool);
+
+		for(i=0; i<num_started; i++) {
+#ifdef IW_WINDOWS
+			WaitForSingleObject(threads[i],INFINITE);
+			CloseHandle(threads[i]);
+#else
+			pthread_join(threads[i],NULL);
+#endif
+		}
+
+#ifdef IW_WINDOWS
+		DeleteCriticalSection(&pool.lock);
+#else
+		pthread_mutex_destroy(&pool.lock);
+#endif
+		iw_free(ctx,threads);
+		return;
+	}
+#endif
+
+	iwthr_run_jobs(&pool);
+}
+
+struct iw_mutex {
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+#else
+	int unused;
+#endif
+};
+
+IW_IMPL(struct iw_mutex*) iw_create_mutex(struct iw_context *ctx)
+{
+	struct iw_mutex *m;
+
+	m = iw_mallocz(ctx,sizeof(struct iw_mutex));
+	if(!m) return NULL;
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+	InitializeCriticalSection(&m->lock);
+#else
+	if(pthread_mutex_init(&m->lock,NULL)) {
+		iw_free(ctx,m);
+		return NULL;
+	}
+#endif
+#endif
+	return m;
+}
+
+IW_IMPL(void) iw_destroy_mutex(struct iw_context *ctx, struct iw_mutex *m)
+{
+	if(!m) return;
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+	DeleteCriticalSection(&m->lock);
+#else
+	pthread_mutex_destroy(&m->lock);
+#endif
+#endif
+	iw_free(ctx,m);
+}
+
+IW_IMPL(void) iw_lock_mutex(struct iw_mutex *m)
+{
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+	EnterCriticalSection(&m->lock);
+#else
+	pthread_mutex_lock(&m->lock);
+#endif
+#endif
+}
+
+IW_IMPL(void) iw_unlock_mutex(struct iw_mutex *m)
+{
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+	LeaveCriticalSection(&m->lock);
+#else
+	pthread_mutex_unlock(&m->lock);
+#endif
+#endif
+}
@@ -6,12 +6,21 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
 
 #define IWTIFF_MAX_TAGS 20
 
+// Default uncompressed size of a strip, when the image is compressed.
+#define IWTIFF_STRIP_SIZE 262144
+
+#define IWTIFF_CMPR_NONE     1
+#define IWTIFF_CMPR_LZW      5
+#define IWTIFF_CMPR_DEFLATE  8 // "Adobe Deflate"
+#define IWTIFF_CMPR_PACKBITS 32773
+
 struct iwtiffwcontext {
 	int bitsperpixel;
 	int bitspersample;
@@ -33,6 +42,15 @@ struct iwtiffwcontext {
 
 	int write_density_in_cm;
 
+	int compression; // IWTIFF_CMPR_*
+	int predictor; // 1=none, 2=horizontal differencing
+	size_t dstbpr;
+	int rowsperstrip;
+	int num_strips;
+	size_t *strip_size; // Array[num_strips]
+	iw_byte **strip_data; // Array[num_strips]. Compressed strips only.
+	struct iw_zlib_module *zmod;
+
 	unsigned int curr_filepos;
 
 	// All tags whose size can be larger than 4 bytes are
@@ -45,6 +63,9 @@ struct iwtiffwcontext {
 	unsigned int palette_size; // size in bytes
 	unsigned int transferfunc_offset;
 	unsigned int transferfunc_size;
+	unsigned int stripoffsets_offset;
+	unsigned int stripbytecounts_offset;
+	unsigned int stripinfo_size; // size of each of the two arrays, in bytes
 	unsigned int bitmap_offset;
 	size_t bitmap_size;
 
@@ -116,6 +137,364 @@ static void iwtiff_convert_row16bps(const iw_byte *srcrow, iw_byte *dstrow, int
 	}
 }
 
+static void iwtiff_convert_row(struct iwtiffwcontext *wctx, const iw_byte *srcrow, iw_byte *dstrow)
+{
+	int width = wctx->img->width;
+
+	if(wctx->bitspersample==16) {
+		switch(wctx->bitsperpixel) {
+		case 64: iwtiff_convert_row16bps(srcrow,dstrow,width,4); break; // RGBA16
+		case 48: iwtiff_convert_row16bps(srcrow,dstrow,width,3); break; // RGB16
+		case 32: iwtiff_convert_row16bps(srcrow,dstrow,width,2); break; // GA16
+		case 16: iwtiff_convert_row16bps(srcrow,dstrow,width,1); break; // G16
+		}
+	}
+	else {
+		switch(wctx->bitsperpixel) {
+		case 32: iwtiff_convert_row8bps(srcrow,dstrow,width,4); break; // RGBA8
+		case 24: iwtiff_convert_row8bps(srcrow,dstrow,width,3); break; // RGB8
+		case 16: iwtiff_convert_row8bps(srcrow,dstrow,width,2); break; // GA8
+		case 8: iwtiff_convert_row8bps(srcrow,dstrow,width,1); break; // G8 or palette8
+		case 4: iwtiff_convert_row4(srcrow,dstrow,width); break; // G4 or palette4
+		case 1: iwtiff_convert_row1(srcrow,dstrow,width); break; // G1
+		}
+	}
+}
+
+// Horizontal differencing (Predictor=2). 16-bit samples have already been
+// put in little-endian order.
+static void iwtiff_apply_predictor(struct iwtiffwcontext *wctx, iw_byte *row)
+{
+	int spp = wctx->samplesperpixel;
+	int i;
+	unsigned int v;
+
+	if(wctx->bitspersample==16) {
+		for(i=spp*wctx->img->width-1;i>=spp;i--) {
+			v = (unsigned int)(row[i*2]|(row[i*2+1]<<8)) -
+				(unsigned int)(row[(i-spp)*2]|(row[(i-spp)*2+1]<<8));
+			row[i*2] = (iw_byte)(v&0xff);
+			row[i*2+1] = (iw_byte)((v>>8)&0xff);
+		}
+	}
+	else {
+		for(i=spp*wctx->img->width-1;i>=spp;i--) {
+			row[i] = (iw_byte)(row[i]-row[i-spp]);
+		}
+	}
+}
+
+// PackBits-compress one row. Returns the number of bytes written to dst, which
+// must have room for n + (n+127)/128 bytes.
+static size_t iwtiff_packbits_row(const iw_byte *src, size_t n, iw_byte *dst)
+{
+	size_t i = 0;
+	size_t d = 0;
+	size_t run;
+	size_t lit_start;
+
+	while(i<n) {
+		// Measure the run of identical bytes starting here.
+		run = 1;
+		while(i+run<n && run<128 && src[i+run]==src[i]) run++;
+
+		if(run>=2) {
+			dst[d++] = (iw_byte)(257-run);
+			dst[d++] = src[i];
+			i += run;
+			continue;
+		}
+
+		// A literal sequence, which ends where a run of 3 or more begins.
+		lit_start = i;
+		while(i<n && i-lit_start<128) {
+			if(i+2<n && src[i]==src[i+1] && src[i]==src[i+2]) break;
+			i++;
+		}
+		dst[d++] = (iw_byte)(i-lit_start-1);
+		memcpy(&dst[d],&src[lit_start],i-lit_start);
+		d += i-lit_start;
+	}
+	return d;
+}
+
+#define IWTIFF_LZW_CLEAR    256
+#define IWTIFF_LZW_EOI      257
+#define IWTIFF_LZW_FIRST    258
+#define IWTIFF_LZW_MAXCODE  4094 // Clear the table when it gets this full.
+#define IWTIFF_LZW_HASHSIZE 8192
+
+struct iwtiff_lzwenc {
+	// Each used entry is ((prefix code + (next byte<<12))<<12) | code.
+	unsigned int *hash; // Array[IWTIFF_LZW_HASHSIZE]
+	iw_byte *dst;
+	size_t dstpos;
+	unsigned int bitbuf;
+	int bitcount;
+	int nbits;
+	unsigned int free_ent;
+};
+
+static void iwtiff_lzw_put(struct iwtiff_lzwenc *e, unsigned int code)
+{
+	e->bitbuf = (e->bitbuf<<e->nbits) | code;
+	e->bitcount += e->nbits;
+	while(e->bitcount>=8) {
+		e->bitcount -= 8;
+		e->dst[e->dstpos++] = (iw_byte)((e->bitbuf>>e->bitcount)&0xff);
+	}
+}
+
+static void iwtiff_lzw_reset(struct iwtiff_lzwenc *e)
+{
+	memset(e->hash,0xff,IWTIFF_LZW_HASHSIZE*sizeof(unsigned int));
+	e->nbits = 9;
+	e->free_ent = IWTIFF_LZW_FIRST;
+}
+
+// A new table entry has been added. Emit a clear code if the table is full,
+// or switch to longer codes if needed.
+// The code size changes one code earlier than might be expected, as it does
+// in libtiff, and as required by the TIFF spec.
+static void iwtiff_lzw_check_size(struct iwtiff_lzwenc *e)
+{
+	if(e->free_ent==IWTIFF_LZW_MAXCODE) {
+		iwtiff_lzw_put(e,IWTIFF_LZW_CLEAR);
+		iwtiff_lzw_reset(e);
+	}
+	else if(e->free_ent > (1U<<e->nbits)-1) {
+		e->nbits++;
+	}
+}
+
+// LZW-compress a strip, in the MSB-first style of TIFF 6.0.
+// dst must have room for n + n/2 + n/128 + 16 bytes. Returns the number of
+// bytes written.
+static size_t iwtiff_lzw_strip(unsigned int *hash, const iw_byte *src, size_t n,
+	iw_byte *dst)
+{
+	struct iwtiff_lzwenc e;
+	unsigned int ent;
+	unsigned int fcode;
+	unsigned int h;
+	size_t i;
+
+	iw_zeromem(&e,sizeof(struct iwtiff_lzwenc));
+	e.hash = hash;
+	e.dst = dst;
+	iwtiff_lzw_reset(&e);
+
+	iwtiff_lzw_put(&e,IWTIFF_LZW_CLEAR);
+	if(n<1) goto eoi;
+
+	ent = src[0];
+	for(i=1;i<n;i++) {
+		fcode = ((unsigned int)src[i]<<12) + ent;
+		h = ((fcode>>3)^(fcode<<2)^fcode) & (IWTIFF_LZW_HASHSIZE-1);
+		while(hash[h]!=0xffffffffU) {
+			if((hash[h]>>12)==fcode) break;
+			h = (h+1) & (IWTIFF_LZW_HASHSIZE-1);
+		}
+		if(hash[h]!=0xffffffffU) {
+			// The string is in the table. Keep extending it.
+			ent = hash[h]&0xfff;
+			continue;
+		}
+
+		iwtiff_lzw_put(&e,ent);
+		hash[h] = (fcode<<12) | e.free_ent;
+		e.free_ent++;
+		iwtiff_lzw_check_size(&e);
+		ent = src[i];
+	}
+
+	iwtiff_lzw_put(&e,ent);
+	// The decoder will add a table entry after reading this code, so we have
+	// to account for it.
+	e.free_ent++;
+	iwtiff_lzw_check_size(&e);
+
+eoi:
+	iwtiff_lzw_put(&e,IWTIFF_LZW_EOI);
+	if(e.bitcount>0) {
+		e.dst[e.dstpos++] = (iw_byte)((e.bitbuf<<(8-e.bitcount))&0xff);
+	}
+	return e.dstpos;
+}
+
+static size_t iwtiff_max_cmpr_strip_size(struct iwtiffwcontext *wctx, int nrows)
+{
+	size_t n = wctx->dstbpr*(size_t)nrows;
+
+	switch(wctx->compression) {
+	case IWTIFF_CMPR_LZW:
+		return n + n/2 + n/128 + 16;
+	case IWTIFF_CMPR_PACKBITS:
+		return n + ((wctx->dstbpr+127)/128)*(size_t)nrows;
+	}
+	// Deflate, including the zlib header and checksum.
+	return n + n/1000 + 64;
+}
+
+// Used by iwtiff_strip_job().
+struct iwtiff_stripctx {
+	struct iwtiffwcontext *wctx;
+	int num_jobs;
+	int first_strip; // The number of the first strip in the band
+	int num_strips; // Number of strips in the band
+	iw_byte *ubuf; // Uncompressed strips
+	size_t ubuf_stripsize;
+	iw_byte *cbuf; // Compressed strips
+	size_t cbuf_stripsize;
+	size_t *cmprsize; // Array[num_strips]
+	unsigned int **lzwhash; // Array[num_jobs]
+};
+
+static int iwtiff_rows_in_strip(struct iwtiffwcontext *wctx, int strip)
+{
+	int nrows = wctx->img->height - strip*wctx->rowsperstrip;
+	if(nrows>wctx->rowsperstrip) nrows = wctx->rowsperstrip;
+	return nrows;
+}
+
+// Compresses the LZW or PackBits strips job, job+num_jobs, ..., of the band.
+static void iwtiff_strip_job(void *userdata, int job)
+{
+	struct iwtiff_stripctx *sctx = (struct iwtiff_stripctx*)userdata;
+	struct iwtiffwcontext *wctx = sctx->wctx;
+	const iw_byte *src;
+	iw_byte *dst;
+	int nrows;
+	int i, j;
+
+	for(i=job; i<sctx->num_strips; i+=sctx->num_jobs) {
+		src = &sctx->ubuf[sctx->ubuf_stripsize*i];
+		dst = &sctx->cbuf[sctx->cbuf_stripsize*i];
+		nrows = iwtiff_rows_in_strip(wctx,sctx->first_strip+i);
+
+		if(wctx->compression==IWTIFF_CMPR_LZW) {
+			sctx->cmprsize[i] = iwtiff_lzw_strip(sctx->lzwhash[job],src,
+				wctx->dstbpr*nrows,dst);
+		}
+		else {
+			// PackBits runs may not cross rows.
+			sctx->cmprsize[i] = 0;
+			for(j=0;j<nrows;j++) {
+				sctx->cmprsize[i] += iwtiff_packbits_row(&src[wctx->dstbpr*j],
+					wctx->dstbpr,&dst[sctx->cmprsize[i]]);
+			}
+		}
+	}
+}
+
+// Convert and compress all the strips, in bands of a few strips per thread,
+// and keep them in memory, so that the IFD can be written first.
+static int iwtiff_compress_strips(struct iwtiffwcontext *wctx, int num_threads)
+{
+	struct iw_context *ctx = wctx->ctx;
+	struct iw_image *img = wctx->img;
+	struct iwtiff_stripctx sctx;
+	struct iw_zlib_mt *mz = NULL;
+	struct iw_zlib_piece *pieces = NULL;
+	int band_strips;
+	int strip, n, k, j;
+	int nrows;
+	iw_byte *dstrow;
+	int retval = 0;
+
+	iw_zeromem(&sctx,sizeof(struct iwtiff_stripctx));
+	sctx.wctx = wctx;
+
+	band_strips = 4*num_threads;
+	if(band_strips>wctx->num_strips) band_strips = wctx->num_strips;
+	sctx.num_jobs = num_threads;
+	if(sctx.num_jobs>band_strips) sctx.num_jobs = band_strips;
+
+	sctx.ubuf_stripsize = wctx->dstbpr*(size_t)wctx->rowsperstrip;
+	sctx.cbuf_stripsize = iwtiff_max_cmpr_strip_size(wctx,wctx->rowsperstrip);
+	sctx.ubuf = iw_malloc_large(ctx,sctx.ubuf_stripsize,band_strips);
+	if(!sctx.ubuf) goto done;
+	sctx.cbuf = iw_malloc_large(ctx,sctx.cbuf_stripsize,band_strips);
+	if(!sctx.cbuf) goto done;
+	sctx.cmprsize = iw_mallocz(ctx,band_strips*sizeof(size_t));
+	if(!sctx.cmprsize) goto done;
+
+	if(wctx->compression==IWTIFF_CMPR_DEFLATE) {
+		pieces = iw_mallocz(ctx,band_strips*sizeof(struct iw_zlib_piece));
+		if(!pieces) goto done;
+		mz = wctx->zmod->mt_init(ctx,sctx.num_jobs,1);
+		if(!mz) goto done;
+	}
+	else if(wctx->compression==IWTIFF_CMPR_LZW) {
+		sctx.lzwhash = iw_mallocz(ctx,sctx.num_jobs*sizeof(unsigned int*));
+		if(!sctx.lzwhash) goto done;
+		for(k=0;k<sctx.num_jobs;k++) {
+			sctx.lzwhash[k] = iw_malloc(ctx,IWTIFF_LZW_HASHSIZE*sizeof(unsigned int));
+			if(!sctx.lzwhash[k]) goto done;
+		}
+	}
+
+	for(strip=0;strip<wctx->num_strips;strip+=n) {
+		n = wctx->num_strips-strip;
+		if(n>band_strips) n = band_strips;
+		sctx.first_strip = strip;
+		sctx.num_strips = n;
+
+		for(k=0;k<n;k++) {
+			nrows = iwtiff_rows_in_strip(wctx,strip+k);
+			for(j=0;j<nrows;j++) {
+				dstrow = &sctx.ubuf[sctx.ubuf_stripsize*k + wctx->dstbpr*j];
+				iwtiff_convert_row(wctx,
+					&img->pixels[((size_t)(strip+k)*wctx->rowsperstrip+j)*img->bpr],dstrow);
+				if(wctx->predictor==2) iwtiff_apply_predictor(wctx,dstrow);
+			}
+
+			if(pieces) {
+				iw_zeromem(&pieces[k],sizeof(struct iw_zlib_piece));
+				pieces[k].src = &sctx.ubuf[sctx.ubuf_stripsize*k];
+				pieces[k].srclen = wctx->dstbpr*nrows;
+				pieces[k].dst = &sctx.cbuf[sctx.cbuf_stripsize*k];
+				pieces[k].dstlen = sctx.cbuf_stripsize;
+				pieces[k].whole_stream = 1;
+			}
+		}
+
+		if(pieces) {
+			if(!wctx->zmod->mt_run(mz,pieces,n)) goto done;
+			for(k=0;k<n;k++) {
+				sctx.cmprsize[k] = pieces[k].dstused;
+			}
+		}
+		else {
+			iw_run_parallel(ctx,sctx.num_jobs,sctx.num_jobs,iwtiff_strip_job,(void*)&sctx);
+		}
+
+		for(k=0;k<n;k++) {
+			wctx->strip_size[strip+k] = sctx.cmprsize[k];
+			wctx->strip_data[strip+k] = iw_malloc(ctx,sctx.cmprsize[k]);
+			if(!wctx->strip_data[strip+k]) goto done;
+			memcpy(wctx->strip_data[strip+k],&sctx.cbuf[sctx.cbuf_stripsize*k],sctx.cmprsize[k]);
+			wctx->bitmap_size += sctx.cmprsize[k];
+		}
+	}
+
+	retval = 1;
+
+done:
+	if(mz) wctx->zmod->mt_end(mz);
+	if(pieces) iw_free(ctx,pieces);
+	if(sctx.lzwhash) {
+		for(k=0;k<sctx.num_jobs;k++) {
+			if(sctx.lzwhash[k]) iw_free(ctx,sctx.lzwhash[k]);
+		}
+		iw_free(ctx,sctx.lzwhash);
+	}
+	if(sctx.cmprsize) iw_free(ctx,sctx.cmprsize);
+	if(sctx.cbuf) iw_free(ctx,sctx.cbuf);
+	if(sctx.ubuf) iw_free(ctx,sctx.ubuf);
+	return retval;
+}
+
 static void iwtiff_write_file_header(struct iwtiffwcontext *wctx)
 {
 	iw_byte buf[8];
@@ -195,11 +574,11 @@ static void iwtiff_write_palette(struct iwtiffwcontext *wctx)
 	iw_byte *buf = NULL;
 	unsigned int v;
 
-	buf = iw_malloc(wctx->ctx,wctx->palette_size);
-	if(!buf) return;
-
 	if(wctx->palentries<1) return;
 
+	buf = iw_mallocz(wctx->ctx,wctx->palette_size);
+	if(!buf) return;
+
 	// Palette samples are always 16-bit in TIFF files.
 	// IW does not support generating palettes which contain colors that can't
 	// be represented at 8 bits, so not every image that could be written
@@ -237,6 +616,7 @@ static void iwtiff_write_palette(struct iwtiffwcontext *wctx)
 #define IWTIFF_TAG283_YRESOLUTION 283
 #define IWTIFF_TAG296_RESOLUTIONUNIT 296
 #define IWTIFF_TAG301_TRANSFERFUNCTION 301
+#define IWTIFF_TAG317_PREDICTOR 317
 #define IWTIFF_TAG320_COLORMAP 320
 #define IWTIFF_TAG338_EXTRASAMPLES 338
 
@@ -273,7 +653,7 @@ static void write_tag_to_ifd(struct iwtiffwcontext *wctx,int tagnum,iw_byte *buf
 		}
 		break;
 	case IWTIFF_TAG259_COMPRESSION:
-		iw_set_ui16le(&buf[8],1);
+		iw_set_ui16le(&buf[8],wctx->compression);
 		break;
 	case IWTIFF_TAG262_PHOTOMETRIC:
 		iw_set_ui16le(&buf[8],wctx->photometric);
@@ -297,18 +677,26 @@ static void write_tag_to_ifd(struct iwtiffwcontext *wctx,int tagnum,iw_byte *buf
 		break;
 	case IWTIFF_TAG273_STRIPOFFSETS:
 		iw_set_ui16le(&buf[2],IWTIFF_UINT32);
-		iw_set_ui32le(&buf[8],wctx->bitmap_offset);
+		iw_set_ui32le(&buf[4],wctx->num_strips);
+		if(wctx->num_strips>1)
+			iw_set_ui32le(&buf[8],wctx->stripoffsets_offset);
+		else
+			iw_set_ui32le(&buf[8],wctx->bitmap_offset);
 		break;
 	case IWTIFF_TAG277_SAMPLESPERPIXEL:
 		iw_set_ui16le(&buf[8],wctx->samplesperpixel);
 		break;
 	case IWTIFF_TAG278_ROWSPERSTRIP:
 		iw_set_ui16le(&buf[2],IWTIFF_UINT32);
-		iw_set_ui32le(&buf[8],wctx->img->height);
+		iw_set_ui32le(&buf[8],wctx->rowsperstrip);
 		break;
 	case IWTIFF_TAG279_STRIPBYTECOUNTS:
 		iw_set_ui16le(&buf[2],IWTIFF_UINT32);
-		iw_set_ui32le(&buf[8],(unsigned int)wctx->bitmap_size);
+		iw_set_ui32le(&buf[4],wctx->num_strips);
+		if(wctx->num_strips>1)
+			iw_set_ui32le(&buf[8],wctx->stripbytecounts_offset);
+		else
+			iw_set_ui32le(&buf[8],(unsigned int)wctx->bitmap_size);
 		break;
 	case IWTIFF_TAG320_COLORMAP:
 		iw_set_ui32le(&buf[4],3*wctx->palentries);
@@ -318,6 +706,9 @@ static void write_tag_to_ifd(struct iwtiffwcontext *wctx,int tagnum,iw_byte *buf
 		iw_set_ui32le(&buf[4],wctx->transferfunc_numentries);
 		iw_set_ui32le(&buf[8],wctx->transferfunc_offset);
 		break;
+	case IWTIFF_TAG317_PREDICTOR:
+		iw_set_ui16le(&buf[8],wctx->predictor);
+		break;
 	case IWTIFF_TAG338_EXTRASAMPLES:
 		iw_set_ui16le(&buf[8],2); // 2 = Unassociated alpha
 		break;
@@ -332,6 +723,28 @@ static void append_tag(struct iwtiffwcontext *wctx, unsigned short tagnum)
 	wctx->num_tags++;
 }
 
+// Writes the StripOffsets and StripByteCounts arrays. The strips are stored
+// in order, right after each other.
+static void iwtiff_write_stripinfo(struct iwtiffwcontext *wctx)
+{
+	iw_byte *buf = NULL;
+	unsigned int pos;
+	int i;
+
+	buf = iw_malloc(wctx->ctx,2*wctx->stripinfo_size);
+	if(!buf) return;
+
+	pos = wctx->bitmap_offset;
+	for(i=0;i<wctx->num_strips;i++) {
+		iw_set_ui32le(&buf[4*i],pos);
+		iw_set_ui32le(&buf[wctx->stripinfo_size+4*i],(unsigned int)wctx->strip_size[i]);
+		pos += (unsigned int)wctx->strip_size[i];
+	}
+	iwtiff_write(wctx,buf,2*wctx->stripinfo_size);
+
+	iw_free(wctx->ctx,buf);
+}
+
 // Writes the IFD, and meta data
 static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 {
@@ -371,6 +784,9 @@ static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 	if(wctx->transferfunc_size>0) {
 		append_tag(wctx,IWTIFF_TAG301_TRANSFERFUNCTION);
 	}
+	if(wctx->predictor!=1) {
+		append_tag(wctx,IWTIFF_TAG317_PREDICTOR);
+	}
 	if(wctx->palette_size>0) {
 		append_tag(wctx,IWTIFF_TAG320_COLORMAP);
 	}
@@ -404,6 +820,13 @@ static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 		tmppos += wctx->palette_size;
 	}
 
+	if(wctx->num_strips>1) {
+		wctx->stripoffsets_offset = tmppos;
+		tmppos += wctx->stripinfo_size;
+		wctx->stripbytecounts_offset = tmppos;
+		tmppos += wctx->stripinfo_size;
+	}
+
 	// Put the bitmap last
 	wctx->bitmap_offset = tmppos;
 
@@ -441,17 +864,99 @@ static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 	// Palette is always too large to be inlined.
 	iwtiff_write_palette(wctx);
 
+	if(wctx->num_strips>1) {
+		iwtiff_write_stripinfo(wctx);
+	}
+
 done:
 	if(buf) iw_free(wctx->ctx,buf);
 }
 
+static void iwtiff_choose_compression(struct iwtiffwcontext *wctx)
+{
+	const char *optv;
+	int cmpr_req;
+
+	cmpr_req = iw_get_value(wctx->ctx,IW_VAL_COMPRESSION);
+	switch(cmpr_req) {
+	case IW_COMPRESSION_ZIP:
+		wctx->zmod = iw_get_zlib_module(wctx->ctx);
+		if(wctx->zmod && wctx->zmod->mt_init)
+			wctx->compression = IWTIFF_CMPR_DEFLATE;
+		else
+			wctx->compression = IWTIFF_CMPR_NONE;
+		break;
+	case IW_COMPRESSION_LZW:
+		wctx->compression = IWTIFF_CMPR_LZW;
+		break;
+	case IW_COMPRESSION_RLE:
+		wctx->compression = IWTIFF_CMPR_PACKBITS;
+		break;
+	default:
+		wctx->compression = IWTIFF_CMPR_NONE;
+	}
+
+	// The predictor only helps continuous-tone images, and TIFF readers only
+	// support it for 8- and 16-bit samples.
+	wctx->predictor = 1;
+	if((wctx->compression==IWTIFF_CMPR_DEFLATE || wctx->compression==IWTIFF_CMPR_LZW) &&
+		(wctx->bitspersample==8 || wctx->bitspersample==16) &&
+		wctx->photometric!=IWTIFF_PHOTO_PALETTE)
+	{
+		wctx->predictor = 2;
+		optv = iw_get_option(wctx->ctx, "tiff:predictor");
+		if(optv && iw_parse_int(optv)==0) {
+			wctx->predictor = 1;
+		}
+	}
+}
+
+static int iwtiff_set_strips(struct iwtiffwcontext *wctx)
+{
+	const char *optv;
+	int height = wctx->img->height;
+	int j;
+
+	// By default, an uncompressed image is written as a single strip.
+	wctx->rowsperstrip = height;
+	if(wctx->compression!=IWTIFF_CMPR_NONE) {
+		wctx->rowsperstrip = (int)(IWTIFF_STRIP_SIZE/wctx->dstbpr);
+	}
+
+	optv = iw_get_option(wctx->ctx, "tiff:rowsperstrip");
+	if(optv) {
+		wctx->rowsperstrip = iw_parse_int(optv);
+	}
+
+	if(wctx->rowsperstrip<1) wctx->rowsperstrip = 1;
+	if(wctx->rowsperstrip>height) wctx->rowsperstrip = height;
+
+	wctx->num_strips = (height+wctx->rowsperstrip-1)/wctx->rowsperstrip;
+	wctx->stripinfo_size = 4*wctx->num_strips;
+
+	wctx->strip_size = iw_mallocz(wctx->ctx,wctx->num_strips*sizeof(size_t));
+	if(!wctx->strip_size) return 0;
+
+	if(wctx->compression==IWTIFF_CMPR_NONE) {
+		for(j=0;j<wctx->num_strips;j++) {
+			wctx->strip_size[j] = wctx->dstbpr*iwtiff_rows_in_strip(wctx,j);
+		}
+		wctx->bitmap_size = wctx->dstbpr * height;
+	}
+	else {
+		wctx->strip_data = iw_mallocz(wctx->ctx,wctx->num_strips*sizeof(iw_byte*));
+		if(!wctx->strip_data) return 0;
+	}
+	return 1;
+}
+
 static int iwtiff_write_main(struct iwtiffwcontext *wctx)
 {
 	struct iw_image *img;
 	iw_byte *dstrow = NULL;
-	size_t dstbpr;
+	int num_threads;
 	int j;
-	const iw_byte *srcrow;
+	int retval = 0;
 
 	img = wctx->img;
 
@@ -510,9 +1015,11 @@ static int iwtiff_write_main(struct iwtiffwcontext *wctx)
 	wctx->bitsperpixel = wctx->bitspersample * wctx->samplesperpixel;
 	wctx->bitspersample_size = 2*wctx->samplesperpixel;
 
-	dstbpr = iwtiff_calc_bpr(wctx->bitsperpixel,img->width);
+	wctx->dstbpr = iwtiff_calc_bpr(wctx->bitsperpixel,img->width);
+
+	iwtiff_choose_compression(wctx);
+	if(!iwtiff_set_strips(wctx)) goto done;
 
-	wctx->bitmap_size = dstbpr * img->height;
 	wctx->palette_size = wctx->palentries*6;
 	wctx->pixdens_size = 16;
 
@@ -545,41 +1052,53 @@ static int iwtiff_write_main(struct iwtiffwcontext *wctx)
 
 	wctx->transferfunc_size = 2*wctx->transferfunc_numentries;
 
+	if(wctx->compression!=IWTIFF_CMPR_NONE) {
+		// Compress the strips first, so that we know their sizes.
+		num_threads = iw_get_value(wctx->ctx,IW_VAL_NUM_THREADS);
+		if(num_threads<1) num_threads = iw_get_num_cpus();
+		if(!iwtiff_compress_strips(wctx,num_threads)) goto done;
+	}
+
+	// Offsets in a TIFF file are 32-bit.
+	if(wctx->bitmap_size > 0xff000000U) {
+		iw_set_error(wctx->ctx,"TIFF: Image too large");
+		goto done;
+	}
+
 	// File header
 	iwtiff_write_file_header(wctx);
 
 	iwtiff_write_ifd(wctx);
 
 	// Pixels
-	dstrow = iw_mallocz(wctx->ctx,dstbpr);
+	if(wctx->compression!=IWTIFF_CMPR_NONE) {
+		for(j=0;j<wctx->num_strips;j++) {
+			iwtiff_write(wctx,wctx->strip_data[j],wctx->strip_size[j]);
+		}
+		retval = 1;
+		goto done;
+	}
+
+	dstrow = iw_mallocz(wctx->ctx,wctx->dstbpr);
 	if(!dstrow) goto done;
 
 	for(j=0;j<img->height;j++) {
-		srcrow = &img->pixels[j*img->bpr];
-		if(wctx->bitspersample==16) {
-			switch(wctx->bitsperpixel) {
-			case 64: iwtiff_convert_row16bps(srcrow,dstrow,img->width,4); break; // RGBA16
-			case 48: iwtiff_convert_row16bps(srcrow,dstrow,img->width,3); break; // RGB16
-			case 32: iwtiff_convert_row16bps(srcrow,dstrow,img->width,2); break; // GA16
-			case 16: iwtiff_convert_row16bps(srcrow,dstrow,img->width,1); break; // G16
-			}
-		}
-		else {
-			switch(wctx->bitsperpixel) {
-			case 32: iwtiff_convert_row8bps(srcrow,dstrow,img->width,4); break; // RGBA8
-			case 24: iwtiff_convert_row8bps(srcrow,dstrow,img->width,3); break; // RGB8
-			case 16: iwtiff_convert_row8bps(srcrow,dstrow,img->width,2); break; // GA8
-			case 8: iwtiff_convert_row8bps(srcrow,dstrow,img->width,1); break; // G8 or palette8
-			case 4: iwtiff_convert_row4(srcrow,dstrow,img->width); break; // G4 or palette4
-			case 1: iwtiff_convert_row1(srcrow,dstrow,img->width); break; // G1
-			}
-		}
-		iwtiff_write(wctx,dstrow,dstbpr);
+		iwtiff_convert_row(wctx,&img->pixels[j*img->bpr],dstrow);
+		iwtiff_write(wctx,dstrow,wctx->dstbpr);
 	}
 
+	retval = 1;
+
 done:
 	if(dstrow) iw_free(wctx->ctx,dstrow);
-	return 1;
+	if(wctx->strip_data) {
+		for(j=0;j<wctx->num_strips;j++) {
+			if(wctx->strip_data[j]) iw_free(wctx->ctx,wctx->strip_data[j]);
+		}
+		iw_free(wctx->ctx,wctx->strip_data);
+	}
+	if(wctx->strip_size) iw_free(wctx->ctx,wctx->strip_size);
+	return retval;
 }
 
 IW_IMPL(int) iw_write_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
@@ -609,7 +1128,7 @@ IW_IMPL(int) iw_write_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodes
 		if(!wctx->pal) goto done;
 	}
 
-	iwtiff_write_main(wctx);
+	if(!iwtiff_write_main(wctx)) goto done;
 
 	retval=1;
 
@@ -617,3 +1136,1166 @@ done:
 	if(wctx) iw_free(ctx,wctx);
 	return retval;
 }
+
+////////////////////////////////////////////////////////
+//                    TIFF reader
+////////////////////////////////////////////////////////
+
+#define IWTIFF_TAG266_FILLORDER 266
+#define IWTIFF_TAG284_PLANARCONFIG 284
+#define IWTIFF_TAG322_TILEWIDTH 322
+#define IWTIFF_TAG323_TILELENGTH 323
+#define IWTIFF_TAG324_TILEOFFSETS 324
+#define IWTIFF_TAG325_TILEBYTECOUNTS 325
+#define IWTIFF_TAG339_SAMPLEFORMAT 339
+
+#define IWTIFF_UINT8    1 // "BYTE"
+
+#define IWTIFF_CMPR_DEFLATE_OLD 32946
+
+#define IWTIFF_PHOTO_MINISWHITE 0
+
+// The maximum number of strips or tiles decompressed at a time, per thread.
+#define IWTIFFR_CHUNKS_PER_THREAD 4
+
+// A "chunk" is a strip or a tile.
+
+struct iwtiffr_lzwdec {
+	unsigned short prefix[4096];
+	unsigned short length[4096];
+	iw_byte suffix[4096];
+	iw_byte first[4096]; // The first byte of the code's string
+};
+
+struct iwtiffrcontext {
+	struct iw_context *ctx;
+	struct iw_iodescr *iodescr;
+	struct iw_image *img;
+	struct iw_image_info *probe_info;
+	const iw_byte *mem; // The whole file
+	size_t memsize;
+	int endian;
+	unsigned int ifd_pos;
+
+	// Locations of the IFD entries we care about. 0 if not present.
+	size_t e_bitspersample;
+	size_t e_chunkoffsets;
+	size_t e_chunkbytecounts;
+	size_t e_colormap;
+	size_t e_extrasamples;
+	size_t e_transferfunc;
+	size_t e_xres, e_yres;
+
+	int width, height;
+	int bitspersample;
+	int samplesperpixel;
+	int compression;
+	int photometric;
+	int predictor;
+	int planarconfig;
+	int fillorder;
+	int sampleformat;
+	int resunit;
+	int num_color_channels; // 1, or 3 for RGB
+	int has_alpha;
+	int alpha_is_assoc;
+	unsigned int maxsample; // (1<<bitspersample)-1
+
+	unsigned int palette[3][256]; // 16-bit samples
+	int palette_is_16bit;
+
+	int is_tiled;
+	unsigned int rowsperstrip;
+	int chunk_w, chunk_h;
+	size_t chunk_bpr;
+	int chunks_across, chunks_down;
+	size_t *chunk_offset; // Array[chunks_across*chunks_down]
+	size_t *chunk_size;
+
+	// The rectangle of the image being read.
+	int use_crop;
+	int crop_x, crop_y;
+
+	int out_bitspersample; // 8 or 16
+	int out_samplesperpixel;
+
+	struct iw_zlib_module *zmod;
+	struct iw_csdescr csdescr;
+};
+
+static unsigned int iwtiffr_ui16(struct iwtiffrcontext *rctx, size_t pos)
+{
+	return iw_get_ui16_e(&rctx->mem[pos],rctx->endian);
+}
+
+static unsigned int iwtiffr_ui32(struct iwtiffrcontext *rctx, size_t pos)
+{
+	return iw_get_ui32_e(&rctx->mem[pos],rctx->endian);
+}
+
+// Finds the position of the data of an IFD entry, which has the given number
+// of bytes per value. Returns 0 if it's not in the file.
+static size_t iwtiffr_get_value_pos(struct iwtiffrcontext *rctx, size_t epos,
+	unsigned int idx, size_t valsize)
+{
+	size_t count;
+	size_t pos;
+
+	count = iwtiffr_ui32(rctx,epos+4);
+	if(idx>=count) return 0;
+	if(count > rctx->memsize/valsize) return 0;
+	if(count*valsize<=4) {
+		pos = epos+8;
+	}
+	else {
+		pos = iwtiffr_ui32(rctx,epos+8);
+		if(pos > rctx->memsize || count*valsize > rctx->memsize-pos) return 0;
+	}
+	return pos + idx*valsize;
+}
+
+static unsigned int iwtiffr_get_count(struct iwtiffrcontext *rctx, size_t epos)
+{
+	return iwtiffr_ui32(rctx,epos+4);
+}
+
+// Reads the idx-th value of an IFD entry of type BYTE, SHORT, or LONG.
+static int iwtiffr_get_uint(struct iwtiffrcontext *rctx, size_t epos,
+	unsigned int idx, unsigned int *pv)
+{
+	size_t pos;
+
+	switch(iwtiffr_ui16(rctx,epos+2)) {
+	case IWTIFF_UINT8:
+		pos = iwtiffr_get_value_pos(rctx,epos,idx,1);
+		if(!pos) return 0;
+		*pv = rctx->mem[pos];
+		return 1;
+	case IWTIFF_UINT16:
+		pos = iwtiffr_get_value_pos(rctx,epos,idx,2);
+		if(!pos) return 0;
+		*pv = iwtiffr_ui16(rctx,pos);
+		return 1;
+	case IWTIFF_UINT32:
+		pos = iwtiffr_get_value_pos(rctx,epos,idx,4);
+		if(!pos) return 0;
+		*pv = iwtiffr_ui32(rctx,pos);
+		return 1;
+	}
+	return 0;
+}
+
+static int iwtiffr_get_rational(struct iwtiffrcontext *rctx, size_t epos, double *pv)
+{
+	size_t pos;
+	unsigned int num, den;
+
+	if(iwtiffr_ui16(rctx,epos+2)!=IWTIFF_RATIONAL) return 0;
+	pos = iwtiffr_get_value_pos(rctx,epos,0,8);
+	if(!pos) return 0;
+	num = iwtiffr_ui32(rctx,pos);
+	den = iwtiffr_ui32(rctx,pos+4);
+	if(den==0) return 0;
+	*pv = ((double)num)/den;
+	return 1;
+}
+
+// Check that there is an IFD at pos, and return the number of entries in it.
+static int iwtiffr_check_ifd(struct iwtiffrcontext *rctx, size_t pos, int *pnum_entries)
+{
+	size_t n;
+
+	if(pos<8 || pos+2 > rctx->memsize) return 0;
+	n = iwtiffr_ui16(rctx,pos);
+	if(2+12*n+4 > rctx->memsize-pos) return 0;
+	*pnum_entries = (int)n;
+	return 1;
+}
+
+static int iwtiffr_read_file_header(struct iwtiffrcontext *rctx)
+{
+	if(rctx->memsize<8) goto bad;
+	if(rctx->mem[0]=='I' && rctx->mem[1]=='I')
+		rctx->endian = IW_ENDIAN_LITTLE;
+	else if(rctx->mem[0]=='M' && rctx->mem[1]=='M')
+		rctx->endian = IW_ENDIAN_BIG;
+	else
+		goto bad;
+
+	if(iwtiffr_ui16(rctx,2)==43) {
+		iw_set_error(rctx->ctx,"BigTIFF files are not supported");
+		return 0;
+	}
+	if(iwtiffr_ui16(rctx,2)!=42) goto bad;
+	rctx->ifd_pos = iwtiffr_ui32(rctx,4);
+	return 1;
+bad:
+	iw_set_error(rctx->ctx,"Not a TIFF file");
+	return 0;
+}
+
+// Find the IFD of the requested page, and count the pages.
+static int iwtiffr_find_ifd(struct iwtiffrcontext *rctx)
+{
+	int page;
+	int pages_seen = 0;
+	int num_entries;
+	unsigned int pos;
+	unsigned int page_pos = 0;
+
+	page = iw_get_value(rctx->ctx,IW_VAL_PAGE_TO_READ);
+	if(page<1) page=1;
+
+	pos = rctx->ifd_pos;
+	while(pos!=0) {
+		if(!iwtiffr_check_ifd(rctx,pos,&num_entries)) break;
+		pages_seen++;
+		if(pages_seen==page) {
+			page_pos = pos;
+			// We only need to count the pages if we're probing.
+			if(!rctx->probe_info) break;
+		}
+		// Guard against IFDs that refer to each other.
+		if(pages_seen>=65535) break;
+		pos = iwtiffr_ui32(rctx,pos+2+12*num_entries);
+	}
+
+	if(pages_seen==0) {
+		iw_set_error(rctx->ctx,"No image in file");
+		return 0;
+	}
+	if(!page_pos) {
+		iw_set_error(rctx->ctx,"Image not found");
+		return 0;
+	}
+	if(rctx->probe_info) {
+		rctx->probe_info->page_count = pages_seen;
+	}
+	rctx->ifd_pos = page_pos;
+	return 1;
+}
+
+// Read the IFD, and check that we support the image.
+static int iwtiffr_read_ifd(struct iwtiffrcontext *rctx)
+{
+	int num_entries;
+	int i;
+	size_t epos;
+	unsigned int tag;
+	unsigned int v;
+	unsigned int tile_w = 0, tile_h = 0;
+	int has_photometric = 0;
+	int retval = 0;
+
+	if(!iwtiffr_check_ifd(rctx,rctx->ifd_pos,&num_entries)) goto bad;
+
+	// Defaults
+	rctx->bitspersample = 1;
+	rctx->samplesperpixel = 1;
+	rctx->compression = IWTIFF_CMPR_NONE;
+	rctx->predictor = 1;
+	rctx->planarconfig = 1;
+	rctx->fillorder = 1;
+	rctx->sampleformat = 1;
+	rctx->resunit = 2;
+	rctx->rowsperstrip = 0xffffffffU;
+
+	for(i=0;i<num_entries;i++) {
+		epos = rctx->ifd_pos + 2 + 12*i;
+		tag = iwtiffr_ui16(rctx,epos);
+
+		switch(tag) {
+		case IWTIFF_TAG258_BITSPERSAMPLE: rctx->e_bitspersample = epos; continue;
+		case IWTIFF_TAG273_STRIPOFFSETS:
+		case IWTIFF_TAG324_TILEOFFSETS:
+			rctx->e_chunkoffsets = epos;
+			continue;
+		case IWTIFF_TAG279_STRIPBYTECOUNTS:
+		case IWTIFF_TAG325_TILEBYTECOUNTS:
+			rctx->e_chunkbytecounts = epos;
+			continue;
+		case IWTIFF_TAG282_XRESOLUTION: rctx->e_xres = epos; continue;
+		case IWTIFF_TAG283_YRESOLUTION: rctx->e_yres = epos; continue;
+		case IWTIFF_TAG301_TRANSFERFUNCTION: rctx->e_transferfunc = epos; continue;
+		case IWTIFF_TAG320_COLORMAP: rctx->e_colormap = epos; continue;
+		case IWTIFF_TAG338_EXTRASAMPLES: rctx->e_extrasamples = epos; continue;
+		}
+
+		// The remaining tags have a single integer value.
+		if(!iwtiffr_get_uint(rctx,epos,0,&v)) continue;
+
+		switch(tag) {
+		case IWTIFF_TAG256_IMAGEWIDTH: rctx->width = (v>0x7fffffff)?0:(int)v; break;
+		case IWTIFF_TAG257_IMAGELENGTH: rctx->height = (v>0x7fffffff)?0:(int)v; break;
+		case IWTIFF_TAG259_COMPRESSION: rctx->compression = (int)v; break;
+		case IWTIFF_TAG262_PHOTOMETRIC:
+			rctx->photometric = (int)v;
+			has_photometric = 1;
+			break;
+		case IWTIFF_TAG266_FILLORDER: rctx->fillorder = (int)v; break;
+		case IWTIFF_TAG277_SAMPLESPERPIXEL: rctx->samplesperpixel = (int)v; break;
+		case IWTIFF_TAG278_ROWSPERSTRIP: rctx->rowsperstrip = v; break;
+		case IWTIFF_TAG284_PLANARCONFIG: rctx->planarconfig = (int)v; break;
+		case IWTIFF_TAG296_RESOLUTIONUNIT: rctx->resunit = (int)v; break;
+		case IWTIFF_TAG317_PREDICTOR: rctx->predictor = (int)v; break;
+		case IWTIFF_TAG322_TILEWIDTH: tile_w = v; rctx->is_tiled = 1; break;
+		case IWTIFF_TAG323_TILELENGTH: tile_h = v; rctx->is_tiled = 1; break;
+		case IWTIFF_TAG339_SAMPLEFORMAT: rctx->sampleformat = (int)v; break;
+		}
+	}
+
+	if(rctx->e_bitspersample) {
+		// We require all samples to have the same depth, so the first one is
+		// all we need.
+		if(!iwtiffr_get_uint(rctx,rctx->e_bitspersample,0,&v)) goto bad;
+		rctx->bitspersample = (int)v;
+	}
+
+	if(rctx->width<1 || rctx->height<1) {
+		iw_set_error(rctx->ctx,"Invalid image dimensions");
+		goto done;
+	}
+	if(rctx->samplesperpixel<1 || rctx->samplesperpixel>16) goto bad;
+
+	if(!has_photometric) {
+		// Not allowed, but make a guess.
+		rctx->photometric = (rctx->samplesperpixel>=3) ? IWTIFF_PHOTO_RGB : IWTIFF_PHOTO_MINISBLACK;
+	}
+
+	switch(rctx->photometric) {
+	case IWTIFF_PHOTO_MINISWHITE:
+	case IWTIFF_PHOTO_MINISBLACK:
+		rctx->num_color_channels = 1;
+		if(rctx->bitspersample!=1 && rctx->bitspersample!=2 && rctx->bitspersample!=4 &&
+			rctx->bitspersample!=8 && rctx->bitspersample!=16) goto unsupported;
+		break;
+	case IWTIFF_PHOTO_RGB:
+		rctx->num_color_channels = 3;
+		if(rctx->bitspersample!=8 && rctx->bitspersample!=16) goto unsupported;
+		break;
+	case IWTIFF_PHOTO_PALETTE:
+		rctx->num_color_channels = 1;
+		if(rctx->bitspersample!=1 && rctx->bitspersample!=2 && rctx->bitspersample!=4 &&
+			rctx->bitspersample!=8) goto unsupported;
+		if(!rctx->e_colormap) goto bad;
+		break;
+	default:
+		iw_set_errorf(rctx->ctx,"Unsupported TIFF color type (%d)",rctx->photometric);
+		goto done;
+	}
+	rctx->maxsample = (1U<<rctx->bitspersample)-1;
+
+	if(rctx->samplesperpixel<rctx->num_color_channels) goto bad;
+	if(rctx->bitspersample<8 && rctx->samplesperpixel!=1) goto unsupported;
+	if(rctx->planarconfig!=1 && rctx->samplesperpixel>1) goto unsupported;
+	if(rctx->sampleformat!=1) goto unsupported;
+	if(rctx->fillorder!=1) goto unsupported;
+
+	// An extra sample is used as the alpha channel if it is labeled as one.
+	if(rctx->samplesperpixel>rctx->num_color_channels && rctx->e_extrasamples &&
+		rctx->photometric!=IWTIFF_PHOTO_PALETTE)
+	{
+		if(iwtiffr_get_uint(rctx,rctx->e_extrasamples,0,&v) && (v==1 || v==2)) {
+			rctx->has_alpha = 1;
+			rctx->alpha_is_assoc = (v==1);
+		}
+	}
+
+	switch(rctx->compression) {
+	case IWTIFF_CMPR_NONE:
+	case IWTIFF_CMPR_LZW:
+	case IWTIFF_CMPR_PACKBITS:
+		break;
+	case IWTIFF_CMPR_DEFLATE:
+	case IWTIFF_CMPR_DEFLATE_OLD:
+		if(!rctx->zmod || !rctx->zmod->mt_init) {
+			iw_set_error(rctx->ctx,"TIFF: Deflate compression is not supported");
+			goto done;
+		}
+		break;
+	default:
+		iw_set_errorf(rctx->ctx,"Unsupported TIFF compression (%d)",rctx->compression);
+		goto done;
+	}
+
+	if(rctx->predictor==2) {
+		if(rctx->bitspersample!=8 && rctx->bitspersample!=16) goto unsupported;
+		if(rctx->compression==IWTIFF_CMPR_NONE || rctx->compression==IWTIFF_CMPR_PACKBITS) {
+			// The predictor is only defined for LZW and Deflate.
+			rctx->predictor = 1;
+		}
+	}
+	else if(rctx->predictor!=1) {
+		goto unsupported;
+	}
+
+	if(rctx->is_tiled) {
+		// Tiles are supposed to be multiples of 16 pixels, but we don't need
+		// them to be.
+		if(tile_w<1 || tile_h<1 || tile_w>65536 || tile_h>65536) goto bad;
+		rctx->chunk_w = (int)tile_w;
+		rctx->chunk_h = (int)tile_h;
+	}
+	else {
+		rctx->chunk_w = rctx->width;
+		rctx->chunk_h = rctx->height;
+		if(rctx->rowsperstrip>=1 && rctx->rowsperstrip<(unsigned int)rctx->height) {
+			rctx->chunk_h = (int)rctx->rowsperstrip;
+		}
+	}
+	rctx->chunk_bpr = iwtiff_calc_bpr(rctx->bitspersample*rctx->samplesperpixel,
+		(size_t)rctx->chunk_w);
+	if(rctx->chunk_bpr > ((size_t)-1)/(size_t)rctx->chunk_h) goto bad;
+	rctx->chunks_across = (int)((rctx->width+(iw_int64)rctx->chunk_w-1)/rctx->chunk_w);
+	rctx->chunks_down = (int)((rctx->height+(iw_int64)rctx->chunk_h-1)/rctx->chunk_h);
+
+	if(!rctx->e_chunkoffsets) goto bad;
+	if((iw_int64)rctx->chunks_across*rctx->chunks_down > 0x7fffffff) goto bad;
+	if((iw_int64)iwtiffr_get_count(rctx,rctx->e_chunkoffsets) <
+		(iw_int64)rctx->chunks_across*rctx->chunks_down) goto bad;
+	if(!rctx->e_chunkbytecounts && rctx->compression!=IWTIFF_CMPR_NONE) goto bad;
+
+	retval = 1;
+	goto done;
+
+unsupported:
+	iw_set_error(rctx->ctx,"Unsupported TIFF image type");
+	goto done;
+bad:
+	iw_set_error(rctx->ctx,"Invalid or unsupported TIFF file");
+done:
+	return retval;
+}
+
+static void iwtiffr_set_imgtype(struct iwtiffrcontext *rctx, int *pimgtype, int *pbit_depth)
+{
+	if(rctx->photometric==IWTIFF_PHOTO_PALETTE) {
+		*pimgtype = IW_IMGTYPE_RGB;
+		*pbit_depth = rctx->palette_is_16bit ? 16 : 8;
+		return;
+	}
+	if(rctx->num_color_channels==3)
+		*pimgtype = rctx->has_alpha ? IW_IMGTYPE_RGBA : IW_IMGTYPE_RGB;
+	else
+		*pimgtype = rctx->has_alpha ? IW_IMGTYPE_GRAYA : IW_IMGTYPE_GRAY;
+	*pbit_depth = (rctx->bitspersample==16) ? 16 : 8;
+}
+
+static int iwtiffr_read_palette(struct iwtiffrcontext *rctx)
+{
+	unsigned int numentries;
+	unsigned int i, v;
+	int c;
+
+	numentries = 1U<<rctx->bitspersample;
+	if(iwtiffr_get_count(rctx,rctx->e_colormap) < 3*numentries) goto bad;
+
+	// All the red samples are first, then green, then blue.
+	for(c=0;c<3;c++) {
+		for(i=0;i<numentries;i++) {
+			if(!iwtiffr_get_uint(rctx,rctx->e_colormap,c*numentries+i,&v)) goto bad;
+			rctx->palette[c][i] = v&0xffff;
+			// If any sample can't be represented at 8 bits, we'll need 16.
+			if(rctx->palette[c][i]%257 != 0) rctx->palette_is_16bit = 1;
+		}
+	}
+	return 1;
+bad:
+	iw_set_error(rctx->ctx,"Invalid TIFF palette");
+	return 0;
+}
+
+// Read the StripOffsets/StripByteCounts (or TileOffsets/TileByteCounts)
+// arrays.
+static int iwtiffr_read_chunk_table(struct iwtiffrcontext *rctx)
+{
+	int num_chunks;
+	int i;
+	unsigned int v;
+
+	num_chunks = rctx->chunks_across*rctx->chunks_down;
+	rctx->chunk_offset = iw_malloc_large(rctx->ctx,num_chunks,sizeof(size_t));
+	if(!rctx->chunk_offset) return 0;
+	rctx->chunk_size = iw_malloc_large(rctx->ctx,num_chunks,sizeof(size_t));
+	if(!rctx->chunk_size) return 0;
+
+	for(i=0;i<num_chunks;i++) {
+		if(!iwtiffr_get_uint(rctx,rctx->e_chunkoffsets,i,&v)) goto bad;
+		rctx->chunk_offset[i] = v;
+
+		if(rctx->e_chunkbytecounts) {
+			if(!iwtiffr_get_uint(rctx,rctx->e_chunkbytecounts,i,&v)) goto bad;
+			rctx->chunk_size[i] = v;
+		}
+		else {
+			// Allowed for uncompressed images.
+			rctx->chunk_size[i] = rctx->chunk_bpr*rctx->chunk_h;
+		}
+
+		// Truncated files are dealt with when the chunk is decoded.
+		if(rctx->chunk_offset[i] > rctx->memsize) {
+			rctx->chunk_offset[i] = rctx->memsize;
+		}
+		if(rctx->chunk_size[i] > rctx->memsize-rctx->chunk_offset[i]) {
+			rctx->chunk_size[i] = rctx->memsize-rctx->chunk_offset[i];
+		}
+	}
+	return 1;
+bad:
+	iw_set_error(rctx->ctx,"Invalid or unsupported TIFF file");
+	return 0;
+}
+
+static void iwtiffr_lzw_init(struct iwtiffr_lzwdec *d)
+{
+	int i;
+
+	for(i=0;i<256;i++) {
+		d->prefix[i] = 0;
+		d->length[i] = 1;
+		d->suffix[i] = (iw_byte)i;
+		d->first[i] = (iw_byte)i;
+	}
+}
+
+// Decompress LZW data, until dstlen bytes have been written, or the data
+// ends. Returns the number of bytes written.
+// Old-style LZW, as written by some very old software, isn't supported.
+static size_t iwtiffr_lzw_decode(struct iwtiffr_lzwdec *d, const iw_byte *src, size_t srclen,
+	iw_byte *dst, size_t dstlen)
+{
+	size_t srcpos = 0;
+	size_t dstpos = 0;
+	unsigned int bitbuf = 0;
+	int bitcount = 0;
+	int nbits = 9;
+	unsigned int free_ent = IWTIFF_LZW_FIRST;
+	unsigned int code;
+	unsigned int oldcode = 0;
+	int have_oldcode = 0;
+	unsigned int c;
+	size_t len;
+	size_t i;
+
+	while(dstpos<dstlen) {
+		while(bitcount<nbits) {
+			if(srcpos>=srclen) return dstpos;
+			bitbuf = (bitbuf<<8) | src[srcpos++];
+			bitcount += 8;
+		}
+		bitcount -= nbits;
+		code = (bitbuf>>bitcount) & ((1U<<nbits)-1);
+
+		if(code==IWTIFF_LZW_CLEAR) {
+			nbits = 9;
+			free_ent = IWTIFF_LZW_FIRST;
+			have_oldcode = 0;
+			continue;
+		}
+		if(code==IWTIFF_LZW_EOI) break;
+
+		if(!have_oldcode) {
+			if(code>255) break;
+			dst[dstpos++] = (iw_byte)code;
+			oldcode = code;
+			have_oldcode = 1;
+			continue;
+		}
+
+		if(code>free_ent) break; // Invalid code
+		if(free_ent<4096) {
+			// Add a new code: the previous code's string, plus the first byte of
+			// this code's string (which, if this is the new code, is the same as
+			// the first byte of the previous code's string).
+			d->prefix[free_ent] = (unsigned short)oldcode;
+			d->length[free_ent] = d->length[oldcode]+1;
+			d->first[free_ent] = d->first[oldcode];
+			d->suffix[free_ent] = (code==free_ent) ? d->first[oldcode] : d->first[code];
+			free_ent++;
+		}
+		else if(code==free_ent) {
+			break;
+		}
+
+		// Write the string backward, leaving off anything that doesn't fit.
+		len = d->length[code];
+		c = code;
+		for(i=len;i>0;i--) {
+			if(dstpos+i-1 < dstlen) dst[dstpos+i-1] = d->suffix[c];
+			c = d->prefix[c];
+		}
+		dstpos += len;
+		if(dstpos>dstlen) dstpos = dstlen;
+
+		oldcode = code;
+		// Switch to longer codes one code early, as the encoder does.
+		if(free_ent >= (1U<<nbits)-1 && nbits<12) nbits++;
+	}
+	return dstpos;
+}
+
+static size_t iwtiffr_packbits_decode(const iw_byte *src, size_t srclen,
+	iw_byte *dst, size_t dstlen)
+{
+	size_t srcpos = 0;
+	size_t dstpos = 0;
+	size_t n;
+	unsigned int b;
+
+	while(dstpos<dstlen && srcpos<srclen) {
+		b = src[srcpos++];
+		if(b<128) {
+			// Copy the next b+1 bytes.
+			n = b+1;
+			if(n>srclen-srcpos) n = srclen-srcpos;
+			if(n>dstlen-dstpos) n = dstlen-dstpos;
+			memcpy(&dst[dstpos],&src[srcpos],n);
+			srcpos += b+1;
+			dstpos += n;
+		}
+		else if(b>128) {
+			// Repeat the next byte 257-b times.
+			if(srcpos>=srclen) break;
+			n = 257-b;
+			if(n>dstlen-dstpos) n = dstlen-dstpos;
+			memset(&dst[dstpos],src[srcpos],n);
+			srcpos++;
+			dstpos += n;
+		}
+	}
+	return dstpos;
+}
+
+static unsigned int iwtiffr_get_sample(struct iwtiffrcontext *rctx, const iw_byte *row, size_t idx)
+{
+	switch(rctx->bitspersample) {
+	case 16:
+		return iw_get_ui16_e(&row[2*idx],rctx->endian);
+	case 4:
+		return (row[idx/2]>>((idx%2)?0:4)) & 0x0f;
+	case 2:
+		return (row[idx/4]>>(6-2*(idx%4))) & 0x03;
+	case 1:
+		return (row[idx/8]>>(7-idx%8)) & 0x01;
+	}
+	return row[idx];
+}
+
+static void iwtiffr_put_sample(iw_byte *dst, size_t idx, int bitspersample, unsigned int v)
+{
+	if(bitspersample==16) {
+		dst[2*idx] = (iw_byte)(v>>8);
+		dst[2*idx+1] = (iw_byte)(v&0xff);
+	}
+	else {
+		dst[idx] = (iw_byte)v;
+	}
+}
+
+// Convert npixels pixels, starting at pixel x of a decoded row of a chunk.
+static void iwtiffr_convert_row(struct iwtiffrcontext *rctx, const iw_byte *src,
+	int x, int npixels, iw_byte *dst)
+{
+	int spp = rctx->samplesperpixel;
+	int obps = rctx->out_bitspersample;
+	int ospp = rctx->out_samplesperpixel;
+	size_t si, di;
+	unsigned int v;
+	int i, k;
+
+	if(rctx->photometric!=IWTIFF_PHOTO_PALETTE && rctx->photometric!=IWTIFF_PHOTO_MINISWHITE &&
+		spp==ospp)
+	{
+		if(rctx->bitspersample==8) {
+			memcpy(dst,&src[(size_t)x*spp],(size_t)npixels*spp);
+			return;
+		}
+		if(rctx->bitspersample==16) {
+			if(rctx->endian==IW_ENDIAN_BIG) {
+				memcpy(dst,&src[(size_t)x*spp*2],(size_t)npixels*spp*2);
+			}
+			else {
+				iwtiff_convert_row16bps(&src[(size_t)x*spp*2],dst,npixels,spp);
+			}
+			return;
+		}
+	}
+
+	for(i=0;i<npixels;i++) {
+		si = (size_t)(x+i)*spp;
+		di = (size_t)i*ospp;
+		if(rctx->photometric==IWTIFF_PHOTO_PALETTE) {
+			v = iwtiffr_get_sample(rctx,src,si);
+			for(k=0;k<3;k++) {
+				if(obps==16)
+					iwtiffr_put_sample(dst,di+k,16,rctx->palette[k][v]);
+				else
+					iwtiffr_put_sample(dst,di+k,8,rctx->palette[k][v]>>8);
+			}
+			continue;
+		}
+
+		for(k=0;k<rctx->num_color_channels;k++) {
+			v = iwtiffr_get_sample(rctx,src,si+k);
+			if(rctx->photometric==IWTIFF_PHOTO_MINISWHITE) v = rctx->maxsample-v;
+			iwtiffr_put_sample(dst,di+k,obps,v);
+		}
+		if(rctx->has_alpha) {
+			v = iwtiffr_get_sample(rctx,src,si+rctx->num_color_channels);
+			iwtiffr_put_sample(dst,di+rctx->num_color_channels,obps,v);
+		}
+	}
+}
+
+// Undo horizontal differencing (Predictor=2), for a whole row of a chunk.
+static void iwtiffr_undo_predictor(struct iwtiffrcontext *rctx, iw_byte *row)
+{
+	int spp = rctx->samplesperpixel;
+	size_t nsamples = (size_t)rctx->chunk_w*spp;
+	size_t i;
+	unsigned int v;
+
+	if(rctx->bitspersample==16) {
+		for(i=spp;i<nsamples;i++) {
+			v = iw_get_ui16_e(&row[2*i],rctx->endian) + iw_get_ui16_e(&row[2*(i-spp)],rctx->endian);
+			if(rctx->endian==IW_ENDIAN_LITTLE)
+				iw_set_ui16le(&row[2*i],v&0xffff);
+			else
+				iw_set_ui16be(&row[2*i],v&0xffff);
+		}
+	}
+	else {
+		for(i=spp;i<nsamples;i++) {
+			row[i] = (iw_byte)(row[i]+row[i-spp]);
+		}
+	}
+}
+
+// Used by iwtiffr_chunk_job().
+struct iwtiffr_bandctx {
+	struct iwtiffrcontext *rctx;
+	int num_jobs;
+	int first; // Index of the band's first chunk, in the list of chunks to read
+	int num_chunks;
+	int col0, row0; // The first chunk column and row that are needed
+	int num_cols; // Number of chunk columns that are needed
+	iw_byte *ubuf; // Decompressed chunks. NULL if uncompressed.
+	size_t ubuf_chunksize;
+	int decompressed; // Set if the chunks have already been decompressed.
+	int *ok; // Array[num_chunks]
+	struct iwtiffr_lzwdec **lzw; // Array[num_jobs]
+};
+
+struct iwtiffr_chunkgeom {
+	int chunk; // Index into chunk_offset[], etc.
+	int top, left; // Position of the chunk in the image
+	// The rows and columns of the chunk that are needed, relative to the
+	// chunk. row1 and x1 are one past the last one.
+	int row0, row1;
+	int x0, x1;
+};
+
+// Find which part of chunk number k (in the list of chunks to read) is needed.
+static void iwtiffr_get_chunk_geom(struct iwtiffr_bandctx *bctx, int k,
+	struct iwtiffr_chunkgeom *g)
+{
+	struct iwtiffrcontext *rctx = bctx->rctx;
+	int cr, cc;
+	int nrows;
+
+	cr = bctx->row0 + k/bctx->num_cols;
+	cc = bctx->col0 + k%bctx->num_cols;
+	g->chunk = cr*rctx->chunks_across + cc;
+	g->top = cr*rctx->chunk_h;
+	g->left = cc*rctx->chunk_w;
+
+	// The last strip may be short. Tiles are always padded to full size.
+	nrows = rctx->chunk_h;
+	if(!rctx->is_tiled && g->top+nrows>rctx->height) nrows = rctx->height-g->top;
+
+	g->row0 = rctx->crop_y - g->top;
+	if(g->row0<0) g->row0 = 0;
+	g->row1 = rctx->crop_y + rctx->img->height - g->top;
+	if(g->row1>nrows) g->row1 = nrows;
+	g->x0 = rctx->crop_x - g->left;
+	if(g->x0<0) g->x0 = 0;
+	g->x1 = rctx->crop_x + rctx->img->width - g->left;
+	if(g->x1>rctx->chunk_w) g->x1 = rctx->chunk_w;
+}
+
+// Decompresses (if needed) and converts the chunks job, job+num_jobs, ...
+// of the band.
+static void iwtiffr_chunk_job(void *userdata, int job)
+{
+	struct iwtiffr_bandctx *bctx = (struct iwtiffr_bandctx*)userdata;
+	struct iwtiffrcontext *rctx = bctx->rctx;
+	struct iw_image *img = rctx->img;
+	struct iwtiffr_chunkgeom g;
+	const iw_byte *src;
+	iw_byte *ubuf = NULL;
+	iw_byte *dst;
+	size_t srclen;
+	size_t need;
+	size_t got;
+	size_t bytesperpixel;
+	int k;
+	int j;
+
+	bytesperpixel = rctx->out_samplesperpixel*(rctx->out_bitspersample/8);
+
+	for(k=job; k<bctx->num_chunks; k+=bctx->num_jobs) {
+		iwtiffr_get_chunk_geom(bctx,bctx->first+k,&g);
+		src = &rctx->mem[rctx->chunk_offset[g.chunk]];
+		srclen = rctx->chunk_size[g.chunk];
+		// We don't need any rows after the last one we're going to use.
+		need = rctx->chunk_bpr*g.row1;
+
+		if(bctx->ubuf) {
+			ubuf = &bctx->ubuf[bctx->ubuf_chunksize*k];
+			if(!bctx->decompressed) {
+				if(rctx->compression==IWTIFF_CMPR_LZW) {
+					got = iwtiffr_lzw_decode(bctx->lzw[job],src,srclen,ubuf,need);
+				}
+				else {
+					got = iwtiffr_packbits_decode(src,srclen,ubuf,need);
+				}
+				if(got<need) continue;
+			}
+			src = ubuf;
+		}
+		else if(srclen<need) {
+			continue;
+		}
+
+		for(j=g.row0;j<g.row1;j++) {
+			if(rctx->predictor==2 && ubuf) {
+				iwtiffr_undo_predictor(rctx,&ubuf[rctx->chunk_bpr*j]);
+			}
+			dst = &img->pixels[(size_t)(g.top+j-rctx->crop_y)*img->bpr +
+				(size_t)(g.left+g.x0-rctx->crop_x)*bytesperpixel];
+			iwtiffr_convert_row(rctx,&src[rctx->chunk_bpr*j],g.x0,g.x1-g.x0,dst);
+		}
+		bctx->ok[k] = 1;
+	}
+}
+
+// Decode the chunks that intersect the part of the image we want, in bands
+// of a few chunks per thread.
+static int iwtiffr_read_pixels(struct iwtiffrcontext *rctx)
+{
+	struct iw_context *ctx = rctx->ctx;
+	struct iw_image *img = rctx->img;
+	struct iwtiffr_bandctx bctx;
+	struct iwtiffr_chunkgeom g;
+	struct iw_zlib_mt *mz = NULL;
+	struct iw_zlib_piece *pieces = NULL;
+	int is_deflate;
+	int num_threads;
+	int total_chunks;
+	int band_chunks;
+	int n, k;
+	int retval = 0;
+
+	iw_zeromem(&bctx,sizeof(struct iwtiffr_bandctx));
+	bctx.rctx = rctx;
+	is_deflate = (rctx->compression==IWTIFF_CMPR_DEFLATE ||
+		rctx->compression==IWTIFF_CMPR_DEFLATE_OLD);
+
+	bctx.col0 = rctx->crop_x/rctx->chunk_w;
+	bctx.row0 = rctx->crop_y/rctx->chunk_h;
+	bctx.num_cols = (rctx->crop_x+img->width-1)/rctx->chunk_w - bctx.col0 + 1;
+	total_chunks = bctx.num_cols * ((rctx->crop_y+img->height-1)/rctx->chunk_h - bctx.row0 + 1);
+
+	num_threads = iw_get_value(ctx,IW_VAL_NUM_THREADS);
+	if(num_threads<1) num_threads = iw_get_num_cpus();
+	band_chunks = IWTIFFR_CHUNKS_PER_THREAD*num_threads;
+	if(band_chunks>total_chunks) band_chunks = total_chunks;
+	bctx.num_jobs = num_threads;
+	if(bctx.num_jobs>band_chunks) bctx.num_jobs = band_chunks;
+
+	bctx.ok = iw_mallocz(ctx,band_chunks*sizeof(int));
+	if(!bctx.ok) goto done;
+
+	// Uncompressed chunks are converted straight from the file.
+	if(rctx->compression!=IWTIFF_CMPR_NONE) {
+		bctx.ubuf_chunksize = rctx->chunk_bpr*rctx->chunk_h;
+		bctx.ubuf = iw_malloc_large(ctx,bctx.ubuf_chunksize,band_chunks);
+		if(!bctx.ubuf) goto done;
+	}
+
+	if(is_deflate) {
+		pieces = iw_mallocz(ctx,band_chunks*sizeof(struct iw_zlib_piece));
+		if(!pieces) goto done;
+		mz = rctx->zmod->mt_init(ctx,bctx.num_jobs,0);
+		if(!mz) goto done;
+		bctx.decompressed = 1;
+	}
+	else if(rctx->compression==IWTIFF_CMPR_LZW) {
+		bctx.lzw = iw_mallocz(ctx,bctx.num_jobs*sizeof(struct iwtiffr_lzwdec*));
+		if(!bctx.lzw) goto done;
+		for(k=0;k<bctx.num_jobs;k++) {
+			bctx.lzw[k] = iw_malloc(ctx,sizeof(struct iwtiffr_lzwdec));
+			if(!bctx.lzw[k]) goto done;
+			iwtiffr_lzw_init(bctx.lzw[k]);
+		}
+	}
+
+	for(bctx.first=0;bctx.first<total_chunks;bctx.first+=n) {
+		n = total_chunks-bctx.first;
+		if(n>band_chunks) n = band_chunks;
+		bctx.num_chunks = n;
+		iw_zeromem(bctx.ok,n*sizeof(int));
+
+		if(is_deflate) {
+			for(k=0;k<n;k++) {
+				iwtiffr_get_chunk_geom(&bctx,bctx.first+k,&g);
+				iw_zeromem(&pieces[k],sizeof(struct iw_zlib_piece));
+				pieces[k].src = &rctx->mem[rctx->chunk_offset[g.chunk]];
+				pieces[k].srclen = rctx->chunk_size[g.chunk];
+				pieces[k].dst = &bctx.ubuf[bctx.ubuf_chunksize*k];
+				pieces[k].dstlen = rctx->chunk_bpr*g.row1;
+				pieces[k].whole_stream = 1;
+			}
+			rctx->zmod->mt_run(mz,pieces,n);
+			for(k=0;k<n;k++) {
+				if(!pieces[k].ok) goto cmprerror;
+			}
+		}
+
+		iw_run_parallel(ctx,bctx.num_jobs,bctx.num_jobs,iwtiffr_chunk_job,(void*)&bctx);
+
+		for(k=0;k<n;k++) {
+			if(!bctx.ok[k]) goto cmprerror;
+		}
+	}
+
+	retval = 1;
+	goto done;
+
+cmprerror:
+	iw_set_errorf(ctx,"TIFF: Invalid or truncated %s data",rctx->is_tiled?"tile":"strip");
+done:
+	if(mz) rctx->zmod->mt_end(mz);
+	if(pieces) iw_free(ctx,pieces);
+	if(bctx.lzw) {
+		for(k=0;k<bctx.num_jobs;k++) {
+			if(bctx.lzw[k]) iw_free(ctx,bctx.lzw[k]);
+		}
+		iw_free(ctx,bctx.lzw);
+	}
+	if(bctx.ubuf) iw_free(ctx,bctx.ubuf);
+	if(bctx.ok) iw_free(ctx,bctx.ok);
+	return retval;
+}
+
+// Use the TransferFunction tag, if present, to figure out the colorspace.
+// IW writes it for any colorspace it supports, but it might not have been
+// written by IW, so we just test whether it looks like linear, sRGB, or some
+// gamma curve.
+static void iwtiffr_read_transferfunction(struct iwtiffrcontext *rctx)
+{
+	unsigned int numentries;
+	unsigned int idx;
+	unsigned int v;
+	double t, lin;
+	struct iw_csdescr srgb;
+
+	if(!rctx->e_transferfunc) return;
+	if(rctx->bitspersample<2 || rctx->bitspersample>16) return;
+	if(rctx->photometric==IWTIFF_PHOTO_PALETTE) return;
+
+	numentries = 1U<<rctx->bitspersample;
+	if(iwtiffr_get_count(rctx,rctx->e_transferfunc)<numentries) return;
+
+	idx = numentries/2;
+	if(!iwtiffr_get_uint(rctx,rctx->e_transferfunc,idx,&v)) return;
+	t = ((double)idx)/(numentries-1);
+	lin = ((double)v)/65535.0;
+	if(lin<=0.0 || lin>=1.0) return;
+
+	iw_make_srgb_csdescr_2(&srgb);
+	if(fabs(lin-t)<0.002) {
+		iw_make_linear_csdescr(&rctx->csdescr);
+	}
+	else if(fabs(lin-iw_convert_sample_to_linear(t,&srgb))<0.002) {
+		rctx->csdescr = srgb;
+	}
+	else {
+		iw_make_gamma_csdescr(&rctx->csdescr,log(lin)/log(t));
+	}
+}
+
+static void iwtiffr_read_density(struct iwtiffrcontext *rctx)
+{
+	double xres, yres;
+	struct iw_image *img = rctx->img;
+
+	if(!rctx->e_xres || !rctx->e_yres) return;
+	if(!iwtiffr_get_rational(rctx,rctx->e_xres,&xres)) return;
+	if(!iwtiffr_get_rational(rctx,rctx->e_yres,&yres)) return;
+
+	if(rctx->resunit==2) { // pixels/inch
+		img->density_code = IW_DENSITY_UNITS_PER_METER;
+		img->density_x = xres/0.0254;
+		img->density_y = yres/0.0254;
+	}
+	else if(rctx->resunit==3) { // pixels/cm
+		img->density_code = IW_DENSITY_UNITS_PER_METER;
+		img->density_x = xres*100.0;
+		img->density_y = yres*100.0;
+	}
+	else {
+		img->density_code = IW_DENSITY_UNITS_UNKNOWN;
+		img->density_x = xres;
+		img->density_y = yres;
+	}
+	if(!iw_is_valid_density(img->density_x,img->density_y,img->density_code)) {
+		img->density_code = IW_DENSITY_UNKNOWN;
+	}
+}
+
+static int iwtiffr_read_header_and_ifd(struct iwtiffrcontext *rctx)
+{
+	if(!iwtiffr_read_file_header(rctx)) return 0;
+	if(!iwtiffr_find_ifd(rctx)) return 0;
+	if(!iwtiffr_read_ifd(rctx)) return 0;
+	if(rctx->photometric==IWTIFF_PHOTO_PALETTE) {
+		if(!iwtiffr_read_palette(rctx)) return 0;
+	}
+	return 1;
+}
+
+static int iwtiffr_open(struct iwtiffrcontext *rctx, int *pborrowed)
+{
+	void *mem = NULL;
+	iw_int64 memsize = 0;
+
+	if(!iw_file_to_memory_ex(rctx->ctx,rctx->iodescr,&mem,&memsize,pborrowed)) {
+		if(!rctx->iodescr->getmem_fn && !rctx->iodescr->getfilesize_fn) {
+			iw_set_error(rctx->ctx,"TIFF files can't be read from a stream");
+		}
+		return 0;
+	}
+	rctx->mem = (const iw_byte*)mem;
+	rctx->memsize = (size_t)memsize;
+	rctx->zmod = iw_get_zlib_module(rctx->ctx);
+	return 1;
+}
+
+static void iwtiffr_close(struct iwtiffrcontext *rctx, int borrowed)
+{
+	if(rctx->mem && !borrowed) iw_free(rctx->ctx,(void*)rctx->mem);
+	if(rctx->chunk_offset) iw_free(rctx->ctx,rctx->chunk_offset);
+	if(rctx->chunk_size) iw_free(rctx->ctx,rctx->chunk_size);
+}
+
+IW_IMPL(int) iw_read_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
+{
+	struct iwtiffrcontext rctx;
+	struct iw_image img;
+	int crop_w, crop_h;
+	int borrowed = 0;
+	int retval = 0;
+
+	iw_zeromem(&rctx,sizeof(struct iwtiffrcontext));
+	iw_zeromem(&img,sizeof(struct iw_image));
+
+	rctx.ctx = ctx;
+	rctx.img = &img;
+	rctx.iodescr = iodescr;
+
+	// Start with a default sRGB colorspace. This may be overridden later.
+	iw_make_srgb_csdescr_2(&rctx.csdescr);
+
+	if(!iwtiffr_open(&rctx,&borrowed)) goto done;
+	if(!iwtiffr_read_header_and_ifd(&rctx)) goto done;
+
+	if(!iw_check_image_dimensions(ctx,rctx.width,rctx.height)) {
+		goto done;
+	}
+
+	iwtiffr_set_imgtype(&rctx,&img.imgtype,&img.bit_depth);
+	rctx.out_bitspersample = img.bit_depth;
+	rctx.out_samplesperpixel = iw_imgtype_num_channels(img.imgtype);
+	img.native_grayscale = (rctx.num_color_channels==1 &&
+		rctx.photometric!=IWTIFF_PHOTO_PALETTE);
+	img.associated_alpha = rctx.alpha_is_assoc;
+
+	// If the caller only wants part of the image, read only the strips or
+	// tiles that it's in.
+	img.width = rctx.width;
+	img.height = rctx.height;
+	if(iw_get_input_crop(ctx,rctx.width,rctx.height,&rctx.crop_x,&rctx.crop_y,&crop_w,&crop_h)) {
+		rctx.use_crop = 1;
+		img.width = crop_w;
+		img.height = crop_h;
+	}
+
+	if(!iwtiffr_read_chunk_table(&rctx)) goto done;
+
+	img.bpr = iw_calc_bytesperrow(img.width,
+		rctx.out_samplesperpixel*rctx.out_bitspersample);
+	img.pixels = (iw_byte*)iw_malloc_large(ctx, img.bpr, img.height);
+	if(!img.pixels) goto done;
+
+	if(!iwtiffr_read_pixels(&rctx)) goto done;
+
+	iwtiffr_read_density(&rctx);
+	iwtiffr_read_transferfunction(&rctx);
+
+	iw_set_input_image(ctx, &img);
+	if(rctx.use_crop) {
+		iw_set_input_image_offset(ctx,rctx.crop_x,rctx.crop_y,rctx.width,rctx.height);
+	}
+
+	iw_set_input_colorspace(ctx,&rctx.csdescr);
+	if(rctx.bitspersample<8 && rctx.photometric!=IWTIFF_PHOTO_PALETTE) {
+		// Samples of 1, 2, or 4 bits were stored in 8-bit samples, unscaled.
+		iw_set_input_max_color_code(ctx,0,rctx.maxsample);
+	}
+
+	retval = 1;
+done:
+	iwtiffr_close(&rctx,borrowed);
+	if(!retval) {
+		iw_set_error(ctx,"TIFF read failed");
+		// If we didn't call iw_set_input_image, 'img' still belongs to us,
+		// so free its contents.
+		iw_free(ctx, img.pixels);
+	}
+	return retval;
+}
+
+IW_IMPL(int) iw_probe_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info)
+{
+	struct iwtiffrcontext rctx;
+	struct iw_image img;
+	int borrowed = 0;
+	int retval = 0;
+
+	iw_zeromem(info,sizeof(struct iw_image_info));
+	iw_zeromem(&rctx,sizeof(struct iwtiffrcontext));
+	iw_zeromem(&img,sizeof(struct iw_image));
+
+	rctx.ctx = ctx;
+	rctx.img = &img;
+	rctx.iodescr = iodescr;
+	rctx.probe_info = info;
+
+	if(!iwtiffr_open(&rctx,&borrowed)) goto done;
+	if(!iwtiffr_read_header_and_ifd(&rctx)) goto done;
+
+	iwtiffr_set_imgtype(&rctx,&info->imgtype,&info->bit_depth);
+	info->width = rctx.width;
+	info->height = rctx.height;
+	info->sampletype = IW_SAMPLETYPE_UINT;
+	info->native_grayscale = (rctx.num_color_channels==1 &&
+		rctx.photometric!=IWTIFF_PHOTO_PALETTE);
+	info->orient_transform = IW_REORIENT_NOCHANGE;
+
+	retval = 1;
+done:
+	iwtiffr_close(&rctx,borrowed);
+	return retval;
+}
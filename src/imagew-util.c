@@ -11,10 +11,14 @@
 #include <stdlib.h>
 #include <string.h>
 #ifdef IW_WINDOWS
+#include <windows.h>
 #include <malloc.h>
 #endif
 #include <stdarg.h>
 #include <time.h>
+#if IW_SUPPORT_THREADS == 1 && !defined(IW_WINDOWS)
+#include <pthread.h>
+#endif
 
 #include "imagew-internals.h"
 #ifdef IW_WINDOWS
@@ -52,6 +56,7 @@ IW_IMPL(void*) iw_malloc_ex(struct iw_context *ctx, unsigned int flags, size_t n
 			iw_set_error(ctx,"Out of memory");
 		return NULL;
 	}
+	if(ctx->statsctx.enabled) iwpvt_stats_track(ctx,mem,n);
 	return mem;
 }
 
@@ -113,6 +118,10 @@ IW_IMPL(void*) iw_realloc_ex(struct iw_context *ctx, unsigned int flags,
 	}
 
 	mem = emulated_realloc(ctx,flags,oldmem,oldmem_size,newmem_size);
+	if(ctx->statsctx.enabled) {
+		iwpvt_stats_untrack(ctx,oldmem);
+		if(mem) iwpvt_stats_track(ctx,mem,newmem_size);
+	}
 
 	if(!mem) {
 		if(!(flags&IW_MALLOCFLAG_NOERRORS))
@@ -131,11 +140,315 @@ IW_IMPL(void*) iw_realloc(struct iw_context *ctx, void *oldmem,
 IW_IMPL(void) iw_free(struct iw_context *ctx, void *mem)
 {
 	if(!mem) return;
+	if(ctx->statsctx.enabled) iwpvt_stats_untrack(ctx,mem);
 	// Note that this function can be used to free the ctx struct itself,
 	// so we're not allowed to use ctx after freeing the memory.
 	(*ctx->freefn)(ctx->userdata,mem);
 }
 
+////////////////////////////////////////////
+// Statistics
+
+// Record that a memory block has been allocated.
+void iwpvt_stats_track(struct iw_context *ctx, void *mem, size_t n)
+{
+	struct iw_stats_ctx *sc = &ctx->statsctx;
+	struct iw_stats_memblock *newblocks;
+	int newalloc;
+
+	sc->stats.alloc_count++;
+	sc->cur_bytes += n;
+	if(sc->cur_bytes > sc->stats.peak_bytes)
+		sc->stats.peak_bytes = sc->cur_bytes;
+
+	if(sc->blocks_used >= sc->blocks_alloc) {
+		// The list is allocated directly, so that it isn't itself tracked.
+		newalloc = sc->blocks_alloc ? sc->blocks_alloc*2 : 64;
+		newblocks = (*ctx->mallocfn)(ctx->userdata,0,newalloc*sizeof(struct iw_stats_memblock));
+		if(!newblocks) return; // Not fatal; the block just won't be counted when freed.
+		if(sc->blocks) {
+			memcpy(newblocks,sc->blocks,sc->blocks_used*sizeof(struct iw_stats_memblock));
+			(*ctx->freefn)(ctx->userdata,sc->blocks);
+		}
+		sc->blocks = newblocks;
+		sc->blocks_alloc = newalloc;
+	}
+	sc->blocks[sc->blocks_used].mem = mem;
+	sc->blocks[sc->blocks_used].size = n;
+	sc->blocks_used++;
+}
+
+// Record that a memory block is about to be freed. It's okay if we don't
+// know about it.
+void iwpvt_stats_untrack(struct iw_context *ctx, void *mem)
+{
+	struct iw_stats_ctx *sc = &ctx->statsctx;
+	int i;
+
+	if(!mem) return;
+	// Blocks tend to be freed in the reverse order they were allocated.
+	for(i=sc->blocks_used-1; i>=0; i--) {
+		if(sc->blocks[i].mem==mem) {
+			sc->cur_bytes -= sc->blocks[i].size;
+			sc->blocks[i] = sc->blocks[sc->blocks_used-1];
+			sc->blocks_used--;
+			return;
+		}
+	}
+}
+
+// Clear the statistics, but keep track of memory that is still allocated.
+void iwpvt_stats_reset(struct iw_context *ctx)
+{
+	struct iw_stats_ctx *sc = &ctx->statsctx;
+	iw_zeromem(&sc->stats,sizeof(struct iw_stats));
+	sc->stats.peak_bytes = sc->cur_bytes;
+}
+
+void iwpvt_stats_free(struct iw_context *ctx)
+{
+	struct iw_stats_ctx *sc = &ctx->statsctx;
+	if(sc->blocks) (*ctx->freefn)(ctx->userdata,sc->blocks);
+	iw_zeromem(sc,sizeof(struct iw_stats_ctx));
+}
+
+// Returns the elapsed ("wall clock") time, and the CPU time used by the
+// current thread, in seconds, from some arbitrary starting point.
+static void iw_get_times(double *wall, double *cpu)
+{
+#ifdef IW_WINDOWS
+	LARGE_INTEGER count, freq;
+	FILETIME t_create, t_exit, t_kernel, t_user;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	*wall = (double)count.QuadPart / (double)freq.QuadPart;
+
+	*cpu = 0.0;
+	if(GetThreadTimes(GetCurrentThread(),&t_create,&t_exit,&t_kernel,&t_user)) {
+		*cpu = ((double)t_kernel.dwLowDateTime + 4294967296.0*(double)t_kernel.dwHighDateTime +
+			(double)t_user.dwLowDateTime + 4294967296.0*(double)t_user.dwHighDateTime) / 10000000.0;
+	}
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	*wall = (double)ts.tv_sec + (double)ts.tv_nsec/1000000000.0;
+
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+	*cpu = (double)ts.tv_sec + (double)ts.tv_nsec/1000000000.0;
+#else
+	*cpu = (double)clock() / (double)CLOCKS_PER_SEC;
+#endif
+#endif
+}
+
+static unsigned long iw_get_thread_id(void)
+{
+#ifdef IW_WINDOWS
+	return (unsigned long)GetCurrentThreadId();
+#elif IW_SUPPORT_THREADS == 1
+	return (unsigned long)(size_t)pthread_self();
+#else
+	return 0;
+#endif
+}
+
+static void iw_emit_trace_event(struct iw_context *ctx, int type, const char *name, int arg)
+{
+	struct iw_trace_event ev;
+	double cpu;
+
+	ev.type = type;
+	ev.name = name;
+	ev.arg = arg;
+	iw_get_times(&ev.time,&cpu);
+	ev.thread_id = iw_get_thread_id();
+	(*ctx->trace_fn)(ctx,&ev);
+}
+
+IW_IMPL(void) iw_trace_begin(struct iw_context *ctx, const char *name, int arg)
+{
+	if(!ctx->trace_fn) return;
+	iw_emit_trace_event(ctx,IW_TRACE_BEGIN,name,arg);
+}
+
+IW_IMPL(void) iw_trace_end(struct iw_context *ctx, const char *name, int arg)
+{
+	if(!ctx->trace_fn) return;
+	iw_emit_trace_event(ctx,IW_TRACE_END,name,arg);
+}
+
+IW_IMPL(void) iw_begin_stage(struct iw_context *ctx, int stage)
+{
+	struct iw_stats_ctx *sc = &ctx->statsctx;
+
+	if(stage<0 || stage>=IW_NUM_STAGES) return;
+	iw_trace_begin(ctx,iw_get_stage_name(stage),-1);
+	if(!sc->enabled) return;
+	iw_get_times(&sc->stage_start_wall[stage],&sc->stage_start_cpu[stage]);
+}
+
+IW_IMPL(void) iw_end_stage(struct iw_context *ctx, int stage)
+{
+	struct iw_stats_ctx *sc = &ctx->statsctx;
+	double wall, cpu;
+
+	if(stage<0 || stage>=IW_NUM_STAGES) return;
+	if(sc->enabled) {
+		iw_get_times(&wall,&cpu);
+		sc->stats.stage[stage].count++;
+		sc->stats.stage[stage].wall_time += wall - sc->stage_start_wall[stage];
+		sc->stats.stage[stage].cpu_time += cpu - sc->stage_start_cpu[stage];
+	}
+	iw_trace_end(ctx,iw_get_stage_name(stage),-1);
+}
+
+////////////////////////////////////////////
+// Scratch memory pool.
+// Buffers used internally during processing are allocated with
+// iwpvt_scratch_alloc(). If ctx->scratch_limit is nonzero, freed scratch
+// buffers are kept (up to that many bytes in total), and handed out again
+// by later requests, so that a context that is reused with
+// iw_reset_context() can process similar images without allocating memory.
+
+static struct iw_scratch_block *iwpvt_scratch_find(struct iw_context *ctx, void *mem)
+{
+	int i;
+	for(i=0;i<IW_SCRATCH_SLOTS;i++) {
+		if(ctx->scratch[i].mem==mem) return &ctx->scratch[i];
+	}
+	return NULL;
+}
+
+static size_t iwpvt_scratch_idle_bytes(struct iw_context *ctx)
+{
+	int i;
+	size_t n = 0;
+	for(i=0;i<IW_SCRATCH_SLOTS;i++) {
+		if(ctx->scratch[i].mem && !ctx->scratch[i].in_use)
+			n += ctx->scratch[i].size;
+	}
+	return n;
+}
+
+static void iwpvt_scratch_discard(struct iw_context *ctx, struct iw_scratch_block *blk)
+{
+	iw_free(ctx,blk->mem);
+	blk->mem = NULL;
+	blk->size = 0;
+	blk->in_use = 0;
+}
+
+// Allocates n1*n2 bytes, checking for overflow like iw_malloc_large().
+// The only supported flag is IW_MALLOCFLAG_ZEROMEM.
+void *iwpvt_scratch_alloc(struct iw_context *ctx, unsigned int flags,
+	size_t n1, size_t n2)
+{
+	struct iw_scratch_block *blk = NULL;
+	struct iw_scratch_block *smaller = NULL;
+	struct iw_scratch_block *empty = NULL;
+	size_t n;
+	int i;
+
+	if(n2>0 && n1 > ctx->max_malloc/n2) {
+		iw_set_error(ctx,"Image too large to process");
+		return NULL;
+	}
+	n = n1*n2;
+
+	if(ctx->scratch_limit==0 || n>ctx->scratch_limit) {
+		return iw_malloc_ex(ctx,flags,n);
+	}
+
+	// Prefer the smallest idle block that is big enough.
+	for(i=0;i<IW_SCRATCH_SLOTS;i++) {
+		struct iw_scratch_block *b = &ctx->scratch[i];
+		if(!b->mem) {
+			if(!empty) empty = b;
+		}
+		else if(!b->in_use) {
+			if(b->size>=n) {
+				if(!blk || b->size<blk->size) blk = b;
+			}
+			else if(!smaller) {
+				smaller = b;
+			}
+		}
+	}
+
+	if(blk) {
+		blk->in_use = 1;
+		if(flags&IW_MALLOCFLAG_ZEROMEM) memset(blk->mem,0,n);
+		return blk->mem;
+	}
+
+	// No idle block is big enough. Allocate a new one, replacing a
+	// too-small idle block if there's no free slot.
+	if(!empty && smaller) {
+		iwpvt_scratch_discard(ctx,smaller);
+		empty = smaller;
+	}
+
+	if(!empty) {
+		// No slots available; this block won't be pooled.
+		return iw_malloc_ex(ctx,flags,n);
+	}
+
+	empty->mem = iw_malloc_ex(ctx,flags,n);
+	if(!empty->mem) return NULL;
+	empty->size = n;
+	empty->in_use = 1;
+	return empty->mem;
+}
+
+// Like iw_realloc(), the old block is always released, even on failure.
+void *iwpvt_scratch_realloc(struct iw_context *ctx, void *oldmem,
+	size_t oldmem_size, size_t newmem_size)
+{
+	struct iw_scratch_block *blk;
+	void *newmem;
+
+	if(oldmem) {
+		blk = iwpvt_scratch_find(ctx,oldmem);
+		if(blk && blk->size>=newmem_size) return oldmem;
+	}
+
+	newmem = iwpvt_scratch_alloc(ctx,0,newmem_size,1);
+	if(newmem && oldmem) {
+		memcpy(newmem,oldmem,(oldmem_size<newmem_size)?oldmem_size:newmem_size);
+	}
+	iwpvt_scratch_free(ctx,oldmem);
+	return newmem;
+}
+
+void iwpvt_scratch_free(struct iw_context *ctx, void *mem)
+{
+	struct iw_scratch_block *blk;
+
+	if(!mem) return;
+	blk = iwpvt_scratch_find(ctx,mem);
+	if(!blk) {
+		iw_free(ctx,mem);
+		return;
+	}
+
+	blk->in_use = 0;
+	if(iwpvt_scratch_idle_bytes(ctx) > ctx->scratch_limit) {
+		iwpvt_scratch_discard(ctx,blk);
+	}
+}
+
+// Frees all pooled memory. Blocks that are still in use are freed as well.
+void iwpvt_scratch_free_all(struct iw_context *ctx)
+{
+	int i;
+	for(i=0;i<IW_SCRATCH_SLOTS;i++) {
+		if(ctx->scratch[i].mem) iwpvt_scratch_discard(ctx,&ctx->scratch[i]);
+	}
+}
+
 IW_IMPL(char*) iw_strdup(struct iw_context *ctx, const char *s)
 {
 	size_t len;
@@ -242,14 +555,31 @@ int iwpvt_util_randomize(struct iw_prng *prng)
 	return s;
 }
 
-IW_IMPL(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iodescr,
-  void **pmem, iw_int64 *psize)
+IW_IMPL(int) iw_file_to_memory_ex(struct iw_context *ctx, struct iw_iodescr *iodescr,
+  void **pmem, iw_int64 *psize, int *pborrowed)
 {
 	int ret;
 	size_t bytesread;
+	const void *srcmem;
 
 	*pmem=NULL;
 	*psize=0;
+	if(pborrowed) *pborrowed=0;
+
+	if(iodescr->getmem_fn) {
+		ret = (*iodescr->getmem_fn)(ctx,iodescr,&srcmem,psize);
+		if(!ret) return 0;
+		if(pborrowed) {
+			// The file is already in memory. Don't copy it.
+			*pmem = (void*)srcmem;
+			*pborrowed = 1;
+			return 1;
+		}
+		*pmem = iw_malloc(ctx,(size_t)*psize);
+		if(!*pmem) return 0;
+		memcpy(*pmem,srcmem,(size_t)*psize);
+		return 1;
+	}
 
 	if(!iodescr->getfilesize_fn) return 0;
 
@@ -258,6 +588,7 @@ IW_IMPL(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iodesc
 	if(!ret) return 0;
 
 	*pmem = iw_malloc(ctx,(size_t)*psize);
+	if(!*pmem) return 0;
 
 	ret = (*iodescr->read_fn)(ctx,iodescr,*pmem,(size_t)*psize,&bytesread);
 	if(!ret) return 0;
@@ -265,6 +596,12 @@ IW_IMPL(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iodesc
 	return 1;
 }
 
+IW_IMPL(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iodescr,
+  void **pmem, iw_int64 *psize)
+{
+	return iw_file_to_memory_ex(ctx,iodescr,pmem,psize,NULL);
+}
+
 struct iw_utf8cvt_struct {
 	char *dst;
 	int dstlen;
@@ -642,6 +979,7 @@ IW_IMPL(int) iw_is_input_fmt_supported(int fmt)
 	case IW_FORMAT_MIFF:
 	case IW_FORMAT_GIF:
 	case IW_FORMAT_BMP:
+	case IW_FORMAT_TIFF:
 	case IW_FORMAT_PNM:
 	case IW_FORMAT_PAM:
 		return 1;
@@ -368,6 +368,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	int retval=0;
 	void *webpimage=NULL;
 	iw_int64 webpimage_size=0;
+	int webpimage_borrowed=0;
 	uint8_t* uncmpr_webp_pixels = NULL;
 	int width, height;
 	size_t npixels;
@@ -376,7 +377,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	img = rctx->img;
 
 	// Read the whole WebP file into a memory block.
-	if(!iw_file_to_memory(rctx->ctx, rctx->iodescr, &webpimage, &webpimage_size)) {
+	if(!iw_file_to_memory_ex(rctx->ctx, rctx->iodescr, &webpimage, &webpimage_size, &webpimage_borrowed)) {
 		goto done;
 	}
 
@@ -418,7 +419,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	retval=1;
 
 done:
-	if(webpimage) iw_free(rctx->ctx,webpimage);
+	if(webpimage && !webpimage_borrowed) iw_free(rctx->ctx,webpimage);
 
 	// !!! Portability warning: This is dangerous, because this memory was
 	// allocated by libwebp. There's no way to be sure that our free() function
@@ -438,6 +439,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	int retval=0;
 	void *webpimage=NULL;
 	iw_int64 webpimage_size=0;
+	int webpimage_borrowed=0;
 	int width, height;
 	size_t npixels;
 	int bytes_per_pixel;
@@ -453,7 +455,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	needfree_decbuffer = 1;
 
 	// Read the whole WebP file into a memory block.
-	if(!iw_file_to_memory(rctx->ctx, rctx->iodescr, &webpimage, &webpimage_size)) {
+	if(!iw_file_to_memory_ex(rctx->ctx, rctx->iodescr, &webpimage, &webpimage_size, &webpimage_borrowed)) {
 		if(rctx->iodescr->getfilesize_fn==NULL) {
 			// Assume this was the problem.
 			iw_set_errorf(rctx->ctx,"Failed to read WebP file: Seekable stream required");
@@ -517,7 +519,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	retval=1;
 
 done:
-	if(webpimage) iw_free(rctx->ctx,webpimage);
+	if(webpimage && !webpimage_borrowed) iw_free(rctx->ctx,webpimage);
 
 	if(needfree_decbuffer) {
 		 WebPFreeDecBuffer(&cfg.output);
@@ -561,6 +563,44 @@ done:
 	return retval;
 }
 
+IW_IMPL(int) iw_probe_webp_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info)
+{
+	// The dimensions are always within the first 30 bytes of the file.
+	iw_byte buf[64];
+	size_t bytesread = 0;
+	int width=0, height=0;
+	int retval=0;
+	int ret;
+
+	iw_zeromem(info,sizeof(struct iw_image_info));
+
+	ret = (*iodescr->read_fn)(ctx,iodescr,buf,sizeof(buf),&bytesread);
+	if(!ret) goto done;
+
+	if(!WebPGetInfo((const uint8_t*)buf, bytesread, &width, &height)) {
+		iw_set_error(ctx,"Invalid or unsupported WebP file");
+		goto done;
+	}
+	if(width<1 || height<1) goto done;
+
+	info->width = width;
+	info->height = height;
+	// iw_read_webp_file() decides on the image type by examining the pixels.
+	info->imgtype = IW_IMGTYPE_RGBA;
+	info->flags |= IW_IMAGEINFOFLAG_IMGTYPE_IS_MAX;
+	info->bit_depth = 8;
+	info->sampletype = IW_SAMPLETYPE_UINT;
+	info->page_count = 1;
+	retval = 1;
+
+done:
+	if(!retval) {
+		iw_set_error(ctx,"Failed to read WebP file");
+	}
+	return retval;
+}
+
 struct iwwebpwcontext {
 	struct iw_iodescr *iodescr;
 	struct iw_context *ctx;
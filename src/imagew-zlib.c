@@ -91,12 +91,23 @@ static int iw_zlib_inflate_item(struct iw_zlib_context *zctx,
 	return 1;
 }
 
+// The compression level to use for row-by-row compression.
+static int iwz_get_cmprlevel(struct iw_context *ctx)
+{
+	const char *optv;
+
+	optv = iw_get_option(ctx, "deflate:cmprlevel");
+	if(optv) {
+		return iw_parse_int(optv);
+	}
+	return 9;
+}
+
 static struct iw_zlib_context* iw_zlib_deflate_init(struct iw_context *ctx)
 {
 	struct iw_zlib_context *zctx;
 	int ret;
 	int cmprlevel;
-	const char *optv;
 
 	zctx = iw_mallocz(ctx,sizeof(struct iw_zlib_context));
 	if(!zctx) return NULL;
@@ -106,11 +117,7 @@ static struct iw_zlib_context* iw_zlib_deflate_init(struct iw_context *ctx)
 	zctx->strm.zalloc = my_zlib_malloc;
 	zctx->strm.zfree = my_zlib_free;
 
-	cmprlevel = 9;
-	optv = iw_get_option(ctx, "deflate:cmprlevel");
-	if(optv) {
-		cmprlevel = iw_parse_int(optv);
-	}
+	cmprlevel = iwz_get_cmprlevel(ctx);
 
 	ret = deflateInit(&zctx->strm,cmprlevel);
 	if(ret!=Z_OK) {
@@ -159,6 +166,498 @@ done:
 	return retval;
 }
 
+// Parallel compression: The data is split into pieces, each of which is
+// compressed to a raw deflate stream that ends on a byte boundary (using
+// Z_SYNC_FLUSH), and primed with the 32K of data that precedes it. The pieces
+// are concatenated, and given a zlib header and checksum.
+// The data can be supplied in several parts, so that the caller doesn't have
+// to have all of it at once.
+
+#define IWZ_PIECE_SIZE 131072
+#define IWZ_WINDOW_SIZE 32768
+
+struct iwz_piece {
+	size_t src_start;
+	size_t src_len;
+	iw_byte *dst;
+	size_t dst_alloc;
+	size_t dst_used;
+	uLong adler;
+	int ok;
+};
+
+struct iw_zlib_pdeflate {
+	struct iw_context *ctx;
+	struct iw_zlib_context zctx_for_alloc;
+	int cmprlevel;
+	int strategy;
+	z_stream *strms; // One per thread
+	int num_strms;
+	int num_strms_inited;
+	size_t piece_alloc;
+
+	// The last (up to) 32K of data from previous calls.
+	iw_byte window[IWZ_WINDOW_SIZE];
+	size_t window_len;
+
+	int header_written;
+	uLong adler;
+
+	// Used by iwz_deflate_job().
+	const iw_byte *src;
+	int is_last;
+	int num_jobs;
+	struct iwz_piece *pieces;
+	int num_pieces;
+	size_t pieces_alloc; // Number of pieces allocated
+
+	iw_byte *dst;
+	size_t dst_alloc;
+};
+
+// Write a 2-byte zlib header.
+static void iwz_write_header(int cmprlevel, iw_byte *buf)
+{
+	int flevel;
+
+	if(cmprlevel==Z_DEFAULT_COMPRESSION || cmprlevel==6) flevel = 2;
+	else if(cmprlevel<2) flevel = 0;
+	else if(cmprlevel<6) flevel = 1;
+	else flevel = 3;
+	buf[0] = 0x78;
+	buf[1] = (iw_byte)(flevel<<6);
+	buf[1] += (iw_byte)(31 - (((unsigned int)buf[0]*256 + buf[1]) % 31));
+}
+
+// Compresses pieces job, job+num_jobs, job+2*num_jobs, ...
+static void iwz_deflate_job(void *userdata, int job)
+{
+	struct iw_zlib_pdeflate *pz = (struct iw_zlib_pdeflate*)userdata;
+	z_stream *strm = &pz->strms[job];
+	struct iwz_piece *pc;
+	size_t dictlen;
+	int is_last;
+	int ret;
+	int i;
+
+	for(i=job; i<pz->num_pieces; i+=pz->num_jobs) {
+		pc = &pz->pieces[i];
+		is_last = pz->is_last && (i==pz->num_pieces-1);
+
+		if(deflateReset(strm)!=Z_OK) continue;
+		if(pc->src_start>0) {
+			dictlen = pc->src_start;
+			if(dictlen>IWZ_WINDOW_SIZE) dictlen = IWZ_WINDOW_SIZE;
+			if(deflateSetDictionary(strm,&pz->src[pc->src_start-dictlen],(uInt)dictlen)!=Z_OK)
+				continue;
+		}
+		else if(pz->window_len>0) {
+			// The first piece is primed with data from the previous call.
+			if(deflateSetDictionary(strm,pz->window,(uInt)pz->window_len)!=Z_OK)
+				continue;
+		}
+
+		strm->next_in = (Bytef*)&pz->src[pc->src_start];
+		strm->avail_in = (uInt)pc->src_len;
+		strm->next_out = pc->dst;
+		strm->avail_out = (uInt)pc->dst_alloc;
+		ret = deflate(strm,is_last ? Z_FINISH : Z_SYNC_FLUSH);
+		if(is_last) {
+			if(ret!=Z_STREAM_END) continue;
+		}
+		else {
+			// If the output buffer filled up, the flush may not be complete.
+			if(ret!=Z_OK || strm->avail_out==0) continue;
+		}
+		if(strm->avail_in!=0) continue;
+
+		pc->dst_used = pc->dst_alloc - strm->avail_out;
+		pc->adler = adler32(adler32(0L,Z_NULL,0),&pz->src[pc->src_start],(uInt)pc->src_len);
+		pc->ok = 1;
+	}
+}
+
+static void iw_zlib_pdeflate_end(struct iw_zlib_pdeflate *pz)
+{
+	struct iw_context *ctx;
+	int i;
+
+	if(!pz) return;
+	ctx = pz->ctx;
+	for(i=0; i<pz->num_strms_inited; i++) {
+		deflateEnd(&pz->strms[i]);
+	}
+	if(pz->strms) iw_free(ctx,pz->strms);
+	if(pz->pieces) iw_free(ctx,pz->pieces);
+	if(pz->dst) iw_free(ctx,pz->dst);
+	iw_free(ctx,pz);
+}
+
+static struct iw_zlib_pdeflate* iw_zlib_pdeflate_init(struct iw_context *ctx,
+	int num_threads, int cmprlevel, int strategy)
+{
+	struct iw_zlib_pdeflate *pz;
+	int i;
+
+	pz = iw_mallocz(ctx,sizeof(struct iw_zlib_pdeflate));
+	if(!pz) return NULL;
+	pz->ctx = ctx;
+	pz->zctx_for_alloc.ctx = ctx;
+
+	if(cmprlevel<0) cmprlevel = Z_DEFAULT_COMPRESSION;
+	if(num_threads<1) num_threads = iw_get_num_cpus();
+	pz->cmprlevel = cmprlevel;
+	pz->strategy = strategy;
+	pz->num_strms = num_threads;
+	pz->adler = adler32(0L,Z_NULL,0);
+
+	pz->strms = iw_mallocz(ctx,pz->num_strms*sizeof(z_stream));
+	if(!pz->strms) goto fail;
+
+	// zlib doesn't allocate any memory after deflateInit2(), so it's okay to
+	// use the context's memory functions here, and deflate() in other threads.
+	for(i=0; i<pz->num_strms; i++) {
+		pz->strms[i].opaque = (voidpf)&pz->zctx_for_alloc;
+		pz->strms[i].zalloc = my_zlib_malloc;
+		pz->strms[i].zfree = my_zlib_free;
+		if(deflateInit2(&pz->strms[i],cmprlevel,Z_DEFLATED,-15,8,strategy)!=Z_OK)
+			goto fail;
+		pz->num_strms_inited++;
+	}
+
+	pz->piece_alloc = deflateBound(&pz->strms[0],IWZ_PIECE_SIZE) + 64;
+	return pz;
+
+fail:
+	iw_zlib_pdeflate_end(pz);
+	return NULL;
+}
+
+// Remember the last 32K of the data compressed so far.
+static void iwz_update_window(struct iw_zlib_pdeflate *pz,
+	const iw_byte *src, size_t srclen)
+{
+	size_t keep;
+
+	if(srclen>=IWZ_WINDOW_SIZE) {
+		memcpy(pz->window,&src[srclen-IWZ_WINDOW_SIZE],IWZ_WINDOW_SIZE);
+		pz->window_len = IWZ_WINDOW_SIZE;
+		return;
+	}
+	keep = IWZ_WINDOW_SIZE-srclen;
+	if(keep>pz->window_len) keep = pz->window_len;
+	memmove(pz->window,&pz->window[pz->window_len-keep],keep);
+	memcpy(&pz->window[keep],src,srclen);
+	pz->window_len = keep+srclen;
+}
+
+// Compress the next part of the data. is_last must be set for the final part.
+// On success, *pdst points to the compressed data, which is owned by pz, and
+// is valid until the next call.
+static int iw_zlib_pdeflate_write(struct iw_zlib_pdeflate *pz,
+	const iw_byte *src, size_t srclen, int is_last,
+	const iw_byte **pdst, size_t *pdstlen)
+{
+	struct iw_context *ctx = pz->ctx;
+	size_t dst_needed;
+	size_t start, pos;
+	int i;
+
+	*pdst = NULL;
+	*pdstlen = 0;
+
+	pz->src = src;
+	pz->is_last = is_last;
+	pz->num_pieces = (int)((srclen+IWZ_PIECE_SIZE-1)/IWZ_PIECE_SIZE);
+	if(pz->num_pieces<1) pz->num_pieces = 1;
+
+	if((size_t)pz->num_pieces > pz->pieces_alloc) {
+		if(pz->pieces) iw_free(ctx,pz->pieces);
+		pz->pieces_alloc = (size_t)pz->num_pieces;
+		pz->pieces = iw_mallocz(ctx,pz->pieces_alloc*sizeof(struct iwz_piece));
+		if(!pz->pieces) { pz->pieces_alloc = 0; return 0; }
+	}
+
+	// Compress each piece into its own part of one big buffer, leaving room
+	// for the zlib header at the start, and the checksum at the end.
+	dst_needed = 2 + pz->piece_alloc*(size_t)pz->num_pieces + 4;
+	if(dst_needed > pz->dst_alloc) {
+		if(pz->dst) iw_free(ctx,pz->dst);
+		pz->dst_alloc = dst_needed;
+		pz->dst = iw_malloc_large(ctx,pz->dst_alloc,1);
+		if(!pz->dst) { pz->dst_alloc = 0; return 0; }
+	}
+
+	for(i=0; i<pz->num_pieces; i++) {
+		iw_zeromem(&pz->pieces[i],sizeof(struct iwz_piece));
+		pz->pieces[i].src_start = (size_t)i*IWZ_PIECE_SIZE;
+		pz->pieces[i].src_len = srclen - pz->pieces[i].src_start;
+		if(pz->pieces[i].src_len>IWZ_PIECE_SIZE) pz->pieces[i].src_len = IWZ_PIECE_SIZE;
+		pz->pieces[i].dst = &pz->dst[2+pz->piece_alloc*i];
+		pz->pieces[i].dst_alloc = pz->piece_alloc;
+	}
+
+	pz->num_jobs = pz->num_strms;
+	if(pz->num_jobs>pz->num_pieces) pz->num_jobs = pz->num_pieces;
+	iw_run_parallel(ctx,pz->num_jobs,pz->num_jobs,iwz_deflate_job,(void*)pz);
+
+	for(i=0; i<pz->num_pieces; i++) {
+		if(!pz->pieces[i].ok) {
+			iw_set_error(ctx,"zlib compression failed");
+			return 0;
+		}
+	}
+
+	start = 2;
+	if(!pz->header_written) {
+		iwz_write_header(pz->cmprlevel,pz->dst);
+		start = 0;
+		pz->header_written = 1;
+	}
+
+	// Move the compressed pieces together, and compute the checksum.
+	pos = 2;
+	for(i=0; i<pz->num_pieces; i++) {
+		memmove(&pz->dst[pos],pz->pieces[i].dst,pz->pieces[i].dst_used);
+		pos += pz->pieces[i].dst_used;
+		pz->adler = adler32_combine(pz->adler,pz->pieces[i].adler,(z_off_t)pz->pieces[i].src_len);
+	}
+	if(is_last) {
+		iw_set_ui32be(&pz->dst[pos],(unsigned int)pz->adler);
+		pos += 4;
+	}
+	*pdst = &pz->dst[start];
+	*pdstlen = pos-start;
+
+	if(!is_last) {
+		iwz_update_window(pz,src,srclen);
+	}
+	return 1;
+}
+
+static int iw_zlib_deflate_parallel(struct iw_context *ctx,
+	const iw_byte *src, size_t srclen, int num_threads, int cmprlevel, int strategy,
+	iw_byte **pdst, size_t *pdstlen)
+{
+	struct iw_zlib_pdeflate *pz;
+	const iw_byte *zdata;
+	size_t zlen;
+	int retval = 0;
+
+	*pdst = NULL;
+	*pdstlen = 0;
+
+	pz = iw_zlib_pdeflate_init(ctx,num_threads,cmprlevel,strategy);
+	if(!pz) goto done;
+	if(!iw_zlib_pdeflate_write(pz,src,srclen,1,&zdata,&zlen)) goto done;
+
+	// Take ownership of pz's buffer, and move the data to the start of it.
+	memmove(pz->dst,zdata,zlen);
+	*pdst = pz->dst;
+	*pdstlen = zlen;
+	pz->dst = NULL;
+	retval = 1;
+
+done:
+	iw_zlib_pdeflate_end(pz);
+	return retval;
+}
+
+// Multithreaded compression or decompression of separate pieces of a stream,
+// with one raw zlib stream per thread.
+
+struct iw_zlib_mt {
+	struct iw_context *ctx;
+	struct iw_zlib_context zctx_for_alloc;
+	int deflate_flag;
+	int cmprlevel;
+	z_stream *strms; // One per thread
+	int num_strms;
+	int num_strms_inited;
+
+	// Used by iwz_mt_job().
+	struct iw_zlib_piece *pieces;
+	int num_pieces;
+	int num_jobs;
+};
+
+static int iwz_mt_deflate_piece(struct iw_zlib_mt *mz, z_stream *strm,
+	struct iw_zlib_piece *pc)
+{
+	size_t hdrlen = 0;
+	int ret;
+
+	if(deflateReset(strm)!=Z_OK) return 0;
+	if(pc->dict && pc->dictlen>0) {
+		if(deflateSetDictionary(strm,pc->dict,(uInt)pc->dictlen)!=Z_OK) return 0;
+	}
+	if(pc->zlib_header || pc->whole_stream) {
+		if(pc->dstlen<2) return 0;
+		iwz_write_header(mz->cmprlevel,pc->dst);
+		hdrlen = 2;
+	}
+
+	strm->next_in = (Bytef*)pc->src;
+	strm->avail_in = (uInt)pc->srclen;
+	strm->next_out = &pc->dst[hdrlen];
+	strm->avail_out = (uInt)(pc->dstlen-hdrlen);
+	if(pc->whole_stream) {
+		ret = deflate(strm,Z_FINISH);
+		if(ret!=Z_STREAM_END || strm->avail_out<4) return 0;
+		pc->dstused = pc->dstlen - strm->avail_out;
+		iw_set_ui32be(&pc->dst[pc->dstused],
+			(unsigned int)adler32(adler32(0L,Z_NULL,0),pc->src,(uInt)pc->srclen));
+		pc->dstused += 4;
+		return 1;
+	}
+
+	ret = deflate(strm,Z_SYNC_FLUSH);
+	// If the output buffer filled up, the flush may not be complete.
+	if(ret!=Z_OK || strm->avail_out==0 || strm->avail_in!=0) return 0;
+
+	pc->dstused = pc->dstlen - strm->avail_out;
+	return 1;
+}
+
+static int iwz_mt_inflate_piece(struct iw_zlib_mt *mz, z_stream *strm,
+	struct iw_zlib_piece *pc)
+{
+	const iw_byte *src = pc->src;
+	size_t srclen = pc->srclen;
+
+	if(pc->zlib_header || pc->whole_stream) {
+		// Check the header, and skip over it.
+		if(srclen<2) return 0;
+		if((src[0]&0x0f)!=8 || (src[0]>>4)>7) return 0;
+		if(((unsigned int)src[0]*256+src[1])%31 != 0) return 0;
+		if(src[1]&0x20) return 0; // Preset dictionary
+		src += 2;
+		srclen -= 2;
+	}
+
+	if(inflateReset(strm)!=Z_OK) return 0;
+	if(pc->dict && pc->dictlen>0) {
+		if(inflateSetDictionary(strm,pc->dict,(uInt)pc->dictlen)!=Z_OK) return 0;
+	}
+
+	strm->next_in = (Bytef*)src;
+	strm->avail_in = (uInt)srclen;
+	strm->next_out = pc->dst;
+	strm->avail_out = (uInt)pc->dstlen;
+	inflate(strm,Z_SYNC_FLUSH);
+
+	// Without the right dictionary, a piece that refers to earlier data will
+	// fail here.
+	if(strm->avail_out!=0) return 0;
+	return 1;
+}
+
+// Processes pieces job, job+num_jobs, job+2*num_jobs, ...
+static void iwz_mt_job(void *userdata, int job)
+{
+	struct iw_zlib_mt *mz = (struct iw_zlib_mt*)userdata;
+	z_stream *strm = &mz->strms[job];
+	struct iw_zlib_piece *pc;
+	int i;
+
+	for(i=job; i<mz->num_pieces; i+=mz->num_jobs) {
+		pc = &mz->pieces[i];
+		if(mz->deflate_flag)
+			pc->ok = iwz_mt_deflate_piece(mz,strm,pc);
+		else
+			pc->ok = iwz_mt_inflate_piece(mz,strm,pc);
+	}
+}
+
+static void iw_zlib_mt_end(struct iw_zlib_mt *mz)
+{
+	struct iw_context *ctx;
+	int i;
+
+	if(!mz) return;
+	ctx = mz->ctx;
+	for(i=0; i<mz->num_strms_inited; i++) {
+		if(mz->deflate_flag)
+			deflateEnd(&mz->strms[i]);
+		else
+			inflateEnd(&mz->strms[i]);
+	}
+	if(mz->strms) iw_free(ctx,mz->strms);
+	iw_free(ctx,mz);
+}
+
+static struct iw_zlib_mt* iw_zlib_mt_init(struct iw_context *ctx,
+	int num_threads, int deflate_flag)
+{
+	struct iw_zlib_mt *mz;
+	static const iw_byte dummy_dict[1] = { 0 };
+	int ret;
+	int i;
+
+	mz = iw_mallocz(ctx,sizeof(struct iw_zlib_mt));
+	if(!mz) return NULL;
+	mz->ctx = ctx;
+	mz->zctx_for_alloc.ctx = ctx;
+	mz->deflate_flag = deflate_flag;
+	mz->cmprlevel = iwz_get_cmprlevel(ctx);
+
+	if(num_threads<1) num_threads = iw_get_num_cpus();
+	mz->num_strms = num_threads;
+	mz->strms = iw_mallocz(ctx,mz->num_strms*sizeof(z_stream));
+	if(!mz->strms) goto fail;
+
+	// As with pdeflate, all of zlib's memory has to be allocated now, because
+	// our memory functions can't be used from the worker threads.
+	for(i=0; i<mz->num_strms; i++) {
+		mz->strms[i].opaque = (voidpf)&mz->zctx_for_alloc;
+		mz->strms[i].zalloc = my_zlib_malloc;
+		mz->strms[i].zfree = my_zlib_free;
+		if(deflate_flag) {
+			ret = deflateInit2(&mz->strms[i],mz->cmprlevel,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY);
+		}
+		else {
+			ret = inflateInit2(&mz->strms[i],-15);
+		}
+		if(ret!=Z_OK) goto fail;
+		mz->num_strms_inited++;
+
+		if(!deflate_flag) {
+			// inflate() doesn't allocate its window until it needs it. Setting a
+			// dictionary forces it to do so.
+			if(inflateSetDictionary(&mz->strms[i],dummy_dict,1)!=Z_OK) goto fail;
+		}
+	}
+
+	return mz;
+
+fail:
+	iw_zlib_mt_end(mz);
+	return NULL;
+}
+
+static int iw_zlib_mt_run(struct iw_zlib_mt *mz,
+	struct iw_zlib_piece *pieces, int num_pieces)
+{
+	int i;
+
+	if(num_pieces<1) return 1;
+	mz->pieces = pieces;
+	mz->num_pieces = num_pieces;
+	mz->num_jobs = mz->num_strms;
+	if(mz->num_jobs>num_pieces) mz->num_jobs = num_pieces;
+	iw_run_parallel(mz->ctx,mz->num_jobs,mz->num_jobs,iwz_mt_job,(void*)mz);
+
+	if(mz->deflate_flag) {
+		for(i=0; i<num_pieces; i++) {
+			if(!pieces[i].ok) {
+				iw_set_error(mz->ctx,"zlib compression failed");
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
 IW_IMPL(char*) iw_get_zlib_version_string(char *s, int s_len)
 {
 	const char *zv;
@@ -175,7 +674,14 @@ IW_IMPL(void) iw_enable_zlib(struct iw_context *ctx)
 		iw_zlib_inflate_item,
 		iw_zlib_deflate_init,
 		iw_zlib_deflate_end,
-		iw_zlib_deflate_item
+		iw_zlib_deflate_item,
+		iw_zlib_deflate_parallel,
+		iw_zlib_pdeflate_init,
+		iw_zlib_pdeflate_write,
+		iw_zlib_pdeflate_end,
+		iw_zlib_mt_init,
+		iw_zlib_mt_run,
+		iw_zlib_mt_end
 	};
 
 	iw_set_zlib_module(ctx,&zlib_module);
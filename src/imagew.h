@@ -15,7 +15,7 @@
 #endif
 #endif
 
-#include <stddef.h> // for size_t
+#include <stddef.h> // for size_t, ptrdiff_t
 #ifdef IW_INCLUDE_UTIL_FUNCTIONS
 #include <stdarg.h> // for va_list
 #endif
@@ -148,6 +148,14 @@ extern "C" {
 // Make a negative image (in target colorspace).
 #define IW_VAL_NEGATE_TARGET     53
 
+// Record timing and memory statistics. See iw_get_stats().
+#define IW_VAL_COLLECT_STATS     54
+
+// The maximum number of threads that may be used to encode the output file
+// (or to decode the input file), if the format supports it. 0 = one per CPU.
+// The default is 1.
+#define IW_VAL_NUM_THREADS       55
+
 // File formats.
 #define IW_FORMAT_UNKNOWN  0
 #define IW_FORMAT_PNG      1
@@ -229,6 +237,15 @@ extern "C" {
 #define IW_IMGTYPE_IS_GRAY(x)   (((x)&0x001)?1:0)
 #define IW_IMGTYPE_HAS_ALPHA(x) (((x)&0x100)?1:0)
 
+// The order of the samples within a pixel of an input image
+// (iw_image::channel_order). "X" is an unused sample.
+#define IW_CHANORDER_DEFAULT 0 // R,G,B[,A] or GRAY[,A]
+#define IW_CHANORDER_BGR     1 // B,G,R[,A]
+#define IW_CHANORDER_ARGB    2 // A,R,G,B or A,GRAY
+#define IW_CHANORDER_ABGR    3 // A,B,G,R
+#define IW_CHANORDER_RGBX    4 // R,G,B,X (IW_IMGTYPE_RGB only)
+#define IW_CHANORDER_BGRX    5 // B,G,R,X (IW_IMGTYPE_RGB only)
+
 #define IW_SAMPLETYPE_UINT          0
 #define IW_SAMPLETYPE_FLOATINGPOINT 1
 
@@ -390,6 +407,25 @@ struct iw_image {
 	iw_byte *pixels;
 	size_t bpr; // bytes per row
 
+	// For input images: If stride is nonzero, the first row starts at
+	// firstrow, and each row starts stride bytes after the previous one. The
+	// stride may be negative (for a bottom-up buffer), or larger than bpr (for
+	// padded rows). If stride is 0, rows start at pixels, bpr bytes apart.
+	// Either way, pixels is the memory block that IW frees, and may be NULL if
+	// the caller keeps ownership of the rows.
+	iw_byte *firstrow;
+	ptrdiff_t stride;
+
+	// For input images: The order of the samples in each pixel
+	// (IW_CHANORDER_*). Orders other than the default require a bit depth of
+	// at least 8.
+	int channel_order;
+	// For input images: Nonzero if the color samples have already been
+	// multiplied by the alpha sample (associated, or "premultiplied", alpha).
+	// The multiplication is assumed to have been done in the image's own
+	// colorspace.
+	int associated_alpha;
+
 	// Describes orientation transformations that need to be made to the
 	// pixels.
 	// Used with input images only.
@@ -409,6 +445,35 @@ struct iw_image {
 	int rendering_intent; // Valid for both input and output images.
 };
 
+// Information about an image file, obtained without decoding the pixels.
+// See iw_probe_file_by_fmt().
+struct iw_image_info {
+	// The logical width and height, as IW will see the image after reading it
+	// (i.e. after any orientation correction made by the file reader).
+	int width, height;
+
+	// The image type, bit depth, and sample type that the file reader will
+	// use for the decoded image.
+	int imgtype;  // IW_IMGTYPE_*
+	int bit_depth;
+	int sampletype; // IW_SAMPLETYPE_*
+
+	int native_grayscale; // Was the image encoded as grayscale?
+
+	// Number of pages (images) in the file. 0 if not known.
+	int page_count;
+
+	// The IW_REORIENT_* transformation that the file reader will apply.
+	unsigned int orient_transform;
+
+	unsigned int flags; // IW_IMAGEINFOFLAG_*
+};
+
+// The true image type can only be determined by examining the pixels. The
+// reader may choose a type with fewer channels (e.g. RGB instead of RGBA)
+// than the one reported in ->imgtype.
+#define IW_IMAGEINFOFLAG_IMGTYPE_IS_MAX 0x1
+
 struct iw_rgba8color {
 	iw_byte r, g, b, a;
 };
@@ -427,6 +492,7 @@ typedef int (*iw_closefn_type)(struct iw_context *ctx, struct iw_iodescr *iodesc
 typedef int (*iw_getfilesizefn_type)(struct iw_context *ctx, struct iw_iodescr *iodescr, iw_int64 *pfilesize);
 typedef int (*iw_seekfn_type)(struct iw_context *ctx, struct iw_iodescr *iodescr, iw_int64 offset, int whence);
 typedef int (*iw_tellfn_type)(struct iw_context *ctx, struct iw_iodescr *iodescr, iw_int64 *pfileptr);
+typedef int (*iw_getmemfn_type)(struct iw_context *ctx, struct iw_iodescr *iodescr, const void **pmem, iw_int64 *psize);
 
 // I/O descriptor
 struct iw_iodescr {
@@ -462,6 +528,11 @@ struct iw_iodescr {
 
 	// Return the current file position.
 	iw_tellfn_type tell_fn;
+
+	// Optional. If the entire file is already in memory, set *pmem and *psize
+	// to describe it. The memory must remain valid, and unmodified, until the
+	// descriptor is closed. Does not change the file position.
+	iw_getmemfn_type getmem_fn;
 };
 
 // Allocate n bytes of memory. Return NULL on failure.
@@ -498,6 +569,26 @@ IW_EXPORT(struct iw_context*) iw_create_context(struct iw_init_params *params);
 
 IW_EXPORT(void) iw_destroy_context(struct iw_context *ctx);
 
+// Free the input and output images and other per-image state, so that the
+// context can be used to process another image.
+// If keep_settings is 0, all settings revert to their defaults. Otherwise,
+// the settings that were in effect when the image was processed are kept.
+// The memory functions, userdata, message hooks, and the scratch memory
+// pool are always kept.
+IW_EXPORT(void) iw_reset_context(struct iw_context *ctx, int keep_settings);
+
+// Allow up to n bytes of internal work buffers to be kept for reuse, instead
+// of being freed when they are no longer needed. This is most useful with
+// iw_reset_context(): a context that processes a series of similar images
+// can then do so without allocating any more memory. The default is 0.
+IW_EXPORT(void) iw_set_scratch_pool_limit(struct iw_context *ctx, size_t n);
+
+// Create a new context whose input image is the image that has been read
+// into srcctx. The pixels are shared, not copied, so srcctx must not be
+// destroyed before the new context is. Other than the input image, only the
+// memory functions, userdata, message hooks, and limits are copied.
+IW_EXPORT(struct iw_context*) iw_create_derived_context(struct iw_context *srcctx);
+
 IW_EXPORT(int) iw_process_image(struct iw_context *ctx);
 
 // Rotate and/or mirror the image. 'x' is an IW_REORIENT_ code.
@@ -535,6 +626,20 @@ IW_EXPORT(void*) iw_get_userdata(struct iw_context *ctx);
 typedef void (*iw_warningfn_type)(struct iw_context *ctx, const char *msg);
 IW_EXPORT(void) iw_set_warning_fn(struct iw_context *ctx, iw_warningfn_type warnfn);
 
+#define IW_TRACE_BEGIN 1
+#define IW_TRACE_END   2
+struct iw_trace_event {
+	int type; // IW_TRACE_*
+	const char *name; // Stage or phase name. Only valid during the callback.
+	int arg; // Channel number, job number, etc. (-1 if none)
+	double time; // Elapsed time in seconds, from some arbitrary starting point
+	unsigned long thread_id;
+};
+// The trace function may be called from multiple threads at once, by
+// different (derived) contexts.
+typedef void (*iw_tracefn_type)(struct iw_context *ctx, const struct iw_trace_event *ev);
+IW_EXPORT(void) iw_set_trace_fn(struct iw_context *ctx, iw_tracefn_type tracefn);
+
 // Set the maximum amount of memory to allocate at one time.
 IW_EXPORT(void) iw_set_max_malloc(struct iw_context *ctx, size_t n);
 
@@ -549,8 +654,17 @@ IW_EXPORT(void) iw_set_output_canvas_size(struct iw_context *ctx, int w, int h);
 IW_EXPORT(void) iw_set_output_image_size(struct iw_context *ctx, double w, double h);
 
 // Crop before resizing.
+// If this is called before the image is read, the file reader may decode
+// only the cropped part of the image. The coordinates are then those of the
+// image as the reader delivers it, so if you are going to call
+// iw_reorient_image(), set the crop after reading the image instead.
 IW_EXPORT(void) iw_set_input_crop(struct iw_context *ctx, int x, int y, int w, int h);
 
+// Compute only the given rectangle of the output canvas. The result is the
+// same as cropping the full output image, but usually much faster.
+// If w or h is negative, the region extends to the right or bottom edge.
+IW_EXPORT(void) iw_set_output_region(struct iw_context *ctx, int x, int y, int w, int h);
+
 // Inform IW about the features of your intended output file format.
 // n is a bitwise combination of IW_PROFILE_* values.
 // iw_get_profile_by_fmt() can be used to get value for n.
@@ -634,6 +748,9 @@ IW_EXPORT(void) iw_set_allow_opt(struct iw_context *ctx, int opt, int n);
 // Caller allocates the pixels with (preferably) iw_malloc_large().
 // The memory will be freed by IW.
 // A copy is made of the img structure itself.
+// To have IW use rows that it does not own, without copying them, set
+// img->pixels to NULL, and set img->firstrow and img->stride. The rows must
+// then remain valid until the context is reset or destroyed.
 IW_EXPORT(void) iw_set_input_image(struct iw_context *ctx, const struct iw_image *img);
 
 // Caller supplies an (uninitialized) iw_image structure, which the
@@ -646,6 +763,38 @@ IW_EXPORT(void) iw_get_output_colorspace(struct iw_context *ctx, struct iw_csdes
 
 IW_EXPORT(const struct iw_palette*) iw_get_output_palette(struct iw_context *ctx);
 
+// Processing stages, for struct iw_stats.
+#define IW_STAGE_READ       0 // Decoding the input file
+#define IW_STAGE_PREPARE    1 // Deciding how to process the image
+#define IW_STAGE_VERTICAL   2 // Converting to linear samples, and resizing columns
+#define IW_STAGE_HORIZONTAL 3 // Resizing rows, converting to output samples, dithering
+#define IW_STAGE_OPTIMIZE   4 // Choosing the output image type
+#define IW_STAGE_WRITE      5 // Encoding the output file
+#define IW_NUM_STAGES       6
+
+struct iw_stage_stats {
+	int count; // Number of times the stage was run
+	double wall_time; // Elapsed time in seconds
+	double cpu_time; // CPU time of the thread that ran it, in seconds
+};
+
+// Statistics recorded if IW_VAL_COLLECT_STATS is set.
+// Memory figures only include memory allocated by IW's memory functions
+// (iw_malloc, etc.) since statistics were enabled.
+struct iw_stats {
+	struct iw_stage_stats stage[IW_NUM_STAGES]; // Indexed by IW_STAGE_*
+	size_t alloc_count; // Number of memory blocks allocated
+	size_t peak_bytes; // Maximum number of bytes allocated at one time
+	iw_uint64 taps[2]; // Resampling filter taps applied; indexed by IW_DIMENSION_*
+};
+
+// Caller supplies an (uninitialized) iw_stats structure, which the
+// function fills in.
+IW_EXPORT(void) iw_get_stats(struct iw_context *ctx, struct iw_stats *stats);
+
+// Returns a short name for an IW_STAGE_* code, e.g. "read".
+IW_EXPORT(const char*) iw_get_stage_name(int stage);
+
 IW_EXPORT(void) iw_set_value(struct iw_context *ctx, int code, int n);
 IW_EXPORT(int) iw_get_value(struct iw_context *ctx, int code);
 
@@ -658,6 +807,8 @@ IW_EXPORT(const char*) iw_get_option(struct iw_context *ctx, const char *name);
 IW_EXPORT(void) iw_set_error(struct iw_context *ctx, const char *s);
 IW_EXPORT(void) iw_set_errorf(struct iw_context *ctx, const char *fmt, ...)
   iw_gnuc_attribute ((format (printf, 2, 3)));
+// Forget about an error, for use by a reader that recovers from it.
+IW_EXPORT(void) iw_clear_error(struct iw_context *ctx);
 IW_EXPORT(void) iw_warning(struct iw_context *ctx, const char *s);
 IW_EXPORT(void) iw_warningf(struct iw_context *ctx, const char *fmt, ...)
   iw_gnuc_attribute ((format (printf, 2, 3)));
@@ -711,12 +862,40 @@ IW_EXPORT(int) iw_write_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iod
 IW_EXPORT(char*) iw_get_libjpeg_version_string(char *s, int s_len);
 IW_EXPORT(int) iw_read_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
+IW_EXPORT(int) iw_read_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_read_miff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_miff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_read_webp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_webp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_read_gif_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
+
+// Reading every frame of an animated GIF, in a single pass.
+struct iw_gif_frame_reader;
+struct iw_gif_frame_info {
+	int frame_num; // 1=first
+	int left, top, width, height; // The frame's position on the screen
+	int delay; // In 1/100 seconds
+	// What to do with the frame's area before painting the next frame:
+	// 0=unspecified, 1=nothing, 2=restore to background, 3=restore to previous.
+	int disposal;
+	int has_transparency;
+	int trans_color_index;
+};
+// Reads the GIF header. The iodescr must remain open until the reader is
+// closed. Returns NULL on failure.
+IW_EXPORT(struct iw_gif_frame_reader*) iw_open_gif_frame_reader(struct iw_context *ctx,
+	struct iw_iodescr *iodescr);
+// Decode the next frame, and paint it onto the GIF screen, which keeps the
+// result of the previous frames. A copy of the screen (always RGBA) becomes
+// the input image of ctx, after ctx has been reset as if by
+// iw_reset_context(ctx,1), so the frame can be processed like any other
+// image. The same ctx must be used for every call.
+// Returns 1 if a frame was read, or 0 if there are no more frames or an
+// error occurred (see iw_get_errorflag()).
+IW_EXPORT(int) iw_read_next_gif_frame(struct iw_context *ctx, struct iw_gif_frame_reader *fr,
+	struct iw_gif_frame_info *info);
+IW_EXPORT(void) iw_close_gif_frame_reader(struct iw_context *ctx, struct iw_gif_frame_reader *fr);
 IW_EXPORT(int) iw_read_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 // The output format can be refined by setting IW_VAL_OUTPUT_FORMAT.
 IW_EXPORT(int) iw_write_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
@@ -729,6 +908,84 @@ IW_EXPORT(int) iw_read_file_by_fmt(struct iw_context *ctx,
 	struct iw_iodescr *iodescr, int fmt);
 IW_EXPORT(int) iw_write_file_by_fmt(struct iw_context *ctx,
 	struct iw_iodescr *writedescr, int fmt);
+IW_EXPORT(int) iw_probe_file_by_fmt(struct iw_context *ctx,
+	struct iw_iodescr *iodescr, int fmt, struct iw_image_info *info);
+
+// Functions that read only the header of a file, and report information
+// about it, without decoding the image. They do not check the image
+// dimensions against the limits set by IW_VAL_MAX_WIDTH/HEIGHT.
+// The settings that affect the reader (IW_VAL_PAGE_TO_READ, etc.) are
+// respected, but the context is otherwise unaffected.
+IW_EXPORT(int) iw_probe_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info);
+IW_EXPORT(int) iw_probe_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info);
+IW_EXPORT(int) iw_probe_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info);
+IW_EXPORT(int) iw_probe_miff_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info);
+IW_EXPORT(int) iw_probe_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info);
+IW_EXPORT(int) iw_probe_webp_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info);
+IW_EXPORT(int) iw_probe_gif_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info);
+// Handles PNM and PAM formats.
+IW_EXPORT(int) iw_probe_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_image_info *info);
+
+struct iw_render_target;
+typedef int (*iw_rendersetupfn_type)(struct iw_context *ctx, struct iw_render_target *target);
+
+// An output image to be made by iw_render_targets().
+struct iw_render_target {
+	int fmt; // IW_FORMAT_*
+	struct iw_iodescr *writedescr;
+	// Called to configure the target's context, as you would before calling
+	// iw_process_image(). May be called from a worker thread. Return 0 on
+	// failure.
+	iw_rendersetupfn_type setup_fn;
+	void *userdata;
+	// Set by iw_render_targets():
+	int ok;
+	char errmsg[200];
+	struct iw_stats stats; // If IW_VAL_COLLECT_STATS was set
+};
+
+// Make several output images from the image that has been read into srcctx,
+// without reading it again. Each target is processed in its own derived
+// context (see iw_create_derived_context()), and up to num_threads of them
+// (0 = one per CPU) at the same time.
+// Returns 1 if every target was written successfully.
+IW_EXPORT(int) iw_render_targets(struct iw_context *srcctx,
+	struct iw_render_target *targets, int num_targets, int num_threads);
+
+// Built-in I/O descriptors.
+// Each of these functions initializes the whole iodescr struct. The app must
+// eventually call iodescr->close_fn, with the same context, to free the
+// resources it uses.
+
+// Read from a memory block owned by the app. The memory is not copied, and
+// must remain valid until the descriptor is closed.
+IW_EXPORT(int) iw_open_mem_reader(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const void *mem, size_t memsize);
+// Read from a file, by mapping it into memory.
+// fn is in UTF-8 format.
+IW_EXPORT(int) iw_open_mmap_reader(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const char *fn);
+// Write to a memory block that is allocated (with iw_malloc) and grown as
+// needed. If you know roughly how large the file will be, set capacity_hint
+// to that size (or 0 if unknown) to avoid reallocations.
+IW_EXPORT(int) iw_open_mem_writer(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	size_t capacity_hint);
+IW_EXPORT(void) iw_set_mem_writer_capacity_hint(struct iw_context *ctx,
+	struct iw_iodescr *iodescr, size_t capacity_hint);
+// Returns the data written so far. The memory belongs to the descriptor,
+// unless IW_MEMIOFLAG_DETACH is set, in which case the caller takes
+// ownership of it, and must free it with iw_free().
+#define IW_MEMIOFLAG_DETACH 0x1
+IW_EXPORT(int) iw_get_mem_writer_data(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	unsigned int flags, void **pmem, size_t *psize);
 
 // iw_enable_zlib() must be called to enable zlib compression in modules for
 // which it is optional.
@@ -772,10 +1029,29 @@ IW_EXPORT(size_t) iw_calc_bytesperrow(int num_pixels, int bits_per_pixel);
 // considered valid by IW. If not, generates a warning and returns 0.
 IW_EXPORT(int) iw_check_image_dimensions(struct iw_context *ctx, int w, int h);
 
+// For file readers: If the caller requested a crop before the image was read,
+// returns nonzero and sets *px, *py, *pw, *ph to the part of an image of the
+// given size that is needed. The reader may then decode just that part (or
+// any rectangle containing it), and call iw_set_input_image_offset().
+IW_EXPORT(int) iw_get_input_crop(struct iw_context *ctx, int full_width, int full_height,
+	int *px, int *py, int *pw, int *ph);
+// For file readers: Call after iw_set_input_image() if the image is only the
+// rectangle at (x,y) of a full_width x full_height image.
+IW_EXPORT(void) iw_set_input_image_offset(struct iw_context *ctx, int x, int y,
+	int full_width, int full_height);
+
 IW_EXPORT(int) iw_is_valid_density(double density_x, double density_y, int density_code);
 
+// Read an entire file into memory. The memory must be freed with iw_free().
 IW_EXPORT(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iodescr,
   void **pmem, iw_int64 *psize);
+// Like iw_file_to_memory(), but if the iodescr is memory-backed (has a
+// getmem_fn) and pborrowed is not NULL, no copy is made: *pmem points to the
+// descriptor's memory, which must not be modified or freed, and *pborrowed is
+// set to 1. Otherwise, *pborrowed is set to 0, and the memory must be freed
+// with iw_free().
+IW_EXPORT(int) iw_file_to_memory_ex(struct iw_context *ctx, struct iw_iodescr *iodescr,
+  void **pmem, iw_int64 *psize, int *pborrowed);
 
 // Various memory allocation functions.
 // In general, they allocate a block of memory of size n.
@@ -824,6 +1100,33 @@ IW_EXPORT(double) iw_parse_number(const char *s);
 IW_EXPORT(int) iw_parse_int(const char *s);
 IW_EXPORT(int) iw_round_to_int(double x);
 
+// Mark the start and end of an IW_STAGE_*, for statistics and tracing.
+IW_EXPORT(void) iw_begin_stage(struct iw_context *ctx, int stage);
+IW_EXPORT(void) iw_end_stage(struct iw_context *ctx, int stage);
+
+// Report the start and end of some other phase of processing to the
+// trace function, if any. The name should be a string constant.
+IW_EXPORT(void) iw_trace_begin(struct iw_context *ctx, const char *name, int arg);
+IW_EXPORT(void) iw_trace_end(struct iw_context *ctx, const char *name, int arg);
+
+// Call fn(userdata,job) for each job from 0 to num_jobs-1, using up to
+// num_threads threads (0 = one per CPU). Jobs may run at the same time, and
+// in any order, so fn must not use ctx, or anything else that isn't
+// thread-safe.
+typedef void (*iw_paralleljobfn_type)(void *userdata, int job);
+IW_EXPORT(void) iw_run_parallel(struct iw_context *ctx, int num_threads, int num_jobs,
+	iw_paralleljobfn_type fn, void *userdata);
+IW_EXPORT(int) iw_get_num_cpus(void);
+
+// A lock, for jobs run by iw_run_parallel() that need to share something.
+// If thread support is disabled, locking and unlocking do nothing.
+// iw_create_mutex() returns NULL on failure.
+struct iw_mutex;
+IW_EXPORT(struct iw_mutex*) iw_create_mutex(struct iw_context *ctx);
+IW_EXPORT(void) iw_destroy_mutex(struct iw_context *ctx, struct iw_mutex *m);
+IW_EXPORT(void) iw_lock_mutex(struct iw_mutex *m);
+IW_EXPORT(void) iw_unlock_mutex(struct iw_mutex *m);
+
 struct iw_zlib_context;
 
 typedef struct iw_zlib_context* (*iw_zlib_inflate_init_type)(struct iw_context *ctx);
@@ -836,6 +1139,57 @@ typedef void (*iw_zlib_deflate_end_type)(struct iw_zlib_context *zctx);
 typedef int (*iw_zlib_deflate_item_type)(struct iw_zlib_context *zctx,
 	iw_byte *src, size_t srclen, iw_byte *dst, size_t dstlen, size_t *pdstused);
 
+// Compress a whole buffer to a zlib stream, using up to num_threads threads
+// (0 = one per CPU). cmprlevel is a zlib compression level (-1 = default), and
+// strategy is a zlib strategy (Z_DEFAULT_STRATEGY, Z_FILTERED, etc.).
+// On success, *pdst is allocated with iw_malloc, and must be freed by the
+// caller.
+typedef int (*iw_zlib_deflate_parallel_type)(struct iw_context *ctx,
+	const iw_byte *src, size_t srclen, int num_threads, int cmprlevel, int strategy,
+	iw_byte **pdst, size_t *pdstlen);
+
+// The same, but with the data supplied in parts, so that the caller doesn't
+// need to have all of it at once. Call pdeflate_write() for each part, setting
+// is_last for the final part. The compressed data for each part is returned
+// in *pdst, which is owned by the compressor, and is valid until the next call.
+struct iw_zlib_pdeflate;
+typedef struct iw_zlib_pdeflate* (*iw_zlib_pdeflate_init_type)(struct iw_context *ctx,
+	int num_threads, int cmprlevel, int strategy);
+typedef int (*iw_zlib_pdeflate_write_type)(struct iw_zlib_pdeflate *pz,
+	const iw_byte *src, size_t srclen, int is_last,
+	const iw_byte **pdst, size_t *pdstlen);
+typedef void (*iw_zlib_pdeflate_end_type)(struct iw_zlib_pdeflate *pz);
+
+// Compress or decompress a number of separate pieces of a zlib stream at once,
+// using up to num_threads threads (0 = one per CPU), each with its own zlib
+// stream. Each piece is raw deflate data that ends on a byte boundary (as
+// written with Z_SYNC_FLUSH). If a piece refers to data that precedes it in
+// the stream, that data (up to 32K of it) must be supplied in dict.
+struct iw_zlib_piece {
+	const iw_byte *src;
+	size_t srclen;
+	iw_byte *dst;
+	size_t dstlen; // When compressing, the size of the dst buffer.
+	size_t dstused; // Set when compressing.
+	const iw_byte *dict; // May be NULL
+	size_t dictlen;
+	int zlib_header; // The piece starts with a zlib header (first piece only).
+	// The piece is a complete zlib stream, with a header and checksum, that
+	// doesn't use a dictionary.
+	int whole_stream;
+	int ok; // Set to nonzero if the piece was processed successfully.
+};
+// When compressing, mt_run() fails if any piece could not be compressed.
+// When decompressing, a piece that does not decompress to exactly dstlen
+// bytes just has its ok flag cleared, and no error is reported, so that the
+// caller can try again (e.g. with a dictionary).
+struct iw_zlib_mt;
+typedef struct iw_zlib_mt* (*iw_zlib_mt_init_type)(struct iw_context *ctx,
+	int num_threads, int deflate_flag);
+typedef int (*iw_zlib_mt_run_type)(struct iw_zlib_mt *mz,
+	struct iw_zlib_piece *pieces, int num_pieces);
+typedef void (*iw_zlib_mt_end_type)(struct iw_zlib_mt *mz);
+
 struct iw_zlib_module {
 	iw_zlib_inflate_init_type inflate_init;
 	iw_zlib_inflate_end_type inflate_end;
@@ -843,6 +1197,13 @@ struct iw_zlib_module {
 	iw_zlib_deflate_init_type deflate_init;
 	iw_zlib_deflate_end_type deflate_end;
 	iw_zlib_deflate_item_type deflate_item;
+	iw_zlib_deflate_parallel_type deflate_parallel; // May be NULL
+	iw_zlib_pdeflate_init_type pdeflate_init; // May be NULL
+	iw_zlib_pdeflate_write_type pdeflate_write;
+	iw_zlib_pdeflate_end_type pdeflate_end;
+	iw_zlib_mt_init_type mt_init; // May be NULL
+	iw_zlib_mt_run_type mt_run;
+	iw_zlib_mt_end_type mt_end;
 };
 
 IW_EXPORT(void) iw_set_zlib_module(struct iw_context *ctx, struct iw_zlib_module *z);